@@ -0,0 +1,412 @@
+/*
+ * allocationcheck.cpp
+ *
+ * Checks that the command and telemetry path does not allocate once warmed up. Server runs
+ * in-process on the simulated device library with the flight recorder enabled, a loopback
+ * client sends a mix of all commands and requests, with and without TIMESTAMP and
+ * CORRELATION_ID prefixes, batches and trajectories. malloc and friends are interposed and
+ * every heap allocation made by any thread during the measured run is counted, the first
+ * ones are reported with a backtrace. Exit status is non zero when anything was allocated.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+
+#include "server.h"
+#include "netcodec.h"
+#include "logging.h"
+#include "util.h"
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t n, size_t size);
+    void* __libc_realloc(void* p, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+    void __libc_free(void* p);
+};
+
+namespace {
+    constexpr unsigned MAX_TRACES = 8;
+    constexpr int TRACE_DEPTH = 16;
+
+    std::atomic<bool> armed(false);
+    std::atomic<uint64_t> allocations(0);
+    std::atomic<uint64_t> allocatedBytes(0);
+
+    struct Trace
+    {
+        size_t size;
+        int depth;
+        void* frames[TRACE_DEPTH];
+    };
+
+    Trace traces[MAX_TRACES];
+    std::atomic<unsigned> traceCount(0);
+    thread_local bool inHook = false;
+
+    void Count(size_t size)
+    {
+        if(!armed.load(std::memory_order_relaxed) || inHook) return;
+
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+
+        unsigned slot = traceCount.fetch_add(1);
+        if(slot < MAX_TRACES) {
+            inHook = true;
+            traces[slot].size = size;
+            traces[slot].depth = backtrace(traces[slot].frames, TRACE_DEPTH);
+            inHook = false;
+        }
+    }
+};
+
+/*
+ * NOTE: Definitions in the executable take precedence over the C library for every module
+ * of the process, including libstdc++ operator new
+ */
+extern "C" {
+    void* malloc(size_t size)
+    {
+        Count(size);
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t n, size_t size)
+    {
+        Count(n * size);
+        return __libc_calloc(n, size);
+    }
+
+    void* realloc(void* p, size_t size)
+    {
+        Count(size);
+        return __libc_realloc(p, size);
+    }
+
+    void* memalign(size_t alignment, size_t size)
+    {
+        Count(size);
+        return __libc_memalign(alignment, size);
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size)
+    {
+        Count(size);
+        return __libc_memalign(alignment, size);
+    }
+
+    int posix_memalign(void** p, size_t alignment, size_t size)
+    {
+        Count(size);
+        *p = __libc_memalign(alignment, size);
+        return *p ? 0 : ENOMEM;
+    }
+
+    void free(void* p)
+    {
+        __libc_free(p);
+    }
+};
+
+namespace {
+    struct CheckConfig
+    {
+        uint16_t port = 15562;
+        double rate = 2000;
+        double warmupSeconds = 1.0;
+        double seconds = 3.0;
+    };
+
+    struct Client
+    {
+        int sock;
+        pthread_t receiver;
+        std::atomic<uint64_t> responses;
+    };
+
+    void* ReceiveProcedure(void* arg)
+    {
+        Client* c = static_cast<Client*>(arg);
+        RoverNet::Message msg;
+        while(RoverNet::MESSAGE_STRUCT_SIZE == recv(c->sock, &msg, RoverNet::MESSAGE_STRUCT_SIZE, MSG_WAITALL)) {
+            c->responses.fetch_add(1, std::memory_order_relaxed);
+        }
+        return nullptr;
+    }
+
+    bool Connect(Client& c, uint16_t port)
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        for(int attempt = 0; attempt < 100; ++attempt) {
+            c.sock = socket(AF_INET, SOCK_STREAM, 0);
+            if(0 == connect(c.sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+                int noDelay = 1;
+                setsockopt(c.sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+                c.responses = 0;
+                return 0 == pthread_create(&c.receiver, NULL, ReceiveProcedure, &c);
+            }
+            close(c.sock);
+            usleep(10000);
+        }
+
+        fprintf(stderr, "connect to port %u: %s\n", port, strerror(errno));
+        return false;
+    }
+
+    constexpr unsigned MIX_STEPS = 14;
+    constexpr unsigned MIX_FRAME_MAX = 6;
+
+    /* Fills frame with the messages of step i of the mix in network byte order, returns their number */
+    unsigned MixFrame(uint64_t i, RoverNet::Message* frame)
+    {
+        using namespace RoverNet;
+        int16_t left = static_cast<int16_t>(i % 200) - 100;
+        int16_t right = 100 - static_cast<int16_t>(i % 200);
+        uint32_t id = static_cast<uint32_t>(i % UINT32_MAX) + 1;
+        unsigned n = 0;
+
+        auto add = [&](MessageType type) -> Message& {
+            frame[n] = Message();
+            frame[n].msgType = type;
+            return frame[n++];
+        };
+        auto wheels = [&](MessageType type) {
+            Message& m = add(type);
+            m.data.wheelsState.leftWheelSpeed = left;
+            m.data.wheelsState.rightWheelSpeed = right;
+        };
+
+        switch(i % MIX_STEPS) {
+            case 0: wheels(CMD_SET_WHEELS_SPEED); break;
+            case 1: add(REQ_WHEELS_STATE); break;
+            case 2: wheels(CMD_SET_LEFT_WHEEL_SPEED); break;
+            case 3: add(REQ_DISTANCE).data.distanceRequest.filter = static_cast<uint8_t>(i % 3); break;
+            case 4: wheels(CMD_SET_RIGHT_WHEEL_SPEED); break;
+            case 5: add(REQ_VID_STREAM_PORT); break;
+            case 6:
+                add(TIMESTAMP).data.timestamp = MakeTimestamp(MonotonicNs());
+                wheels(CMD_SET_WHEELS_SPEED);
+                break;
+            case 7:
+                add(CORRELATION_ID).data.correlationId.id = id;
+                add(REQ_WHEELS_STATE);
+                break;
+            case 8:
+                add(CORRELATION_ID).data.correlationId.id = id;
+                add(BATCH).data.batch.count = 4;
+                wheels(CMD_SET_WHEELS_SPEED);
+                add(REQ_WHEELS_STATE);
+                add(REQ_DISTANCE).data.distanceRequest.filter = DIST_MEDIAN;
+                wheels(CMD_SET_LEFT_WHEEL_SPEED);
+                break;
+            case 9:
+                add(CMD_TRAJECTORY).data.trajectory.count = 4;
+                for(uint32_t p = 0; p < 4; ++p) {
+                    Message& m = add(TRAJECTORY_POINT);
+                    m.data.trajectoryPoint.offsetUs = p * 2000;
+                    m.data.trajectoryPoint.leftWheelSpeed = left;
+                    m.data.trajectoryPoint.rightWheelSpeed = right;
+                }
+                break;
+            case 10: {
+                Message& m = add(CMD_RAMP_WHEELS_SPEED);
+                m.data.wheelsRamp.leftWheelSpeed = right;
+                m.data.wheelsRamp.rightWheelSpeed = left;
+                break;
+            }
+            case 11: {
+                Message& m = add(REQ_HISTORY);
+                m.data.historyRequest.spanMs = 1000;
+                m.data.historyRequest.series = (i / MIX_STEPS) % 2 ? HIST_WHEELS : HIST_DISTANCE;
+                break;
+            }
+            case 12:
+                add(REQ_TIME_SYNC).data.timeSync.sequence = id;
+                add(CMD_HEARTBEAT);
+                break;
+            default:
+                add(CMD_STOP);
+        }
+
+        for(unsigned k = 0; k < n; ++k) frame[k] = HostToNet(frame[k]);
+        return n;
+    }
+
+    /* Sends the frames of the mix at the given rate, returns the number of messages sent */
+    uint64_t Drive(Client& c, double rate, double seconds)
+    {
+        uint64_t count = static_cast<uint64_t>(rate * seconds);
+        uint64_t start = MonotonicNs();
+        uint64_t sent = 0;
+
+        for(uint64_t i = 0; i < count; ++i) {
+            timespec t = NsToTimespec(start + static_cast<uint64_t>(i * NSEC_PER_SEC / rate));
+            while(EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL));
+
+/*
+ * NOTE: The wire format is the leading MESSAGE_STRUCT_SIZE bytes of each message, the
+ * frame is packed before it is sent in one piece
+ */
+            RoverNet::Message frame[MIX_FRAME_MAX];
+            uint8_t wire[MIX_FRAME_MAX * RoverNet::MESSAGE_STRUCT_SIZE];
+            unsigned n = MixFrame(i, frame);
+            for(unsigned k = 0; k < n; ++k) memcpy(wire + k * RoverNet::MESSAGE_STRUCT_SIZE, &frame[k], RoverNet::MESSAGE_STRUCT_SIZE);
+
+            ssize_t size = n * RoverNet::MESSAGE_STRUCT_SIZE;
+            if(size != send(c.sock, wire, size, MSG_NOSIGNAL)) {
+                fprintf(stderr, "send: %s\n", strerror(errno));
+                return sent;
+            }
+            sent += n;
+        }
+
+        return sent;
+    }
+
+    void PrintUsage(FILE* s)
+    {
+        fprintf(s,
+                "Usage: \n"
+                "   -p  --port PORT     Loopback port of the server (default 15562).\n"
+                "   -r  --rate HZ       Messages per second sent by the client (default 2000).\n"
+                "   -w  --warmup SEC    Traffic before counting starts (default 1).\n"
+                "   -t  --time SEC      Duration of the counted run (default 3).\n"
+                "   -h  --help          Print this message.\n");
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char* const short_options = "p:r:w:t:h";
+
+    const struct option long_options[] = {
+        { "port",       1,  NULL,  'p'},
+        { "rate",       1,  NULL,  'r'},
+        { "warmup",     1,  NULL,  'w'},
+        { "time",       1,  NULL,  't'},
+        { "help",       0,  NULL,  'h'},
+        { NULL,         0,  NULL,   0 }
+    };
+
+    CheckConfig cc;
+    int option;
+
+    while(-1 != (option = getopt_long(argc, argv, short_options, long_options, NULL))) {
+        switch(option) {
+            case 'p':
+                cc.port = atoi(optarg);
+                break;
+            case 'r':
+                cc.rate = atof(optarg);
+                break;
+            case 'w':
+                cc.warmupSeconds = atof(optarg);
+                break;
+            case 't':
+                cc.seconds = atof(optarg);
+                break;
+            case 'h':
+                PrintUsage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                PrintUsage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(cc.rate <= 0 || cc.seconds <= 0 || cc.warmupSeconds < 0) {
+        PrintUsage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    RoverLog::SetLevel(LOG_WARNING);
+/*
+ * NOTE: The simulated device library logs every call at LOG_NOTICE and syslog may allocate,
+ * that is an artifact of the simulation and is masked
+ */
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    /* backtrace loads its unwinder on the first call, outside of the counted run */
+    void* frame;
+    backtrace(&frame, 1);
+
+    char recorderPath[] = "/tmp/rover_allocationcheck.XXXXXX";
+    int fd = mkstemp(recorderPath);
+    if(fd == -1) {
+        fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    unlink(recorderPath);
+
+    ServerConfig config;
+    config.video.source = "none";
+    config.net.address = "127.0.0.1";
+    config.net.port = cc.port;
+    config.recorderPath = recorderPath;
+
+    Server server(config);
+    server.Start();
+
+    Client client;
+    if(!Connect(client, cc.port)) return EXIT_FAILURE;
+
+    Drive(client, cc.rate, cc.warmupSeconds);
+    usleep(3 * DEV_CMD_SEND_NS / 1000);
+
+    uint64_t responsesBefore = client.responses.load();
+    armed = true;
+    uint64_t sent = Drive(client, cc.rate, cc.seconds);
+    usleep(3 * DEV_CMD_SEND_NS / 1000);
+    armed = false;
+    uint64_t responses = client.responses.load() - responsesBefore;
+
+    shutdown(client.sock, SHUT_RDWR);
+    pthread_join(client.receiver, NULL);
+    close(client.sock);
+    server.Stop();
+    unlink(recorderPath);
+
+    uint64_t count = allocations.load();
+    printf("%llu messages sent, %llu responses, %llu allocations (%llu bytes), %.6f allocations per message\n",
+            static_cast<unsigned long long>(sent), static_cast<unsigned long long>(responses),
+            static_cast<unsigned long long>(count), static_cast<unsigned long long>(allocatedBytes.load()),
+            sent ? static_cast<double>(count) / sent : 0.0);
+
+    unsigned traced = std::min(traceCount.load(), MAX_TRACES);
+    for(unsigned i = 0; i < traced; ++i) {
+        fprintf(stderr, "allocation of %zu bytes:\n", traces[i].size);
+        backtrace_symbols_fd(traces[i].frames, traces[i].depth, STDERR_FILENO);
+    }
+
+    if(responses == 0) {
+        fprintf(stderr, "no responses received\n");
+        return EXIT_FAILURE;
+    }
+
+    return count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
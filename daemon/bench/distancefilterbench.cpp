@@ -0,0 +1,156 @@
+/*
+ * distancefilterbench.cpp
+ *
+ * Cost and accuracy of the distance filtering pipeline. A synthetic target approaches and
+ * recedes at a known speed, the samples get sensor noise and timeout spikes (the firmware
+ * reports 100 cm when the echo is lost). For each median window the time per update and
+ * the RMS error of the raw samples, the median and the estimate against the true distance
+ * are printed. The median network is checked against std::nth_element first.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <math.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "distancefilter.h"
+#include "util.h"
+
+namespace {
+    struct Sample
+    {
+        int32_t measured;
+        double truth;
+        uint64_t ns;
+    };
+
+    /* Triangle wave between 20 and 90 cm at speedCmS, Gaussian noise and a share of timeouts */
+    std::vector<Sample> Generate(size_t count, double rateHz, double speedCmS, double noiseCm, double spikes, unsigned seed)
+    {
+        std::mt19937 rng(seed);
+        std::normal_distribution<double> noise(0, noiseCm);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        std::vector<Sample> samples(count);
+
+        double period = 2 * 70 / speedCmS;
+        for(size_t i = 0; i < count; ++i) {
+            double t = i / rateHz;
+            double phase = fmod(t, period) / period;
+            double truth = 90 - 70 * (phase < 0.5 ? 2 * phase : 2 - 2 * phase);
+            samples[i].truth = truth;
+            samples[i].measured = uniform(rng) < spikes ? 100 : static_cast<int32_t>(lround(truth + noise(rng)));
+            samples[i].ns = static_cast<uint64_t>(t * NSEC_PER_SEC);
+        }
+        return samples;
+    }
+
+    bool CheckMedian(unsigned rounds, unsigned seed)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<int32_t> value(-1000, 1000);
+        for(unsigned r = 0; r < rounds; ++r) {
+            int32_t v[DISTANCE_MEDIAN_MAX];
+            int32_t sorted[DISTANCE_MEDIAN_MAX];
+            for(unsigned i = 0; i < DISTANCE_MEDIAN_MAX; ++i) sorted[i] = v[i] = value(rng) % (r % 4 == 0 ? 3 : 1000);
+            std::nth_element(sorted, sorted + DISTANCE_MEDIAN_MAX / 2, sorted + DISTANCE_MEDIAN_MAX);
+            if(DistanceFilter::Median9(v) != sorted[DISTANCE_MEDIAN_MAX / 2]) return false;
+        }
+        return true;
+    }
+
+    void PrintUsage(FILE* s)
+    {
+        fprintf(s,
+                "Usage: distancefilterbench [options]\n"
+                "   -n  --samples N     Samples per window size (default 1000000).\n"
+                "   -r  --rate HZ       Sensor rate (default 50).\n"
+                "   -s  --speed CM/S    Speed of the target (default 40).\n"
+                "   -e  --noise CM      Standard deviation of the sensor noise (default 2).\n"
+                "   -p  --spikes P      Share of samples lost to timeouts (default 0.05).\n"
+                "   -h  --help          Print this message.\n");
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char* const short_options = "n:r:s:e:p:h";
+
+    const struct option long_options[] = {
+        { "samples",    1,  NULL,  'n'},
+        { "rate",       1,  NULL,  'r'},
+        { "speed",      1,  NULL,  's'},
+        { "noise",      1,  NULL,  'e'},
+        { "spikes",     1,  NULL,  'p'},
+        { "help",       0,  NULL,  'h'},
+        { NULL,         0,  NULL,   0 }
+    };
+
+    size_t count = 1000000;
+    double rateHz = 50;
+    double speedCmS = 40;
+    double noiseCm = 2;
+    double spikes = 0.05;
+    int option;
+
+    while(-1 != (option = getopt_long(argc, argv, short_options, long_options, NULL))) {
+        switch(option) {
+            case 'n': count = strtoul(optarg, NULL, 10); break;
+            case 'r': rateHz = atof(optarg); break;
+            case 's': speedCmS = atof(optarg); break;
+            case 'e': noiseCm = atof(optarg); break;
+            case 'p': spikes = atof(optarg); break;
+            case 'h':
+                PrintUsage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                PrintUsage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(count == 0 || rateHz <= 0 || speedCmS <= 0 || noiseCm < 0 || spikes < 0 || spikes > 1) {
+        PrintUsage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    if(!CheckMedian(100000, 1)) {
+        fprintf(stderr, "median network differs from nth_element\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Sample> samples = Generate(count, rateHz, speedCmS, noiseCm, spikes, 2);
+
+    printf("%-6s %12s %10s %10s %12s %10s\n", "median", "ns/update", "raw rms", "median rms", "estimate rms", "rejected");
+    for(unsigned window = 1; window <= DISTANCE_MEDIAN_MAX; window += 2) {
+        DistanceFilterConfig config;
+        config.median = window;
+        DistanceFilter filter(config);
+
+        double rawError = 0, medianError = 0, estimateError = 0;
+        uint64_t start = MonotonicNs();
+        for(const Sample& s : samples) {
+            filter.Update(s.measured, s.ns);
+            double e = filter.Median() - s.truth;
+            medianError += e * e;
+            e = filter.Estimate() - s.truth;
+            estimateError += e * e;
+        }
+        uint64_t elapsed = MonotonicNs() - start;
+        for(const Sample& s : samples) rawError += (s.measured - s.truth) * (s.measured - s.truth);
+
+        printf("%-6u %12.1f %10.2f %10.2f %12.2f %10llu\n", window, static_cast<double>(elapsed) / count,
+                sqrt(rawError / count), sqrt(medianError / count), sqrt(estimateError / count),
+                static_cast<unsigned long long>(filter.Rejected()));
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,526 @@
+/*
+ * e2elatencybench.cpp
+ *
+ * End to end latency benchmark of the daemon. Server runs in-process on the simulated device
+ * library and a loopback client offers load from 10 Hz to 10 kHz. Device calls are intercepted
+ * with the linker (--wrap=set_wheel_speed, --wrap=set_wheel_stop), so the time from sending
+ * a command to the call that applies it is measured along with the request round trips.
+ * The timing of CMD_TRAJECTORY setpoints executed by the daemon is measured once at the end.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "server.h"
+#include "netcodec.h"
+#include "logging.h"
+#include "util.h"
+
+namespace {
+/*
+ * Every speed command of a step carries a unique (left, right) pair, the wrapped device call
+ * maps the pair back to the command
+ */
+    constexpr int SPEED_RANGE = 511;
+    constexpr unsigned MAX_COMMANDS = SPEED_RANGE * SPEED_RANGE;
+
+    std::atomic<uint64_t> wheelCallNs[MAX_COMMANDS];
+    std::atomic<uint64_t> stopCallNs(0);
+    std::atomic<unsigned> stopCalls(0);
+
+    void SpeedOf(unsigned seq, int16_t& left, int16_t& right)
+    {
+        left = static_cast<int16_t>(seq % SPEED_RANGE) - 255;
+        right = static_cast<int16_t>(seq / SPEED_RANGE % SPEED_RANGE) - 255;
+    }
+
+    unsigned SequenceOf(int16_t left, int16_t right)
+    {
+        return (left + 255) + (right + 255) * SPEED_RANGE;
+    }
+};
+
+extern "C" {
+    int __real_set_wheel_speed(device_rover* dev, int16_t left, int16_t right);
+    int __real_set_wheel_stop(device_rover* dev);
+
+    int __wrap_set_wheel_speed(device_rover* dev, int16_t left, int16_t right)
+    {
+        uint64_t now = MonotonicNs();
+        uint64_t expected = 0;
+        unsigned seq = SequenceOf(left, right);
+        if(seq < MAX_COMMANDS) wheelCallNs[seq].compare_exchange_strong(expected, now);
+        return __real_set_wheel_speed(dev, left, right);
+    }
+
+    int __wrap_set_wheel_stop(device_rover* dev)
+    {
+        stopCallNs.store(MonotonicNs());
+        stopCalls.fetch_add(1);
+        return __real_set_wheel_stop(dev);
+    }
+};
+
+namespace {
+    struct BenchConfig
+    {
+        uint16_t port = 15561;
+        double stepSeconds = 1.0;
+        std::vector<double> rates = { 10, 100, 1000, 10000 };
+        const char* recorder = nullptr;
+        const char* threads = nullptr;
+        bool json = false;
+    };
+
+    struct Summary
+    {
+        size_t sent;
+        size_t count;
+        double p50;
+        double p90;
+        double p99;
+        double max;
+    };
+
+/*
+ * Loopback client, responses are matched to requests by the receiving thread. The daemon
+ * answers every request once and in order within its kind.
+ */
+    struct Client
+    {
+        int sock;
+        pthread_t receiver;
+        pthread_mutex_t mutex;
+        std::deque<uint64_t> pendingState;
+        std::deque<uint64_t> pendingDistance;
+        std::vector<uint64_t> stateLatency;
+        std::vector<uint64_t> distanceLatency;
+    };
+
+    void* ReceiveProcedure(void* arg)
+    {
+        Client* c = static_cast<Client*>(arg);
+        RoverNet::Message msg;
+
+        while(RoverNet::MESSAGE_STRUCT_SIZE == recv(c->sock, &msg, RoverNet::MESSAGE_STRUCT_SIZE, MSG_WAITALL)) {
+            uint64_t now = MonotonicNs();
+            msg = RoverNet::NetToHost(msg);
+
+            pthread_mutex_lock(&c->mutex);
+            if(msg.msgType == RoverNet::MSG_WHEELS_STATE && !c->pendingState.empty()) {
+                c->stateLatency.push_back(now - c->pendingState.front());
+                c->pendingState.pop_front();
+            }
+            else if(msg.msgType == RoverNet::MSG_DISTANCE && !c->pendingDistance.empty()) {
+                c->distanceLatency.push_back(now - c->pendingDistance.front());
+                c->pendingDistance.pop_front();
+            }
+            pthread_mutex_unlock(&c->mutex);
+        }
+
+        return nullptr;
+    }
+
+    bool Connect(Client& c, uint16_t port)
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        /* The server binds from its own thread, retry until it listens */
+        for(int attempt = 0; attempt < 100; ++attempt) {
+            c.sock = socket(AF_INET, SOCK_STREAM, 0);
+            if(0 == connect(c.sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+                int noDelay = 1;
+                setsockopt(c.sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+                pthread_mutex_init(&c.mutex, NULL);
+                return 0 == pthread_create(&c.receiver, NULL, ReceiveProcedure, &c);
+            }
+            close(c.sock);
+            usleep(10000);
+        }
+
+        fprintf(stderr, "connect to port %u: %s\n", port, strerror(errno));
+        return false;
+    }
+
+    void Disconnect(Client& c)
+    {
+        shutdown(c.sock, SHUT_RDWR);
+        pthread_join(c.receiver, NULL);
+        close(c.sock);
+        pthread_mutex_destroy(&c.mutex);
+    }
+
+    void Send(Client& c, RoverNet::Message msg)
+    {
+        msg = RoverNet::HostToNet(msg);
+        if(RoverNet::MESSAGE_STRUCT_SIZE != send(c.sock, &msg, RoverNet::MESSAGE_STRUCT_SIZE, MSG_NOSIGNAL)) {
+            fprintf(stderr, "send: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    RoverNet::Message MakeMessage(RoverNet::MessageType type)
+    {
+        RoverNet::Message msg = {};
+        msg.msgType = type;
+        return msg;
+    }
+
+    void SleepUntil(uint64_t ns)
+    {
+        timespec t = NsToTimespec(ns);
+        while(EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL));
+    }
+
+    Summary Summarize(std::vector<uint64_t>& samples, size_t sent)
+    {
+        Summary s = { sent, samples.size(), 0, 0, 0, 0 };
+        if(samples.empty()) return s;
+
+        std::sort(samples.begin(), samples.end());
+        auto at = [&samples](double p) { return samples[static_cast<size_t>(p * (samples.size() - 1) + 0.5)] / 1e6; };
+        s.p50 = at(0.5);
+        s.p90 = at(0.9);
+        s.p99 = at(0.99);
+        s.max = at(1.0);
+        return s;
+    }
+
+/*
+ * Open loop: messages are sent at their scheduled time regardless of the responses and the
+ * latency is measured from the schedule, so a sender falling behind is included
+ */
+    template<typename F>
+    size_t Paced(double rate, double seconds, F send)
+    {
+        size_t count = std::max<size_t>(1, static_cast<size_t>(rate * seconds));
+        uint64_t start = MonotonicNs();
+        for(size_t i = 0; i < count; ++i) {
+            uint64_t scheduled = start + static_cast<uint64_t>(i * NSEC_PER_SEC / rate);
+            SleepUntil(scheduled);
+            send(i, scheduled);
+        }
+        return count;
+    }
+
+    /* Waits for the device thread to apply the last command and for outstanding responses */
+    void Settle()
+    {
+        usleep(3 * DEV_CMD_SEND_NS / 1000);
+    }
+
+    Summary MeasureCommand(Client& c, double rate, double seconds)
+    {
+        std::vector<uint64_t> sentNs(std::min<size_t>(MAX_COMMANDS, rate * seconds + 1));
+        for(size_t i = 0; i < sentNs.size(); ++i) wheelCallNs[i].store(0);
+
+        size_t sent = Paced(rate, seconds, [&](size_t i, uint64_t scheduled) {
+            RoverNet::Message msg = MakeMessage(RoverNet::CMD_SET_WHEELS_SPEED);
+            SpeedOf(i % sentNs.size(), msg.data.wheelsState.leftWheelSpeed, msg.data.wheelsState.rightWheelSpeed);
+            sentNs[i % sentNs.size()] = scheduled;
+            Send(c, msg);
+        });
+        Settle();
+
+/*
+ * NOTE: The device timer applies only the latest command of each DEV_CMD_SEND_NS period,
+ * the overwritten commands have no call and are counted only as sent
+ */
+        std::vector<uint64_t> latency;
+        for(size_t i = 0; i < sentNs.size(); ++i) {
+            uint64_t call = wheelCallNs[i].load();
+            if(call != 0 && call >= sentNs[i]) latency.push_back(call - sentNs[i]);
+        }
+        return Summarize(latency, sent);
+    }
+
+    Summary MeasureRequest(Client& c, double rate, double seconds, RoverNet::MessageType type)
+    {
+        pthread_mutex_lock(&c.mutex);
+        c.stateLatency.clear();
+        c.distanceLatency.clear();
+        pthread_mutex_unlock(&c.mutex);
+
+        size_t sent = Paced(rate, seconds, [&](size_t, uint64_t scheduled) {
+            pthread_mutex_lock(&c.mutex);
+            if(type == RoverNet::REQ_WHEELS_STATE) c.pendingState.push_back(scheduled);
+            else c.pendingDistance.push_back(scheduled);
+            pthread_mutex_unlock(&c.mutex);
+            Send(c, MakeMessage(type));
+        });
+        Settle();
+
+        pthread_mutex_lock(&c.mutex);
+        std::vector<uint64_t> latency = (type == RoverNet::REQ_WHEELS_STATE) ? c.stateLatency : c.distanceLatency;
+        c.pendingState.clear();
+        c.pendingDistance.clear();
+        pthread_mutex_unlock(&c.mutex);
+
+        return Summarize(latency, sent);
+    }
+
+/*
+ * Speed commands are sent at the given rate for a while, then CMD_STOP, the latency is
+ * measured from the stop to the device stop call
+ */
+    Summary MeasureStop(Client& c, double rate, double seconds)
+    {
+        constexpr uint64_t DRIVE_NS = 200000000ULL;
+        constexpr uint64_t STOP_TIMEOUT_NS = 500000000ULL;
+        constexpr unsigned MIN_STOPS = 10;
+
+        std::vector<uint64_t> latency;
+        size_t sent = 0;
+        uint64_t end = MonotonicNs() + static_cast<uint64_t>(seconds * NSEC_PER_SEC);
+
+        while(sent < MIN_STOPS || MonotonicNs() < end) {
+            Paced(rate, static_cast<double>(DRIVE_NS) / NSEC_PER_SEC, [&](size_t, uint64_t) {
+                RoverNet::Message msg = MakeMessage(RoverNet::CMD_SET_WHEELS_SPEED);
+                msg.data.wheelsState.leftWheelSpeed = 100;
+                msg.data.wheelsState.rightWheelSpeed = 100;
+                Send(c, msg);
+            });
+
+            unsigned calls = stopCalls.load();
+            uint64_t stopSent = MonotonicNs();
+            Send(c, MakeMessage(RoverNet::CMD_STOP));
+            sent++;
+
+            while(stopCalls.load() == calls && MonotonicNs() - stopSent < STOP_TIMEOUT_NS) usleep(100);
+            if(stopCalls.load() != calls) latency.push_back(stopCallNs.load() - stopSent);
+        }
+
+        return Summarize(latency, sent);
+    }
+
+/*
+ * Trajectories of TRAJECTORY_MAX_POINTS setpoints every TRAJECTORY_STEP_NS. The error of each
+ * setpoint call is measured against the schedule anchored at the first call, so the result
+ * shows the timer precision and not the dispatch delay.
+ */
+    Summary MeasureTrajectory(Client& c, unsigned trajectories)
+    {
+        constexpr uint64_t TRAJECTORY_STEP_NS = 10000000ULL;
+        std::vector<uint64_t> error;
+        unsigned seq = 0;
+        size_t sent = 0;
+
+        for(unsigned t = 0; t < trajectories; ++t) {
+            RoverNet::Message frame[TRAJECTORY_MAX_POINTS + 1];
+            frame[0] = MakeMessage(RoverNet::CMD_TRAJECTORY);
+            frame[0].data.trajectory.count = TRAJECTORY_MAX_POINTS;
+
+            unsigned first = seq;
+            for(unsigned i = 1; i <= TRAJECTORY_MAX_POINTS; ++i, ++seq) {
+                wheelCallNs[seq].store(0);
+                frame[i] = MakeMessage(RoverNet::TRAJECTORY_POINT);
+                frame[i].data.trajectoryPoint.offsetUs = (i - 1) * TRAJECTORY_STEP_NS / 1000;
+                SpeedOf(seq, frame[i].data.trajectoryPoint.leftWheelSpeed, frame[i].data.trajectoryPoint.rightWheelSpeed);
+            }
+
+            uint8_t wire[(TRAJECTORY_MAX_POINTS + 1) * RoverNet::MESSAGE_STRUCT_SIZE];
+            for(unsigned i = 0; i <= TRAJECTORY_MAX_POINTS; ++i) {
+                RoverNet::Message m = RoverNet::HostToNet(frame[i]);
+                memcpy(wire + i * RoverNet::MESSAGE_STRUCT_SIZE, &m, RoverNet::MESSAGE_STRUCT_SIZE);
+            }
+            if(static_cast<ssize_t>(sizeof(wire)) != send(c.sock, wire, sizeof(wire), MSG_NOSIGNAL)) {
+                fprintf(stderr, "send: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            sent += TRAJECTORY_MAX_POINTS;
+
+            usleep((TRAJECTORY_MAX_POINTS * TRAJECTORY_STEP_NS + DEV_CMD_SEND_NS) / 1000);
+
+            uint64_t anchor = wheelCallNs[first].load();
+            for(unsigned i = 1; anchor != 0 && i < TRAJECTORY_MAX_POINTS; ++i) {
+                uint64_t call = wheelCallNs[first + i].load();
+                if(call == 0) continue;
+                int64_t e = static_cast<int64_t>(call - anchor) - static_cast<int64_t>(i * TRAJECTORY_STEP_NS);
+                error.push_back(e < 0 ? -e : e);
+            }
+        }
+
+        return Summarize(error, sent);
+    }
+
+    void PrintSummary(const char* name, const Summary& s, bool json, bool first)
+    {
+        if(json) {
+            printf("%s\"%s\":{\"sent\":%zu,\"count\":%zu,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+                    first ? "" : ",", name, s.sent, s.count, s.p50, s.p90, s.p99, s.max);
+        }
+        else {
+            printf("  %-18s %8zu %8zu %9.3f %9.3f %9.3f %9.3f\n", name, s.sent, s.count, s.p50, s.p90, s.p99, s.max);
+        }
+    }
+
+    bool ParseRates(const char* text, std::vector<double>& rates)
+    {
+        rates.clear();
+        std::string s = text;
+        size_t pos = 0;
+        while(pos < s.size()) {
+            size_t end = s.find(',', pos);
+            if(end == std::string::npos) end = s.size();
+            double r = atof(s.substr(pos, end - pos).c_str());
+            if(r <= 0) return false;
+            rates.push_back(r);
+            pos = end + 1;
+        }
+        return !rates.empty();
+    }
+
+    void PrintUsage(FILE* s)
+    {
+        fprintf(s,
+                "Usage: \n"
+                "   -p  --port PORT     Loopback port of the server (default 15561).\n"
+                "   -r  --rates LIST    Offered load steps in Hz (default 10,100,1000,10000).\n"
+                "   -t  --time SEC      Duration of each measurement (default 1).\n"
+                "   -R  --recorder PATH Run with the flight recorder writing to PATH.\n"
+                "   -P  --threads SPEC  Thread settings of the server as rover_daemon --threads.\n"
+                "   -j  --json          Print results as JSON.\n"
+                "   -h  --help          Print this message.\n"
+                "Latency is measured from the scheduled send time to the device call or response.\n");
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char* const short_options = "p:r:t:R:P:jh";
+
+    const struct option long_options[] = {
+        { "port",       1,  NULL,  'p'},
+        { "rates",      1,  NULL,  'r'},
+        { "time",       1,  NULL,  't'},
+        { "recorder",   1,  NULL,  'R'},
+        { "threads",    1,  NULL,  'P'},
+        { "json",       0,  NULL,  'j'},
+        { "help",       0,  NULL,  'h'},
+        { NULL,         0,  NULL,   0 }
+    };
+
+    BenchConfig bc;
+    int option;
+
+    while(-1 != (option = getopt_long(argc, argv, short_options, long_options, NULL))) {
+        switch(option) {
+            case 'p':
+                bc.port = atoi(optarg);
+                break;
+            case 'r':
+                if(!ParseRates(optarg, bc.rates)) {
+                    PrintUsage(stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                bc.stepSeconds = atof(optarg);
+                break;
+            case 'R':
+                bc.recorder = optarg;
+                break;
+            case 'P':
+                bc.threads = optarg;
+                break;
+            case 'j':
+                bc.json = true;
+                break;
+            case 'h':
+                PrintUsage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                PrintUsage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(bc.stepSeconds <= 0) {
+        PrintUsage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    RoverLog::SetLevel(LOG_WARNING);
+    /* The simulated device library logs every call at LOG_NOTICE */
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    ServerConfig config;
+    config.video.source = "none";
+    config.net.address = "127.0.0.1";
+    config.net.port = bc.port;
+    config.recorderPath = bc.recorder ? bc.recorder : "";
+    if(bc.threads && !ParseThreadConfig(bc.threads, config)) {
+        PrintUsage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    Server server(config);
+    server.Start();
+
+    Client client;
+    if(!Connect(client, bc.port)) return EXIT_FAILURE;
+
+    if(bc.json) printf("{\"step_seconds\":%.3f,\"results\":[", bc.stepSeconds);
+    else printf("%-20s %8s %8s %9s %9s %9s %9s\n", "rate / metric", "sent", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+    for(size_t i = 0; i < bc.rates.size(); ++i) {
+        double rate = bc.rates[i];
+
+        Summary command = MeasureCommand(client, rate, bc.stepSeconds);
+        Summary state = MeasureRequest(client, rate, bc.stepSeconds, RoverNet::REQ_WHEELS_STATE);
+        Summary distance = MeasureRequest(client, rate, bc.stepSeconds, RoverNet::REQ_DISTANCE);
+        Summary stop = MeasureStop(client, rate, bc.stepSeconds);
+
+        if(bc.json) printf("%s{\"rate_hz\":%.1f,", i == 0 ? "" : ",", rate);
+        else printf("%.0f Hz\n", rate);
+
+        PrintSummary("command_to_device", command, bc.json, true);
+        PrintSummary("wheels_state_rtt", state, bc.json, false);
+        PrintSummary("distance_rtt", distance, bc.json, false);
+        PrintSummary("stop_to_wheels", stop, bc.json, false);
+
+        if(bc.json) printf("}");
+        fflush(stdout);
+    }
+
+    Summary trajectory = MeasureTrajectory(client, 5);
+    if(bc.json) {
+        printf("],");
+        PrintSummary("trajectory_timing_error", trajectory, bc.json, true);
+        printf("}\n");
+    }
+    else {
+        printf("trajectory\n");
+        PrintSummary("timing_error", trajectory, bc.json, true);
+    }
+
+    Disconnect(client);
+    server.Stop();
+
+    return EXIT_SUCCESS;
+}
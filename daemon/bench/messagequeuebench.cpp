@@ -0,0 +1,409 @@
+/*
+ * messagequeuebench.cpp
+ *
+ * Microbenchmark of the control path building blocks: MessageQueue<RoverNet::Message> under
+ * one producer, several producers and bursty load (throughput, handoff latency, heap
+ * allocations per message) and the Message byte order codec. Implementations are listed in
+ * QUEUES and CODECS, an alternative is compared side by side by adding it to the list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <queue>
+#include <vector>
+
+#include "messagequeue.h"
+#include "nettypes.h"
+#include "netcodec.h"
+#include "util.h"
+
+/*
+ * Heap allocations are counted by replacing the global operator new. The glibc entry points
+ * are called directly, the compiler pairs malloc and free with new and delete otherwise.
+ */
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void __libc_free(void* p);
+};
+
+namespace {
+    std::atomic<uint64_t> allocations(0);
+};
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = __libc_malloc(size ? size : 1);
+    if(p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    __libc_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    __libc_free(p);
+}
+
+namespace {
+    using RoverNet::Message;
+
+    struct BenchConfig
+    {
+        size_t messages = 1000000;
+        unsigned producers = 4;
+        unsigned burst = 64;
+        bool json = false;
+    };
+
+    struct QueueResult
+    {
+        double opsPerSec;
+        double p50;
+        double p99;
+        double max;
+        double allocsPerOp;
+    };
+
+    /* Send time travels in the 8 byte payload of the message */
+    Message Stamp()
+    {
+        Message msg;
+        uint64_t now = MonotonicNs();
+        msg.msgType = RoverNet::CMD_SET_WHEELS_SPEED;
+        memcpy(&msg.data, &now, sizeof(now));
+        return msg;
+    }
+
+    uint64_t SentAt(const Message& msg)
+    {
+        uint64_t t;
+        memcpy(&t, &msg.data, sizeof(t));
+        return t;
+    }
+
+    void SleepNs(uint64_t ns)
+    {
+        timespec t = NsToTimespec(ns);
+        while(EINTR == clock_nanosleep(CLOCK_MONOTONIC, 0, &t, &t));
+    }
+
+/*
+ * Producers enqueue count messages each with the given pacing, the calling thread consumes
+ * all of them and records the handoff latency
+ */
+    template<typename Q>
+    struct Pattern
+    {
+        Q* queue;
+        size_t count;
+        unsigned burst;
+        uint64_t pauseNs;
+        pthread_barrier_t* start;
+
+        static void* Produce(void* arg)
+        {
+            Pattern* p = static_cast<Pattern*>(arg);
+            pthread_barrier_wait(p->start);
+            for(size_t i = 0; i < p->count; ++i) {
+                p->queue->Enqueue(Stamp());
+                if(p->pauseNs != 0 && (i + 1) % p->burst == 0) SleepNs(p->pauseNs);
+            }
+            return nullptr;
+        }
+    };
+
+    template<typename Q>
+    QueueResult RunPattern(unsigned producers, size_t perProducer, unsigned burst, uint64_t pauseNs)
+    {
+        Q queue;
+        size_t total = perProducer * producers;
+        std::vector<uint64_t> latency;
+        latency.reserve(total);
+
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, producers + 1);
+
+        Pattern<Q> pattern = { &queue, perProducer, burst ? burst : 1, pauseNs, &start };
+        std::vector<pthread_t> threads(producers);
+        for(pthread_t& t : threads) pthread_create(&t, NULL, Pattern<Q>::Produce, &pattern);
+
+        pthread_barrier_wait(&start);
+        uint64_t allocStart = allocations.load();
+        uint64_t begin = MonotonicNs();
+
+        for(size_t i = 0; i < total; ++i) {
+            Message msg = queue.Dequeue();
+            latency.push_back(MonotonicNs() - SentAt(msg));
+        }
+
+        uint64_t elapsed = MonotonicNs() - begin;
+        uint64_t allocs = allocations.load() - allocStart;
+
+        for(pthread_t& t : threads) pthread_join(t, NULL);
+        pthread_barrier_destroy(&start);
+
+        std::sort(latency.begin(), latency.end());
+        QueueResult r;
+        r.opsPerSec = static_cast<double>(total) * NSEC_PER_SEC / elapsed;
+        r.p50 = latency[latency.size() / 2];
+        r.p99 = latency[latency.size() * 99 / 100];
+        r.max = latency.back();
+        r.allocsPerOp = static_cast<double>(allocs) / total;
+        return r;
+    }
+
+/*
+ * Previous MessageQueue design, std::queue under a mutex, kept as the baseline
+ */
+    template<typename T>
+    class StdQueueBaseline
+    {
+        public:
+            StdQueueBaseline()
+            {
+                pthread_mutex_init(&mutex, NULL);
+                pthread_cond_init(&cond, NULL);
+            }
+
+            ~StdQueueBaseline()
+            {
+                pthread_cond_destroy(&cond);
+                pthread_mutex_destroy(&mutex);
+            }
+
+            void Enqueue(const T& item)
+            {
+                pthread_mutex_lock(&mutex);
+                queue.push(item);
+                pthread_mutex_unlock(&mutex);
+                pthread_cond_signal(&cond);
+            }
+
+            T Dequeue()
+            {
+                pthread_mutex_lock(&mutex);
+                while(queue.empty()) pthread_cond_wait(&cond, &mutex);
+                T item = queue.front();
+                queue.pop();
+                pthread_mutex_unlock(&mutex);
+                return item;
+            }
+
+        private:
+            std::queue<T> queue;
+            pthread_mutex_t mutex;
+            pthread_cond_t cond;
+    };
+
+    struct QueueImpl
+    {
+        const char* name;
+        QueueResult (*run)(unsigned producers, size_t perProducer, unsigned burst, uint64_t pauseNs);
+    };
+
+    struct CodecImpl
+    {
+        const char* name;
+        Message (*hostToNet)(Message);
+        Message (*netToHost)(Message);
+    };
+
+/*
+ * Implementations compared by the benchmark, the first codec is the reference the others
+ * are checked against
+ */
+    const QueueImpl QUEUES[] = {
+        { "MessageQueue", RunPattern<MessageQueue<Message>> },
+        { "std::queue", RunPattern<StdQueueBaseline<Message>> },
+    };
+
+    const CodecImpl CODECS[] = {
+        { "netcodec", RoverNet::HostToNet, RoverNet::NetToHost },
+    };
+
+    /* Mix of all message types with random payload */
+    std::vector<Message> MakeMessages(size_t count)
+    {
+        static const RoverNet::MessageType types[] = {
+            RoverNet::CMD_SET_LEFT_WHEEL_SPEED, RoverNet::CMD_SET_RIGHT_WHEEL_SPEED, RoverNet::CMD_SET_WHEELS_SPEED,
+            RoverNet::CMD_STOP, RoverNet::REQ_WHEELS_STATE, RoverNet::REQ_DISTANCE, RoverNet::REQ_VID_STREAM_PORT,
+            RoverNet::MSG_WHEELS_STATE, RoverNet::MSG_DISTANCE, RoverNet::MSG_VID_STREAM_PORT, RoverNet::MSG_DEV_AVAILABILITY
+        };
+
+        std::vector<Message> msgs(count);
+        srand(1);
+        for(Message& m : msgs) {
+            m = Message();
+            m.msgType = types[rand() % (sizeof(types) / sizeof(types[0]))];
+            for(size_t b = 0; b < sizeof(m.data); ++b) reinterpret_cast<uint8_t*>(&m.data)[b] = rand();
+        }
+        return msgs;
+    }
+
+    bool SameMessage(const Message& a, const Message& b)
+    {
+        return a.msgType == b.msgType && 0 == memcmp(&a.data, &b.data, sizeof(a.data));
+    }
+
+    bool VerifyCodec(const CodecImpl& codec, const std::vector<Message>& msgs)
+    {
+        const CodecImpl& ref = CODECS[0];
+        for(const Message& m : msgs) {
+            if(!SameMessage(codec.hostToNet(m), ref.hostToNet(m)) ||
+                    !SameMessage(codec.netToHost(m), ref.netToHost(m)) ||
+                    !SameMessage(codec.netToHost(codec.hostToNet(m)), m)) return false;
+        }
+        return true;
+    }
+
+    /* Messages per second of the conversion over the whole buffer */
+    double MeasureCodec(Message (*convert)(Message), std::vector<Message>& msgs, size_t total)
+    {
+        std::vector<Message> out(msgs.size());
+        uint64_t begin = MonotonicNs();
+        for(size_t done = 0; done < total; done += msgs.size()) {
+            for(size_t i = 0; i < msgs.size(); ++i) out[i] = convert(msgs[i]);
+            /* Keeps the compiler from removing the loop */
+            msgs[done / msgs.size() % msgs.size()].msgType = out[0].msgType;
+        }
+        uint64_t elapsed = MonotonicNs() - begin;
+        return static_cast<double>(total) * NSEC_PER_SEC / elapsed;
+    }
+
+    void PrintQueue(const char* impl, const char* pattern, const QueueResult& r, bool json, bool& first)
+    {
+        if(json) {
+            printf("%s{\"impl\":\"%s\",\"pattern\":\"%s\",\"ops_per_sec\":%.0f,\"latency_ns\":{\"p50\":%.0f,"
+                    "\"p99\":%.0f,\"max\":%.0f},\"allocs_per_op\":%.4f}",
+                    first ? "" : ",", impl, pattern, r.opsPerSec, r.p50, r.p99, r.max, r.allocsPerOp);
+        }
+        else {
+            printf("%-16s %-10s %12.0f %10.0f %10.0f %12.0f %10.4f\n",
+                    impl, pattern, r.opsPerSec, r.p50, r.p99, r.max, r.allocsPerOp);
+        }
+        first = false;
+    }
+
+    void PrintUsage(FILE* s)
+    {
+        fprintf(s,
+                "Usage: \n"
+                "   -n  --messages N    Messages per queue measurement (default 1000000).\n"
+                "   -p  --producers N   Producer threads of the NP1C pattern (default 4).\n"
+                "   -b  --burst N       Messages per burst of the burst pattern (default 64).\n"
+                "   -j  --json          Print results as JSON.\n"
+                "   -h  --help          Print this message.\n"
+                "Patterns: 1p1c and np1c enqueue as fast as possible, paced sends one message every\n"
+                "50 us (wake-up latency of an idle consumer), burst sends bursts 1 ms apart.\n");
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char* const short_options = "n:p:b:jh";
+
+    const struct option long_options[] = {
+        { "messages",   1,  NULL,  'n'},
+        { "producers",  1,  NULL,  'p'},
+        { "burst",      1,  NULL,  'b'},
+        { "json",       0,  NULL,  'j'},
+        { "help",       0,  NULL,  'h'},
+        { NULL,         0,  NULL,   0 }
+    };
+
+    BenchConfig bc;
+    int option;
+
+    while(-1 != (option = getopt_long(argc, argv, short_options, long_options, NULL))) {
+        switch(option) {
+            case 'n':
+                bc.messages = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                bc.producers = atoi(optarg);
+                break;
+            case 'b':
+                bc.burst = atoi(optarg);
+                break;
+            case 'j':
+                bc.json = true;
+                break;
+            case 'h':
+                PrintUsage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                PrintUsage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(bc.messages < 1000 || bc.producers < 1 || bc.burst < 1) {
+        PrintUsage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    bool first = true;
+    bool exact = true;
+
+    if(bc.json) printf("{\"messages\":%zu,\"queues\":[", bc.messages);
+    else printf("%-16s %-10s %12s %10s %10s %12s %10s\n", "queue", "pattern", "ops/s", "p50 ns", "p99 ns", "max ns", "allocs/op");
+
+    for(const QueueImpl& q : QUEUES) {
+        size_t paced = std::min<size_t>(bc.messages, 20000);
+        size_t bursts = std::max<size_t>(1, std::min<size_t>(bc.messages, 200000) / bc.burst);
+
+        PrintQueue(q.name, "1p1c", q.run(1, bc.messages, 1, 0), bc.json, first);
+        PrintQueue(q.name, "np1c", q.run(bc.producers, bc.messages / bc.producers, 1, 0), bc.json, first);
+        PrintQueue(q.name, "paced", q.run(1, paced, 1, 50000), bc.json, first);
+        PrintQueue(q.name, "burst", q.run(1, bursts * bc.burst, bc.burst, 1000000), bc.json, first);
+    }
+
+    if(bc.json) printf("],\"codecs\":[");
+    else printf("\n%-16s %-12s %14s %10s\n", "codec", "op", "msgs/s", "ns/msg");
+
+    std::vector<Message> msgs = MakeMessages(4096);
+    first = true;
+
+    for(const CodecImpl& c : CODECS) {
+        bool ok = VerifyCodec(c, msgs);
+        exact = exact && ok;
+
+        struct { const char* op; Message (*fn)(Message); } ops[] = {
+            { "host_to_net", c.hostToNet },
+            { "net_to_host", c.netToHost }
+        };
+
+        for(const auto& op : ops) {
+            double rate = MeasureCodec(op.fn, msgs, bc.messages * 10);
+            if(bc.json) {
+                printf("%s{\"impl\":\"%s\",\"op\":\"%s\",\"msgs_per_sec\":%.0f,\"ns_per_msg\":%.2f,\"exact\":%s}",
+                        first ? "" : ",", c.name, op.op, rate, 1e9 / rate, ok ? "true" : "false");
+            }
+            else {
+                printf("%-16s %-12s %14.0f %10.2f%s\n", c.name, op.op, rate, 1e9 / rate, ok ? "" : "  MISMATCH");
+            }
+            first = false;
+        }
+    }
+
+    if(bc.json) printf("]}\n");
+
+    return exact ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,197 @@
+/*
+ * pixelconvertbench.cpp
+ *
+ * Benchmark of the pixel conversion and downscaling kernels. Every implementation available
+ * on the machine is first checked to be bit-exact with the scalar reference, then timed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <vector>
+
+#include "pixelconvert.h"
+#include "util.h"
+
+namespace {
+    enum Kernel { YUYV_TO_I420, DOWNSCALE_2X, DOWNSCALE_4X };
+    const char* const KERNEL_NAMES[] = { "yuyv_to_i420", "downscale_2x", "downscale_4x" };
+
+    struct Image
+    {
+        unsigned width;
+        unsigned height;
+        unsigned srcStride;
+        std::vector<uint8_t> src;
+        std::vector<uint8_t> dst;
+    };
+
+/*
+ * Destination planes are laid out one after another, each with stride equal to its width
+ */
+    Image MakeImage(Kernel kernel, unsigned width, unsigned height, unsigned seed)
+    {
+        Image img;
+        img.width = width;
+        img.height = height;
+        img.srcStride = (kernel == YUYV_TO_I420 ? width * 2 : width) + 16;
+        img.src.resize(img.srcStride * height);
+        img.dst.assign(width * height * 2, 0);
+
+        srand(seed);
+        for(auto& b : img.src) b = rand() & 0xFF;
+
+        return img;
+    }
+
+    void Run(const PixelKernels& k, Kernel kernel, Image& img)
+    {
+        uint8_t* dst = img.dst.data();
+
+        switch(kernel) {
+            case YUYV_TO_I420:
+                {
+                    unsigned cw = img.width / 2;
+                    uint8_t* y = dst;
+                    uint8_t* u = y + img.width * img.height;
+                    uint8_t* v = u + cw * (img.height / 2);
+                    k.yuyvToI420(img.src.data(), img.srcStride, img.width, img.height, y, img.width, u, cw, v, cw);
+                }
+                break;
+            case DOWNSCALE_2X:
+                k.downscale2x(img.src.data(), img.srcStride, img.width, img.height, dst, img.width / 2);
+                break;
+            case DOWNSCALE_4X:
+                k.downscale4x(img.src.data(), img.srcStride, img.width, img.height, dst, img.width / 4);
+                break;
+        }
+    }
+
+    bool Verify(const PixelKernels& k, Kernel kernel)
+    {
+        static const unsigned sizes[][2] = { { 640, 480 }, { 334, 246 }, { 66, 38 }, { 8, 4 }, { 1282, 724 } };
+
+        for(const auto& s : sizes) {
+            Image ref = MakeImage(kernel, s[0], s[1], s[0] * s[1]);
+            Image test = MakeImage(kernel, s[0], s[1], s[0] * s[1]);
+
+            Run(PixelConvert::SCALAR, kernel, ref);
+            Run(k, kernel, test);
+
+            if(ref.dst != test.dst) {
+                fprintf(stderr, "%s %s: output differs from scalar reference at %ux%u\n",
+                        k.name, KERNEL_NAMES[kernel], s[0], s[1]);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    double Measure(const PixelKernels& k, Kernel kernel, unsigned width, unsigned height, double seconds)
+    {
+        Image img = MakeImage(kernel, width, height, 1);
+        unsigned iterations = 0;
+
+        Run(k, kernel, img);
+
+        uint64_t start = MonotonicNs();
+        uint64_t end = start + static_cast<uint64_t>(seconds * NSEC_PER_SEC);
+        uint64_t now;
+        do {
+            for(unsigned i = 0; i < 16; ++i) Run(k, kernel, img);
+            iterations += 16;
+            now = MonotonicNs();
+        } while(now < end);
+
+        /* Throughput in source megapixels per second */
+        return static_cast<double>(width) * height * iterations / ((now - start) / 1e3);
+    }
+
+    void PrintUsage(FILE* s)
+    {
+        fprintf(s,
+                "Usage: \n"
+                "   -s  --size WxH      Frame size used for timing (default 640x480).\n"
+                "   -t  --time SEC      Time spent on each kernel (default 0.5).\n"
+                "   -j  --json          Print results as JSON.\n"
+                "   -h  --help          Print this message.\n");
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char* const short_options = "s:t:jh";
+
+    const struct option long_options[] = {
+        { "size",   1,  NULL,  's'},
+        { "time",   1,  NULL,  't'},
+        { "json",   0,  NULL,  'j'},
+        { "help",   0,  NULL,  'h'},
+        { NULL,     0,  NULL,   0 }
+    };
+
+    unsigned width = 640;
+    unsigned height = 480;
+    double seconds = 0.5;
+    bool json = false;
+    int option;
+
+    while(-1 != (option = getopt_long(argc, argv, short_options, long_options, NULL))) {
+        switch(option) {
+            case 's':
+                if(2 != sscanf(optarg, "%ux%u", &width, &height) || width < 4 || height < 4) {
+                    PrintUsage(stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 'h':
+                PrintUsage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                PrintUsage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    bool exact = true;
+    bool first = true;
+
+    if(json) printf("{\"size\":\"%ux%u\",\"selected\":\"%s\",\"results\":[", width, height, PixelConvert::Kernels().name);
+    else printf("%ux%u, runtime selection: %s\n%-8s %-14s %12s\n", width, height, PixelConvert::Kernels().name,
+            "impl", "kernel", "MPix/s");
+
+    for(const PixelKernels* k : PixelConvert::Available()) {
+        for(Kernel kernel : { YUYV_TO_I420, DOWNSCALE_2X, DOWNSCALE_4X }) {
+            bool ok = Verify(*k, kernel);
+            double mpps = Measure(*k, kernel, width, height, seconds);
+            exact = exact && ok;
+
+            if(json) {
+                printf("%s{\"impl\":\"%s\",\"kernel\":\"%s\",\"mpix_per_sec\":%.2f,\"bit_exact\":%s}",
+                        first ? "" : ",", k->name, KERNEL_NAMES[kernel], mpps, ok ? "true" : "false");
+            }
+            else {
+                printf("%-8s %-14s %12.2f%s\n", k->name, KERNEL_NAMES[kernel], mpps, ok ? "" : "  MISMATCH");
+            }
+            first = false;
+        }
+    }
+
+    if(json) printf("]}\n");
+
+    return exact ? EXIT_SUCCESS : EXIT_FAILURE;
+}
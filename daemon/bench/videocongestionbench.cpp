@@ -0,0 +1,437 @@
+/*
+ * videocongestionbench.cpp
+ *
+ * Video congestion benchmark. The video stream is relayed over loopback through a userspace
+ * bottleneck: a drop-tail FIFO drained at the link rate, shared with a 50 Hz stream of small
+ * control packets. The link rate steps down in the middle of the run, the benchmark reports
+ * the control packet latency and loss and the delivered video rate, with and without
+ * congestion adaptation of the stream.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "videostreammanager.h"
+#include "nettypes.h"
+#include "logging.h"
+#include "util.h"
+
+namespace {
+    /* Control traffic: 50 commands per second, Message plus TCP/IP headers */
+    constexpr uint64_t PING_INTERVAL_NS = 20000000ULL;
+    constexpr size_t PING_SIZE = 64;
+    constexpr uint64_t REPORT_INTERVAL_NS = 100000000ULL;
+    /* Per datagram overhead on the link, IP and UDP headers */
+    constexpr size_t UDP_OVERHEAD = 28;
+
+    struct BenchConfig
+    {
+        const char* source = "pattern:320x240@15";
+        unsigned highKbps = 10000;
+        unsigned lowKbps = 2000;
+        double phaseSec = 6.0;
+        size_t queueBytes = 256 * 1024;
+        bool json = false;
+    };
+
+    struct Packet
+    {
+        uint64_t arrivalNs;
+        size_t size;
+        bool ping;
+        /* Video datagram fields */
+        uint32_t sequence;
+        uint32_t frameSize;
+    };
+
+/*
+ * Measurement window, metrics are collected from packets leaving the bottleneck in [start, end)
+ */
+    struct Window
+    {
+        const char* name;
+        uint64_t startNs;
+        uint64_t endNs;
+
+        std::vector<uint64_t> pingLatency;
+        unsigned pingsSent = 0;
+        size_t videoBytes = 0;
+        unsigned videoDrops = 0;
+
+        double Percentile(double p)
+        {
+            if(pingLatency.empty()) return 0;
+            std::sort(pingLatency.begin(), pingLatency.end());
+            size_t i = std::min(pingLatency.size() - 1, static_cast<size_t>(p * pingLatency.size()));
+            return pingLatency[i] / 1e6;
+        }
+    };
+
+    struct RunResult
+    {
+        bool adaptive;
+        Window windows[3];
+        VideoStreamStats stats;
+    };
+
+    class Bottleneck
+    {
+        public:
+            Bottleneck(size_t limitBytes): limitBytes(limitBytes), queuedBytes(0), linkFreeNs(0), rateBps(0) {}
+
+            void SetRate(unsigned kbps) { rateBps = kbps * 1000.0 / 8; }
+
+            bool Enqueue(const Packet& p)
+            {
+                if(queuedBytes + p.size > limitBytes) return false;
+                queue.push_back(p);
+                queuedBytes += p.size;
+                return true;
+            }
+
+/*
+ * Packets leave one after another at the link rate, returns false when the head
+ * of the queue is still being transmitted at the time now
+ */
+            bool Dequeue(uint64_t now, Packet& p, uint64_t& departureNs)
+            {
+                if(queue.empty()) return false;
+
+                uint64_t start = std::max(linkFreeNs, queue.front().arrivalNs);
+                uint64_t done = start + static_cast<uint64_t>(queue.front().size * NSEC_PER_SEC / rateBps);
+                if(done > now) return false;
+
+                p = queue.front();
+                queue.pop_front();
+                queuedBytes -= p.size;
+                linkFreeNs = done;
+                departureNs = done;
+                return true;
+            }
+
+            /* Time the head of the queue leaves the link, 0 when empty */
+            uint64_t NextDepartureNs() const
+            {
+                if(queue.empty()) return 0;
+                return std::max(linkFreeNs, queue.front().arrivalNs) +
+                        static_cast<uint64_t>(queue.front().size * NSEC_PER_SEC / rateBps);
+            }
+
+        private:
+            std::deque<Packet> queue;
+            size_t limitBytes;
+            size_t queuedBytes;
+            uint64_t linkFreeNs;
+            double rateBps;
+    };
+
+    Window* FindWindow(RunResult& r, uint64_t t)
+    {
+        for(auto& w : r.windows) {
+            if(t >= w.startNs && t < w.endNs) return &w;
+        }
+        return nullptr;
+    }
+
+    void SendControl(int sock, const sockaddr_in& server, RoverNet::VideoControlType type,
+            uint32_t packets, uint32_t bytes, uint32_t lastSequence, uint32_t ageUS)
+    {
+        RoverNet::VideoControl ctrl;
+        memset(&ctrl, 0, sizeof(ctrl));
+        ctrl.ctrlType = type;
+        ctrl.data.receiverReport.packetsReceived = htonl(packets);
+        ctrl.data.receiverReport.bytesReceived = htonl(bytes);
+        ctrl.data.receiverReport.lastFrameSequence = htonl(lastSequence);
+        ctrl.data.receiverReport.lastFrameAgeUS = htonl(ageUS);
+        sendto(sock, &ctrl, sizeof(ctrl), 0, reinterpret_cast<const sockaddr*>(&server), sizeof(server));
+    }
+
+    bool Run(const BenchConfig& bc, bool adaptive, RunResult& result)
+    {
+        VideoConfig vc;
+        vc.source = bc.source;
+        vc.port = 0;
+        vc.adaptive = adaptive;
+        vc.maxKbps = bc.highKbps;
+
+        VideoStreamManager manager(vc);
+        manager.Start();
+        if(!manager.Running()) {
+            fprintf(stderr, "video source %s could not be started\n", bc.source);
+            return false;
+        }
+
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        int rcvBuf = 8 << 20;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+
+        sockaddr_in server;
+        memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(manager.Port());
+        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        Bottleneck link(bc.queueBytes);
+        link.SetRate(bc.highKbps);
+
+        uint64_t phaseNs = static_cast<uint64_t>(bc.phaseSec * NSEC_PER_SEC);
+        uint64_t start = MonotonicNs();
+        uint64_t stepNs = start + phaseNs;
+        uint64_t end = stepNs + phaseNs;
+
+        result.adaptive = adaptive;
+        result.windows[0].name = "high";
+        result.windows[0].startNs = start + phaseNs / 2;
+        result.windows[0].endNs = stepNs;
+        result.windows[1].name = "step";
+        result.windows[1].startNs = stepNs;
+        result.windows[1].endNs = stepNs + NSEC_PER_SEC;
+        result.windows[2].name = "low";
+        result.windows[2].startNs = stepNs + phaseNs / 2;
+        result.windows[2].endNs = end;
+
+        bool stepped = false;
+        uint64_t nextPing = start;
+        uint64_t nextReport = start;
+        /* Packets of frames before the current one, and at the last complete frame */
+        uint32_t packetsSettled = 0;
+        uint32_t packetsReported = 0;
+        uint32_t bytesDelivered = 0;
+        uint32_t lastSequence = 0;
+        uint64_t lastCompleteNs = 0;
+        uint32_t frameSequence = 0;
+        uint32_t framePackets = 0;
+        uint32_t frameBytes = 0;
+        uint8_t buffer[2048];
+
+        SendControl(sock, server, RoverNet::VideoControlType::VID_SUBSCRIBE, 0, 0, 0, 0);
+
+        for(uint64_t now = MonotonicNs(); now < end; now = MonotonicNs()) {
+            if(!stepped && now >= stepNs) {
+                link.SetRate(bc.lowKbps);
+                stepped = true;
+            }
+
+            /* Reports travel on the uncongested reverse direction */
+            if(now >= nextReport) {
+                SendControl(sock, server, RoverNet::VideoControlType::VID_RECEIVER_REPORT,
+                        packetsReported, bytesDelivered, lastSequence,
+                        lastCompleteNs ? static_cast<uint32_t>((now - lastCompleteNs) / 1000) : 0);
+                nextReport += REPORT_INTERVAL_NS;
+            }
+
+            if(now >= nextPing) {
+                Packet p = { now, PING_SIZE, true, 0, 0 };
+                Window* w = FindWindow(result, now);
+                if(w != nullptr) w->pingsSent++;
+                link.Enqueue(p);
+                nextPing += PING_INTERVAL_NS;
+            }
+
+            ssize_t r;
+            while(0 < (r = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT))) {
+                if(static_cast<size_t>(r) < sizeof(RoverNet::VideoPacketHeader)) continue;
+
+                RoverNet::VideoPacketHeader header;
+                memcpy(&header, buffer, sizeof(header));
+                Packet p = { now, static_cast<size_t>(r) + UDP_OVERHEAD, false,
+                        ntohl(header.frameSequence), ntohl(header.frameSize) };
+                if(!link.Enqueue(p)) {
+                    Window* w = FindWindow(result, now);
+                    if(w != nullptr) w->videoDrops++;
+                }
+            }
+
+            Packet p;
+            uint64_t departure;
+            while(link.Dequeue(now, p, departure)) {
+                Window* w = FindWindow(result, departure);
+                if(p.ping) {
+                    if(w != nullptr) w->pingLatency.push_back(departure - p.arrivalNs);
+                    continue;
+                }
+                bytesDelivered += p.size - UDP_OVERHEAD;
+                if(w != nullptr) w->videoBytes += p.size;
+
+                if(p.sequence != frameSequence) {
+                    packetsSettled += framePackets;
+                    frameSequence = p.sequence;
+                    framePackets = 0;
+                    frameBytes = 0;
+                }
+                framePackets++;
+                frameBytes += p.size - UDP_OVERHEAD - sizeof(RoverNet::VideoPacketHeader);
+                if(frameBytes == p.frameSize) {
+                    lastSequence = p.sequence;
+                    lastCompleteNs = departure;
+                    packetsReported = packetsSettled + framePackets;
+                }
+            }
+
+            uint64_t wake = std::min(nextPing, nextReport);
+            uint64_t departureNs = link.NextDepartureNs();
+            if(departureNs != 0) wake = std::min(wake, departureNs);
+
+            pollfd pfd = { sock, POLLIN, 0 };
+            timespec timeout = NsToTimespec(wake > now ? wake - now : 0);
+            ppoll(&pfd, 1, &timeout, NULL);
+        }
+
+        result.stats = manager.Stats();
+        SendControl(sock, server, RoverNet::VideoControlType::VID_UNSUBSCRIBE, 0, 0, 0, 0);
+
+        manager.Stop();
+        close(sock);
+        return true;
+    }
+
+    void Print(const BenchConfig& bc, RunResult* results, unsigned count)
+    {
+        bool first = true;
+
+        if(bc.json) {
+            printf("{\"source\":\"%s\",\"high_kbps\":%u,\"low_kbps\":%u,\"queue_bytes\":%zu,\"results\":[",
+                    bc.source, bc.highKbps, bc.lowKbps, bc.queueBytes);
+        }
+        else {
+            printf("%s, link %u -> %u kbps, queue %zu bytes\n", bc.source, bc.highKbps, bc.lowKbps, bc.queueBytes);
+            printf("%-9s %-5s %10s %10s %10s %9s %11s\n",
+                    "mode", "phase", "ctl p50 ms", "ctl p99 ms", "ctl loss %", "vid kbps", "vid drops");
+        }
+
+        for(unsigned i = 0; i < count; ++i) {
+            RunResult& r = results[i];
+            for(auto& w : r.windows) {
+                double seconds = static_cast<double>(w.endNs - w.startNs) / NSEC_PER_SEC;
+                double loss = w.pingsSent ? 100.0 * (w.pingsSent - std::min<size_t>(w.pingsSent, w.pingLatency.size())) / w.pingsSent : 0;
+                double kbps = w.videoBytes * 8 / seconds / 1000;
+                double p50 = w.Percentile(0.5);
+                double p99 = w.Percentile(0.99);
+
+                if(bc.json) {
+                    printf("%s{\"adaptive\":%s,\"phase\":\"%s\",\"control_p50_ms\":%.2f,\"control_p99_ms\":%.2f,"
+                            "\"control_loss_pct\":%.1f,\"video_kbps\":%.0f,\"video_drops\":%u}",
+                            first ? "" : ",", r.adaptive ? "true" : "false", w.name, p50, p99, loss, kbps, w.videoDrops);
+                }
+                else {
+                    printf("%-9s %-5s %10.2f %10.2f %10.1f %9.0f %11u\n",
+                            r.adaptive ? "adaptive" : "fixed", w.name, p50, p99, loss, kbps, w.videoDrops);
+                }
+                first = false;
+            }
+
+            if(!bc.json && r.stats.subscriberCount > 0) {
+                const VideoSubscriberStats& sub = r.stats.subscribers[0];
+                printf("%-9s final level: scale 1/%u, frame rate 1/%u, budget %u kbps, frames sent %llu, skipped %llu\n",
+                        r.adaptive ? "adaptive" : "fixed", sub.scale, sub.frameDivider,
+                        sub.budgetBytesPerSec * 8 / 1000,
+                        static_cast<unsigned long long>(sub.framesSent),
+                        static_cast<unsigned long long>(sub.framesDropped));
+            }
+        }
+
+        if(bc.json) printf("]}\n");
+    }
+
+    void PrintUsage(FILE* s)
+    {
+        fprintf(s,
+                "Usage: \n"
+                "   -s  --source SPEC   Video source (default pattern:320x240@15).\n"
+                "   -a  --high KBPS     Link rate of the first phase (default 10000).\n"
+                "   -b  --low KBPS      Link rate after the step down (default 2000).\n"
+                "   -t  --time SEC      Duration of each phase (default 6).\n"
+                "   -q  --queue BYTES   Bottleneck queue limit (default 262144).\n"
+                "   -m  --mode MODE     adaptive, fixed or both (default both).\n"
+                "   -j  --json          Print results as JSON.\n"
+                "   -h  --help          Print this message.\n");
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char* const short_options = "s:a:b:t:q:m:jh";
+
+    const struct option long_options[] = {
+        { "source", 1,  NULL,  's'},
+        { "high",   1,  NULL,  'a'},
+        { "low",    1,  NULL,  'b'},
+        { "time",   1,  NULL,  't'},
+        { "queue",  1,  NULL,  'q'},
+        { "mode",   1,  NULL,  'm'},
+        { "json",   0,  NULL,  'j'},
+        { "help",   0,  NULL,  'h'},
+        { NULL,     0,  NULL,   0 }
+    };
+
+    BenchConfig bc;
+    bool modes[2] = { true, true };
+    int option;
+
+    while(-1 != (option = getopt_long(argc, argv, short_options, long_options, NULL))) {
+        switch(option) {
+            case 's':
+                bc.source = optarg;
+                break;
+            case 'a':
+                bc.highKbps = atoi(optarg);
+                break;
+            case 'b':
+                bc.lowKbps = atoi(optarg);
+                break;
+            case 't':
+                bc.phaseSec = atof(optarg);
+                break;
+            case 'q':
+                bc.queueBytes = atoi(optarg);
+                break;
+            case 'm':
+                modes[0] = (0 != strcmp(optarg, "fixed"));
+                modes[1] = (0 != strcmp(optarg, "adaptive"));
+                break;
+            case 'j':
+                bc.json = true;
+                break;
+            case 'h':
+                PrintUsage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                PrintUsage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(bc.highKbps == 0 || bc.lowKbps == 0 || bc.phaseSec < 2 || bc.queueBytes < 2048) {
+        PrintUsage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    RoverLog::SetLevel(LOG_WARNING);
+
+    RunResult results[2];
+    unsigned count = 0;
+
+    if(modes[0] && !Run(bc, true, results[count++])) return EXIT_FAILURE;
+    if(modes[1] && !Run(bc, false, results[count++])) return EXIT_FAILURE;
+
+    Print(bc, results, count);
+
+    return EXIT_SUCCESS;
+}
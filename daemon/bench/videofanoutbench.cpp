@@ -0,0 +1,251 @@
+/*
+ * videofanoutbench.cpp
+ *
+ * Video fan-out benchmark. The stream is received by 1 to N local subscribers, for each count
+ * the benchmark reports the delivered frame rate, the number of conversion passes, the CPU
+ * time spent by the streaming threads and the resident memory of the process.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <poll.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "videostreammanager.h"
+#include "nettypes.h"
+#include "logging.h"
+#include "util.h"
+
+namespace {
+    struct Result
+    {
+        unsigned subscribers;
+        double fpsPerSubscriber;
+        double conversionsPerSec;
+        /* CPU time of the streaming threads, percent of one core */
+        double serverCpu;
+        double rssMB;
+    };
+
+    uint64_t ProcessCpuNs()
+    {
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * NSEC_PER_SEC +
+                (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+    }
+
+    uint64_t ThreadCpuNs()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return TimespecToNs(ts);
+    }
+
+    double ResidentMB()
+    {
+        long pages = 0;
+        FILE* f = fopen("/proc/self/statm", "r");
+        if(f != nullptr) {
+            if(1 != fscanf(f, "%*s %ld", &pages)) pages = 0;
+            fclose(f);
+        }
+        return pages * sysconf(_SC_PAGESIZE) / 1048576.0;
+    }
+
+    void Subscribe(int sock, uint16_t port, RoverNet::VideoControlType type)
+    {
+        sockaddr_in server;
+        memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(port);
+        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        RoverNet::VideoControl ctrl;
+        memset(&ctrl, 0, sizeof(ctrl));
+        ctrl.ctrlType = type;
+        sendto(sock, &ctrl, sizeof(ctrl), 0, reinterpret_cast<const sockaddr*>(&server), sizeof(server));
+    }
+
+/*
+ * Subscribers are sockets drained by the calling thread, whose CPU time is subtracted
+ * from the process total
+ */
+    bool Run(const char* spec, unsigned count, double seconds, Result& result)
+    {
+        VideoConfig vc;
+        vc.source = spec;
+        vc.port = 0;
+        vc.adaptive = false;
+
+        VideoStreamManager manager(vc);
+        manager.Start();
+        if(!manager.Running()) {
+            fprintf(stderr, "video source %s could not be started\n", spec);
+            return false;
+        }
+
+        int socks[VIDEO_MAX_SUBSCRIBERS];
+        pollfd pfds[VIDEO_MAX_SUBSCRIBERS];
+        uint32_t frames[VIDEO_MAX_SUBSCRIBERS] = { 0 };
+        uint32_t lastSequence[VIDEO_MAX_SUBSCRIBERS];
+
+        for(unsigned i = 0; i < count; ++i) {
+            int rcvBuf = 8 << 20;
+            socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+            setsockopt(socks[i], SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+            Subscribe(socks[i], manager.Port(), RoverNet::VideoControlType::VID_SUBSCRIBE);
+            pfds[i] = { socks[i], POLLIN, 0 };
+            lastSequence[i] = UINT32_MAX;
+        }
+
+        /* Measurement starts after a warm up in which pools reach their steady state */
+        uint64_t start = MonotonicNs() + NSEC_PER_SEC / 2;
+        uint64_t end = start + static_cast<uint64_t>(seconds * NSEC_PER_SEC);
+        bool measuring = false;
+        VideoStreamStats before;
+        uint64_t cpuStart = 0;
+        uint8_t buffer[2048];
+
+        for(uint64_t now = MonotonicNs(); now < end; now = MonotonicNs()) {
+            if(!measuring && now >= start) {
+                before = manager.Stats();
+                cpuStart = ProcessCpuNs() - ThreadCpuNs();
+                start = now;
+                measuring = true;
+                for(auto& f : frames) f = 0;
+            }
+
+            if(0 >= poll(pfds, count, 100)) continue;
+
+            for(unsigned i = 0; i < count; ++i) {
+                ssize_t r;
+                while(0 < (r = recv(socks[i], buffer, sizeof(buffer), MSG_DONTWAIT))) {
+                    if(static_cast<size_t>(r) < sizeof(RoverNet::VideoPacketHeader)) continue;
+                    RoverNet::VideoPacketHeader header;
+                    memcpy(&header, buffer, sizeof(header));
+                    if(ntohl(header.frameSequence) != lastSequence[i]) {
+                        lastSequence[i] = ntohl(header.frameSequence);
+                        frames[i]++;
+                    }
+                }
+            }
+        }
+
+        uint64_t elapsed = MonotonicNs() - start;
+        uint64_t cpu = ProcessCpuNs() - ThreadCpuNs() - cpuStart;
+        VideoStreamStats after = manager.Stats();
+
+        uint64_t totalFrames = 0;
+        for(unsigned i = 0; i < count; ++i) {
+            totalFrames += frames[i];
+            Subscribe(socks[i], manager.Port(), RoverNet::VideoControlType::VID_UNSUBSCRIBE);
+            close(socks[i]);
+        }
+
+        result.subscribers = count;
+        result.fpsPerSubscriber = static_cast<double>(totalFrames) / count * NSEC_PER_SEC / elapsed;
+        result.conversionsPerSec = static_cast<double>(after.framesConverted - before.framesConverted) * NSEC_PER_SEC / elapsed;
+        result.serverCpu = 100.0 * cpu / elapsed;
+        result.rssMB = ResidentMB();
+
+        manager.Stop();
+        return true;
+    }
+
+    void PrintUsage(FILE* s)
+    {
+        fprintf(s,
+                "Usage: \n"
+                "   -s  --source SPEC   Video source (default pattern:640x480@30).\n"
+                "   -n  --count N       Highest number of subscribers (default %u).\n"
+                "   -t  --time SEC      Measurement time per subscriber count (default 3).\n"
+                "   -j  --json          Print results as JSON.\n"
+                "   -h  --help          Print this message.\n", VIDEO_MAX_SUBSCRIBERS);
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char* const short_options = "s:n:t:jh";
+
+    const struct option long_options[] = {
+        { "source", 1,  NULL,  's'},
+        { "count",  1,  NULL,  'n'},
+        { "time",   1,  NULL,  't'},
+        { "json",   0,  NULL,  'j'},
+        { "help",   0,  NULL,  'h'},
+        { NULL,     0,  NULL,   0 }
+    };
+
+    const char* spec = "pattern:640x480@30";
+    unsigned maxCount = VIDEO_MAX_SUBSCRIBERS;
+    double seconds = 3.0;
+    bool json = false;
+    int option;
+
+    while(-1 != (option = getopt_long(argc, argv, short_options, long_options, NULL))) {
+        switch(option) {
+            case 's':
+                spec = optarg;
+                break;
+            case 'n':
+                maxCount = atoi(optarg);
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 'h':
+                PrintUsage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                PrintUsage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(maxCount < 1 || maxCount > VIDEO_MAX_SUBSCRIBERS || seconds <= 0) {
+        PrintUsage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    RoverLog::SetLevel(LOG_WARNING);
+
+    if(json) printf("{\"source\":\"%s\",\"results\":[", spec);
+    else printf("%s\n%-6s %10s %12s %12s %8s\n", spec, "subs", "fps/sub", "convert/s", "server cpu%", "rss MB");
+
+    for(unsigned count = 1; count <= maxCount; ++count) {
+        Result r;
+        if(!Run(spec, count, seconds, r)) return EXIT_FAILURE;
+
+        if(json) {
+            printf("%s{\"subscribers\":%u,\"fps_per_subscriber\":%.1f,\"conversions_per_sec\":%.1f,"
+                    "\"server_cpu_pct\":%.1f,\"rss_mb\":%.1f}",
+                    count == 1 ? "" : ",", r.subscribers, r.fpsPerSubscriber, r.conversionsPerSec, r.serverCpu, r.rssMB);
+        }
+        else {
+            printf("%-6u %10.1f %12.1f %12.1f %8.1f\n",
+                    r.subscribers, r.fpsPerSubscriber, r.conversionsPerSec, r.serverCpu, r.rssMB);
+        }
+    }
+
+    if(json) printf("]}\n");
+
+    return EXIT_SUCCESS;
+}
@@ -12,23 +12,66 @@
 #include <signal.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include <errno.h>
 #include <cxxabi.h>
+#include <algorithm>
+#include <cstdlib>
 
 #include "deviceuc0service.h"
+#include "flightrecorder.h"
+#include "tracing.h"
+#include "netcodec.h"
 #include "util.h"
 #include "logging.h"
 
 
 DeviceUC0Service::DeviceUC0Service(RoverNet::NetMsgQueueShrPtr incomingQueue,
-        RoverNet::NetMsgQueueShrPtr outgoingQueue):
-    deviceHandler(nullptr),
+        RoverNet::NetMsgQueueShrPtr outgoingQueue,
+        TimerService* timers,
+        const DeviceConfig& config):
+    config(config),
     inQueue(incomingQueue),
     outQueue(outgoingQueue),
-    distanceRequestPending(false)
+    timers(timers),
+    trajectoryPoints(0),
+    trajectoryStartNs(0),
+    rampPending(false),
+    motionTraceId(0),
+    motionGeneration(0),
+    runningGeneration(0),
+    runningPoints(0),
+    runningRamp(false),
+    delayedTimer(0),
+    delayedWriteNs(0),
+    deviceHandler(nullptr),
+    reflexActive(false),
+    watchdogTimer(0),
+    lastCommandNs(0),
+    clientDeadlineMs(0),
+    watchdogDeadlineMs(0),
+    distanceHistory(1, TimeSeries::MEAN),
+    wheelsHistory(2, TimeSeries::LAST)
 {
     PTHREAD_GUARD( pthread_mutex_init(&deviceLockMutex, NULL) );
-    PTHREAD_GUARD( pthread_mutex_init(&distanceMonitorMutex, NULL) );
-    PTHREAD_GUARD( pthread_cond_init(&distanceMonitorCond, NULL) );
+    PTHREAD_GUARD( pthread_mutex_init(&batchMutex, NULL) );
+    batches.reserve(DEV_PENDING_BATCHES);
+
+    pthread_condattr_t condAttr;
+    PTHREAD_GUARD( pthread_mutex_init(&motionMutex, NULL) );
+    PTHREAD_GUARD( pthread_condattr_init(&condAttr) );
+    PTHREAD_GUARD( pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC) );
+    PTHREAD_GUARD( pthread_cond_init(&motionCond, &condAttr) );
+    PTHREAD_GUARD( pthread_cond_init(&batchCond, &condAttr) );
+    PTHREAD_GUARD( pthread_mutex_init(&watchdogMutex, NULL) );
+    pthread_condattr_destroy(&condAttr);
+    InitGroup(stateRequests);
+    InitGroup(distanceRequests);
+
+    commandStop.Register(RoverNet::NetMsgQueue::Wake, inQueue.get());
+    stop.Register(WakeGroup, &stateRequests);
+    stop.Register(WakeGroup, &distanceRequests);
+    stop.Register(WakeMotion, this);
 
     delayedMessage.msgType = RoverNet::MessageType::INVALID;
 }
@@ -47,11 +90,16 @@ DeviceUC0Service::~DeviceUC0Service()
     }
 
     pthread_mutex_destroy(&deviceLockMutex);
-    pthread_mutex_destroy(&distanceMonitorMutex);
-    pthread_cond_destroy(&distanceMonitorCond);
+    pthread_mutex_destroy(&batchMutex);
+    pthread_cond_destroy(&batchCond);
+    pthread_mutex_destroy(&motionMutex);
+    pthread_cond_destroy(&motionCond);
+    pthread_mutex_destroy(&watchdogMutex);
+    DestroyGroup(stateRequests);
+    DestroyGroup(distanceRequests);
 }
 
-void DeviceUC0Service::Init()
+void DeviceUC0Service::Init(const HandoffState* state)
 {
     delayedMessage.msgType = RoverNet::MessageType::INVALID;
 
@@ -60,30 +108,265 @@ void DeviceUC0Service::Init()
 
     if(EXIT_SUCCESS != init_device_rover(deviceHandler)) THROW_RUNTIME_MSG("Unable to initialize device");
 
-    PTHREAD_GUARD( pthread_create(&threadIncomingCommand, NULL, ThreadIncomingCommandProcedure, this) );
-    PTHREAD_GUARD( pthread_create(&threadDelayedMessage, NULL, ThreadDelayedMessageProcedure, this) );
-    PTHREAD_GUARD( pthread_create(&threadDistanceMonitor, NULL, ThreadDistanceMonitorProcedure, this) );
+    delayedTimer = timers->Create(FlushDelayedMessage, this);
+    watchdogTimer = timers->Create(WatchdogExpired, this);
+
+    if(state != nullptr) Restore(*state);
+
+    CreateThread(&threadIncomingCommand, config.controlThreads, "rover-command", ThreadIncomingCommandProcedure, this);
+    CreateThread(&threadStateMonitor, config.monitorThreads, "rover-state", ThreadStateMonitorProcedure, this);
+    CreateThread(&threadDistanceMonitor, config.monitorThreads, "rover-distance", ThreadDistanceMonitorProcedure, this);
+    CreateThread(&threadMotion, config.controlThreads, "rover-motion", ThreadMotionProcedure, this);
 }
 
 void DeviceUC0Service::Stop()
 {
+    commandStop.Request();
+    stop.Request();
+
+    PTHREAD_GUARD( pthread_join(threadIncomingCommand, NULL) );
+    JoinThreads();
+    Release(true);
+}
+
+void DeviceUC0Service::Freeze(HandoffState& state)
+{
+    commandStop.Request();
+    PTHREAD_GUARD( pthread_join(threadIncomingCommand, NULL) );
+
+/*
+ * NOTE: Nothing attaches to the groups any more, the monitors answer what is left within
+ * a device read
+ */
+    if(!WaitDrained(MonotonicNs() + HANDOFF_DRAIN_NS)) RLOG_WARNING("DeviceUC0Service", "requests still waiting for the device are dropped by the upgrade");
+
+/*
+ * NOTE: The motion is saved before the stop cancels it. A setpoint applied in between is
+ * applied once more by the next daemon, which is harmless.
+ */
+    PTHREAD_GUARD( pthread_mutex_lock(&motionMutex) );
+    state.trajectoryPoints = 0;
+    state.rampPending = false;
+    if(trajectoryPoints != 0 || rampPending) {
+        state.trajectoryPoints = trajectoryPoints;
+        state.rampPending = rampPending;
+    }
+    else if(runningGeneration == motionGeneration) {
+        state.trajectoryPoints = runningPoints;
+        state.rampPending = runningRamp;
+    }
+    std::copy(trajectory, trajectory + state.trajectoryPoints, state.trajectory);
+    state.trajectoryStartNs = trajectoryStartNs;
+    state.ramp = ramp;
+    state.motionTraceId = motionTraceId;
+    PTHREAD_GUARD( pthread_mutex_unlock(&motionMutex) );
+
+    stop.Request();
+    JoinThreads();
+
 /*
- * NOTE: since pthread_cancel will return either 0 or ESRCH which in both cases we do not care
- * therefore pthread_cancel does not have to be guarded
+ * NOTE: BATCH and CMD_TRAJECTORY are queued together with their members and read by the next
+ * daemon as one, so they are handed over whole. The first group that does not fit is dropped
+ * along with everything after it.
  */
-    pthread_cancel(threadDistanceMonitor);
-    pthread_cancel(threadDelayedMessage);
-    pthread_cancel(threadIncomingCommand);
+    static_assert(HANDOFF_MAX_MESSAGES >= BATCH_MAX_ITEMS + 1 && HANDOFF_MAX_MESSAGES >= TRAJECTORY_MAX_POINTS + 1,
+            "largest group does not fit the handoff");
+    state.queued = 0;
+    while(!inQueue->Empty()) {
+        RoverNet::Message header = inQueue->Dequeue();
+        unsigned members = 0;
+        if(header.msgType == RoverNet::MessageType::BATCH) members = header.data.batch.count;
+        else if(header.msgType == RoverNet::MessageType::CMD_TRAJECTORY) members = header.data.trajectory.count;
+
+        if(state.queued + 1 + members > HANDOFF_MAX_MESSAGES) {
+            RLOG_WARNING("DeviceUC0Service", "more than %u queued commands, the rest is dropped by the upgrade",
+                    HANDOFF_MAX_MESSAGES);
+            break;
+        }
+        state.queue[state.queued++] = header;
+        for(unsigned i = 0; i < members; ++i) state.queue[state.queued++] = inQueue->Dequeue();
+    }
+
+    PTHREAD_GUARD( pthread_mutex_lock(&watchdogMutex) );
+    state.lastCommandNs = lastCommandNs;
+    state.clientDeadlineMs = clientDeadlineMs;
+    state.watchdogDeadlineMs = watchdogDeadlineMs;
+    state.deadman = deadman;
+    PTHREAD_GUARD( pthread_mutex_unlock(&watchdogMutex) );
+
+    device_state devState = {};
+    PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+    if(EXIT_SUCCESS != get_device_state(deviceHandler, &devState))
+        RLOG_WARNING("DeviceUC0Service", "wheel speeds not read for the upgrade");
+    state.leftWheelSpeed = devState.left_wheel_speed;
+    state.rightWheelSpeed = devState.right_wheel_speed;
+    state.reflexActive = reflexActive;
+    state.delayedMessage = delayedMessage;
+    state.delayedWriteNs = delayedWriteNs;
+    PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
 
+    Release(false);
+}
+
+void DeviceUC0Service::JoinThreads()
+{
+    PTHREAD_GUARD( pthread_join(threadMotion, NULL) );
     PTHREAD_GUARD( pthread_join(threadDistanceMonitor, NULL) );
-    PTHREAD_GUARD( pthread_join(threadDelayedMessage, NULL) );
-    PTHREAD_GUARD( pthread_join(threadIncomingCommand, NULL) );
+    PTHREAD_GUARD( pthread_join(threadStateMonitor, NULL) );
+}
+
+void DeviceUC0Service::Release(bool stopWheels)
+{
+/*
+ * NOTE: The timers go after the threads that arm them, Destroy waits for a callback in progress
+ */
+    if(delayedTimer != 0) timers->Destroy(delayedTimer);
+    if(watchdogTimer != 0) timers->Destroy(watchdogTimer);
+    delayedTimer = watchdogTimer = 0;
+
+/*
+ * NOTE: Whatever was in flight is dropped so that a restart begins from an empty state.
+ * On a stop the wheels are left stopped rather than at the last commanded speed.
+ */
+    inQueue->Clear();
+    ClearGroup(stateRequests);
+    ClearGroup(distanceRequests);
+    PTHREAD_GUARD( pthread_mutex_lock(&batchMutex) );
+    for(PendingBatch& b : batches) b.remaining = 0;
+    PTHREAD_GUARD( pthread_mutex_unlock(&batchMutex) );
 
     if(deviceHandler != nullptr) {
+        PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+        delayedMessage.msgType = RoverNet::MessageType::INVALID;
+        if(stopWheels && EXIT_SUCCESS != StopWheels())
+            RLOG_WARNING("DeviceUC0Service", "wheels not stopped at shutdown");
+        PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
+
         release_device_rover(deviceHandler);
         deviceHandler = nullptr;
     }
 
+    commandStop.Reset();
+    stop.Reset();
+}
+
+bool DeviceUC0Service::WaitDrained(uint64_t deadlineNs)
+{
+    timespec deadline = NsToTimespec(deadlineNs);
+    bool drained = true;
+    int r = 0;
+
+/*
+ * NOTE: The waiters of a batch are taken before the batch completes, so the groups are
+ * waited for first
+ */
+    for(RequestGroup* group : { &stateRequests, &distanceRequests }) {
+        PTHREAD_GUARD( pthread_mutex_lock(&group->mutex) );
+        while(!group->waiters.empty() && ETIMEDOUT != r) {
+            r = pthread_cond_timedwait(&group->cond, &group->mutex, &deadline);
+            if(r != 0 && r != ETIMEDOUT) {
+                pthread_mutex_unlock(&group->mutex);
+                THROW_RUNTIME_EID(r);
+            }
+        }
+        drained = drained && group->waiters.empty();
+        PTHREAD_GUARD( pthread_mutex_unlock(&group->mutex) );
+    }
+
+    auto pending = [this]() {
+        return std::any_of(batches.begin(), batches.end(), [](const PendingBatch& b) { return b.remaining != 0; });
+    };
+    PTHREAD_GUARD( pthread_mutex_lock(&batchMutex) );
+    while(pending() && ETIMEDOUT != r) {
+        r = pthread_cond_timedwait(&batchCond, &batchMutex, &deadline);
+        if(r != 0 && r != ETIMEDOUT) {
+            pthread_mutex_unlock(&batchMutex);
+            THROW_RUNTIME_EID(r);
+        }
+    }
+    drained = drained && !pending();
+    PTHREAD_GUARD( pthread_mutex_unlock(&batchMutex) );
+
+    return drained;
+}
+
+void DeviceUC0Service::Restore(const HandoffState& state)
+{
+/*
+ * NOTE: The driver keeps the speed between the daemons, it is written again only when the
+ * device was reset in between. Ramps restored below start from the speed read here.
+ */
+    device_state devState = {};
+    PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+    reflexActive = state.reflexActive;
+    int status = get_device_state(deviceHandler, &devState);
+    if(EXIT_SUCCESS == status &&
+            (devState.left_wheel_speed != state.leftWheelSpeed || devState.right_wheel_speed != state.rightWheelSpeed))
+        status = SetWheelSpeed(state.leftWheelSpeed, state.rightWheelSpeed);
+    else if(EXIT_SUCCESS == status) {
+        int32_t setpoint[2] = { state.leftWheelSpeed, state.rightWheelSpeed };
+        wheelsHistory.Append(MonotonicNs(), setpoint);
+    }
+    PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
+    if(EXIT_SUCCESS != status) THROW_RUNTIME_MSG("error restoring the wheel speeds");
+
+    if(state.queued != 0) inQueue->EnqueueBatch(state.queue, state.queued);
+
+/*
+ * NOTE: The trajectory continues from the last point that was due at the freeze, it was
+ * applied already and applying it again only catches up a late setpoint
+ */
+    PTHREAD_GUARD( pthread_mutex_lock(&motionMutex) );
+    if(state.trajectoryPoints != 0) {
+        uint64_t now = MonotonicNs();
+        unsigned first = 0;
+        while(first + 1 < state.trajectoryPoints &&
+                state.trajectoryStartNs + static_cast<uint64_t>(state.trajectory[first + 1].offsetUs) * 1000 <= now)
+            first++;
+        trajectoryPoints = state.trajectoryPoints - first;
+        std::copy(state.trajectory + first, state.trajectory + state.trajectoryPoints, trajectory);
+        trajectoryStartNs = state.trajectoryStartNs;
+        rampPending = false;
+        StartMotion(state.motionTraceId);
+    }
+    else if(state.rampPending) {
+        ramp = state.ramp;
+        rampPending = true;
+        StartMotion(state.motionTraceId);
+    }
+    PTHREAD_GUARD( pthread_mutex_unlock(&motionMutex) );
+
+    PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+    delayedWriteNs = state.delayedWriteNs;
+    if(RoverNet::MessageType::INVALID != state.delayedMessage.msgType) SetDelayed(state.delayedMessage);
+    PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
+
+    PTHREAD_GUARD( pthread_mutex_lock(&watchdogMutex) );
+    lastCommandNs = state.lastCommandNs;
+    clientDeadlineMs = state.clientDeadlineMs;
+    watchdogDeadlineMs = state.watchdogDeadlineMs;
+    deadman = state.deadman;
+    uint64_t deadlineNs = watchdogDeadlineMs * 1000000ULL;
+    PTHREAD_GUARD( pthread_mutex_unlock(&watchdogMutex) );
+
+    if(deadlineNs != 0) timers->Arm(watchdogTimer, lastCommandNs + deadlineNs);
+}
+
+bool DeviceUC0Service::Stale(const RoverNet::Message& msg) const
+{
+/*
+ * NOTE: CMD_STOP is applied however old it is, stopping late is still better than not stopping
+ */
+    if(config.maxCommandAgeMs == 0 || msg.meta.timestampNs == 0 || msg.msgType == RoverNet::MessageType::CMD_STOP)
+        return false;
+
+    uint64_t now = MonotonicNs();
+    if(now <= msg.meta.timestampNs + static_cast<uint64_t>(config.maxCommandAgeMs) * 1000000ULL)
+        return false;
+
+    RLOG_INFO("DeviceUC0Service", "dropped stale %s, %llu ms old", RoverNet::MessageTypeName(msg.msgType),
+            static_cast<unsigned long long>((now - msg.meta.timestampNs) / 1000000));
+    return true;
 }
 
 void* DeviceUC0Service::ThreadIncomingCommandProcedure(void *arg)
@@ -93,71 +376,84 @@ void* DeviceUC0Service::ThreadIncomingCommandProcedure(void *arg)
  * and should not free it
  */
     DeviceUC0Service* dev = static_cast<DeviceUC0Service*>(arg);
+    Tracing::RegisterThread("device commands");
     try {
-        while(true) {
-            RoverNet::Message msg = dev->inQueue->Dequeue();
+        RoverNet::Message msg;
+        while(dev->inQueue->Dequeue(msg, dev->commandStop)) {
+            uint64_t dispatchNs = Tracing::Now();
+            Tracing::Span(Tracing::SPAN_IN_QUEUE, msg.meta.traceId, msg.msgType, msg.meta.queuedNs, dispatchNs);
+
             switch(msg.msgType) {
                 case RoverNet::MessageType::CMD_SET_LEFT_WHEEL_SPEED:
                 case RoverNet::MessageType::CMD_SET_RIGHT_WHEEL_SPEED:
                 case RoverNet::MessageType::CMD_SET_WHEELS_SPEED:
                 case RoverNet::MessageType::CMD_STOP:
-                    {
-                        PTHREAD_GUARD( pthread_mutex_lock(&(dev->deviceLockMutex)) );
-                        dev->delayedMessage = msg;
-                        PTHREAD_GUARD( pthread_mutex_unlock(&(dev->deviceLockMutex)) );
-                    }
+                case RoverNet::MessageType::CMD_TRAJECTORY:
+                case RoverNet::MessageType::CMD_RAMP_WHEELS_SPEED:
+                case RoverNet::MessageType::CMD_HEARTBEAT:
+                case RoverNet::MessageType::BATCH:
+                    dev->Feed(msg);
                     break;
-                case RoverNet::MessageType::REQ_WHEELS_STATE:
+                default:
+                    break;
+            }
+
+            switch(msg.msgType) {
+                case RoverNet::MessageType::CMD_SET_LEFT_WHEEL_SPEED:
+                case RoverNet::MessageType::CMD_SET_RIGHT_WHEEL_SPEED:
+                case RoverNet::MessageType::CMD_SET_WHEELS_SPEED:
+                case RoverNet::MessageType::CMD_STOP:
                     {
-                        device_state devState;
-                        int responseStatus;
+                        /* A stale command must not replace a fresh one waiting in the slot */
+                        if(dev->Stale(msg)) break;
+                        dev->CancelMotion();
 
                         PTHREAD_GUARD( pthread_mutex_lock(&(dev->deviceLockMutex)) );
-                        responseStatus = get_device_state(dev->deviceHandler, &devState);
+                        msg.meta.queuedNs = Tracing::Now();
+                        dev->SetDelayed(msg);
                         PTHREAD_GUARD( pthread_mutex_unlock(&(dev->deviceLockMutex)) );
-
-                        if(EXIT_SUCCESS != responseStatus) THROW_RUNTIME_MSG("error reading device state");
-
-                        RoverNet::Message response;
-                        response.msgType = RoverNet::MessageType::MSG_WHEELS_STATE;
-                        response.data.wheelsState = { devState.left_wheel_speed,
-                                                      devState.right_wheel_speed,
-                                                      devState.wheel_max_speed,
-                                                      devState.wheel_min_speed };
-
-                        dev->outQueue->Enqueue(response);
                     }
                     break;
+                case RoverNet::MessageType::REQ_WHEELS_STATE:
+                    Attach(dev->stateRequests, msg);
+                    break;
                 case RoverNet::MessageType::REQ_DISTANCE:
-                    {
-                        PTHREAD_GUARD( pthread_mutex_lock(&(dev->distanceMonitorMutex)) );
-                        dev->distanceRequestPending = true;
-                        PTHREAD_GUARD( pthread_mutex_unlock(&(dev->distanceMonitorMutex)) );
-                        PTHREAD_GUARD( pthread_cond_signal(&(dev->distanceMonitorCond)) );
-                    }
+                    Attach(dev->distanceRequests, msg);
+                    break;
+                case RoverNet::MessageType::REQ_HISTORY:
+                    dev->AnswerHistory(msg);
+                    break;
+                case RoverNet::MessageType::BATCH:
+                    dev->DispatchBatch(msg);
+                    break;
+                case RoverNet::MessageType::CMD_TRAJECTORY:
+                    dev->StartTrajectory(msg);
+                    break;
+                case RoverNet::MessageType::CMD_RAMP_WHEELS_SPEED:
+                    dev->StartRamp(msg);
+                    break;
+                case RoverNet::MessageType::CMD_HEARTBEAT:
                     break;
                 default:
-                    {
-                        std::stringstream ss;
-                        ss << "Unsupported message received " << msg.msgType;
-                        THROW_RUNTIME_MSG(ss.str().c_str());
-                    }
+                    THROW_RUNTIME_MSG("Unsupported message received 0x%02x", msg.msgType);
             };
 
-            pthread_testcancel();
+            Tracing::Span(Tracing::SPAN_DISPATCH, msg.meta.traceId, msg.msgType, dispatchNs, Tracing::Now());
         }
     }
     catch(const std::exception &e) {
-        syslog(LOG_ERR, LOG_EXCEPT("DeviceUC0Service", e));
+        RLOG_EXCEPT("DeviceUC0Service", e);
         kill(getpid(), SIGTERM);
     }
     catch(abi::__forced_unwind&) {
         throw;
     }
     catch(...) {
-        syslog(LOG_ERR, LOG_MSG("DeviceUC0Service", "unknown exception"));
+        RLOG_ERR("DeviceUC0Service", "unknown exception");
         kill(getpid(), SIGTERM);
     }
+
+    return nullptr;
 }
 
 //thread cleanup routines
@@ -169,100 +465,434 @@ namespace {
     }
 };
 
-void* DeviceUC0Service::ThreadDelayedMessageProcedure(void *arg)
+void DeviceUC0Service::InitGroup(RequestGroup& group)
+{
+    pthread_condattr_t condAttr;
+    group.waiters.reserve(DEV_REQUEST_WAITERS);
+    PTHREAD_GUARD( pthread_mutex_init(&group.mutex, NULL) );
+    PTHREAD_GUARD( pthread_condattr_init(&condAttr) );
+    PTHREAD_GUARD( pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC) );
+    PTHREAD_GUARD( pthread_cond_init(&group.cond, &condAttr) );
+    pthread_condattr_destroy(&condAttr);
+}
+
+void DeviceUC0Service::DestroyGroup(RequestGroup& group)
+{
+    pthread_mutex_destroy(&group.mutex);
+    pthread_cond_destroy(&group.cond);
+}
+
+void DeviceUC0Service::Attach(RequestGroup& group, const RoverNet::Message& msg, uint32_t batch, uint32_t index)
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&group.mutex) );
+    uint8_t variant = msg.msgType == RoverNet::MessageType::REQ_DISTANCE ? msg.data.distanceRequest.filter : 0;
+    group.waiters.push_back({ msg.meta.correlationId, msg.meta.traceId, batch, index, variant });
+    PTHREAD_GUARD( pthread_mutex_unlock(&group.mutex) );
+    PTHREAD_GUARD( pthread_cond_signal(&group.cond) );
+}
+
+bool DeviceUC0Service::WaitForWaiters(RequestGroup& group, const StopToken& stop)
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&group.mutex) );
+    while(group.waiters.empty() && !stop.Requested()) PTHREAD_GUARD( pthread_cond_wait(&group.cond, &group.mutex) );
+    PTHREAD_GUARD( pthread_mutex_unlock(&group.mutex) );
+
+    return !stop.Requested();
+}
+
+void DeviceUC0Service::WakeGroup(void* group)
 {
+    RequestGroup* g = static_cast<RequestGroup*>(group);
+    PTHREAD_GUARD( pthread_mutex_lock(&(g->mutex)) );
+    PTHREAD_GUARD( pthread_mutex_unlock(&(g->mutex)) );
+    PTHREAD_GUARD( pthread_cond_broadcast(&(g->cond)) );
+}
+
+void DeviceUC0Service::ClearGroup(RequestGroup& group)
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&group.mutex) );
+    group.waiters.clear();
+    PTHREAD_GUARD( pthread_mutex_unlock(&group.mutex) );
+}
+
+void DeviceUC0Service::TakeWaiters(RequestGroup& group, std::vector<Waiter>& taken)
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&group.mutex) );
+    taken.swap(group.waiters);
+    PTHREAD_GUARD( pthread_mutex_unlock(&group.mutex) );
+    /* Wakes WaitDrained, the monitor waiting in WaitForWaiters is the caller */
+    PTHREAD_GUARD( pthread_cond_broadcast(&group.cond) );
+}
+
+void DeviceUC0Service::Respond(const std::vector<Waiter>& waiters, RoverNet::Message& response)
+{
+/*
+ * NOTE: Every waiter gets its own copy of the shared result in the order the requests came,
+ * so uncorrelated clients still receive one response per request
+ */
+    Respond(waiters, &response, 1);
+}
+
+void DeviceUC0Service::Respond(const std::vector<Waiter>& waiters, RoverNet::Message* responses, unsigned variants)
+{
+    uint64_t queuedNs = Tracing::Now();
+    for(const Waiter& w : waiters) {
+        RoverNet::Message& response = responses[w.variant < variants ? w.variant : 0];
+        response.meta.queuedNs = queuedNs;
+        response.meta.traceId = w.traceId;
+        response.meta.correlationId = w.correlationId;
+        if(w.batch != 0) CompleteBatchItem(w, response);
+        else outQueue->Enqueue(response);
+    }
+}
+
+namespace {
 /*
- * NOTE: The purpose of this thread is to offload the communication between
+ * Folds cmd into the command that holds the effect of the earlier commands of a batch.
+ * A later command overrides the wheels it sets, a single wheel command after the other
+ * wheel was set becomes CMD_SET_WHEELS_SPEED.
+ */
+    void FoldCommand(RoverNet::Message& folded, const RoverNet::Message& cmd)
+    {
+        using namespace RoverNet;
+
+        bool singleWheel = cmd.msgType == CMD_SET_LEFT_WHEEL_SPEED || cmd.msgType == CMD_SET_RIGHT_WHEEL_SPEED;
+        if(!singleWheel || folded.msgType == INVALID || folded.msgType == cmd.msgType) {
+            folded.msgType = cmd.msgType;
+            folded.data = cmd.data;
+        }
+        else {
+            int16_t left = folded.msgType == CMD_STOP ? 0 : folded.data.wheelsState.leftWheelSpeed;
+            int16_t right = folded.msgType == CMD_STOP ? 0 : folded.data.wheelsState.rightWheelSpeed;
+            if(cmd.msgType == CMD_SET_LEFT_WHEEL_SPEED) left = cmd.data.wheelsState.leftWheelSpeed;
+            else right = cmd.data.wheelsState.rightWheelSpeed;
+
+            folded.msgType = CMD_SET_WHEELS_SPEED;
+            folded.data.wheelsState.leftWheelSpeed = left;
+            folded.data.wheelsState.rightWheelSpeed = right;
+        }
+        folded.meta = cmd.meta;
+    }
+};
+
+void DeviceUC0Service::DispatchBatch(const RoverNet::Message& header)
+{
+    RoverNet::Message items[BATCH_MAX_ITEMS];
+    unsigned count = header.data.batch.count;
+    unsigned requests = 0;
+
+    for(unsigned i = 0; i < count; ++i) {
+        items[i] = inQueue->Dequeue();
+        if(items[i].msgType == RoverNet::MessageType::REQ_WHEELS_STATE || items[i].msgType == RoverNet::MessageType::REQ_DISTANCE)
+            requests++;
+    }
+
+    uint32_t batch = requests != 0 ? OpenBatch(header, requests) : 0;
+    unsigned index = 0;
+    RoverNet::Message folded;
+    folded.msgType = RoverNet::MessageType::INVALID;
+
+    for(unsigned i = 0; i < count; ++i) {
+        switch(items[i].msgType) {
+            case RoverNet::MessageType::REQ_WHEELS_STATE:
+                Attach(stateRequests, items[i], batch, index++);
+                break;
+            case RoverNet::MessageType::REQ_DISTANCE:
+                Attach(distanceRequests, items[i], batch, index++);
+                break;
+            default:
+                FoldCommand(folded, items[i]);
+                break;
+        }
+    }
+
+/*
+ * NOTE: The commands of a batch share the stamp, so the batch is applied or dropped as a whole
+ */
+    if(RoverNet::MessageType::INVALID == folded.msgType || Stale(folded)) return;
+    CancelMotion();
+
+    PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+    folded.meta.queuedNs = Tracing::Now();
+    SetDelayed(folded);
+    PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
+}
+
+uint32_t DeviceUC0Service::OpenBatch(const RoverNet::Message& header, unsigned requests)
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&batchMutex) );
+
+    size_t slot = 0;
+    while(slot < batches.size() && batches[slot].remaining != 0) slot++;
+    if(slot == batches.size()) batches.emplace_back();
+
+    PendingBatch& b = batches[slot];
+    b.remaining = requests;
+    b.replies[0].msgType = RoverNet::MessageType::BATCH;
+    b.replies[0].data.batch.count = requests;
+    b.replies[0].meta = RoverNet::MessageMeta();
+    b.replies[0].meta.traceId = header.meta.traceId;
+    b.replies[0].meta.correlationId = header.meta.correlationId;
+
+    PTHREAD_GUARD( pthread_mutex_unlock(&batchMutex) );
+    return slot + 1;
+}
+
+void DeviceUC0Service::CompleteBatchItem(const Waiter& waiter, const RoverNet::Message& response)
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&batchMutex) );
+
+    PendingBatch& b = batches[waiter.batch - 1];
+    b.replies[waiter.index + 1] = response;
+    b.replies[waiter.index + 1].meta.correlationId = 0;
+
+    if(--b.remaining == 0) {
+        b.replies[0].meta.queuedNs = response.meta.queuedNs;
+        outQueue->EnqueueBatch(b.replies, b.replies[0].data.batch.count + 1);
+        PTHREAD_GUARD( pthread_cond_broadcast(&batchCond) );
+    }
+
+    PTHREAD_GUARD( pthread_mutex_unlock(&batchMutex) );
+}
+
+void DeviceUC0Service::SetDelayed(const RoverNet::Message& msg)
+{
+    if(RoverNet::MessageType::INVALID != delayedMessage.msgType) {
+        Tracing::Span(Tracing::SPAN_SUPERSEDED, delayedMessage.meta.traceId, delayedMessage.msgType,
+                delayedMessage.meta.queuedNs, msg.meta.queuedNs);
+    }
+    else {
+        /* An empty slot has no write scheduled, the timer is armed only for the first command */
+        timers->Arm(delayedTimer, std::max(MonotonicNs(), delayedWriteNs + DEV_CMD_SEND_NS));
+    }
+    delayedMessage = msg;
+}
+
+void DeviceUC0Service::FlushDelayedMessage(void *arg)
+{
+/*
+ * NOTE: The purpose of this timer is to offload the communication between
  * driver and the uc0 occuring for the commands that set wheels speed.
  * Later the driver should implement its own thread that will handle the load
  * Commands that set wheels speed that occur in short amount of time between them
  * can be safely overwritten.
  *
- * NOTE: Thread does not have the ownership over the pointer to DeviceUC0Service
- * and should not free it
+ * NOTE: Runs on the timer thread, which does not have the ownership over the pointer
+ * to DeviceUC0Service and should not free it
  */
     DeviceUC0Service* dev = static_cast<DeviceUC0Service*>(arg);
     int responseStatus;
 
-    try {
-        while(true) {
+    PTHREAD_GUARD( pthread_mutex_lock(&(dev->deviceLockMutex)) );
+    pthread_cleanup_push(CleanupMutexUnlock, &(dev->deviceLockMutex));
+    uint64_t ioStartNs = Tracing::Now();
 
-            PTHREAD_GUARD( pthread_mutex_lock(&(dev->deviceLockMutex)) );
-            pthread_cleanup_push(CleanupMutexUnlock, &(dev->deviceLockMutex));
+    if(RoverNet::MessageType::INVALID != dev->delayedMessage.msgType && dev->Stale(dev->delayedMessage))
+        dev->delayedMessage.msgType = RoverNet::MessageType::INVALID;
 
-            switch(dev->delayedMessage.msgType) {
-                case RoverNet::MessageType::INVALID:
-                    responseStatus = EXIT_SUCCESS;
-                    break;
-                case RoverNet::MessageType::CMD_SET_LEFT_WHEEL_SPEED:
-                case RoverNet::MessageType::CMD_SET_RIGHT_WHEEL_SPEED:
-                    {
-                        device_state devState;
-                        responseStatus = get_device_state(dev->deviceHandler, &devState);
+    switch(dev->delayedMessage.msgType) {
+        case RoverNet::MessageType::INVALID:
+            responseStatus = EXIT_SUCCESS;
+            break;
+        case RoverNet::MessageType::CMD_SET_LEFT_WHEEL_SPEED:
+        case RoverNet::MessageType::CMD_SET_RIGHT_WHEEL_SPEED:
+            {
+                device_state devState;
+                responseStatus = get_device_state(dev->deviceHandler, &devState);
 /*
  * NOTE: If the response was not EXIT_SUCCESS we immediately break and let the later portion to throw 
  */
-                        if(EXIT_SUCCESS != responseStatus)
-                            break;
-
-                        if(dev->delayedMessage.msgType == RoverNet::MessageType::CMD_SET_LEFT_WHEEL_SPEED) {
-                            responseStatus = set_wheel_speed(dev->deviceHandler, 
-                                    dev->delayedMessage.data.wheelsState.leftWheelSpeed,
-                                    devState.right_wheel_speed);
-                        } else {
-                            responseStatus = set_wheel_speed(dev->deviceHandler,
-                                    devState.left_wheel_speed,
-                                    dev->delayedMessage.data.wheelsState.rightWheelSpeed);
-                        }
-                    }
+                if(EXIT_SUCCESS != responseStatus)
                     break;
-                case RoverNet::MessageType::CMD_SET_WHEELS_SPEED:
-                    responseStatus = set_wheel_speed(dev->deviceHandler,
-                                dev->delayedMessage.data.wheelsState.leftWheelSpeed,
-                                dev->delayedMessage.data.wheelsState.rightWheelSpeed);
-                    break;
-                case RoverNet::MessageType::CMD_STOP:
-                    responseStatus = set_wheel_stop(dev->deviceHandler);
-                    break;
-                default:
-                    {
-                        std::stringstream ss;
-                        ss << "Unsupported message received " << dev->delayedMessage.msgType;
-                        THROW_RUNTIME_MSG(ss.str().c_str());
-                    }
-            };
 
-            dev->delayedMessage.msgType = RoverNet::MessageType::INVALID;
-            pthread_cleanup_pop(0);
-            PTHREAD_GUARD( pthread_mutex_unlock(&(dev->deviceLockMutex)) );
-            if(EXIT_SUCCESS != responseStatus) THROW_RUNTIME_MSG("error sending command to the device");
+                if(dev->delayedMessage.msgType == RoverNet::MessageType::CMD_SET_LEFT_WHEEL_SPEED) {
+                    responseStatus = dev->SetWheelSpeed(
+                            dev->delayedMessage.data.wheelsState.leftWheelSpeed,
+                            devState.right_wheel_speed);
+                } else {
+                    responseStatus = dev->SetWheelSpeed(
+                            devState.left_wheel_speed,
+                            dev->delayedMessage.data.wheelsState.rightWheelSpeed);
+                }
+            }
+            break;
+        case RoverNet::MessageType::CMD_SET_WHEELS_SPEED:
+            responseStatus = dev->SetWheelSpeed(
+                        dev->delayedMessage.data.wheelsState.leftWheelSpeed,
+                        dev->delayedMessage.data.wheelsState.rightWheelSpeed);
+            break;
+        case RoverNet::MessageType::CMD_STOP:
+            responseStatus = dev->StopWheels();
+            break;
+        default:
+            THROW_RUNTIME_MSG("Unsupported message received 0x%02x", dev->delayedMessage.msgType);
+    };
+
+    if(RoverNet::MessageType::INVALID != dev->delayedMessage.msgType) {
+        FlightRecorder::RecordDevice(dev->delayedMessage, responseStatus);
+
+        const RoverNet::Message& sent = dev->delayedMessage;
+        Tracing::Span(Tracing::SPAN_DELAYED_SLOT, sent.meta.traceId, sent.msgType, sent.meta.queuedNs, ioStartNs);
+        Tracing::Span(Tracing::SPAN_DEVICE_IO, sent.meta.traceId, sent.msgType, ioStartNs, Tracing::Now());
+        dev->delayedWriteNs = MonotonicNs();
+    }
+
+    dev->delayedMessage.msgType = RoverNet::MessageType::INVALID;
+    pthread_cleanup_pop(0);
+    PTHREAD_GUARD( pthread_mutex_unlock(&(dev->deviceLockMutex)) );
+    if(EXIT_SUCCESS != responseStatus) THROW_RUNTIME_MSG("error sending command to the device");
+}
+
+void DeviceUC0Service::StartTrajectory(const RoverNet::Message& header)
+{
+    RoverNet::DataTrajectoryPoint points[TRAJECTORY_MAX_POINTS];
+    unsigned count = header.data.trajectory.count;
+
+    for(unsigned i = 0; i < count; ++i) points[i] = inQueue->Dequeue().data.trajectoryPoint;
+
+    if(Stale(header)) return;
+
+    PTHREAD_GUARD( pthread_mutex_lock(&motionMutex) );
+    for(unsigned i = 0; i < count; ++i) trajectory[i] = points[i];
+    trajectoryPoints = count;
+    trajectoryStartNs = MonotonicNs();
+    rampPending = false;
+    StartMotion(header.meta.traceId);
+    PTHREAD_GUARD( pthread_mutex_unlock(&motionMutex) );
+    PTHREAD_GUARD( pthread_cond_broadcast(&motionCond) );
+}
+
+void DeviceUC0Service::StartRamp(const RoverNet::Message& msg)
+{
+    if(Stale(msg)) return;
+
+    PTHREAD_GUARD( pthread_mutex_lock(&motionMutex) );
+    ramp = msg.data.wheelsRamp;
+    rampPending = true;
+    trajectoryPoints = 0;
+    StartMotion(msg.meta.traceId);
+    PTHREAD_GUARD( pthread_mutex_unlock(&motionMutex) );
+    PTHREAD_GUARD( pthread_cond_broadcast(&motionCond) );
+}
 
+void DeviceUC0Service::StartMotion(uint32_t traceId)
+{
+/*
+ * NOTE: A command waiting in the delayed slot is older than the motion and must not
+ * override its first setpoint. Lock order is motionMutex, deviceLockMutex.
+ */
+    PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+    if(RoverNet::MessageType::INVALID != delayedMessage.msgType) {
+        Tracing::Span(Tracing::SPAN_SUPERSEDED, delayedMessage.meta.traceId, delayedMessage.msgType,
+                delayedMessage.meta.queuedNs, Tracing::Now());
+        delayedMessage.msgType = RoverNet::MessageType::INVALID;
+    }
+    PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
+
+    motionTraceId = traceId;
+    motionGeneration++;
+}
+
+void DeviceUC0Service::CancelMotion()
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&motionMutex) );
+    trajectoryPoints = 0;
+    rampPending = false;
+    motionGeneration++;
+    PTHREAD_GUARD( pthread_mutex_unlock(&motionMutex) );
+    PTHREAD_GUARD( pthread_cond_broadcast(&motionCond) );
+}
+
+void DeviceUC0Service::WakeMotion(void* arg)
+{
+    static_cast<DeviceUC0Service*>(arg)->CancelMotion();
+}
+
+bool DeviceUC0Service::WaitMotion(uint32_t generation, uint64_t deadlineNs)
+{
+    timespec deadline = NsToTimespec(deadlineNs);
+    int r = 0;
+
+    PTHREAD_GUARD( pthread_mutex_lock(&motionMutex) );
+    pthread_cleanup_push(CleanupMutexUnlock, &motionMutex);
+    while(generation == motionGeneration && ETIMEDOUT != r) {
+        r = pthread_cond_timedwait(&motionCond, &motionMutex, &deadline);
+        if(r != 0 && r != ETIMEDOUT) THROW_RUNTIME_EID(r);
+    }
+    pthread_cleanup_pop(0);
+    bool current = generation == motionGeneration;
+    PTHREAD_GUARD( pthread_mutex_unlock(&motionMutex) );
+
+    return current;
+}
+
+void* DeviceUC0Service::ThreadStateMonitorProcedure(void *arg)
+{
 /*
- * TODO: Review this section and possibly relax the fail condition
+ * NOTE: Thread does not have the ownership over the pointer to DeviceUC0Service
+ * and should not free it
  */
-            timespec t1, t2;
-            t1.tv_sec = DEV_CMD_SEND_T_SEC;
-            t1.tv_nsec = DEV_CMD_SEND_T_NSEC;
-            if( -1 == nanosleep(&t1, &t2)) THROW_RUNTIME();
+    DeviceUC0Service* dev = static_cast<DeviceUC0Service*>(arg);
+    std::vector<Waiter> waiters;
+    waiters.reserve(DEV_REQUEST_WAITERS);
+    Tracing::RegisterThread("device state");
+
+    try {
+        while(WaitForWaiters(dev->stateRequests, dev->stop)) {
+
+            device_state devState;
+            PTHREAD_GUARD( pthread_mutex_lock(&(dev->deviceLockMutex)) );
+            uint64_t ioStartNs = Tracing::Now();
+            int responseStatus = get_device_state(dev->deviceHandler, &devState);
+            uint64_t capturedNs = MonotonicNs();
+            PTHREAD_GUARD( pthread_mutex_unlock(&(dev->deviceLockMutex)) );
+
+            TakeWaiters(dev->stateRequests, waiters);
+            for(const Waiter& w : waiters)
+                Tracing::Span(Tracing::SPAN_DEVICE_IO, w.traceId, RoverNet::MessageType::REQ_WHEELS_STATE, ioStartNs, capturedNs);
+
+            RoverNet::Message request;
+            request.msgType = RoverNet::MessageType::REQ_WHEELS_STATE;
+            memset(&request.data, 0, sizeof(request.data));
+            FlightRecorder::RecordDevice(request, responseStatus);
+
+            if(EXIT_SUCCESS != responseStatus) THROW_RUNTIME_MSG("error reading device state");
+
+            RoverNet::Message response;
+            response.msgType = RoverNet::MessageType::MSG_WHEELS_STATE;
+            response.data.wheelsState = { devState.left_wheel_speed,
+                                          devState.right_wheel_speed,
+                                          devState.wheel_max_speed,
+                                          devState.wheel_min_speed };
+            response.meta.timestampNs = capturedNs;
+            dev->Respond(waiters, response);
+            waiters.clear();
         }
     }
     catch(const std::exception &e) {
-        syslog(LOG_ERR, LOG_EXCEPT("DeviceUC0Service", e));
+        RLOG_EXCEPT("DeviceUC0Service", e);
         kill(getpid(), SIGTERM);
     }
     catch(abi::__forced_unwind&) {
         throw;
     }
     catch(...) {
-        syslog(LOG_ERR, LOG_MSG("DeviceUC0Service", "unknown exception"));
+        RLOG_ERR("DeviceUC0Service", "unknown exception");
         kill(getpid(), SIGTERM);
     }
+
+    return nullptr;
 }
 
 void* DeviceUC0Service::ThreadDistanceMonitorProcedure(void *arg)
 {
     DeviceUC0Service* dev = static_cast<DeviceUC0Service*>(arg);
-    bool proceed = false;
+    std::vector<Waiter> waiters;
+    waiters.reserve(DEV_REQUEST_WAITERS);
+    bool sampling = dev->config.distanceSampling || dev->config.reflexStopCm != 0;
+    DistanceFilter filter(dev->config.distanceFilter);
+    uint64_t nextSampleNs = MonotonicNs();
+    Tracing::RegisterThread("device distance");
 /*
  * TODO: Improvement needed
  * NOTE: Need a copy of the structure that describe the device to avoid the need
@@ -277,50 +907,443 @@ void* DeviceUC0Service::ThreadDistanceMonitorProcedure(void *arg)
         device = *(dev->deviceHandler);
         PTHREAD_GUARD( pthread_mutex_unlock(&(dev->deviceLockMutex)) );
 
-        while(true) {
-            PTHREAD_GUARD( pthread_mutex_lock(&(dev->distanceMonitorMutex)) );
-            pthread_cleanup_push(CleanupMutexUnlock, &(dev->distanceMonitorMutex));
-
+        while(!dev->stop.Requested()) {
 /*
- * NOTE: We need to release the command procedure thread as soon as possible
- * Instead requesting the distance in this conditional, defer it and release distance mutex immediately
+ * NOTE: The command procedure thread only appends to the group and is never held
+ * for the duration of the reading. With the reflex on the distance is sampled continuously
+ * and the requests are answered by the next sample.
  */
-            if(dev->distanceRequestPending) {
-                proceed = true;
-                dev->distanceRequestPending = false;
-            }
-            else {
-                PTHREAD_GUARD( pthread_cond_wait(&(dev->distanceMonitorCond), &(dev->distanceMonitorMutex)) );
-            }
+            if(sampling ? !dev->stop.SleepUntil(nextSampleNs) : !WaitForWaiters(dev->distanceRequests, dev->stop))
+                break;
+
+            FlightRecorder::RecordDistance sample;
+            uint64_t ioStartNs = Tracing::Now();
+            sample.status = read_distance(&device, &sample.distanceCM);
+            uint64_t capturedNs = MonotonicNs();
+            FlightRecorder::Record(FlightRecorder::REC_DISTANCE, &sample, sizeof(sample));
 
-            pthread_cleanup_pop(0);
+            TakeWaiters(dev->distanceRequests, waiters);
+            for(const Waiter& w : waiters)
+                Tracing::Span(Tracing::SPAN_DEVICE_IO, w.traceId, RoverNet::MessageType::REQ_DISTANCE, ioStartNs, capturedNs);
 
-            if(0 != pthread_mutex_unlock(&(dev->distanceMonitorMutex)))
-                    throw std::runtime_error("DeviceUC0Service: Unable to unlock distanceMonitorMutex");
+            if(EXIT_SUCCESS != sample.status)
+                THROW_RUNTIME_MSG("Unable to obtain distance reading from device");
 
-            if(proceed) {
-                proceed = false;
+            filter.Update(sample.distanceCM, capturedNs);
+            dev->distanceHistory.Append(capturedNs, &sample.distanceCM);
 
-                RoverNet::Message response;
+            /* One response per DistanceFilterMode, the filters not ready yet give the raw sample */
+            RoverNet::Message responses[RoverNet::DIST_ESTIMATE + 1];
+            for(RoverNet::Message& response : responses) {
                 response.msgType = RoverNet::MessageType::MSG_DISTANCE;
+                memset(&response.data, 0, sizeof(response.data));
+                response.data.distance.distanceCM = sample.distanceCM;
+                response.meta.timestampNs = capturedNs;
+            }
+            if(filter.MedianFull()) {
+                responses[RoverNet::DIST_MEDIAN].data.distance.distanceCM = filter.Median();
+                responses[RoverNet::DIST_MEDIAN].data.distance.filter = RoverNet::DIST_MEDIAN;
+            }
+            if(filter.EstimateValid()) {
+                int32_t velocity = std::max<int32_t>(INT16_MIN, std::min<int32_t>(INT16_MAX, filter.VelocityCmS()));
+                responses[RoverNet::DIST_ESTIMATE].data.distance.distanceCM = filter.Estimate();
+                responses[RoverNet::DIST_ESTIMATE].data.distance.velocityCmS = velocity;
+                responses[RoverNet::DIST_ESTIMATE].data.distance.filter = RoverNet::DIST_ESTIMATE;
+            }
+            dev->Respond(waiters, responses, RoverNet::DIST_ESTIMATE + 1);
+            waiters.clear();
+
+            if(dev->config.reflexStopCm != 0 && filter.MedianFull()) dev->Reflex(filter.Median(), capturedNs);
 
-                if(EXIT_SUCCESS != read_distance(&device, &response.data.distance.distanceCM))
-                    THROW_RUNTIME_MSG("Unable to obtain distance reading from device");
-                
-                dev->outQueue->Enqueue(response);
+            if(sampling) {
+                /* A sensor slower than the period is read again right away */
+                nextSampleNs = std::max(nextSampleNs + DEV_DISTANCE_SAMPLE_NS, capturedNs);
             }
         }
     }
     catch(const std::exception &e) {
-        syslog(LOG_ERR, LOG_EXCEPT("DeviceUC0Service", e));
+        RLOG_EXCEPT("DeviceUC0Service", e);
         kill(getpid(), SIGTERM);
     }
     catch(abi::__forced_unwind&) {
         throw;
     }
     catch(...) {
-        syslog(LOG_ERR, LOG_MSG("DeviceUC0Service", "unknown exception"));
+        RLOG_ERR("DeviceUC0Service", "unknown exception");
         kill(getpid(), SIGTERM);
     }
+
+    return nullptr;
+}
+
+int DeviceUC0Service::SetWheelSpeed(int16_t left, int16_t right)
+{
+    if(reflexActive) {
+        left = std::min<int16_t>(left, 0);
+        right = std::min<int16_t>(right, 0);
+    }
+    int status = set_wheel_speed(deviceHandler, left, right);
+    if(EXIT_SUCCESS == status) {
+        int32_t setpoint[2] = { left, right };
+        wheelsHistory.Append(MonotonicNs(), setpoint);
+    }
+    return status;
 }
 
+DeadmanStats DeviceUC0Service::Deadman()
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&watchdogMutex) );
+    DeadmanStats stats = deadman;
+    PTHREAD_GUARD( pthread_mutex_unlock(&watchdogMutex) );
+    return stats;
+}
+
+void DeviceUC0Service::Feed(const RoverNet::Message& msg)
+{
+    uint64_t now = MonotonicNs();
+
+    PTHREAD_GUARD( pthread_mutex_lock(&watchdogMutex) );
+    if(lastCommandNs != 0) {
+        uint64_t gap = now - lastCommandNs;
+        uint64_t ms = gap / 1000000;
+        unsigned bucket = ms == 0 ? 0 : std::min<unsigned>(DEV_GAP_BUCKETS - 1, 64 - __builtin_clzll(ms));
+        deadman.gaps[bucket]++;
+        deadman.maxGapNs = std::max(deadman.maxGapNs, gap);
+
+        /* A gap that tripped the watchdog already counted as a stop */
+        uint64_t deadlineNs = watchdogDeadlineMs * 1000000ULL;
+        if(deadlineNs != 0 && gap < deadlineNs && gap * 100 >= deadlineNs * DEV_DEADMAN_NEAR_MISS_PERCENT)
+            deadman.nearMisses++;
+    }
+    deadman.commands++;
+    lastCommandNs = now;
+
+    if(msg.msgType == RoverNet::MessageType::CMD_HEARTBEAT) clientDeadlineMs = msg.data.heartbeat.deadlineMs;
+    watchdogDeadlineMs = clientDeadlineMs != 0 ? clientDeadlineMs : config.deadmanMs;
+    uint64_t deadlineNs = watchdogDeadlineMs * 1000000ULL;
+    PTHREAD_GUARD( pthread_mutex_unlock(&watchdogMutex) );
+
+    /* Outside of watchdogMutex, Disarm waits for WatchdogExpired that takes it */
+    if(deadlineNs != 0) timers->Arm(watchdogTimer, now + deadlineNs);
+    else timers->Disarm(watchdogTimer);
+}
+
+void DeviceUC0Service::DeadmanStop(uint64_t silenceNs, uint32_t deadlineMs)
+{
+/*
+ * NOTE: A command dequeued while the watchdog fires may be dropped from the delayed slot,
+ * the next command of the client moves the wheels again
+ */
+    CancelMotion();
+
+    PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+    delayedMessage.msgType = RoverNet::MessageType::INVALID;
+    int responseStatus = StopWheels();
+    PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
+
+    RoverNet::Message event;
+    event.msgType = RoverNet::MessageType::MSG_DEADMAN;
+    memset(&event.data, 0, sizeof(event.data));
+    event.data.deadman.silenceMs = silenceNs / 1000000;
+    event.data.deadman.deadlineMs = deadlineMs;
+    FlightRecorder::RecordDevice(event, responseStatus);
+
+    if(EXIT_SUCCESS != responseStatus) THROW_RUNTIME_MSG("error stopping the wheels by the deadman watchdog");
+
+    RLOG_WARNING("DeviceUC0Service", "deadman stop, no command for %u ms, deadline %u ms",
+            event.data.deadman.silenceMs, deadlineMs);
+
+    event.meta.timestampNs = MonotonicNs();
+    event.meta.queuedNs = Tracing::Now();
+    outQueue->Enqueue(event);
+}
+
+void DeviceUC0Service::WatchdogExpired(void *arg)
+{
+    DeviceUC0Service* dev = static_cast<DeviceUC0Service*>(arg);
+
+    PTHREAD_GUARD( pthread_mutex_lock(&(dev->watchdogMutex)) );
+    uint64_t now = MonotonicNs();
+    uint32_t deadlineMs = dev->watchdogDeadlineMs;
+    uint64_t silenceNs = now - dev->lastCommandNs;
+
+/*
+ * NOTE: A command fed while the timer fired moved the deadline and armed the timer again,
+ * the stop is then left to that run
+ */
+    bool expired = deadlineMs != 0 && silenceNs >= deadlineMs * 1000000ULL;
+    if(expired) {
+        dev->watchdogDeadlineMs = 0;
+        dev->deadman.trips++;
+    }
+    PTHREAD_GUARD( pthread_mutex_unlock(&(dev->watchdogMutex)) );
+
+    if(expired) dev->DeadmanStop(silenceNs, deadlineMs);
+}
+
+int DeviceUC0Service::StopWheels()
+{
+    int status = set_wheel_stop(deviceHandler);
+    if(EXIT_SUCCESS == status) {
+        int32_t setpoint[2] = { 0, 0 };
+        wheelsHistory.Append(MonotonicNs(), setpoint);
+    }
+    return status;
+}
+
+void DeviceUC0Service::AnswerHistory(const RoverNet::Message& request)
+{
+    const RoverNet::DataHistoryRequest& req = request.data.historyRequest;
+    TimeSeries* series = nullptr;
+    if(req.series == RoverNet::HIST_DISTANCE) series = &distanceHistory;
+    else if(req.series == RoverNet::HIST_WHEELS) series = &wheelsHistory;
+
+    uint64_t endNs = MonotonicNs();
+    RoverNet::Message& header = historyReply[0];
+    header.msgType = RoverNet::MessageType::MSG_HISTORY;
+    memset(&header.data, 0, sizeof(header.data));
+    header.data.history.series = req.series;
+    header.meta.traceId = request.meta.traceId;
+    header.meta.correlationId = request.meta.correlationId;
+    header.meta.timestampNs = endNs;
+    unsigned count = 0;
+
+/*
+ * NOTE: An unknown series or an empty span is answered with no bins, so the client is not
+ * left waiting for a response that never comes
+ */
+    if(series != nullptr && req.spanMs != 0) {
+        unsigned channels = series->Channels();
+        unsigned perPoint = 4 / channels;
+        uint64_t maxBins = HISTORY_MAX_POINTS * perPoint;
+        uint64_t resolutionMs = std::max<uint64_t>({ req.resolutionMs, (req.spanMs + maxBins - 1) / maxBins, 1 });
+        uint64_t resolutionNs = resolutionMs * 1000000ULL;
+        /* Bins before the clock started are left out, the last bin always ends now */
+        unsigned bins = std::min<uint64_t>((req.spanMs + resolutionMs - 1) / resolutionMs, endNs / resolutionNs);
+        uint64_t startNs = endNs - bins * resolutionNs;
+
+        int32_t values[HISTORY_MAX_BINS * HISTORY_MAX_CHANNELS];
+        bool present[HISTORY_MAX_BINS];
+        series->Query(startNs, resolutionNs, bins, values, present);
+
+        count = (bins + perPoint - 1) / perPoint;
+        for(unsigned p = 0; p < count; ++p) {
+            RoverNet::Message& point = historyReply[p + 1];
+            point.msgType = RoverNet::MessageType::HISTORY_POINT;
+            memset(&point.data, 0, sizeof(point.data));
+            point.meta = RoverNet::MessageMeta();
+            point.meta.traceId = request.meta.traceId;
+            for(unsigned k = 0; k < perPoint; ++k) {
+                unsigned b = p * perPoint + k;
+                for(unsigned c = 0; c < channels; ++c) {
+                    int32_t v = b < bins && present[b] ? values[b * channels + c] : RoverNet::HISTORY_NO_DATA;
+                    if(b < bins && present[b]) v = std::max<int32_t>(INT16_MIN + 1, std::min<int32_t>(INT16_MAX, v));
+                    point.data.historyPoint.values[k * channels + c] = v;
+                }
+            }
+        }
+        header.data.history.resolutionMs = resolutionMs;
+        header.data.history.bins = bins;
+        header.data.history.count = count;
+    }
+
+    uint64_t queuedNs = Tracing::Now();
+    for(unsigned i = 0; i <= count; ++i) historyReply[i].meta.queuedNs = queuedNs;
+    outQueue->EnqueueBatch(historyReply, count + 1);
+}
+
+void DeviceUC0Service::Reflex(int32_t median, uint64_t capturedNs)
+{
+    bool engage = false;
+    bool release = false;
+    int responseStatus = EXIT_SUCCESS;
+
+/*
+ * NOTE: The wheels are cut here, in the thread that read the sample, without waiting for
+ * the delayed slot. Setting reflexActive under the device lock makes every later
+ * SetWheelSpeed clamp, so no other thread can restore forward motion in between.
+ */
+    PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+    if(!reflexActive && median < config.reflexStopCm) {
+        engage = true;
+        reflexActive = true;
+
+        device_state devState;
+        responseStatus = get_device_state(deviceHandler, &devState);
+        if(EXIT_SUCCESS == responseStatus && (devState.left_wheel_speed > 0 || devState.right_wheel_speed > 0))
+            responseStatus = SetWheelSpeed(devState.left_wheel_speed, devState.right_wheel_speed);
+    }
+    else if(reflexActive && median >= config.reflexStopCm + DEV_REFLEX_HYSTERESIS_CM) {
+        release = true;
+        reflexActive = false;
+    }
+    PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
+
+    if(!engage && !release) return;
+
+    RoverNet::Message event;
+    event.msgType = RoverNet::MessageType::MSG_REFLEX;
+    memset(&event.data, 0, sizeof(event.data));
+    event.data.reflex.distanceCM = median;
+    event.data.reflex.active = engage;
+    FlightRecorder::RecordDevice(event, responseStatus);
+
+    if(EXIT_SUCCESS != responseStatus) THROW_RUNTIME_MSG("error stopping the wheels for an obstacle");
+
+    if(engage) CancelMotion();
+    RLOG_NOTICE("DeviceUC0Service", "obstacle reflex %s at %d cm", engage ? "engaged" : "released", median);
+
+    event.meta.timestampNs = capturedNs;
+    event.meta.queuedNs = Tracing::Now();
+    outQueue->Enqueue(event);
+}
+
+void DeviceUC0Service::ApplySetpoint(const RoverNet::Message& setpoint, int16_t left, int16_t right, uint32_t traceId)
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+    uint64_t ioStartNs = Tracing::Now();
+    int responseStatus = SetWheelSpeed(left, right);
+    uint64_t ioEndNs = Tracing::Now();
+    PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
+
+    FlightRecorder::RecordDevice(setpoint, responseStatus);
+    Tracing::Span(Tracing::SPAN_DEVICE_IO, traceId, setpoint.msgType, ioStartNs, ioEndNs);
+
+    if(EXIT_SUCCESS != responseStatus) THROW_RUNTIME_MSG("error sending motion setpoint to the device");
+}
+
+void DeviceUC0Service::RunTrajectory(const RoverNet::DataTrajectoryPoint* points, unsigned count, uint64_t startNs,
+        uint32_t generation, uint32_t traceId)
+{
+    uint64_t maxLateNs = 0;
+    unsigned applied = 0;
+
+    for(unsigned i = 0; i < count; ++i) {
+        uint64_t deadlineNs = startNs + static_cast<uint64_t>(points[i].offsetUs) * 1000;
+        if(!WaitMotion(generation, deadlineNs)) break;
+
+        uint64_t nowNs = MonotonicNs();
+        RoverNet::Message setpoint;
+        setpoint.msgType = RoverNet::MessageType::TRAJECTORY_POINT;
+        setpoint.data.trajectoryPoint = points[i];
+        ApplySetpoint(setpoint, points[i].leftWheelSpeed, points[i].rightWheelSpeed, traceId);
+
+        if(nowNs > deadlineNs) maxLateNs = std::max(maxLateNs, nowNs - deadlineNs);
+        applied++;
+    }
+
+    RLOG_DEBUG("DeviceUC0Service", "trajectory applied %u of %u setpoints, max lateness %llu us", applied, count,
+            static_cast<unsigned long long>(maxLateNs / 1000));
+}
+
+void DeviceUC0Service::RunRamp(const RoverNet::DataWheelsRamp& target, uint32_t generation, uint32_t traceId)
+{
+/*
+ * NOTE: The ramp starts from the speeds the device reports, so a ramp that replaced another
+ * one or a trajectory continues from where the wheels are
+ */
+    device_state devState;
+    PTHREAD_GUARD( pthread_mutex_lock(&deviceLockMutex) );
+    int responseStatus = get_device_state(deviceHandler, &devState);
+    PTHREAD_GUARD( pthread_mutex_unlock(&deviceLockMutex) );
+    if(EXIT_SUCCESS != responseStatus) THROW_RUNTIME_MSG("error reading device state");
+
+    int32_t startLeft = devState.left_wheel_speed;
+    int32_t startRight = devState.right_wheel_speed;
+    int32_t deltaLeft = target.leftWheelSpeed - startLeft;
+    int32_t deltaRight = target.rightWheelSpeed - startRight;
+    uint32_t acceleration = target.acceleration != 0 ? target.acceleration : config.rampAccel;
+
+    /* Steps of the ramp, the larger change takes change / acceleration seconds */
+    uint32_t change = std::max(std::abs(deltaLeft), std::abs(deltaRight));
+    uint64_t steps = (static_cast<uint64_t>(change) * config.rampRateHz + acceleration - 1) / acceleration;
+    uint64_t periodNs = NSEC_PER_SEC / config.rampRateHz;
+    uint64_t startNs = MonotonicNs();
+
+    int16_t sentLeft = devState.left_wheel_speed;
+    int16_t sentRight = devState.right_wheel_speed;
+
+    RoverNet::Message setpoint;
+    setpoint.msgType = RoverNet::MessageType::CMD_RAMP_WHEELS_SPEED;
+    setpoint.data.wheelsRamp.acceleration = acceleration;
+
+    for(uint64_t k = 1; k <= steps; ++k) {
+        if(!WaitMotion(generation, startNs + k * periodNs)) return;
+
+        int16_t left = startLeft + static_cast<int32_t>(deltaLeft * static_cast<int64_t>(k) / static_cast<int64_t>(steps));
+        int16_t right = startRight + static_cast<int32_t>(deltaRight * static_cast<int64_t>(k) / static_cast<int64_t>(steps));
+        if(left == sentLeft && right == sentRight) continue;
+
+        setpoint.data.wheelsRamp.leftWheelSpeed = left;
+        setpoint.data.wheelsRamp.rightWheelSpeed = right;
+        ApplySetpoint(setpoint, left, right, traceId);
+        sentLeft = left;
+        sentRight = right;
+    }
+}
+
+void* DeviceUC0Service::ThreadMotionProcedure(void *arg)
+{
+/*
+ * NOTE: The setpoints are applied directly at absolute deadlines, not through the delayed
+ * slot, so their timing depends only on the timer and the device call.
+ *
+ * NOTE: Thread does not have the ownership over the pointer to DeviceUC0Service
+ * and should not free it
+ */
+    DeviceUC0Service* dev = static_cast<DeviceUC0Service*>(arg);
+    RoverNet::DataTrajectoryPoint points[TRAJECTORY_MAX_POINTS];
+    Tracing::RegisterThread("device motion");
+
+    try {
+        while(true) {
+            unsigned count;
+            uint64_t startNs;
+            RoverNet::DataWheelsRamp ramp;
+            uint32_t generation;
+            uint32_t traceId;
+
+            PTHREAD_GUARD( pthread_mutex_lock(&(dev->motionMutex)) );
+            while(dev->trajectoryPoints == 0 && !dev->rampPending && !dev->stop.Requested())
+                PTHREAD_GUARD( pthread_cond_wait(&(dev->motionCond), &(dev->motionMutex)) );
+            if(dev->stop.Requested()) {
+                PTHREAD_GUARD( pthread_mutex_unlock(&(dev->motionMutex)) );
+                break;
+            }
+
+            count = dev->trajectoryPoints;
+            for(unsigned i = 0; i < count; ++i) points[i] = dev->trajectory[i];
+            startNs = dev->trajectoryStartNs;
+            ramp = dev->ramp;
+            generation = dev->motionGeneration;
+            traceId = dev->motionTraceId;
+            dev->runningGeneration = generation;
+            dev->runningPoints = count;
+            dev->runningRamp = count == 0;
+            dev->trajectoryPoints = 0;
+            dev->rampPending = false;
+            PTHREAD_GUARD( pthread_mutex_unlock(&(dev->motionMutex)) );
+
+            if(count != 0) dev->RunTrajectory(points, count, startNs, generation, traceId);
+            else dev->RunRamp(ramp, generation, traceId);
+
+            PTHREAD_GUARD( pthread_mutex_lock(&(dev->motionMutex)) );
+            dev->runningPoints = 0;
+            dev->runningRamp = false;
+            PTHREAD_GUARD( pthread_mutex_unlock(&(dev->motionMutex)) );
+        }
+    }
+    catch(const std::exception &e) {
+        RLOG_EXCEPT("DeviceUC0Service", e);
+        kill(getpid(), SIGTERM);
+    }
+    catch(abi::__forced_unwind&) {
+        throw;
+    }
+    catch(...) {
+        RLOG_ERR("DeviceUC0Service", "unknown exception");
+        kill(getpid(), SIGTERM);
+    }
+
+    return nullptr;
+}
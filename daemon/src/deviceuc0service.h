@@ -13,41 +13,289 @@
 
 #include <pthread.h>
 #include <uc.h>
+#include <vector>
 
+#include "util.h"
 #include "nettypes.h"
+#include "distancefilter.h"
+#include "timeseries.h"
+#include "threadconfig.h"
+#include "timerservice.h"
+#include "stoptoken.h"
+
+struct DeviceConfig
+{
+    /* Wheel speed commands stamped by the client older than this are dropped, 0 disables */
+    uint32_t maxCommandAgeMs = DEV_CMD_MAX_AGE_MS;
+    /* Setpoints per second generated by CMD_RAMP_WHEELS_SPEED */
+    uint32_t rampRateHz = DEV_RAMP_RATE_HZ;
+    /* Acceleration of a ramp that does not give its own, in speed units per second */
+    uint32_t rampAccel = DEV_RAMP_ACCEL;
+    /* Filtered distance that stops forward motion, 0 disables the obstacle reflex */
+    int32_t reflexStopCm = 0;
+    /* Read the distance every DEV_DISTANCE_SAMPLE_NS instead of on request, on with the reflex */
+    bool distanceSampling = false;
+    DistanceFilterConfig distanceFilter;
+    /* Wheels stop when no command or heartbeat arrives for this long, 0 leaves it to CMD_HEARTBEAT */
+    uint32_t deadmanMs = 0;
+    /* Command dispatch and motion */
+    ThreadAttributes controlThreads;
+    /* State and distance monitors */
+    ThreadAttributes monitorThreads;
+};
+
+struct DeadmanStats
+{
+    /* Commands and heartbeats seen */
+    uint64_t commands = 0;
+    /* Stops by the watchdog */
+    uint64_t trips = 0;
+    /* Gaps longer than DEV_DEADMAN_NEAR_MISS_PERCENT of the deadline that did not stop the wheels */
+    uint64_t nearMisses = 0;
+    uint64_t maxGapNs = 0;
+    /* Gaps between commands, bucket 0 under 1 ms, bucket i from 2^(i-1) ms, the last one unbounded */
+    uint64_t gaps[DEV_GAP_BUCKETS] = {};
+};
 
 class DeviceUC0Service
 {
     public:
         explicit DeviceUC0Service(RoverNet::NetMsgQueueShrPtr incomingQueue,
-                RoverNet::NetMsgQueueShrPtr outgoingQueue);
+                RoverNet::NetMsgQueueShrPtr outgoingQueue,
+                TimerService* timers,
+                const DeviceConfig& config = DeviceConfig());
         DeviceUC0Service(const DeviceUC0Service&) = delete;
         DeviceUC0Service& operator=(const DeviceUC0Service&) = delete;
         ~DeviceUC0Service();
 
-        void Init();
+/*
+ * Command, motion and watchdog state handed to the next daemon by a hot upgrade. Times are
+ * CLOCK_MONOTONIC, which both daemons share.
+ */
+        struct HandoffState
+        {
+            /* Speeds the device reported at the freeze */
+            int16_t leftWheelSpeed;
+            int16_t rightWheelSpeed;
+            bool reflexActive;
+            RoverNet::Message delayedMessage;
+            uint64_t delayedWriteNs;
+            /* Motion to continue, trajectoryPoints 0 and rampPending false when none */
+            RoverNet::DataTrajectoryPoint trajectory[TRAJECTORY_MAX_POINTS];
+            unsigned trajectoryPoints;
+            uint64_t trajectoryStartNs;
+            RoverNet::DataWheelsRamp ramp;
+            bool rampPending;
+            uint32_t motionTraceId;
+            uint64_t lastCommandNs;
+            uint32_t clientDeadlineMs;
+            uint32_t watchdogDeadlineMs;
+            DeadmanStats deadman;
+            /* Commands received but not dispatched yet */
+            RoverNet::Message queue[HANDOFF_MAX_MESSAGES];
+            unsigned queued;
+        };
+
+        /* Continues from the state of the previous daemon when state is given */
+        void Init(const HandoffState* state = nullptr);
         void Stop();
+/*
+ * Stops for a hot upgrade. Requests already dispatched are answered first, the rest is saved
+ * in state and the wheels keep their speed. Init with the state continues from there.
+ */
+        void Freeze(HandoffState& state);
+
+        DeadmanStats Deadman();
 
     private:
+        DeviceConfig config;
         RoverNet::NetMsgQueueShrPtr inQueue;
         RoverNet::NetMsgQueueShrPtr outQueue;
 
         pthread_t threadIncomingCommand;
-        pthread_t threadDelayedMessage;
+        pthread_t threadStateMonitor;
         pthread_t threadDistanceMonitor;
+        pthread_t threadMotion;
 
         static void* ThreadIncomingCommandProcedure(void *arg);
-        static void* ThreadDelayedMessageProcedure(void *arg);
+        static void* ThreadStateMonitorProcedure(void *arg);
         static void* ThreadDistanceMonitorProcedure(void *arg);
+        static void* ThreadMotionProcedure(void *arg);
+
+/*
+ * Ends the threads. Commands left in the queue, requests waiting for a read and the motion
+ * in progress are abandoned, a device call in progress completes first. The command thread
+ * has its own token so that Freeze can stop it before the others.
+ */
+        StopToken commandStop;
+        StopToken stop;
+        /* Joins the threads but the command thread, stop must be requested */
+        void JoinThreads();
+        /* Drops what is left after the threads ended and releases the device */
+        void Release(bool stopWheels);
+        /* Waits until no request waits for a device read or a batch reply, false when the deadline came first */
+        bool WaitDrained(uint64_t deadlineNs);
+        void Restore(const HandoffState& state);
+
+        /* DeviceUC0Service does not hold ownership over the timers */
+        TimerService* const timers;
+
+        /* Request waiting for the next device read of its kind */
+        struct Waiter
+        {
+            uint32_t correlationId;
+            uint32_t traceId;
+            /* Slot in batches plus one, 0 for a request outside of a batch */
+            uint32_t batch;
+            /* Position of the reply in the batch */
+            uint32_t index;
+            /* Form of the response asked for, DistanceFilterMode of REQ_DISTANCE */
+            uint8_t variant;
+        };
+
+/*
+ * Requests of one kind coalesced on a single device read. The reading thread takes the
+ * waiters only after the read, so requests arriving while it is in flight share it and
+ * each of them is answered once.
+ */
+        struct RequestGroup
+        {
+            std::vector<Waiter> waiters;
+            pthread_mutex_t mutex;
+            pthread_cond_t cond;
+        };
+
+        static void InitGroup(RequestGroup& group);
+        static void DestroyGroup(RequestGroup& group);
+        static void Attach(RequestGroup& group, const RoverNet::Message& msg, uint32_t batch = 0, uint32_t index = 0);
+        /* Blocks until the group has waiters, false when the stop came first */
+        static bool WaitForWaiters(RequestGroup& group, const StopToken& stop);
+        /* StopToken waker of WaitForWaiters */
+        static void WakeGroup(void* group);
+        /* Drops the waiters of the group */
+        static void ClearGroup(RequestGroup& group);
+        /* Swaps the waiters into the empty taken list */
+        static void TakeWaiters(RequestGroup& group, std::vector<Waiter>& taken);
+        void Respond(const std::vector<Waiter>& waiters, RoverNet::Message& response);
+        /* Answers each waiter with responses[variant], an unknown variant gets responses[0] */
+        void Respond(const std::vector<Waiter>& waiters, RoverNet::Message* responses, unsigned variants);
+
+        /* Request batch waiting for its replies, the slot is free when remaining is 0 */
+        struct PendingBatch
+        {
+            unsigned remaining;
+            /* Response BATCH followed by the replies */
+            RoverNet::Message replies[BATCH_MAX_ITEMS + 1];
+        };
+
+        /* Dequeues the members following the BATCH header and dispatches them together */
+        void DispatchBatch(const RoverNet::Message& header);
+        /* Returns the batch id for the requests of header */
+        uint32_t OpenBatch(const RoverNet::Message& header, unsigned requests);
+        void CompleteBatchItem(const Waiter& waiter, const RoverNet::Message& response);
+
+        std::vector<PendingBatch> batches;
+        pthread_mutex_t batchMutex;
+        /* Broadcast when a batch is complete */
+        pthread_cond_t batchCond;
+
+/*
+ * Motions are trajectories and ramps, timed setpoint sequences applied by the motion thread.
+ * A new motion replaces the running one, any other command that sets the wheels ends it.
+ */
+        /* Dequeues the points following the CMD_TRAJECTORY header and starts the trajectory */
+        void StartTrajectory(const RoverNet::Message& header);
+        void StartRamp(const RoverNet::Message& msg);
+        /* Hands a motion to the motion thread, called with motionMutex held */
+        void StartMotion(uint32_t traceId);
+        /* Ends the running motion, called for every command that sets the wheels */
+        void CancelMotion();
+        /* StopToken waker of the motion thread, cancels the motion */
+        static void WakeMotion(void* arg);
+/*
+ * Sleeps until the absolute CLOCK_MONOTONIC deadline, returns false as soon as the motion
+ * of the given generation was replaced or cancelled.
+ */
+        bool WaitMotion(uint32_t generation, uint64_t deadlineNs);
+        /* Sets the wheel speeds for a motion and records the setpoint */
+        void ApplySetpoint(const RoverNet::Message& setpoint, int16_t left, int16_t right, uint32_t traceId);
+        void RunTrajectory(const RoverNet::DataTrajectoryPoint* points, unsigned count, uint64_t startNs,
+                uint32_t generation, uint32_t traceId);
+        void RunRamp(const RoverNet::DataWheelsRamp& ramp, uint32_t generation, uint32_t traceId);
+
+        /* Motion waiting for the motion thread, guarded by motionMutex */
+        RoverNet::DataTrajectoryPoint trajectory[TRAJECTORY_MAX_POINTS];
+        unsigned trajectoryPoints;
+        uint64_t trajectoryStartNs;
+        RoverNet::DataWheelsRamp ramp;
+        bool rampPending;
+        uint32_t motionTraceId;
+        /* Changed by every start and cancel, a running motion ends when it changes */
+        uint32_t motionGeneration;
+        /* Motion the motion thread runs, its points are still in trajectory */
+        uint32_t runningGeneration;
+        unsigned runningPoints;
+        bool runningRamp;
+        pthread_mutex_t motionMutex;
+        /* Waits on CLOCK_MONOTONIC */
+        pthread_cond_t motionCond;
+
+        /* True for a timestamped wheel speed command older than maxCommandAgeMs */
+        bool Stale(const RoverNet::Message& msg) const;
+
+/*
+ * Wheel command slot written to the device by delayedTimer. A write follows the previous one
+ * by at least DEV_CMD_SEND_NS, commands arriving in between replace each other in the slot.
+ */
+        /* Puts a command in the slot, called with deviceLockMutex held */
+        void SetDelayed(const RoverNet::Message& msg);
+        static void FlushDelayedMessage(void* arg);
+        TimerService::Handle delayedTimer;
+        /* Guarded by deviceLockMutex */
+        uint64_t delayedWriteNs;
 
         RoverNet::Message delayedMessage;
         pthread_mutex_t deviceLockMutex;
         device_rover* deviceHandler;
 
-        bool distanceRequestPending;
-        pthread_mutex_t distanceMonitorMutex;
-        pthread_cond_t distanceMonitorCond;
+        /* set_wheel_speed limited by the obstacle reflex, called with deviceLockMutex held */
+        int SetWheelSpeed(int16_t left, int16_t right);
+        /* set_wheel_stop, called with deviceLockMutex held */
+        int StopWheels();
+        /* Feeds the median distance to the obstacle reflex, called by the distance thread only */
+        void Reflex(int32_t median, uint64_t capturedNs);
+
+        /* Guarded by deviceLockMutex */
+        bool reflexActive;
+
+        RequestGroup stateRequests;
+        RequestGroup distanceRequests;
+
+/*
+ * Deadman watchdog, fed by the incoming command thread when it dequeues a command, so time
+ * spent in the queue counts against the deadline as well
+ */
+        void Feed(const RoverNet::Message& msg);
+        /* Stops the wheels after silenceNs without commands */
+        void DeadmanStop(uint64_t silenceNs, uint32_t deadlineMs);
+        /* Armed by Feed at the deadline, stops the wheels unless a command came in meanwhile */
+        static void WatchdogExpired(void* arg);
+        TimerService::Handle watchdogTimer;
+
+        /* Guarded by watchdogMutex, a deadline of 0 disarms the watchdog */
+        uint64_t lastCommandNs;
+        uint32_t clientDeadlineMs;
+        uint32_t watchdogDeadlineMs;
+        DeadmanStats deadman;
+        pthread_mutex_t watchdogMutex;
+
+        /* Raw distance samples and the wheel setpoints applied to the device */
+        TimeSeries distanceHistory;
+        TimeSeries wheelsHistory;
 
+        /* Answers REQ_HISTORY, called by the incoming command thread only */
+        void AnswerHistory(const RoverNet::Message& request);
+        RoverNet::Message historyReply[HISTORY_MAX_POINTS + 1];
 };
 
 
@@ -0,0 +1,129 @@
+/*
+ * distancefilter.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+#include "distancefilter.h"
+
+namespace {
+    inline void Exchange(int32_t& a, int32_t& b)
+    {
+        int32_t low = std::min(a, b);
+        b = std::max(a, b);
+        a = low;
+    }
+};
+
+DistanceFilter::DistanceFilter(const DistanceFilterConfig& config):
+    config(config),
+    windowNext(0),
+    samples(0),
+    raw(0),
+    median(0),
+    rejected(0),
+    estimateValid(false),
+    x{0, 0},
+    p{{0, 0}, {0, 0}},
+    lastNs(0)
+{
+}
+
+int32_t DistanceFilter::Median9(int32_t v[DISTANCE_MEDIAN_MAX])
+{
+/*
+ * NOTE: 19 exchanges that leave the median in v[4], the rest of v is only partly ordered.
+ * The network works on values in registers, the exchanges compile to branchless min/max (cmov).
+ */
+    Exchange(v[1], v[2]); Exchange(v[4], v[5]); Exchange(v[7], v[8]);
+    Exchange(v[0], v[1]); Exchange(v[3], v[4]); Exchange(v[6], v[7]);
+    Exchange(v[1], v[2]); Exchange(v[4], v[5]); Exchange(v[7], v[8]);
+    Exchange(v[0], v[3]); Exchange(v[5], v[8]); Exchange(v[4], v[7]);
+    Exchange(v[3], v[6]); Exchange(v[1], v[4]); Exchange(v[2], v[5]);
+    Exchange(v[4], v[7]); Exchange(v[4], v[2]); Exchange(v[6], v[4]);
+    Exchange(v[4], v[2]);
+    return v[4];
+}
+
+void DistanceFilter::Update(int32_t distanceCM, uint64_t capturedNs)
+{
+    raw = distanceCM;
+    window[windowNext] = distanceCM;
+    windowNext = (windowNext + 1) % config.median;
+    if(samples < config.median) samples++;
+
+/*
+ * NOTE: The samples are padded to 9 with the extremes, as many below as above, so the
+ * network gives the median of the samples. An even count while the window fills gives
+ * the lower of the two middle samples.
+ */
+    int32_t v[DISTANCE_MEDIAN_MAX];
+    unsigned padding = DISTANCE_MEDIAN_MAX - samples;
+    unsigned low = (padding + 1) / 2;
+    for(unsigned i = 0; i < DISTANCE_MEDIAN_MAX; ++i) {
+        if(i < samples) v[i] = window[i];
+        else v[i] = (i - samples < low) ? INT32_MIN : INT32_MAX;
+    }
+    median = Median9(v);
+
+    bool outlier = config.outlierCm != 0 && std::abs(distanceCM - median) > config.outlierCm;
+    if(outlier) rejected++;
+
+    double r = static_cast<double>(config.sampleNoise) * config.sampleNoise;
+    if(!estimateValid) {
+        if(outlier) return;
+        x[0] = distanceCM;
+        x[1] = 0;
+        p[0][0] = r;
+        p[0][1] = p[1][0] = 0;
+        /* Unknown velocity, one meter per second either way is plausible */
+        p[1][1] = 100.0 * 100.0;
+        lastNs = capturedNs;
+        estimateValid = true;
+        return;
+    }
+
+    /* Prediction over dt with white noise acceleration */
+    double dt = static_cast<double>(capturedNs - lastNs) / NSEC_PER_SEC;
+    lastNs = capturedNs;
+    double q = static_cast<double>(config.accelNoise) * config.accelNoise;
+    double dt2 = dt * dt;
+
+    x[0] += x[1] * dt;
+    double p00 = p[0][0] + dt * (p[1][0] + p[0][1]) + dt2 * p[1][1] + q * dt2 * dt2 / 4;
+    double p01 = p[0][1] + dt * p[1][1] + q * dt2 * dt / 2;
+    double p11 = p[1][1] + q * dt2;
+    p[0][0] = p00;
+    p[0][1] = p[1][0] = p01;
+    p[1][1] = p11;
+
+    if(outlier) return;
+
+    double s = p00 + r;
+    double k0 = p00 / s;
+    double k1 = p01 / s;
+    double innovation = distanceCM - x[0];
+    x[0] += k0 * innovation;
+    x[1] += k1 * innovation;
+    p[0][0] = (1 - k0) * p00;
+    p[0][1] = p[1][0] = (1 - k0) * p01;
+    p[1][1] = p11 - k1 * p01;
+}
+
+int32_t DistanceFilter::Estimate() const
+{
+    return static_cast<int32_t>(std::lround(x[0]));
+}
+
+int32_t DistanceFilter::VelocityCmS() const
+{
+    return static_cast<int32_t>(std::lround(x[1]));
+}
@@ -0,0 +1,85 @@
+/*
+ * distancefilter.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _DISTANCE_FILTER_H_
+#define _DISTANCE_FILTER_H_
+
+#include <cstdint>
+
+#include "util.h"
+
+struct DistanceFilterConfig
+{
+    /* Samples of the median, odd, 1 to DISTANCE_MEDIAN_MAX */
+    unsigned median = DISTANCE_MEDIAN_DEFAULT;
+    /* Largest distance of a sample from the median fed to the estimate, 0 disables the check */
+    int32_t outlierCm = DISTANCE_OUTLIER_CM;
+    /* Standard deviation of the acceleration of the target, cm/s^2 */
+    float accelNoise = DISTANCE_ACCEL_NOISE;
+    /* Standard deviation of a sample, cm */
+    float sampleNoise = DISTANCE_SAMPLE_NOISE;
+};
+
+/*
+ * Filtering of the raw ultrasonic distance, run on every sample the daemon reads:
+ *
+ *  median      of the last N raw samples, removes single spikes such as the 100 cm the
+ *              firmware reports when the echo times out
+ *  outliers    samples further than the limit from the median do not reach the estimate
+ *  estimate    1-D Kalman filter with a constant velocity model, gives a smoothed distance
+ *              and its rate of change; rejected samples only advance the prediction
+ *
+ * Update does not allocate and costs a fixed few dozen operations, so it can run at any
+ * sensor rate. The class is not synchronized, the owner serializes the calls.
+ */
+class DistanceFilter
+{
+    public:
+        explicit DistanceFilter(const DistanceFilterConfig& config = DistanceFilterConfig());
+
+        void Update(int32_t distanceCM, uint64_t capturedNs);
+
+        int32_t Raw() const { return raw; }
+        /* Median of the samples seen so far until the window fills */
+        int32_t Median() const { return median; }
+        bool MedianFull() const { return samples >= config.median; }
+        /* The estimate exists once a sample was accepted */
+        bool EstimateValid() const { return estimateValid; }
+        int32_t Estimate() const;
+        /* Rate of change of the estimate, negative when approaching, cm/s */
+        int32_t VelocityCmS() const;
+        /* Samples kept away from the estimate as outliers */
+        uint64_t Rejected() const { return rejected; }
+
+/*
+ * Median of 9 values by a fixed exchange network, the exchanges are branchless min/max
+ * so the cost does not depend on the data
+ */
+        static int32_t Median9(int32_t v[DISTANCE_MEDIAN_MAX]);
+
+    private:
+        DistanceFilterConfig config;
+
+        int32_t window[DISTANCE_MEDIAN_MAX];
+        unsigned windowNext;
+        unsigned samples;
+
+        int32_t raw;
+        int32_t median;
+        uint64_t rejected;
+
+        /* State (distance, velocity), its covariance and the time of the last sample */
+        bool estimateValid;
+        double x[2];
+        double p[2][2];
+        uint64_t lastNs;
+};
+
+#endif /* _DISTANCE_FILTER_H_ */
@@ -0,0 +1,161 @@
+/*
+ * flightrecorder.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <string>
+
+#include "flightrecorder.h"
+#include "logging.h"
+#include "util.h"
+
+namespace {
+    FlightRecorder::FlightRecorderHeader* header = nullptr;
+    FlightRecorder::FlightRecord* records = nullptr;
+    uint64_t indexMask = 0;
+    size_t mappingSize = 0;
+    /* Identity of the open file, it may be renamed while open */
+    dev_t fileDevice = 0;
+    ino_t fileInode = 0;
+
+    /* Thread id is looked up once per thread */
+    thread_local pid_t threadId = 0;
+
+    uint16_t ThreadTag() noexcept
+    {
+        if(threadId == 0) threadId = static_cast<pid_t>(syscall(SYS_gettid));
+        return static_cast<uint16_t>(threadId);
+    }
+
+    size_t RoundUpPowerOfTwo(size_t n)
+    {
+        size_t p = 1;
+        while(p < n) p <<= 1;
+        return p;
+    }
+};
+
+namespace FlightRecorder
+{
+    void Open(const char* path, size_t count)
+    {
+        if(header != nullptr) THROW_RUNTIME_MSG("flight recorder already open");
+
+        size_t capacity = RoundUpPowerOfTwo(count < 2 ? 2 : count);
+        size_t size = sizeof(FlightRecorderHeader) + capacity * sizeof(FlightRecord);
+
+        struct stat st;
+        if(0 == stat(path, &st) && st.st_size > 0) {
+            std::string previous = std::string(path) + ".1";
+            if(0 != rename(path, previous.c_str())) THROW_RUNTIME();
+        }
+
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(-1 == fd) THROW_RUNTIME();
+
+/*
+ * NOTE: Blocks are allocated up front, writing a record into a sparse page of a full
+ * file system would raise SIGBUS instead of an error here
+ */
+        int r = posix_fallocate(fd, 0, size);
+        if(0 == r && -1 == fstat(fd, &st)) r = errno;
+        if(0 != r) {
+            close(fd);
+            THROW_RUNTIME_EID(r);
+        }
+
+        void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        close(fd);
+        if(MAP_FAILED == mapping) THROW_RUNTIME();
+        fileDevice = st.st_dev;
+        fileInode = st.st_ino;
+
+        FlightRecorderHeader* h = static_cast<FlightRecorderHeader*>(mapping);
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, MAGIC, sizeof(MAGIC));
+        h->version = VERSION;
+        h->recordSize = sizeof(FlightRecord);
+        h->capacity = capacity;
+        h->writeIndex = 0;
+
+        timespec rt;
+        clock_gettime(CLOCK_REALTIME, &rt);
+        h->monotonicBaseNs = MonotonicNs();
+        h->realtimeBaseNs = TimespecToNs(rt);
+        h->pid = getpid();
+
+        records = reinterpret_cast<FlightRecord*>(h + 1);
+        indexMask = capacity - 1;
+        mappingSize = size;
+        header = h;
+
+        RLOG_INFO("FlightRecorder", "recording %zu records to %s", capacity, path);
+    }
+
+    void Close() noexcept
+    {
+        if(header == nullptr) return;
+
+        void* mapping = header;
+        header = nullptr;
+        records = nullptr;
+
+        if(0 != msync(mapping, mappingSize, MS_SYNC)) RLOG_WARNING("FlightRecorder", "msync: %m");
+        munmap(mapping, mappingSize);
+    }
+
+    void Restore(const char* path)
+    {
+        if(header == nullptr) return;
+
+        struct stat st;
+        std::string previous = std::string(path) + ".1";
+        if(0 != stat(previous.c_str(), &st) || st.st_dev != fileDevice || st.st_ino != fileInode) return;
+
+        if(0 != rename(previous.c_str(), path)) RLOG_WARNING("FlightRecorder", "rename %s: %m", previous.c_str());
+    }
+
+    bool Enabled() noexcept
+    {
+        return header != nullptr;
+    }
+
+    void Record(RecordType type, const void* data, size_t size) noexcept
+    {
+        if(header == nullptr) return;
+        if(size > PAYLOAD_SIZE) size = PAYLOAD_SIZE;
+
+        uint64_t index = __atomic_fetch_add(&header->writeIndex, 1, __ATOMIC_RELAXED);
+        FlightRecord& rec = records[index & indexMask];
+
+/*
+ * NOTE: Clearing the timestamp first marks the slot as incomplete for a reader of the file,
+ * the release store at the end publishes the filled slot
+ */
+        __atomic_store_n(&rec.timestampNs, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        rec.sequence = static_cast<uint32_t>(index);
+        rec.type = type;
+        rec.size = static_cast<uint8_t>(size);
+        rec.thread = ThreadTag();
+        memcpy(rec.payload, data, size);
+        memset(rec.payload + size, 0, PAYLOAD_SIZE - size);
+
+        __atomic_store_n(&rec.timestampNs, MonotonicNs(), __ATOMIC_RELEASE);
+    }
+};
@@ -0,0 +1,132 @@
+/*
+ * flightrecorder.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _FLIGHT_RECORDER_H_
+#define _FLIGHT_RECORDER_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "nettypes.h"
+
+/*
+ * Always-on recorder of the control traffic. Records are appended to a fixed size ring kept in
+ * a memory mapped file, so they stay in the page cache and on disk when the daemon crashes.
+ * Producers claim a slot with an atomic increment and fill it in place, recording costs
+ * no system call and takes no lock. The file is inspected with rover_flightdump.
+ *
+ * File layout: FlightRecorderHeader followed by capacity FlightRecord slots, record of index i
+ * is stored in slot i % capacity. All fields are in host byte order.
+ */
+namespace FlightRecorder
+{
+    constexpr char MAGIC[8] = { 'R', 'O', 'V', 'F', 'L', 'R', 'E', 'C' };
+    constexpr uint32_t VERSION = 1;
+    constexpr size_t PAYLOAD_SIZE = 16;
+
+    enum RecordType : uint8_t
+    {
+        /* RoverNet::Message received from the client, before it is queued */
+        REC_MSG_IN = 0x01,
+        /* RoverNet::Message taken from the outgoing queue */
+        REC_MSG_OUT = 0x02,
+        /* RecordDeviceResult */
+        REC_DEV_RESULT = 0x03,
+        /* RecordDistance */
+        REC_DISTANCE = 0x04
+    };
+
+    struct RecordDeviceResult
+    {
+        /* Wire part of the command as it was passed to the device */
+        uint8_t command[RoverNet::MESSAGE_STRUCT_SIZE];
+        /* Return value of the device library call */
+        int32_t status;
+    };
+
+    struct RecordDistance
+    {
+        int32_t distanceCM;
+        int32_t status;
+    };
+
+    struct FlightRecord
+    {
+/*
+ * NOTE: timestampNs doubles as the commit flag, it is zero while the slot is being written,
+ * so a record torn by a crash is never reported
+ */
+        uint64_t timestampNs;
+        /* Low 32 bits of the record index */
+        uint32_t sequence;
+        uint8_t type;
+        uint8_t size;
+        /* Low 16 bits of the kernel thread id of the producer */
+        uint16_t thread;
+        uint8_t payload[PAYLOAD_SIZE];
+    };
+
+    struct FlightRecorderHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordSize;
+        /* Number of slots, power of two */
+        uint64_t capacity;
+        /* Index of the next record to be claimed */
+        uint64_t writeIndex;
+        /* CLOCK_MONOTONIC and CLOCK_REALTIME sampled together when the file was opened */
+        uint64_t monotonicBaseNs;
+        uint64_t realtimeBaseNs;
+        uint32_t pid;
+        uint32_t reserved[3];
+    };
+
+    static_assert(sizeof(RecordDeviceResult) <= PAYLOAD_SIZE, "device result does not fit the record");
+    static_assert(RoverNet::MESSAGE_STRUCT_SIZE <= PAYLOAD_SIZE, "message does not fit the record");
+    static_assert(sizeof(FlightRecord) == 32, "unexpected record layout");
+    static_assert(sizeof(FlightRecorderHeader) == 64, "unexpected header layout");
+
+/*
+ * Creates the ring file with at least the given number of records and starts recording.
+ * An existing file is kept as path.1, so a restart does not overwrite the record of a crash.
+ * Must be called before the producing threads start, throws runtime_error on failure.
+ */
+    void Open(const char* path, size_t records);
+
+    /* Must be called after the producing threads stopped */
+    void Close() noexcept;
+/*
+ * Renames path.1 back to path when it is the open file, which another daemon opening path
+ * has moved. Used when the upgrade to that daemon is aborted.
+ */
+    void Restore(const char* path);
+
+    bool Enabled() noexcept;
+
+    /* Appends a record, does nothing when the recorder is not open */
+    void Record(RecordType type, const void* data, size_t size) noexcept;
+
+    inline void RecordMessage(RecordType type, const RoverNet::Message& msg) noexcept
+    {
+        Record(type, &msg, RoverNet::MESSAGE_STRUCT_SIZE);
+    }
+
+    inline void RecordDevice(const RoverNet::Message& command, int32_t status) noexcept
+    {
+        RecordDeviceResult result;
+        memcpy(result.command, &command, sizeof(result.command));
+        result.status = status;
+        Record(REC_DEV_RESULT, &result, sizeof(result));
+    }
+};
+
+#endif /* _FLIGHT_RECORDER_H_ */
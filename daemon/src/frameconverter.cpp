@@ -0,0 +1,119 @@
+/*
+ * frameconverter.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include "frameconverter.h"
+#include "util.h"
+#include "logging.h"
+
+namespace {
+    struct Planes
+    {
+        uint8_t* y;
+        uint8_t* u;
+        uint8_t* v;
+    };
+
+    Planes I420Planes(uint8_t* data, unsigned width, unsigned height)
+    {
+        Planes p;
+        p.y = data;
+        p.u = p.y + width * height;
+        p.v = p.u + (width / 2) * (height / 2);
+        return p;
+    }
+};
+
+FrameConverter::FrameConverter(const VideoFormat& input, unsigned poolFrames):
+    input(input),
+    maxScaleShift(0),
+    poolFrames(poolFrames),
+    kernels(PixelConvert::Kernels())
+{
+    if(input.fourcc != VIDEO_FMT_YUYV) THROW_RUNTIME_MSG("Unsupported input format 0x%08x", input.fourcc);
+
+    while(maxScaleShift < MAX_SCALE_SHIFT &&
+            (input.width % (4u << maxScaleShift)) == 0 && (input.height % (4u << maxScaleShift)) == 0) {
+        maxScaleShift++;
+    }
+
+    scratch.resize(VideoFrameSize(OutputFormat(0)));
+
+    RLOG_INFO("FrameConverter", "using %s kernels, max downscale %u", kernels.name, 1u << maxScaleShift);
+}
+
+VideoFormat FrameConverter::OutputFormat(unsigned scaleShift) const
+{
+    VideoFormat out = input;
+    out.fourcc = VIDEO_FMT_I420;
+    out.width >>= scaleShift;
+    out.height >>= scaleShift;
+    return out;
+}
+
+FrameRef FrameConverter::Acquire(unsigned scaleShift)
+{
+    if(!pools[scaleShift]) {
+        pools[scaleShift].reset(new FramePool(poolFrames, VideoFrameSize(OutputFormat(scaleShift))));
+    }
+
+    FrameRef out = pools[scaleShift]->Acquire();
+    if(out) {
+        out->format = OutputFormat(scaleShift);
+        out->size = VideoFrameSize(out->format);
+    }
+    return out;
+}
+
+void FrameConverter::Convert(const VideoFrame& in, unsigned scaleMask, FrameRef (&out)[MAX_SCALE_SHIFT + 1])
+{
+    const unsigned w = input.width;
+    const unsigned h = input.height;
+    const unsigned srcStride = w * 2;
+
+    for(auto& f : out) f.Reset();
+    scaleMask &= (2u << maxScaleShift) - 1;
+    if(scaleMask == 0) return;
+
+/*
+ * NOTE: Downscales read the full resolution planes, from the full size output frame when
+ * that is requested too, otherwise from the scratch buffer. Scratch is only touched by
+ * the capture thread.
+ */
+    uint8_t* fullData = scratch.data();
+    if(scaleMask & 1u) {
+        out[0] = Acquire(0);
+        if(out[0]) fullData = out[0]->Data();
+    }
+
+    Planes full = I420Planes(fullData, w, h);
+    kernels.yuyvToI420(in.Data(), srcStride, w, h, full.y, w, full.u, w / 2, full.v, w / 2);
+
+    for(unsigned shift = 1; shift <= maxScaleShift; ++shift) {
+        if(!(scaleMask & (1u << shift))) continue;
+
+        out[shift] = Acquire(shift);
+        if(!out[shift]) continue;
+
+        const unsigned ow = w >> shift;
+        const unsigned oh = h >> shift;
+        Planes dst = I420Planes(out[shift]->Data(), ow, oh);
+        auto downscale = (shift == 1) ? kernels.downscale2x : kernels.downscale4x;
+
+        downscale(full.y, w, w, h, dst.y, ow);
+        downscale(full.u, w / 2, w / 2, h / 2, dst.u, ow / 2);
+        downscale(full.v, w / 2, w / 2, h / 2, dst.v, ow / 2);
+    }
+
+    for(auto& f : out) {
+        if(!f) continue;
+        f->sequence = in.sequence;
+        f->timestampNs = in.timestampNs;
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * frameconverter.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _FRAME_CONVERTER_H_
+#define _FRAME_CONVERTER_H_
+
+#include <memory>
+#include <vector>
+
+#include "framepool.h"
+#include "pixelconvert.h"
+
+/*
+ * Conversion stage between the video source and the network. Captured YUYV frames are
+ * converted to I420 and optionally box downscaled by 2^scaleShift into frames of its own pools,
+ * so the source buffer can be released right after the conversion. Every scale has a pool
+ * of frames of its size, created when the scale is first used.
+ */
+class FrameConverter
+{
+    public:
+        static constexpr unsigned MAX_SCALE_SHIFT = 2;
+
+        FrameConverter(const VideoFormat& input, unsigned poolFrames);
+        FrameConverter(const FrameConverter&) = delete;
+        FrameConverter& operator=(const FrameConverter&) = delete;
+
+/*
+ * Produces out[shift] for every bit set in scaleMask from a single pass over the input.
+ * Entries of scales whose pool is exhausted are left empty.
+ */
+        void Convert(const VideoFrame& in, unsigned scaleMask, FrameRef (&out)[MAX_SCALE_SHIFT + 1]);
+
+        VideoFormat OutputFormat(unsigned scaleShift) const;
+
+        /* Highest shift for which all I420 planes keep whole dimensions */
+        unsigned MaxScaleShift() const noexcept { return maxScaleShift; }
+
+    private:
+        VideoFormat input;
+        unsigned maxScaleShift;
+        unsigned poolFrames;
+        const PixelKernels& kernels;
+        std::unique_ptr<FramePool> pools[MAX_SCALE_SHIFT + 1];
+        std::vector<uint8_t> scratch;
+
+        FrameRef Acquire(unsigned scaleShift);
+};
+
+#endif /* _FRAME_CONVERTER_H_ */
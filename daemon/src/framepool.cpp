@@ -0,0 +1,179 @@
+/*
+ * framepool.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdlib.h>
+
+#include "framepool.h"
+#include "logging.h"
+
+namespace {
+    constexpr size_t FRAME_ALIGNMENT = 64;
+
+    size_t AlignUp(size_t size)
+    {
+        return (size + FRAME_ALIGNMENT - 1) & ~(FRAME_ALIGNMENT - 1);
+    }
+};
+
+size_t VideoFrameSize(const VideoFormat& format)
+{
+    size_t pixels = static_cast<size_t>(format.width) * format.height;
+
+    switch(format.fourcc) {
+        case VIDEO_FMT_YUYV:
+            return pixels * 2;
+        case VIDEO_FMT_I420:
+            return pixels + 2 * ((format.width / 2) * (format.height / 2));
+        default:
+            return 0;
+    }
+}
+
+FrameRef::FrameRef(VideoFrame* f) noexcept:
+    frame(f)
+{
+    if(frame != nullptr) frame->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+FrameRef::FrameRef(const FrameRef& other) noexcept:
+    frame(other.frame)
+{
+    if(frame != nullptr) frame->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+FrameRef& FrameRef::operator=(const FrameRef& other) noexcept
+{
+    if(this != &other) {
+        if(other.frame != nullptr) other.frame->refs.fetch_add(1, std::memory_order_relaxed);
+        Reset();
+        frame = other.frame;
+    }
+    return *this;
+}
+
+FrameRef& FrameRef::operator=(FrameRef&& other) noexcept
+{
+    if(this != &other) {
+        Reset();
+        frame = other.frame;
+        other.frame = nullptr;
+    }
+    return *this;
+}
+
+void FrameRef::Reset() noexcept
+{
+    if(frame != nullptr) {
+        if(1 == frame->refs.fetch_sub(1, std::memory_order_acq_rel)) {
+            frame->pool->Release(frame);
+        }
+        frame = nullptr;
+    }
+}
+
+FramePool::FramePool(unsigned count, size_t frameSize):
+    count(count),
+    frames(nullptr),
+    storage(nullptr),
+    releaseHook(nullptr),
+    releaseCtx(nullptr)
+{
+    size_t stride = AlignUp(frameSize);
+    void* mem;
+
+    PTHREAD_GUARD( posix_memalign(&mem, FRAME_ALIGNMENT, stride * count) );
+    storage = static_cast<uint8_t*>(mem);
+    frames = new VideoFrame[count];
+    freeList.reserve(count);
+
+    for(unsigned i = 0; i < count; ++i) {
+        frames[i].data = storage + i * stride;
+        frames[i].capacity = frameSize;
+        frames[i].index = i;
+        frames[i].pool = this;
+        frames[i].refs.store(0, std::memory_order_relaxed);
+        frames[i].size = 0;
+        freeList.push_back(count - 1 - i);
+    }
+
+    PTHREAD_GUARD( pthread_mutex_init(&freeListMutex, NULL) );
+}
+
+FramePool::FramePool(const std::vector<std::pair<void*, size_t>>& buffers, ReleaseHook hook, void* ctx):
+    count(buffers.size()),
+    frames(new VideoFrame[buffers.size()]),
+    storage(nullptr),
+    releaseHook(hook),
+    releaseCtx(ctx)
+{
+    for(unsigned i = 0; i < count; ++i) {
+        frames[i].data = static_cast<uint8_t*>(buffers[i].first);
+        frames[i].capacity = buffers[i].second;
+        frames[i].index = i;
+        frames[i].pool = this;
+        frames[i].refs.store(0, std::memory_order_relaxed);
+        frames[i].size = 0;
+    }
+
+    PTHREAD_GUARD( pthread_mutex_init(&freeListMutex, NULL) );
+}
+
+FramePool::~FramePool()
+{
+    pthread_mutex_destroy(&freeListMutex);
+    delete[] frames;
+    free(storage);
+}
+
+FrameRef FramePool::Acquire()
+{
+    VideoFrame* frame = nullptr;
+
+    PTHREAD_GUARD( pthread_mutex_lock(&freeListMutex) );
+    if(!freeList.empty()) {
+        frame = &frames[freeList.back()];
+        freeList.pop_back();
+    }
+    PTHREAD_GUARD( pthread_mutex_unlock(&freeListMutex) );
+
+    return FrameRef(frame);
+}
+
+FrameRef FramePool::Adopt(unsigned index)
+{
+    if(index >= count) THROW_RUNTIME_MSG("Frame index %u out of range", index);
+    return FrameRef(&frames[index]);
+}
+
+unsigned FramePool::Available()
+{
+    unsigned ret;
+
+    PTHREAD_GUARD( pthread_mutex_lock(&freeListMutex) );
+    ret = freeList.size();
+    PTHREAD_GUARD( pthread_mutex_unlock(&freeListMutex) );
+
+    return ret;
+}
+
+void FramePool::Release(VideoFrame* frame) noexcept
+{
+    if(releaseHook != nullptr) {
+        releaseHook(releaseCtx, frame->index);
+        return;
+    }
+
+/*
+ * NOTE: freeList never exceeds the reserved capacity so push_back does not allocate
+ */
+    pthread_mutex_lock(&freeListMutex);
+    freeList.push_back(frame->index);
+    pthread_mutex_unlock(&freeListMutex);
+}
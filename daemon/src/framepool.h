@@ -0,0 +1,132 @@
+/*
+ * framepool.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _FRAME_POOL_H_
+#define _FRAME_POOL_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+
+constexpr uint32_t VideoFourCC(char a, char b, char c, char d)
+{
+    return static_cast<uint32_t>(a) | (static_cast<uint32_t>(b) << 8) |
+        (static_cast<uint32_t>(c) << 16) | (static_cast<uint32_t>(d) << 24);
+}
+
+constexpr uint32_t VIDEO_FMT_YUYV = VideoFourCC('Y', 'U', 'Y', 'V');
+constexpr uint32_t VIDEO_FMT_I420 = VideoFourCC('Y', 'U', '1', '2');
+
+struct VideoFormat
+{
+    uint32_t fourcc;
+    uint16_t width;
+    uint16_t height;
+    uint16_t fps;
+};
+
+/* Size in bytes of a single frame in the given format, 0 for unsupported formats */
+size_t VideoFrameSize(const VideoFormat& format);
+
+class FramePool;
+
+class VideoFrame
+{
+    public:
+        uint8_t* Data() const noexcept { return data; }
+        size_t Capacity() const noexcept { return capacity; }
+        unsigned Index() const noexcept { return index; }
+
+        VideoFormat format;
+        size_t size;
+        uint32_t sequence;
+        uint64_t timestampNs;
+
+    private:
+        friend class FramePool;
+        friend class FrameRef;
+
+        uint8_t* data;
+        size_t capacity;
+        unsigned index;
+        FramePool* pool;
+        std::atomic<unsigned> refs;
+};
+
+/*
+ * Counted reference to a pooled frame. The frame returns to its pool when the last
+ * reference is dropped. Copying only touches the atomic counter, never the heap.
+ */
+class FrameRef
+{
+    public:
+        FrameRef() noexcept : frame(nullptr) {}
+        explicit FrameRef(VideoFrame* f) noexcept;
+        FrameRef(const FrameRef& other) noexcept;
+        FrameRef(FrameRef&& other) noexcept : frame(other.frame) { other.frame = nullptr; }
+        FrameRef& operator=(const FrameRef& other) noexcept;
+        FrameRef& operator=(FrameRef&& other) noexcept;
+        ~FrameRef() { Reset(); }
+
+        void Reset() noexcept;
+
+        VideoFrame* operator->() const noexcept { return frame; }
+        VideoFrame& operator*() const noexcept { return *frame; }
+        VideoFrame* Get() const noexcept { return frame; }
+        explicit operator bool() const noexcept { return frame != nullptr; }
+
+    private:
+        VideoFrame* frame;
+};
+
+/*
+ * Fixed set of frame buffers allocated once at construction. Buffers are either owned by the
+ * pool or provided by the caller (e.g. V4L2 mmap buffers), in which case the release hook
+ * is called instead of returning the buffer to the free list.
+ */
+class FramePool
+{
+    public:
+        using ReleaseHook = void (*)(void* ctx, unsigned index);
+
+        explicit FramePool(unsigned count, size_t frameSize);
+        explicit FramePool(const std::vector<std::pair<void*, size_t>>& buffers, ReleaseHook hook, void* ctx);
+        FramePool(const FramePool&) = delete;
+        FramePool& operator=(const FramePool&) = delete;
+        ~FramePool();
+
+        /* Take a free frame, returns empty reference when the pool is exhausted */
+        FrameRef Acquire();
+
+        /* Wrap an externally filled buffer (pool created over caller buffers) */
+        FrameRef Adopt(unsigned index);
+
+        unsigned Count() const noexcept { return count; }
+        unsigned Available();
+
+    private:
+        friend class FrameRef;
+
+        void Release(VideoFrame* frame) noexcept;
+
+        unsigned count;
+        VideoFrame* frames;
+        uint8_t* storage;
+
+        ReleaseHook releaseHook;
+        void* releaseCtx;
+
+        std::vector<unsigned> freeList;
+        pthread_mutex_t freeListMutex;
+};
+
+#endif /* _FRAME_POOL_H_ */
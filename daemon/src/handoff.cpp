@@ -0,0 +1,215 @@
+/*
+ * handoff.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "handoff.h"
+#include "logging.h"
+
+namespace {
+    void Send(int sock, const void* data, size_t size, const int* fds, unsigned fdCount)
+    {
+        iovec iov = { const_cast<void*>(data), size };
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        if(fdCount != 0) {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), fds, fdCount * sizeof(int));
+        }
+
+        while(-1 == sendmsg(sock, &msg, MSG_NOSIGNAL)) {
+            if(errno != EINTR) THROW_RUNTIME();
+        }
+    }
+
+/*
+ * NOTE: The messages have a fixed size per step, anything else is treated as a failed
+ * handoff. Descriptors that came with a message of the wrong size are closed.
+ */
+    bool Receive(int sock, void* data, size_t size, int* fds, unsigned maxFds, unsigned& fdCount)
+    {
+        fdCount = 0;
+
+        pollfd p = { sock, POLLIN, 0 };
+        int r;
+        while(-1 == (r = poll(&p, 1, HANDOFF_TIMEOUT_MS))) {
+            if(errno != EINTR) THROW_RUNTIME();
+        }
+        if(r == 0) {
+            RLOG_ERR("Handoff", "no answer within %d ms", HANDOFF_TIMEOUT_MS);
+            return false;
+        }
+
+        iovec iov = { data, size };
+        msghdr msg = {};
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n;
+        while(-1 == (n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC))) {
+            if(errno != EINTR) THROW_RUNTIME();
+        }
+
+        for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            unsigned count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            for(unsigned i = 0; i < count; ++i) {
+                if(fdCount < maxFds) fds[fdCount++] = received[i];
+                else close(received[i]);
+            }
+        }
+
+        if(n != static_cast<ssize_t>(size) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            if(n != 0) RLOG_ERR("Handoff", "malformed message of %zd bytes, %zu expected", n, size);
+            for(unsigned i = 0; i < fdCount; ++i) close(fds[i]);
+            fdCount = 0;
+            return false;
+        }
+        return true;
+    }
+};
+
+namespace Handoff
+{
+    int Spawn(const char* path, char* const argv[], pid_t& pid)
+    {
+        int pair[2];
+        if(-1 == socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair)) THROW_RUNTIME();
+
+        char fdText[16];
+        snprintf(fdText, sizeof(fdText), "%d", pair[1]);
+
+        /* A handoff option of this daemon is replaced */
+        std::vector<char*> args;
+        for(int i = 0; argv[i] != NULL; ++i) {
+            if(0 == strcmp(argv[i], "--handoff") && argv[i + 1] != NULL) {
+                i++;
+                continue;
+            }
+            args.push_back(argv[i]);
+        }
+        args.push_back(const_cast<char*>("--handoff"));
+        args.push_back(fdText);
+        args.push_back(NULL);
+
+/*
+ * NOTE: Descriptors opened without O_CLOEXEC, such as the ones of the device library, are
+ * marked here so the new daemon does not inherit them. The child only calls exec.
+ */
+        DIR* dir = opendir("/proc/self/fd");
+        if(dir != NULL) {
+            for(dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+                int fd = atoi(entry->d_name);
+                if(fd > STDERR_FILENO && fd != dirfd(dir)) fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+            closedir(dir);
+        }
+
+        if(-1 == fcntl(pair[1], F_SETFD, 0) || -1 == (pid = fork())) {
+            int err = errno;
+            close(pair[0]);
+            close(pair[1]);
+            THROW_RUNTIME_EID(err);
+        }
+
+        if(pid == 0) {
+            execvp(path, args.data());
+            _exit(127);
+        }
+
+        close(pair[1]);
+        return pair[0];
+    }
+
+    bool Compatible(const Ready& ready)
+    {
+        return ready.magic == MAGIC && ready.version == VERSION && ready.stateSize == sizeof(State);
+    }
+
+    void SendReady(int sock)
+    {
+        Ready ready = { MAGIC, VERSION, sizeof(State), getpid() };
+        Send(sock, &ready, sizeof(ready), NULL, 0);
+    }
+
+    void SendState(int sock, const State& state)
+    {
+        int fds[2] = { state.net.serverSocket, state.net.clientSocket };
+        Send(sock, &state, sizeof(state), fds, state.net.clientSocket != -1 ? 2 : 1);
+    }
+
+    void SendConfirm(int sock, uint64_t gapNs)
+    {
+        Confirm confirm = { MAGIC, gapNs };
+        Send(sock, &confirm, sizeof(confirm), NULL, 0);
+    }
+
+    bool ReceiveReady(int sock, Ready& ready)
+    {
+        unsigned fdCount;
+        return Receive(sock, &ready, sizeof(ready), NULL, 0, fdCount);
+    }
+
+    bool ReceiveState(int sock, State& state)
+    {
+        int fds[2];
+        unsigned fdCount;
+        if(!Receive(sock, &state, sizeof(state), fds, 2, fdCount)) return false;
+
+        bool valid = state.magic == MAGIC && fdCount == (state.net.clientSocket != -1 ? 2u : 1u);
+        if(!valid) {
+            RLOG_ERR("Handoff", "state with %u sockets rejected", fdCount);
+            for(unsigned i = 0; i < fdCount; ++i) close(fds[i]);
+            return false;
+        }
+
+        state.net.serverSocket = fds[0];
+        if(fdCount == 2) state.net.clientSocket = fds[1];
+        return true;
+    }
+
+    bool ReceiveConfirm(int sock, Confirm& confirm)
+    {
+        unsigned fdCount;
+        return Receive(sock, &confirm, sizeof(confirm), NULL, 0, fdCount) && confirm.magic == MAGIC;
+    }
+
+    bool WaitClosed(int sock)
+    {
+        char byte;
+        pollfd p = { sock, POLLIN, 0 };
+        int r;
+        while(-1 == (r = poll(&p, 1, HANDOFF_TIMEOUT_MS))) {
+            if(errno != EINTR) THROW_RUNTIME();
+        }
+        return r == 1 && 0 == recv(sock, &byte, sizeof(byte), MSG_DONTWAIT);
+    }
+};
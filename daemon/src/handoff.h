@@ -0,0 +1,87 @@
+/*
+ * handoff.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+#include <sys/types.h>
+#include <cstdint>
+
+#include "deviceuc0service.h"
+#include "netservice.h"
+
+/*
+ * Hot upgrade between a running daemon and the build that replaces it. The running daemon
+ * starts the new one with --handoff FD, FD being its end of a SOCK_SEQPACKET socket pair.
+ * One message is exchanged per step:
+ *
+ *  new -> old  Ready    the new daemon is up, its build and state layout are announced
+ *  old -> new  State    the services are frozen, the sockets go along as SCM_RIGHTS
+ *  new -> old  Confirm  the new daemon serves the client, the old one exits
+ *
+ * The old daemon resumes from the state it sent when the new one fails or stays silent for
+ * HANDOFF_TIMEOUT_MS. The new daemon ends when the old one does not answer.
+ */
+namespace Handoff
+{
+    constexpr uint32_t MAGIC = 0x524f5648;
+    constexpr uint32_t VERSION = 1;
+
+    struct Ready
+    {
+        uint32_t magic;
+        uint32_t version;
+        /* sizeof(State) of the new build, both daemons must agree on the layout */
+        uint32_t stateSize;
+        int32_t pid;
+    };
+
+    struct State
+    {
+        uint32_t magic;
+        /* CLOCK_MONOTONIC time the old daemon stopped taking commands */
+        uint64_t freezeNs;
+        DeviceUC0Service::HandoffState device;
+        RoverNet::NetService::HandoffState net;
+    };
+
+    struct Confirm
+    {
+        uint32_t magic;
+        /* Time without command handling, from the freeze until the new threads ran */
+        uint64_t gapNs;
+    };
+
+/*
+ * Starts path with argv and --handoff, returns the socket to the new daemon. Descriptors
+ * other than the standard ones are not inherited.
+ */
+    int Spawn(const char* path, char* const argv[], pid_t& pid);
+
+    /* True when the new daemon announced by ready can take the state of this build */
+    bool Compatible(const Ready& ready);
+
+    void SendReady(int sock);
+    void SendState(int sock, const State& state);
+    void SendConfirm(int sock, uint64_t gapNs);
+
+/*
+ * Wait up to HANDOFF_TIMEOUT_MS for the message of the step, false on a timeout, a closed
+ * socket or a malformed message. The sockets of a received state replace the ones in it.
+ */
+    bool ReceiveReady(int sock, Ready& ready);
+    bool ReceiveState(int sock, State& state);
+    bool ReceiveConfirm(int sock, Confirm& confirm);
+
+    /* Waits until the other daemon closed its end, false on timeout */
+    bool WaitClosed(int sock);
+};
+
+#endif /* _HANDOFF_H_ */
@@ -1,6 +1,6 @@
 /*
  * logging.cpp
- * 
+ *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License version 3 as
  * published by the Free Software Foundation.
@@ -8,18 +8,107 @@
  * Copyright (C) 2016 Tomasz Chadzynski
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <strings.h>
+
 #include "logging.h"
 
+namespace RoverLog
+{
+    std::atomic<int> runtimeLevel(LOG_NOTICE);
+
+    void SetLevel(int level) noexcept
+    {
+        runtimeLevel.store(level, std::memory_order_relaxed);
+    }
+
+    int Level() noexcept
+    {
+        return runtimeLevel.load(std::memory_order_relaxed);
+    }
+
+    int ParseLevel(const char* name) noexcept
+    {
+        static const struct { const char* name; int level; } levels[] = {
+            { "err", LOG_ERR },
+            { "warning", LOG_WARNING },
+            { "notice", LOG_NOTICE },
+            { "info", LOG_INFO },
+            { "debug", LOG_DEBUG }
+        };
+
+        for(const auto& l : levels) {
+            if(0 == strcasecmp(name, l.name)) return l.level;
+        }
+
+        char* end;
+        long level = strtol(name, &end, 10);
+        if(*name == '\0' || *end != '\0' || level < LOG_EMERG || level > LOG_DEBUG) return -1;
+
+        return static_cast<int>(level);
+    }
+
+    void Write(int level, const char* module, const char* file, const char* func, int line,
+            const char* fmt, ...) noexcept
+    {
+/*
+ * NOTE: errno is preserved so that "%m" refers to the error of the caller
+ */
+        int savedErrno = errno;
+        char buffer[LINE_BUFFER_SIZE];
+        int prefix = snprintf(buffer, sizeof(buffer), "(%s) %s [%s:%d]: ", module, file, func, line);
+        if(prefix < 0) return;
+
+        if(static_cast<size_t>(prefix) < sizeof(buffer)) {
+            va_list args;
+            va_start(args, fmt);
+            errno = savedErrno;
+            int len = vsnprintf(buffer + prefix, sizeof(buffer) - prefix, fmt, args);
+            va_end(args);
+
+            if(len >= 0 && static_cast<size_t>(prefix + len) < sizeof(buffer)) {
+                syslog(level, "%s", buffer);
+                return;
+            }
+        }
+
+        /* Slow path, message does not fit in the stack buffer */
+        char* longBuffer = nullptr;
+        va_list args;
+        va_start(args, fmt);
+        errno = savedErrno;
+        int len = vasprintf(&longBuffer, fmt, args);
+        va_end(args);
+
+        if(len >= 0) {
+            syslog(level, "(%s) %s [%s:%d]: %s", module, file, func, line, longBuffer);
+            free(longBuffer);
+        }
+    }
+};
+
 std::string log_ex(const char* file, const char* func, int line, int _errno)
 {
-    std::stringstream ss;
-    ss << file << " [" << func << ":" << line << "]: " << strerror(_errno);
-    return ss.str();
+    char buffer[RoverLog::LINE_BUFFER_SIZE];
+    char errBuffer[RoverLog::LINE_BUFFER_SIZE];
+    snprintf(buffer, sizeof(buffer), "%s [%s:%d]: %s", file, func, line,
+            strerror_r(_errno, errBuffer, sizeof(errBuffer)));
+    return buffer;
 }
 
-std::string log_msg(const char* file, const char* func, int line, const char* msg)
+std::string log_msg(const char* file, const char* func, int line, const char* fmt, ...)
 {
-    std::stringstream ss;
-    ss << file << " [" << func << ":" << line << "]: " << msg;
-    return ss.str();
+    char buffer[RoverLog::LINE_BUFFER_SIZE];
+    int prefix = snprintf(buffer, sizeof(buffer), "%s [%s:%d]: ", file, func, line);
+    if(prefix < 0 || static_cast<size_t>(prefix) >= sizeof(buffer)) return buffer;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer + prefix, sizeof(buffer) - prefix, fmt, args);
+    va_end(args);
+
+    return buffer;
 }
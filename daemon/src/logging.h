@@ -1,6 +1,6 @@
 /*
  * logging.h
- * 
+ *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License version 3 as
  * published by the Free Software Foundation.
@@ -9,25 +9,84 @@
  */
 
 #ifndef _LOGGING_H_
-#define _LOGGING_H
+#define _LOGGING_H_
 
 #include <string>
 #include <string.h>
-#include <sstream>
 #include <stdexcept>
+#include <atomic>
+#include <type_traits>
+#include <syslog.h>
+
+/*
+ * Compile time log threshold expressed as syslog priority. Log statements with the priority
+ * numerically above the threshold are removed by the compiler together with their arguments.
+ * Can be overridden with ./configure --with-log-level=LEVEL
+ */
+#ifndef ROVER_LOG_LEVEL
+#ifdef NDEBUG
+#define ROVER_LOG_LEVEL LOG_NOTICE
+#else
+#define ROVER_LOG_LEVEL LOG_DEBUG
+#endif
+#endif
+
+namespace RoverLog
+{
+    /* Messages that fit in the buffer are formatted on the stack, longer ones fall back to the heap */
+    constexpr size_t LINE_BUFFER_SIZE = 256;
+
+    /* Runtime threshold, defaults to LOG_NOTICE */
+    extern std::atomic<int> runtimeLevel;
+
+    template<int LEVEL>
+    constexpr bool Compiled() noexcept
+    {
+        return LEVEL <= ROVER_LOG_LEVEL;
+    }
+
+    inline bool Enabled(int level) noexcept
+    {
+        return level <= runtimeLevel.load(std::memory_order_relaxed);
+    }
+
+    /* Offset of the file name within the path, evaluated at compile time by ROVER_FILE */
+    constexpr size_t BasenameOffset(const char* path) noexcept
+    {
+        size_t offset = 0;
+        for(size_t i = 0; path[i] != '\0'; ++i) {
+            if(path[i] == '/') offset = i + 1;
+        }
+        return offset;
+    }
+
+    void SetLevel(int level) noexcept;
+    int Level() noexcept;
+
+    /* Parse level name (err, warning, notice, info, debug) or number, returns -1 on failure */
+    int ParseLevel(const char* name) noexcept;
+
+    /* Function writing formatted log line to syslog, not to be used directly */
+    void Write(int level, const char* module, const char* file, const char* func, int line,
+            const char* fmt, ...) noexcept __attribute__((format(printf, 6, 7)));
+};
+
+/* Name of the current source file without the directory part */
+#define ROVER_FILE (__FILE__ + std::integral_constant<size_t, RoverLog::BasenameOffset(__FILE__)>::value)
 
 /* Function forming error messages, not to be used directly */
 std::string log_ex(const char* file, const char* func, int line, int _errno);
-std::string log_msg(const char* file, const char* func, int line, const char* msg);
+std::string log_msg(const char* file, const char* func, int line, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
 
 /* Form error message based on errno */
-#define FORM_ERROR() log_ex(__FILE__, __func__, __LINE__, errno)
+#define FORM_ERROR() log_ex(ROVER_FILE, __func__, __LINE__, errno)
 
 /* Form error message based on custom error id that is treated as errno */
-#define FORM_ERROR_EID(_ERR_) log_ex(__FILE__, __func__, __LINE__, _ERR_)
+#define FORM_ERROR_EID(_ERR_) log_ex(ROVER_FILE, __func__, __LINE__, _ERR_)
 
-/* Form log message based on custom message passed */
-#define FORM_MSG(__MSG__) log_msg(__FILE__, __func__, __LINE__, __MSG__)
+/* Form log message based on custom printf style message passed */
+#define FORM_MSG(...) log_msg(ROVER_FILE, __func__, __LINE__, __VA_ARGS__)
 
 /* Throw runtime_error with message formulated based on errno */
 #define THROW_RUNTIME() throw std::runtime_error(FORM_ERROR())
@@ -35,19 +94,32 @@ std::string log_msg(const char* file, const char* func, int line, const char* ms
 /* Throw runtime_error exception based on custom error number that is process as errno */
 #define THROW_RUNTIME_EID(__ERR__) throw std::runtime_error(FORM_ERROR_EID(__ERR__))
 
-/* Throw runtime_error exception with custome message */
-#define THROW_RUNTIME_MSG(_MSG_) throw std::runtime_error(FORM_MSG(_MSG_))
+/* Throw runtime_error exception with custom printf style message */
+#define THROW_RUNTIME_MSG(...) throw std::runtime_error(FORM_MSG(__VA_ARGS__))
 
 /* Default guard function for pthread calls, used since pthread api does not directly modify errno.  */
 #define PTHREAD_GUARD(__FCALL__) { int r; if(0!= (r = __FCALL__)) THROW_RUNTIME_EID(r); }
 
-/* Form log message from the content of exception message */
-#define LOG_EXCEPT(_MODULE_, ex) (std::string("(") + _MODULE_ + std::string(") ") + ex.what()).c_str()
+/*
+ * Write printf style log message with given syslog priority. Arguments are not evaluated
+ * when the priority is disabled either at compile time or at runtime.
+ */
+#define RLOG(_LEVEL_, _MODULE_, ...) \
+    do { \
+        if(RoverLog::Compiled<_LEVEL_>() && RoverLog::Enabled(_LEVEL_)) \
+            RoverLog::Write(_LEVEL_, _MODULE_, ROVER_FILE, __func__, __LINE__, __VA_ARGS__); \
+    } while(0)
+
+#define RLOG_ERR(_MODULE_, ...) RLOG(LOG_ERR, _MODULE_, __VA_ARGS__)
+#define RLOG_WARNING(_MODULE_, ...) RLOG(LOG_WARNING, _MODULE_, __VA_ARGS__)
+#define RLOG_NOTICE(_MODULE_, ...) RLOG(LOG_NOTICE, _MODULE_, __VA_ARGS__)
+#define RLOG_INFO(_MODULE_, ...) RLOG(LOG_INFO, _MODULE_, __VA_ARGS__)
+#define RLOG_DEBUG(_MODULE_, ...) RLOG(LOG_DEBUG, _MODULE_, __VA_ARGS__)
 
-/* Form log message from errno variable */
-#define LOG_MSG_ERR(_MODULE_) (std::string("(") + _MODULE_ + std::string(") ") + FORM_ERROR()).c_str()
+/* Log error message from errno variable */
+#define RLOG_ERRNO(_MODULE_) RLOG_ERR(_MODULE_, "%m")
 
-/* Form log message from custom text passed as argument */
-#define LOG_MSG(_MODULE_, _MSG_) (std::string("(") + _MODULE_ + std::string(") ") + FORM_MSG(_MSG_)).c_str()
+/* Log error message from the content of exception message */
+#define RLOG_EXCEPT(_MODULE_, ex) RLOG_ERR(_MODULE_, "%s", ex.what())
 
 #endif //_LOGGING_H_
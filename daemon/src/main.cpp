@@ -23,76 +23,186 @@
 #include <sys/stat.h>
 #include <syslog.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
 
 #include "util.h"
 #include "server.h"
 #include "logging.h"
 
-volatile bool RUNNING;
+ServerConfig CONFIG;
+/* Started by SIGHUP with the arguments of this daemon, absolute when given with a path */
+std::string EXEC_PATH;
+char** EXEC_ARGV;
+/* Socket to the previous daemon when started by a hot upgrade, -1 otherwise */
+int HANDOFF_SOCKET = -1;
 
 void PrintUsage(FILE *s)
 {
     fprintf(s,
             "Usage: \n"
-            "   -d  --daemon    Start in daemon mode.\n"
-            "   -h  --help      Print this message.\n");
+            "   -d  --daemon            Start in daemon mode.\n"
+            "   -l  --log-level LEVEL   Runtime log threshold (err, warning, notice, info, debug).\n"
+            "   -b  --bind ADDR[:PORT]  Address of the control connection (default %s:%u).\n"
+            "   -s  --video-source SPEC Video source: auto, none, pattern[:WxH[@FPS]],\n"
+            "                           file:PATH[:WxH[@FPS]], v4l2[:DEVICE[:WxH[@FPS]]].\n"
+            "   -v  --video-scale N     Downscale video by 1, 2 or 4 before sending.\n"
+            "   -r  --video-rate KBPS   Upper bound of the video bitrate (default %u).\n"
+            "   -f  --video-fixed       Disable congestion adaptation of the video stream.\n"
+            "   -R  --recorder PATH     Flight recorder file or none (default %s).\n"
+            "   -N  --recorder-size N   Records kept by the flight recorder (default %zu).\n"
+            "   -A  --max-command-age MS\n"
+            "                           Drop timestamped wheel commands older than MS,\n"
+            "                           0 disables (default %u).\n"
+            "   -C  --control-rate HZ   Setpoints per second of speed ramps (default %u).\n"
+            "   -a  --ramp-accel N      Acceleration of speed ramps that do not set their own,\n"
+            "                           in speed units per second (default %u).\n"
+            "   -O  --obstacle-stop CM  Stop forward motion when the filtered distance falls\n"
+            "                           below CM, 0 disables (default 0).\n"
+            "   -F  --distance-filter SPEC\n"
+            "                           Sample the distance continuously and filter it with\n"
+            "                           median=N (odd, at most %u), outlier=CM (0 disables),\n"
+            "                           accel=CM/S2 and noise=CM (default median=%u,\n"
+            "                           outlier=%d,accel=%g,noise=%g).\n"
+            "   -W  --deadman MS        Stop the wheels when no command or heartbeat arrives\n"
+            "                           for MS, 0 leaves it to the client (default 0). The\n"
+            "                           command gap statistics are logged on SIGUSR2.\n"
+            "   -P  --threads SPEC      Scheduling of the service threads, comma separated\n"
+            "                           CLASS=PRIO[@CPUS] for control, monitor, network and\n"
+            "                           video (PRIO 1-99 is SCHED_FIFO, 0 the default policy,\n"
+            "                           CPUS such as 3 or 0-1+3), stack=KB (default %zu) and\n"
+            "                           lock to lock the memory, for example\n"
+            "                           control=80@3,network=70@3,monitor=60@2,video=0@0-1,lock.\n"
+            "   -T  --trace PATH        Trace message lifecycles, written to PATH as Chrome\n"
+            "                           trace JSON on SIGUSR1.\n"
+            "   -H  --handoff FD        Take over from the daemon upgraded by SIGHUP, set by\n"
+            "                           that daemon. SIGHUP starts the binary this daemon was\n"
+            "                           started from, the connection and the wheels are\n"
+            "                           handed over without stopping.\n"
+            "   -h  --help              Print this message.\n", SERVER_IP4_ADDR, SERVER_TCP_PORT, VIDEO_DEFAULT_MAX_KBPS,
+            FLIGHT_RECORDER_DEFAULT_PATH, FLIGHT_RECORDER_DEFAULT_RECORDS, DEV_CMD_MAX_AGE_MS,
+            DEV_RAMP_RATE_HZ, DEV_RAMP_ACCEL, DISTANCE_MEDIAN_MAX, DISTANCE_MEDIAN_DEFAULT, DISTANCE_OUTLIER_CM,
+            DISTANCE_ACCEL_NOISE, DISTANCE_SAMPLE_NOISE, THREAD_STACK_SIZE / 1024);
 }
 
-void ExitSigHandler(int sig)
+/* Comma separated key=value pairs of -F, keys not given keep their value */
+bool ParseDistanceFilter(const char* text, DistanceFilterConfig& config)
 {
-    RUNNING = false;
-    syslog(LOG_NOTICE, LOG_MSG("MAIN", "caught terminating signal, shutting down.\n"));
+    std::string s = text;
+    size_t pos = 0;
+
+    while(pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if(end == std::string::npos) end = s.size();
+        std::string item = s.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t eq = item.find('=');
+        if(eq == std::string::npos) return false;
+        std::string key = item.substr(0, eq);
+        double value = atof(item.c_str() + eq + 1);
+
+        if(key == "median") {
+            if(value < 1 || value > DISTANCE_MEDIAN_MAX || static_cast<unsigned>(value) % 2 == 0) return false;
+            config.median = static_cast<unsigned>(value);
+        }
+        else if(key == "outlier") {
+            if(value < 0) return false;
+            config.outlierCm = static_cast<int32_t>(value);
+        }
+        else if(key == "accel") {
+            if(value <= 0) return false;
+            config.accelNoise = static_cast<float>(value);
+        }
+        else if(key == "noise") {
+            if(value <= 0) return false;
+            config.sampleNoise = static_cast<float>(value);
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
 }
 
 void Run()
 {
-    RUNNING = true;
-
-    if(signal(SIGINT, ExitSigHandler) == SIG_ERR){
-        syslog(LOG_ERR, LOG_MSG_ERR("MAIN"));
-        exit(EXIT_FAILURE);
-    }
-
-    if(signal(SIGTERM, ExitSigHandler) == SIG_ERR){
-        syslog(LOG_ERR, LOG_MSG_ERR("MAIN"));
-        exit(EXIT_FAILURE);
-    }
-
-    if(signal(SIGHUP, ExitSigHandler) == SIG_ERR){
-        syslog(LOG_ERR, LOG_MSG_ERR("MAIN"));
-        exit(EXIT_FAILURE);
-    }
-
-    if(signal(SIGQUIT, ExitSigHandler) == SIG_ERR){
-        syslog(LOG_ERR, LOG_MSG_ERR("MAIN"));
+/*
+ * NOTE: The signals are blocked before any thread is created, every thread inherits the mask
+ * and the signals are only received here through the descriptor. The main thread sleeps until
+ * one arrives, shutdown starts as soon as it does.
+ */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+
+    int signalFd;
+    if(0 != pthread_sigmask(SIG_BLOCK, &signals, NULL) || -1 == (signalFd = signalfd(-1, &signals, SFD_CLOEXEC))) {
+        RLOG_ERRNO("MAIN");
         exit(EXIT_FAILURE);
     }
 
     try {
-        Server server;
-        server.Start();
-
-        while(RUNNING){
-            sleep(1);
+        Server server(CONFIG);
+        if(HANDOFF_SOCKET != -1) server.TakeOver(HANDOFF_SOCKET);
+        else server.Start();
+        bool upgraded = false;
+
+        bool running = true;
+        while(running) {
+            signalfd_siginfo info;
+            if(static_cast<ssize_t>(sizeof(info)) != read(signalFd, &info, sizeof(info))) {
+                if(errno == EINTR) continue;
+                THROW_RUNTIME();
+            }
+
+            switch(info.ssi_signo) {
+                case SIGUSR1:
+                    server.DumpTrace();
+                    break;
+                case SIGUSR2:
+                    server.LogStats();
+                    break;
+                case SIGHUP:
+                    RLOG_NOTICE("MAIN", "caught SIGHUP, upgrading to %s.", EXEC_PATH.c_str());
+                    upgraded = server.Upgrade(EXEC_PATH.c_str(), EXEC_ARGV);
+                    running = !upgraded;
+                    break;
+                default:
+                    RLOG_NOTICE("MAIN", "caught terminating signal, shutting down.");
+                    running = false;
+                    break;
+            }
         }
 
-        server.Stop();
+        if(!upgraded) server.Stop();
     }
     catch (const std::exception& e)
     {
-        syslog(LOG_ERR, LOG_EXCEPT("MAIN", e));
+        RLOG_EXCEPT("MAIN", e);
     }
     catch (...)
     {
-        syslog(LOG_ERR, LOG_MSG("MAIN", "Unknown exception occured.\n"));
+        RLOG_ERR("MAIN", "Unknown exception occured.");
     }
-    
+
+    close(signalFd);
 }
 
 void Daemonize()
 {
-
-    pid_t pid = fork();
+/*
+ * NOTE: A daemon started by a hot upgrade is a child of the previous one, already detached,
+ * and stays in the process the previous daemon waits for
+ */
+    pid_t pid = HANDOFF_SOCKET != -1 ? 0 : fork();
     if(pid < 0) {
         fprintf(stderr, "%s unable to fork into daemon: %s\n", MAIN_NAME, strerror(errno));
         exit(EXIT_FAILURE);
@@ -104,24 +214,33 @@ void Daemonize()
     else {
         umask(0);
 
+/*
+ * NOTE: The standard descriptors point to /dev/null instead of being closed. A closed 0..2
+ * would be reused by the next descriptor opened, the syslog socket or the signalfd of a hot
+ * upgraded daemon, and a stray write to stdout would then go to that descriptor.
+ */
+        int devNull = open("/dev/null", O_RDWR);
+        if(devNull == -1 || -1 == dup2(devNull, STDIN_FILENO) || -1 == dup2(devNull, STDOUT_FILENO) ||
+                -1 == dup2(devNull, STDERR_FILENO)) {
+            fprintf(stderr, "%s unable to redirect standard descriptors: %s\n", MAIN_NAME, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if(devNull > STDERR_FILENO) close(devNull);
+
         openlog(MAIN_NAME, LOG_PID|LOG_NOWAIT,LOG_USER);
-        syslog(LOG_NOTICE, LOG_MSG("MAIN","Starting daemon.\n"));
+        RLOG_NOTICE("MAIN", "Starting daemon.");
 
-        pid_t sid = setsid();
+        pid_t sid = HANDOFF_SOCKET != -1 ? getsid(0) : setsid();
         if(sid < 0) {
-            syslog(LOG_ERR, LOG_MSG("MAIN","Error creating process group.\n"));
+            RLOG_ERR("MAIN", "Error creating process group.");
             exit(EXIT_FAILURE);
         }
         
         if(chdir("/") < 0) {
-            syslog(LOG_ERR, LOG_MSG("MAIN","Error changing working directory to /.\n"));
+            RLOG_ERR("MAIN", "Error changing working directory to /.");
             exit(EXIT_FAILURE);
         }
 
-        close(STDIN_FILENO);
-        close(STDOUT_FILENO);
-        close(STDERR_FILENO);
-
         Run();
 
         closelog();
@@ -132,7 +251,7 @@ void Daemonize()
 void RunLocal()
 {
         openlog(MAIN_NAME, LOG_PID|LOG_NOWAIT,LOG_USER);
-        syslog(LOG_NOTICE, LOG_MSG("MAIN", "Starting local.\n"));
+        RLOG_NOTICE("MAIN", "Starting local.");
 
         Run();
 
@@ -143,12 +262,29 @@ void RunLocal()
 
 int main(int argc, char *argv[])
 {
-    const char* const short_options = "dh";
+    const char* const short_options = "dhl:b:s:v:r:fR:N:A:C:a:O:F:W:P:T:H:";
 
     const struct option long_options[] = {
-        { "help",   0,  NULL,  'h'},
-        { "daemon", 0,  NULL,  'd'},
-        { NULL,     0,  NULL,   0 }
+        { "help",       0,  NULL,  'h'},
+        { "daemon",     0,  NULL,  'd'},
+        { "log-level",  1,  NULL,  'l'},
+        { "bind",       1,  NULL,  'b'},
+        { "video-source", 1, NULL, 's'},
+        { "video-scale", 1, NULL,  'v'},
+        { "video-rate", 1,  NULL,  'r'},
+        { "video-fixed", 0, NULL,  'f'},
+        { "recorder",   1,  NULL,  'R'},
+        { "recorder-size", 1, NULL, 'N'},
+        { "max-command-age", 1, NULL, 'A'},
+        { "control-rate", 1, NULL, 'C'},
+        { "ramp-accel", 1,  NULL,  'a'},
+        { "obstacle-stop", 1, NULL, 'O'},
+        { "distance-filter", 1, NULL, 'F'},
+        { "deadman",    1,  NULL,  'W'},
+        { "threads",    1,  NULL,  'P'},
+        { "trace",      1,  NULL,  'T'},
+        { "handoff",    1,  NULL,  'H'},
+        { NULL,         0,  NULL,   0 }
     };
 
     char option;
@@ -165,6 +301,160 @@ int main(int argc, char *argv[])
             case 'd':
                 runAsDaemon = true;
                 break;
+            case 'l':
+                {
+                    int level = RoverLog::ParseLevel(optarg);
+                    if(level < 0) {
+                        fprintf(stderr, "%s invalid log level: %s\n", MAIN_NAME, optarg);
+                        PrintUsage(stderr);
+                        exit(EXIT_FAILURE);
+                    }
+                    RoverLog::SetLevel(level);
+                }
+                break;
+            case 'b':
+                {
+                    std::string address = optarg;
+                    size_t colon = address.find(':');
+                    if(colon != std::string::npos) {
+                        int port = atoi(address.c_str() + colon + 1);
+                        if(port <= 0 || port > 65535) {
+                            fprintf(stderr, "%s invalid port: %s\n", MAIN_NAME, optarg);
+                            PrintUsage(stderr);
+                            exit(EXIT_FAILURE);
+                        }
+                        CONFIG.net.port = port;
+                        address.resize(colon);
+                    }
+                    CONFIG.net.address = address;
+                }
+                break;
+            case 's':
+                CONFIG.video.source = optarg;
+                break;
+            case 'v':
+                CONFIG.video.scale = atoi(optarg);
+                if(CONFIG.video.scale != 1 && CONFIG.video.scale != 2 && CONFIG.video.scale != 4) {
+                    fprintf(stderr, "%s invalid video scale: %s\n", MAIN_NAME, optarg);
+                    PrintUsage(stderr);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                {
+                    int kbps = atoi(optarg);
+                    if(kbps < static_cast<int>(VIDEO_MIN_KBPS)) {
+                        fprintf(stderr, "%s invalid video rate: %s\n", MAIN_NAME, optarg);
+                        PrintUsage(stderr);
+                        exit(EXIT_FAILURE);
+                    }
+                    CONFIG.video.maxKbps = kbps;
+                }
+                break;
+            case 'f':
+                CONFIG.video.adaptive = false;
+                break;
+            case 'R':
+                CONFIG.recorderPath = (0 == strcmp(optarg, "none")) ? "" : optarg;
+                break;
+            case 'N':
+                {
+                    long records = atol(optarg);
+                    if(records < 2) {
+                        fprintf(stderr, "%s invalid recorder size: %s\n", MAIN_NAME, optarg);
+                        PrintUsage(stderr);
+                        exit(EXIT_FAILURE);
+                    }
+                    CONFIG.recorderRecords = records;
+                }
+                break;
+            case 'A':
+                {
+                    int age = atoi(optarg);
+                    if(age < 0 || (age == 0 && strcmp(optarg, "0") != 0)) {
+                        fprintf(stderr, "%s invalid command age: %s\n", MAIN_NAME, optarg);
+                        PrintUsage(stderr);
+                        exit(EXIT_FAILURE);
+                    }
+                    CONFIG.device.maxCommandAgeMs = age;
+                }
+                break;
+            case 'C':
+                {
+                    int rate = atoi(optarg);
+                    if(rate < 1 || rate > 1000) {
+                        fprintf(stderr, "%s invalid control rate: %s\n", MAIN_NAME, optarg);
+                        PrintUsage(stderr);
+                        exit(EXIT_FAILURE);
+                    }
+                    CONFIG.device.rampRateHz = rate;
+                }
+                break;
+            case 'a':
+                {
+                    int accel = atoi(optarg);
+                    if(accel < 1 || accel > UINT16_MAX) {
+                        fprintf(stderr, "%s invalid ramp acceleration: %s\n", MAIN_NAME, optarg);
+                        PrintUsage(stderr);
+                        exit(EXIT_FAILURE);
+                    }
+                    CONFIG.device.rampAccel = accel;
+                }
+                break;
+            case 'O':
+                {
+                    int cm = atoi(optarg);
+                    if(cm < 0 || (cm == 0 && strcmp(optarg, "0") != 0)) {
+                        fprintf(stderr, "%s invalid obstacle distance: %s\n", MAIN_NAME, optarg);
+                        PrintUsage(stderr);
+                        exit(EXIT_FAILURE);
+                    }
+                    CONFIG.device.reflexStopCm = cm;
+                }
+                break;
+            case 'F':
+                if(!ParseDistanceFilter(optarg, CONFIG.device.distanceFilter)) {
+                    fprintf(stderr, "%s invalid distance filter: %s\n", MAIN_NAME, optarg);
+                    PrintUsage(stderr);
+                    exit(EXIT_FAILURE);
+                }
+                CONFIG.device.distanceSampling = true;
+                break;
+            case 'W':
+                {
+                    int ms = atoi(optarg);
+                    if(ms < 0 || (ms == 0 && strcmp(optarg, "0") != 0)) {
+                        fprintf(stderr, "%s invalid deadman deadline: %s\n", MAIN_NAME, optarg);
+                        PrintUsage(stderr);
+                        exit(EXIT_FAILURE);
+                    }
+                    CONFIG.device.deadmanMs = ms;
+                }
+                break;
+            case 'P':
+                if(!ParseThreadConfig(optarg, CONFIG)) {
+                    fprintf(stderr, "%s invalid thread settings: %s\n", MAIN_NAME, optarg);
+                    PrintUsage(stderr);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                CONFIG.tracePath = optarg;
+                break;
+            case 'H':
+                {
+                    int fd = atoi(optarg);
+                    int type;
+                    socklen_t length = sizeof(type);
+                    if(fd <= STDERR_FILENO || 0 != getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) || type != SOCK_SEQPACKET) {
+                        fprintf(stderr, "%s invalid handoff socket: %s\n", MAIN_NAME, optarg);
+                        PrintUsage(stderr);
+                        exit(EXIT_FAILURE);
+                    }
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    HANDOFF_SOCKET = fd;
+                }
+                break;
             case -1:
                 break;
             default:
@@ -174,6 +464,17 @@ int main(int argc, char *argv[])
     }
     while (option != -1);
 
+    /* Daemon mode changes to /, a relative path is resolved before */
+    EXEC_ARGV = argv;
+    EXEC_PATH = argv[0];
+    if(strchr(argv[0], '/') != NULL) {
+        char* path = realpath(argv[0], NULL);
+        if(path != NULL) {
+            EXEC_PATH = path;
+            free(path);
+        }
+    }
+
     if(runAsDaemon) {
         Daemonize();
     }
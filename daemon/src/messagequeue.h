@@ -11,30 +11,55 @@
 #ifndef _MESSAGE_QUEUE_H_
 #define _MESSAGE_QUEUE_H_
 
-#include <queue>
+#include <cstddef>
+#include <memory>
 #include <pthread.h>
 
+#include "util.h"
+#include "stoptoken.h"
 
+/*
+ * Blocking FIFO between the service threads. Items are kept in a ring allocated up front,
+ * so the queue does not touch the heap in steady state. A full ring is doubled, which keeps
+ * the queue unbounded like before at the cost of one allocation per growth.
+ */
 template<typename T>
 class MessageQueue
 {
     public:
-        using size_type = typename std::queue<T>::size_type;
+        using size_type = size_t;
 
-        explicit MessageQueue();
+        explicit MessageQueue(size_type capacity = MESSAGE_QUEUE_CAPACITY);
         MessageQueue(const MessageQueue<T>&) = delete;
         MessageQueue<T>& operator=(const MessageQueue<T>&) = delete;
         ~MessageQueue();
 
         void Enqueue(const T& item);
+        /* Items stay adjacent, a single consumer dequeues them in one run */
+        void EnqueueBatch(const T* items, size_type n);
         T Dequeue();
+        /* Waits for an item until the stop is requested, false then */
+        bool Dequeue(T& item, const StopToken& stop);
         void Clear();
         bool Empty();
+        /* Waits until the consumers took every item, false when the CLOCK_MONOTONIC deadline came first */
+        bool WaitEmpty(uint64_t deadlineNs);
+
+        /* StopToken waker of the threads waiting in Dequeue */
+        static void Wake(void* queue);
 
     private:
-        std::queue<T> queue;
+        /* Called with queueMutex held */
+        void Grow();
+
+        std::unique_ptr<T[]> ring;
+        size_type capacity;
+        size_type head;
+        size_type count;
+
         pthread_mutex_t queueMutex;
         pthread_cond_t  queueCond;
+        pthread_cond_t  emptyCond;
 };
 
 #include "messagequeue.th"
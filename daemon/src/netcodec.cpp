@@ -0,0 +1,187 @@
+/*
+ * netcodec.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <arpa/inet.h>
+
+#include "netcodec.h"
+
+namespace RoverNet
+{
+    Message HostToNet(Message src)
+    {
+        switch(src.msgType) {
+            case CMD_SET_LEFT_WHEEL_SPEED:
+            case CMD_SET_RIGHT_WHEEL_SPEED:
+            case CMD_SET_WHEELS_SPEED:
+            case MSG_WHEELS_STATE:
+                src.data.wheelsState.leftWheelSpeed = htons(src.data.wheelsState.leftWheelSpeed);
+                src.data.wheelsState.rightWheelSpeed = htons(src.data.wheelsState.rightWheelSpeed);
+                src.data.wheelsState.wheelMaxSpeed = htons(src.data.wheelsState.wheelMaxSpeed);
+                src.data.wheelsState.wheelMinSpeed = htons(src.data.wheelsState.wheelMinSpeed);
+                break;
+            case MSG_DISTANCE:
+                src.data.distance.distanceCM = htonl(src.data.distance.distanceCM);
+                src.data.distance.velocityCmS = htons(src.data.distance.velocityCmS);
+                break;
+            case MSG_REFLEX:
+                src.data.reflex.distanceCM = htonl(src.data.reflex.distanceCM);
+                break;
+            case MSG_VID_STREAM_PORT:
+                src.data.videoStreamPort.port = htons(src.data.videoStreamPort.port);
+                break;
+            case TIMESTAMP:
+                src.data.timestamp.high = htonl(src.data.timestamp.high);
+                src.data.timestamp.low = htonl(src.data.timestamp.low);
+                break;
+            case REQ_TIME_SYNC:
+            case MSG_TIME_SYNC:
+                src.data.timeSync.sequence = htonl(src.data.timeSync.sequence);
+                src.data.timeSync.holdNs = htonl(src.data.timeSync.holdNs);
+                break;
+            case CORRELATION_ID:
+                src.data.correlationId.id = htonl(src.data.correlationId.id);
+                break;
+            case CMD_RAMP_WHEELS_SPEED:
+                src.data.wheelsRamp.leftWheelSpeed = htons(src.data.wheelsRamp.leftWheelSpeed);
+                src.data.wheelsRamp.rightWheelSpeed = htons(src.data.wheelsRamp.rightWheelSpeed);
+                src.data.wheelsRamp.acceleration = htons(src.data.wheelsRamp.acceleration);
+                break;
+            case CMD_HEARTBEAT:
+                src.data.heartbeat.deadlineMs = htonl(src.data.heartbeat.deadlineMs);
+                break;
+            case MSG_DEADMAN:
+                src.data.deadman.silenceMs = htonl(src.data.deadman.silenceMs);
+                src.data.deadman.deadlineMs = htonl(src.data.deadman.deadlineMs);
+                break;
+            case REQ_HISTORY:
+                src.data.historyRequest.spanMs = htonl(src.data.historyRequest.spanMs);
+                src.data.historyRequest.resolutionMs = htons(src.data.historyRequest.resolutionMs);
+                break;
+            case MSG_HISTORY:
+                src.data.history.resolutionMs = htonl(src.data.history.resolutionMs);
+                src.data.history.bins = htons(src.data.history.bins);
+                break;
+            case HISTORY_POINT:
+                for(int16_t& v : src.data.historyPoint.values) v = htons(v);
+                break;
+            case TRAJECTORY_POINT:
+                src.data.trajectoryPoint.offsetUs = htonl(src.data.trajectoryPoint.offsetUs);
+                src.data.trajectoryPoint.leftWheelSpeed = htons(src.data.trajectoryPoint.leftWheelSpeed);
+                src.data.trajectoryPoint.rightWheelSpeed = htons(src.data.trajectoryPoint.rightWheelSpeed);
+                break;
+            default:
+                // no action needed
+                break;
+        }
+        return src;
+    }
+
+    Message NetToHost(Message src)
+    {
+        switch(src.msgType) {
+            case CMD_SET_LEFT_WHEEL_SPEED:
+            case CMD_SET_RIGHT_WHEEL_SPEED:
+            case CMD_SET_WHEELS_SPEED:
+            case MSG_WHEELS_STATE:
+                src.data.wheelsState.leftWheelSpeed = ntohs(src.data.wheelsState.leftWheelSpeed);
+                src.data.wheelsState.rightWheelSpeed = ntohs(src.data.wheelsState.rightWheelSpeed);
+                src.data.wheelsState.wheelMaxSpeed = ntohs(src.data.wheelsState.wheelMaxSpeed);
+                src.data.wheelsState.wheelMinSpeed = ntohs(src.data.wheelsState.wheelMinSpeed);
+                break;
+            case MSG_DISTANCE:
+                src.data.distance.distanceCM = ntohl(src.data.distance.distanceCM);
+                src.data.distance.velocityCmS = ntohs(src.data.distance.velocityCmS);
+                break;
+            case MSG_REFLEX:
+                src.data.reflex.distanceCM = ntohl(src.data.reflex.distanceCM);
+                break;
+            case MSG_VID_STREAM_PORT:
+                src.data.videoStreamPort.port = ntohs(src.data.videoStreamPort.port);
+                break;
+            case TIMESTAMP:
+                src.data.timestamp.high = ntohl(src.data.timestamp.high);
+                src.data.timestamp.low = ntohl(src.data.timestamp.low);
+                break;
+            case REQ_TIME_SYNC:
+            case MSG_TIME_SYNC:
+                src.data.timeSync.sequence = ntohl(src.data.timeSync.sequence);
+                src.data.timeSync.holdNs = ntohl(src.data.timeSync.holdNs);
+                break;
+            case CORRELATION_ID:
+                src.data.correlationId.id = ntohl(src.data.correlationId.id);
+                break;
+            case CMD_RAMP_WHEELS_SPEED:
+                src.data.wheelsRamp.leftWheelSpeed = ntohs(src.data.wheelsRamp.leftWheelSpeed);
+                src.data.wheelsRamp.rightWheelSpeed = ntohs(src.data.wheelsRamp.rightWheelSpeed);
+                src.data.wheelsRamp.acceleration = ntohs(src.data.wheelsRamp.acceleration);
+                break;
+            case CMD_HEARTBEAT:
+                src.data.heartbeat.deadlineMs = ntohl(src.data.heartbeat.deadlineMs);
+                break;
+            case MSG_DEADMAN:
+                src.data.deadman.silenceMs = ntohl(src.data.deadman.silenceMs);
+                src.data.deadman.deadlineMs = ntohl(src.data.deadman.deadlineMs);
+                break;
+            case REQ_HISTORY:
+                src.data.historyRequest.spanMs = ntohl(src.data.historyRequest.spanMs);
+                src.data.historyRequest.resolutionMs = ntohs(src.data.historyRequest.resolutionMs);
+                break;
+            case MSG_HISTORY:
+                src.data.history.resolutionMs = ntohl(src.data.history.resolutionMs);
+                src.data.history.bins = ntohs(src.data.history.bins);
+                break;
+            case HISTORY_POINT:
+                for(int16_t& v : src.data.historyPoint.values) v = ntohs(v);
+                break;
+            case TRAJECTORY_POINT:
+                src.data.trajectoryPoint.offsetUs = ntohl(src.data.trajectoryPoint.offsetUs);
+                src.data.trajectoryPoint.leftWheelSpeed = ntohs(src.data.trajectoryPoint.leftWheelSpeed);
+                src.data.trajectoryPoint.rightWheelSpeed = ntohs(src.data.trajectoryPoint.rightWheelSpeed);
+                break;
+            default:
+                // no action needed
+                break;
+        }
+        return src;
+    }
+
+    const char* MessageTypeName(uint8_t type)
+    {
+        switch(type) {
+            case INVALID: return "INVALID";
+            case CMD_SET_LEFT_WHEEL_SPEED: return "CMD_SET_LEFT_WHEEL_SPEED";
+            case CMD_SET_RIGHT_WHEEL_SPEED: return "CMD_SET_RIGHT_WHEEL_SPEED";
+            case CMD_SET_WHEELS_SPEED: return "CMD_SET_WHEELS_SPEED";
+            case CMD_STOP: return "CMD_STOP";
+            case CMD_TRAJECTORY: return "CMD_TRAJECTORY";
+            case TRAJECTORY_POINT: return "TRAJECTORY_POINT";
+            case CMD_RAMP_WHEELS_SPEED: return "CMD_RAMP_WHEELS_SPEED";
+            case CMD_HEARTBEAT: return "CMD_HEARTBEAT";
+            case REQ_WHEELS_STATE: return "REQ_WHEELS_STATE";
+            case REQ_DISTANCE: return "REQ_DISTANCE";
+            case REQ_VID_STREAM_PORT: return "REQ_VID_STREAM_PORT";
+            case REQ_TIME_SYNC: return "REQ_TIME_SYNC";
+            case REQ_HISTORY: return "REQ_HISTORY";
+            case MSG_WHEELS_STATE: return "MSG_WHEELS_STATE";
+            case MSG_DISTANCE: return "MSG_DISTANCE";
+            case MSG_VID_STREAM_PORT: return "MSG_VID_STREAM_PORT";
+            case MSG_DEV_AVAILABILITY: return "MSG_DEV_AVAILABILITY";
+            case MSG_TIME_SYNC: return "MSG_TIME_SYNC";
+            case MSG_REFLEX: return "MSG_REFLEX";
+            case MSG_HISTORY: return "MSG_HISTORY";
+            case HISTORY_POINT: return "HISTORY_POINT";
+            case MSG_DEADMAN: return "MSG_DEADMAN";
+            case TIMESTAMP: return "TIMESTAMP";
+            case CORRELATION_ID: return "CORRELATION_ID";
+            case BATCH: return "BATCH";
+            default: return nullptr;
+        }
+    }
+};
@@ -0,0 +1,52 @@
+/*
+ * netcodec.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _NET_CODEC_H_
+#define _NET_CODEC_H_
+
+#include <cstddef>
+#include <cstring>
+
+#include "nettypes.h"
+
+/*
+ * Conversion of Message between host and network byte order, shared by the daemon
+ * and the client tools
+ */
+namespace RoverNet
+{
+    Message HostToNet(Message src);
+    Message NetToHost(Message src);
+
+    /* Message in the MESSAGE_STRUCT_SIZE bytes of the wire format, the meta is left empty */
+    inline Message FromWire(const void* bytes)
+    {
+        const uint8_t* wire = static_cast<const uint8_t*>(bytes);
+        Message msg = {};
+        msg.msgType = static_cast<MessageType>(wire[offsetof(Message, msgType)]);
+        memcpy(&msg.data, wire + offsetof(Message, data), sizeof(msg.data));
+        return msg;
+    }
+
+    /* Name of the message type, nullptr for unknown types */
+    const char* MessageTypeName(uint8_t type);
+
+    inline uint64_t TimestampNs(const DataTimestamp& t)
+    {
+        return (static_cast<uint64_t>(t.high) << 32) | t.low;
+    }
+
+    inline DataTimestamp MakeTimestamp(uint64_t ns)
+    {
+        return { static_cast<uint32_t>(ns >> 32), static_cast<uint32_t>(ns) };
+    }
+};
+
+#endif /* _NET_CODEC_H_ */
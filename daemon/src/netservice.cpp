@@ -13,21 +13,109 @@
 #include <syslog.h>
 #include <signal.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <cxxabi.h>
+#include <algorithm>
 
 #include "netservice.h"
+#include "netcodec.h"
+#include "flightrecorder.h"
+#include "tracing.h"
 #include "util.h"
 #include "logging.h"
 
-//thread cleanup routines
 namespace {
-    void CleanupSocketProc(void *sock)
+    /* Sends the whole frame on the non-blocking socket, errno is ECANCELED when the stop came first */
+    bool SendFrame(int sock, const uint8_t* frame, size_t frameSize, StopToken& stop)
     {
-        int s = *(static_cast<int*>(sock));
-        *(static_cast<int*>(sock)) = -1;
-        if(0 != close(s)) THROW_RUNTIME();
+        size_t sent = 0;
+
+        while(sent < frameSize) {
+            ssize_t r = send(sock, frame + sent, frameSize - sent, MSG_NOSIGNAL);
+            if(r == -1) {
+                if(errno == EINTR) continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK) return false;
+                if(!stop.WaitFd(sock, POLLOUT)) {
+                    errno = ECANCELED;
+                    return false;
+                }
+                continue;
+            }
+            sent += r;
+        }
+        return true;
+    }
+
+    bool Batchable(uint8_t type)
+    {
+        switch(type) {
+            case RoverNet::CMD_SET_LEFT_WHEEL_SPEED:
+            case RoverNet::CMD_SET_RIGHT_WHEEL_SPEED:
+            case RoverNet::CMD_SET_WHEELS_SPEED:
+            case RoverNet::CMD_STOP:
+            case RoverNet::REQ_WHEELS_STATE:
+            case RoverNet::REQ_DISTANCE:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool TrajectoryMember(uint8_t type)
+    {
+        return type == RoverNet::TRAJECTORY_POINT;
+    }
+
+    /* Outgoing messages that head a group, the members are enqueued in one run after them */
+    unsigned GroupMembers(const RoverNet::Message& msg)
+    {
+        if(msg.msgType == RoverNet::BATCH) return msg.data.batch.count;
+        if(msg.msgType == RoverNet::MSG_HISTORY) return msg.data.history.count;
+        return 0;
+    }
+
+    constexpr unsigned GROUP_MAX_MEMBERS = BATCH_MAX_ITEMS > HISTORY_MAX_POINTS ? BATCH_MAX_ITEMS : HISTORY_MAX_POINTS;
+
+    /* Writes the prefixes of msg and msg to frame in network byte order, returns the bytes written */
+    size_t AppendMessage(uint8_t* frame, RoverNet::Message msg, bool timestamps)
+    {
+        using namespace RoverNet;
+        size_t frameSize = 0;
+
+        if(msg.msgType == MSG_TIME_SYNC) {
+            uint64_t hold = MonotonicNs() - msg.meta.timestampNs;
+            msg.data.timeSync.holdNs = hold > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(hold);
+        }
+
+        if(msg.meta.correlationId != 0) {
+            Message id;
+            id.msgType = CORRELATION_ID;
+            id.data.correlationId.id = msg.meta.correlationId;
+            id.data.correlationId.reserved = 0;
+            id = HostToNet(id);
+            memcpy(frame, &id, MESSAGE_STRUCT_SIZE);
+            frameSize += MESSAGE_STRUCT_SIZE;
+        }
+
+        if(timestamps && msg.meta.timestampNs != 0) {
+            Message stamp;
+            stamp.msgType = TIMESTAMP;
+            stamp.data.timestamp = MakeTimestamp(msg.meta.timestampNs);
+            stamp = HostToNet(stamp);
+            memcpy(frame + frameSize, &stamp, MESSAGE_STRUCT_SIZE);
+            frameSize += MESSAGE_STRUCT_SIZE;
+        }
+
+        msg = HostToNet(msg);
+        memcpy(frame + frameSize, &msg, MESSAGE_STRUCT_SIZE);
+        return frameSize + MESSAGE_STRUCT_SIZE;
     }
 };
 
@@ -35,13 +123,22 @@ namespace RoverNet
 {
     NetService::NetService(NetMsgQueueShrPtr incomingQueue, 
                            NetMsgQueueShrPtr outgoingQueue,
-                           const VideoStreamManager* const vidStreamMgr):
+                           const VideoStreamManager* const vidStreamMgr,
+                           TimerService* timers,
+                           const NetConfig& config):
+        config(config),
         inQueue(incomingQueue),
         outQueue(outgoingQueue),
+        servSocket(-1),
         videoStreamManager(vidStreamMgr),
-        clientConnectedSocket(-1)
+        timers(timers),
+        statusTimer(0),
+        bcastSocket(-1),
+        clientConnectedSocket(-1),
+        clientTimestamps(false)
     {
         PTHREAD_GUARD( pthread_mutex_init(&clientConnectedMutex, NULL) );
+        stop.Register(NetMsgQueue::Wake, outQueue.get());
     }
 
     NetService::~NetService()
@@ -49,141 +146,300 @@ namespace RoverNet
         pthread_mutex_destroy(&clientConnectedMutex);
     }
 
-    void NetService::Init()
+    void NetService::Init(const HandoffState* state)
     {
-        PTHREAD_GUARD( pthread_create(&threadDeviceStatus, NULL, ThreadDeviceStatusProcedure, this) );
-        PTHREAD_GUARD( pthread_create(&threadNetworkIncoming, NULL, ThreadNetworkIncomingProcedure, this) );
-        PTHREAD_GUARD( pthread_create(&threadNetworkOutgoing, NULL, ThreadNetworkOutgoingProcedure, this) );
+        int bcastEnable = 1;
+        bcastAddr.sin_family = AF_INET;
+        bcastAddr.sin_port = htons(SERVER_UDP_AVAL_BCAST_PORT);
+
+        if( 1 != inet_pton(AF_INET, SERVER_UDP_AVAL_BCAST_ADDR, &bcastAddr.sin_addr.s_addr)) THROW_RUNTIME();
+        if( -1 == (bcastSocket =  socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0))) THROW_RUNTIME();
+        if( -1 == setsockopt(bcastSocket, SOL_SOCKET, SO_BROADCAST, &bcastEnable, sizeof(bcastEnable))) THROW_RUNTIME();
+
+        if(state != nullptr) {
+            servSocket = state->serverSocket;
+            client.socket = state->clientSocket;
+            client.timestamps = state->timestamps;
+            client.nextTimestampNs = state->nextTimestampNs;
+            client.nextCorrelationId = state->nextCorrelationId;
+            memcpy(client.unit, state->pending, state->pendingBytes);
+            client.replayBytes = state->pendingBytes;
+            client.unitBytes = 0;
+
+            PTHREAD_GUARD( pthread_mutex_lock(&clientConnectedMutex) );
+            clientConnectedSocket = client.socket;
+            clientTimestamps = client.timestamps;
+            PTHREAD_GUARD( pthread_mutex_unlock(&clientConnectedMutex) );
+        }
+        else {
+/*
+ * NOTE: SO_REUSEADDR lets a restarted service bind while the previous connection is in TIME_WAIT
+ */
+            int reuse = 1;
+            sockaddr_in servAddr;
+            servAddr.sin_family = AF_INET;
+            servAddr.sin_port = htons(config.port);
+
+            if( 1 != inet_pton(AF_INET, config.address.c_str(), &servAddr.sin_addr.s_addr))
+                THROW_RUNTIME_MSG("invalid bind address %s", config.address.c_str());
+            if( -1 == (servSocket =  socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))) THROW_RUNTIME();
+            if( -1 == setsockopt(servSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))) THROW_RUNTIME();
+            if( 0 != bind(servSocket, reinterpret_cast<sockaddr*>(&servAddr), sizeof(servAddr))) THROW_RUNTIME();
+            if( 0 != listen(servSocket, 1)) THROW_RUNTIME();
+        }
+
+        statusTimer = timers->Create(BroadcastStatus, this);
+        timers->Arm(statusTimer, MonotonicNs(), NET_STATUS_BCAST_T_SEC * static_cast<uint64_t>(NSEC_PER_SEC));
+
+        CreateThread(&threadNetworkIncoming, config.threads, "rover-net-in", ThreadNetworkIncomingProcedure, this);
+        CreateThread(&threadNetworkOutgoing, config.threads, "rover-net-out", ThreadNetworkOutgoingProcedure, this);
     }
 
     void NetService::Stop()
     {
-/*
- * NOTE: since pthread_cancel will return either 0 or ESRCH which in both cases we do not care
- * therefore pthread_cancel does not have to be guarded
- */
-        pthread_cancel(threadDeviceStatus);
-        pthread_cancel(threadNetworkIncoming);
-        pthread_cancel(threadNetworkOutgoing);
+        inputStop.Request();
+        stop.Request();
 
-        PTHREAD_GUARD( pthread_join(threadDeviceStatus, NULL) );
         PTHREAD_GUARD( pthread_join(threadNetworkIncoming, NULL) );
         PTHREAD_GUARD( pthread_join(threadNetworkOutgoing, NULL) );
+
+        Release();
+
+        if(client.socket != -1) {
+            close(client.socket);
+            client.socket = -1;
+        }
+        if(servSocket != -1) {
+            close(servSocket);
+            servSocket = -1;
+        }
     }
 
-    void* NetService::ThreadDeviceStatusProcedure(void *arg)
+    void NetService::StopInput()
     {
-        NetService *netServ = static_cast<NetService*>(arg);
-        try {
+        inputStop.Request();
+        PTHREAD_GUARD( pthread_join(threadNetworkIncoming, NULL) );
+    }
 
-            int bcastSocket;
-            int bcastEnable = 1;
-            sockaddr_in bcastAddr;
-            bcastAddr.sin_family = AF_INET;
-            bcastAddr.sin_port = htons(SERVER_UDP_AVAL_BCAST_PORT);
+    void NetService::Freeze(HandoffState& state)
+    {
+/*
+ * NOTE: The responses to the requests answered before the freeze still go out
+ */
+        if(!outQueue->WaitEmpty(MonotonicNs() + HANDOFF_DRAIN_NS)) RLOG_WARNING("NetService", "responses not sent before the upgrade are dropped");
 
-            if( 1 != inet_pton(AF_INET, SERVER_UDP_AVAL_BCAST_ADDR, &bcastAddr.sin_addr.s_addr)) THROW_RUNTIME();
-            if( -1 == (bcastSocket =  socket(AF_INET, SOCK_DGRAM, 0))) THROW_RUNTIME();
-            if( -1 == setsockopt(bcastSocket, SOL_SOCKET, SO_BROADCAST, &bcastEnable, sizeof(bcastEnable))) THROW_RUNTIME();
+        stop.Request();
+        PTHREAD_GUARD( pthread_join(threadNetworkOutgoing, NULL) );
 
-            pthread_cleanup_push(CleanupSocketProc, &bcastSocket);
+        Release();
+
+        state.serverSocket = servSocket;
+        state.clientSocket = client.socket;
+        state.timestamps = client.timestamps;
+        state.nextTimestampNs = client.nextTimestampNs;
+        state.nextCorrelationId = client.nextCorrelationId;
+        state.pendingBytes = client.unitBytes;
+        memcpy(state.pending, client.unit, client.unitBytes);
+        servSocket = -1;
+        client.socket = -1;
+    }
 
-            
-            while(true) {
-                Message msg;
-                msg.msgType = MessageType::MSG_DEV_AVAILABILITY;
+    void NetService::Release()
+    {
+        outQueue->Clear();
 
-                PTHREAD_GUARD( pthread_mutex_lock(&(netServ->clientConnectedMutex)) );
+        if(statusTimer != 0) {
+            timers->Destroy(statusTimer);
+            statusTimer = 0;
+        }
+        if(bcastSocket != -1) {
+            close(bcastSocket);
+            bcastSocket = -1;
+        }
 
-                msg.data.deviceAvailability.availability = (netServ->clientConnectedSocket != -1) 
-                                                            ? DeviceAvailability::UNAVAILABLE 
-                                                            : DeviceAvailability::AVAILABLE;
+        PTHREAD_GUARD( pthread_mutex_lock(&clientConnectedMutex) );
+        clientConnectedSocket = -1;
+        PTHREAD_GUARD( pthread_mutex_unlock(&clientConnectedMutex) );
 
-                PTHREAD_GUARD( pthread_mutex_unlock(&(netServ->clientConnectedMutex)) );
+        inputStop.Reset();
+        stop.Reset();
+    }
 
-                msg = HostToNet(msg);
-                ssize_t ret;
-                ret = sendto(bcastSocket, &msg, MESSAGE_STRUCT_SIZE, 0,
-                             reinterpret_cast<sockaddr*>(&bcastAddr), sizeof(bcastAddr));
+    ssize_t NetService::RecvMessage(ClientStream& stream, Message& msg, StopToken& stop)
+    {
+        size_t start = stream.unitBytes;
+        size_t end = start + MESSAGE_STRUCT_SIZE;
 
-                if( -1 == ret){
-                    syslog(LOG_ERR, LOG_MSG_ERR("NetService"));
+        while(stream.unitBytes < end) {
+            if(stream.unitBytes < stream.replayBytes) {
+                stream.unitBytes = std::min(end, stream.replayBytes);
+                continue;
+            }
+
+            ssize_t r = recv(stream.socket, stream.unit + stream.unitBytes, end - stream.unitBytes, 0);
+            if(r == 0) return 0;
+            if(r == -1) {
+                if(errno == EINTR) continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+                if(!stop.WaitFd(stream.socket, POLLIN)) {
+                    errno = ECANCELED;
+                    return -1;
                 }
+                continue;
+            }
+            stream.unitBytes += r;
+        }
 
-                sleep(NET_STATUS_BCAST_T_SEC);
+        msg = FromWire(stream.unit + start);
+        return MESSAGE_STRUCT_SIZE;
+    }
+
+    bool NetService::RecvGroup(ClientStream& stream, StopToken& stop, Message* group, unsigned count,
+            unsigned maxCount, bool (*member)(uint8_t), bool& valid)
+    {
+        valid = count != 0 && count <= maxCount;
+
+        for(unsigned i = 1; i <= count; ++i) {
+            Message item;
+            ssize_t recvBytes = RecvMessage(stream, item, stop);
+            if(recvBytes != MESSAGE_STRUCT_SIZE) {
+                if(recvBytes == -1 && errno != ECANCELED) RLOG_ERRNO("NetService");
+                return false;
             }
 
-            pthread_cleanup_pop(1);
-        }
-        catch(const std::exception &e) {
-            syslog(LOG_ERR, LOG_EXCEPT("NetService", e));
-            kill(getpid(), SIGTERM);
-        }
-        catch(abi::__forced_unwind&) {
-            throw;
-        }
-        catch(...) {
-            syslog(LOG_ERR, LOG_MSG("NetService", "unknown exception"));
-            kill(getpid(), SIGTERM);
+            item = NetToHost(item);
+            item.meta = MessageMeta();
+            item.meta.traceId = Tracing::NewId();
+            item.meta.timestampNs = group[0].meta.timestampNs;
+            FlightRecorder::RecordMessage(FlightRecorder::REC_MSG_IN, item);
+
+            if(!member(item.msgType)) valid = false;
+            if(valid) group[i] = item;
         }
+        return true;
     }
 
-    void* NetService::ThreadNetworkIncomingProcedure(void *arg)
+    void NetService::BroadcastStatus(void* arg)
     {
         NetService *netServ = static_cast<NetService*>(arg);
-        try {
+        Message msg;
+        msg.msgType = MessageType::MSG_DEV_AVAILABILITY;
 
-            int servSocket;
-            sockaddr_in servAddr;
-            servAddr.sin_family = AF_INET;
-            servAddr.sin_port = htons(SERVER_TCP_PORT);
+        PTHREAD_GUARD( pthread_mutex_lock(&(netServ->clientConnectedMutex)) );
 
-            if( 1 != inet_pton(AF_INET, SERVER_IP4_ADDR, &servAddr.sin_addr.s_addr)) THROW_RUNTIME();
-            if( -1 == (servSocket =  socket(AF_INET, SOCK_STREAM, 0))) THROW_RUNTIME();
+        msg.data.deviceAvailability.availability = (netServ->clientConnectedSocket != -1) 
+                                                    ? DeviceAvailability::UNAVAILABLE 
+                                                    : DeviceAvailability::AVAILABLE;
 
-            pthread_cleanup_push(CleanupSocketProc, &servSocket);
+        PTHREAD_GUARD( pthread_mutex_unlock(&(netServ->clientConnectedMutex)) );
 
-            if( 0 != bind(servSocket, reinterpret_cast<sockaddr*>(&servAddr), sizeof(servAddr))) THROW_RUNTIME();
-            if( 0 != listen(servSocket, 1)) THROW_RUNTIME();
-            
+        msg = HostToNet(msg);
+        ssize_t ret;
+        ret = sendto(netServ->bcastSocket, &msg, MESSAGE_STRUCT_SIZE, 0,
+                     reinterpret_cast<sockaddr*>(&(netServ->bcastAddr)), sizeof(netServ->bcastAddr));
+
+        if( -1 == ret){
+            RLOG_ERRNO("NetService");
+        }
+    }
+
+    void* NetService::ThreadNetworkIncomingProcedure(void *arg)
+    {
+        NetService *netServ = static_cast<NetService*>(arg);
+        Tracing::RegisterThread("net incoming");
+        ClientStream& client = netServ->client;
+        try {
             while(true) {
-                int clientConnectedSocketLocal;
                 bool connectionPending = true;
                 Message msg;
                 ssize_t recvBytes;
+
+/*
+ * NOTE: A connection taken over from the previous daemon is served before accepting
+ */
+                if(client.socket == -1) {
+                    if(!netServ->inputStop.WaitFd(netServ->servSocket, POLLIN)) break;
 /*
  * TODO: Add logging of the client address that connected
  */
-                clientConnectedSocketLocal = accept(servSocket, NULL, NULL);
+                    int clientConnectedSocketLocal = accept4(netServ->servSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-                if( -1 == clientConnectedSocketLocal) {
-                    syslog(LOG_ERR, LOG_MSG_ERR("NetService"));
-                    continue; //continue to next teration if accept has failed
-                }
+                    if( -1 == clientConnectedSocketLocal) {
+                        /* The connection that woke the thread may be gone again */
+                        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+                            RLOG_ERRNO("NetService");
+                        continue; //continue to next teration if accept has failed
+                    }
 
-                pthread_cleanup_push(CleanupSocketProc, &clientConnectedSocketLocal);
-                PTHREAD_GUARD( pthread_mutex_lock(&(netServ->clientConnectedMutex)) );
-                netServ->clientConnectedSocket = clientConnectedSocketLocal;
-                PTHREAD_GUARD( pthread_mutex_unlock(&(netServ->clientConnectedMutex)) );
+/*
+ * NOTE: Commands are small and latency sensitive, they must not wait for Nagle coalescing
+ * nor queue behind the video stream which is marked for throughput
+ */
+                    int noDelay = 1;
+                    int tos = IPTOS_LOWDELAY;
+                    if( 0 != setsockopt(clientConnectedSocketLocal, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) ||
+                            0 != setsockopt(clientConnectedSocketLocal, IPPROTO_IP, IP_TOS, &tos, sizeof(tos))) {
+                        RLOG_WARNING("NetService", "control socket options: %m");
+                    }
+
+                    client.socket = clientConnectedSocketLocal;
+                    client.timestamps = false;
+                    client.nextTimestampNs = 0;
+                    client.nextCorrelationId = 0;
+                    client.unitBytes = 0;
+                    client.replayBytes = 0;
+
+                    PTHREAD_GUARD( pthread_mutex_lock(&(netServ->clientConnectedMutex)) );
+                    netServ->clientConnectedSocket = client.socket;
+                    netServ->clientTimestamps = false;
+                    PTHREAD_GUARD( pthread_mutex_unlock(&(netServ->clientConnectedMutex)) );
+                }
 
                 while(connectionPending){
-                    recvBytes = recv(clientConnectedSocketLocal, &msg, MESSAGE_STRUCT_SIZE, 0);
+                    /* A new unit starts, the bytes replayed from the previous daemon are used up once it completes */
+                    if(client.unitBytes >= client.replayBytes) client.replayBytes = 0;
+                    client.unitBytes = 0;
+
+                    recvBytes = RecvMessage(client, msg, netServ->inputStop);
                     if(recvBytes == MESSAGE_STRUCT_SIZE) {
+                        uint64_t receivedNs = MonotonicNs();
                         msg = NetToHost(msg);
+                        msg.meta = MessageMeta();
+                        msg.meta.traceId = Tracing::NewId();
+                        FlightRecorder::RecordMessage(FlightRecorder::REC_MSG_IN, msg);
+
+                        if(msg.msgType != TIMESTAMP && msg.msgType != CORRELATION_ID) {
+                            msg.meta.timestampNs = client.nextTimestampNs;
+                            msg.meta.correlationId = client.nextCorrelationId;
+                            client.nextTimestampNs = 0;
+                            client.nextCorrelationId = 0;
+                        }
+
+/*
+ * NOTE: A client that uses timestamps understands them, the responses are stamped from now on
+ */
+                        if(!client.timestamps && (msg.msgType == TIMESTAMP || msg.msgType == REQ_TIME_SYNC)) {
+                            client.timestamps = true;
+                            PTHREAD_GUARD( pthread_mutex_lock(&(netServ->clientConnectedMutex)) );
+                            netServ->clientTimestamps = true;
+                            PTHREAD_GUARD( pthread_mutex_unlock(&(netServ->clientConnectedMutex)) );
+                        }
+
                         switch(msg.msgType) {
                             case CMD_SET_LEFT_WHEEL_SPEED:
                             case CMD_SET_RIGHT_WHEEL_SPEED:
                             case CMD_SET_WHEELS_SPEED:
                             case CMD_STOP:
+                            case CMD_RAMP_WHEELS_SPEED:
+                            case CMD_HEARTBEAT:
                             case REQ_WHEELS_STATE:
                             case REQ_DISTANCE:
+                            case REQ_HISTORY:
+                                msg.meta.queuedNs = Tracing::Now();
                                 netServ->inQueue->Enqueue(msg);
                                 break;
                             case REQ_VID_STREAM_PORT:
                                 {
-/*
- * TODO: review since this might need to be secured by mutex, for now just keep it going unsecured
- */
                                     bool running = netServ->videoStreamManager->Running();
                                     uint16_t port = 0;
                                     if(running) {
@@ -193,26 +449,97 @@ namespace RoverNet
                                     response.msgType = MSG_VID_STREAM_PORT;
                                     response.data.videoStreamPort.running = running;
                                     response.data.videoStreamPort.port = port;
+                                    response.meta.correlationId = msg.meta.correlationId;
+                                    response.meta.traceId = msg.meta.traceId;
+                                    response.meta.queuedNs = Tracing::Now();
                                     netServ->outQueue->Enqueue(response);
                                 }
                                 break;
-                            default:
+                            case REQ_TIME_SYNC:
+                                {
+                                    Message response;
+                                    response.msgType = MSG_TIME_SYNC;
+                                    response.data.timeSync.sequence = msg.data.timeSync.sequence;
+                                    response.data.timeSync.holdNs = 0;
+                                    response.meta.correlationId = msg.meta.correlationId;
+                                    response.meta.traceId = msg.meta.traceId;
+                                    response.meta.queuedNs = Tracing::Now();
+                                    response.meta.timestampNs = receivedNs;
+                                    netServ->outQueue->Enqueue(response);
+                                }
+                                break;
+                            case TIMESTAMP:
+                                client.nextTimestampNs = TimestampNs(msg.data.timestamp);
+                                break;
+                            case CORRELATION_ID:
+                                client.nextCorrelationId = msg.data.correlationId.id;
+                                break;
+                            case BATCH:
                                 {
-                                    std::stringstream ss;
-                                    ss << "NetService: Unsupported message received " << msg.msgType;
-                                    syslog(LOG_ERR, LOG_MSG("NetService", ss.str().c_str()));
+                                    Message batch[BATCH_MAX_ITEMS + 1];
+                                    unsigned count = msg.data.batch.count;
+                                    bool valid;
+                                    batch[0] = msg;
+
+                                    if(!RecvGroup(client, netServ->inputStop, batch, count, BATCH_MAX_ITEMS, Batchable, valid)) {
+                                        connectionPending = false;
+                                        break;
+                                    }
+                                    if(!valid) {
+                                        RLOG_ERR("NetService", "invalid batch of %u messages discarded", count);
+                                        break;
+                                    }
+
+                                    uint64_t queuedNs = Tracing::Now();
+                                    for(unsigned i = 0; i <= count; ++i) batch[i].meta.queuedNs = queuedNs;
+                                    netServ->inQueue->EnqueueBatch(batch, count + 1);
                                 }
+                                break;
+                            case CMD_TRAJECTORY:
+                                {
+                                    Message trajectory[TRAJECTORY_MAX_POINTS + 1];
+                                    unsigned count = msg.data.trajectory.count;
+                                    bool valid;
+                                    trajectory[0] = msg;
+
+                                    if(!RecvGroup(client, netServ->inputStop, trajectory, count, TRAJECTORY_MAX_POINTS,
+                                                TrajectoryMember, valid)) {
+                                        connectionPending = false;
+                                        break;
+                                    }
+                                    for(unsigned i = 2; valid && i <= count; ++i) {
+                                        if(trajectory[i].data.trajectoryPoint.offsetUs < trajectory[i - 1].data.trajectoryPoint.offsetUs)
+                                            valid = false;
+                                    }
+                                    if(!valid) {
+                                        RLOG_ERR("NetService", "invalid trajectory of %u points discarded", count);
+                                        break;
+                                    }
+
+                                    uint64_t queuedNs = Tracing::Now();
+                                    for(unsigned i = 0; i <= count; ++i) trajectory[i].meta.queuedNs = queuedNs;
+                                    netServ->inQueue->EnqueueBatch(trajectory, count + 1);
+                                }
+                                break;
+                            default:
+                                RLOG_ERR("NetService", "Unsupported message received 0x%02x", msg.msgType);
                         }
+                        if(Tracing::Enabled()) Tracing::Span(Tracing::SPAN_RECV, msg.meta.traceId, msg.msgType, receivedNs, MonotonicNs());
                     } else if (recvBytes == 0) {
                         /* EOF, Other end has closed connection */
                         connectionPending = false;
                     } else { 
-                        /* -1 case for SOCKET_STREAM, Error occured */
-                        syslog(LOG_ERR, LOG_MSG_ERR("NetService"));
+                        /* -1 case for SOCKET_STREAM, Error occured or the service stops */
+                        if(errno != ECANCELED) RLOG_ERRNO("NetService");
                         connectionPending = false;
                     }
                 }
 
+/*
+ * NOTE: On a stop the connection stays open, Stop closes it and Freeze hands it over
+ */
+                if(netServ->inputStop.Requested()) break;
+
                 PTHREAD_GUARD( pthread_mutex_lock(&(netServ->clientConnectedMutex)) );
 
                 netServ->clientConnectedSocket = -1;
@@ -220,22 +547,23 @@ namespace RoverNet
                 PTHREAD_GUARD( pthread_mutex_unlock(&(netServ->clientConnectedMutex)) );
 
                 /* Closes the connection socket that originated from accept call */
-                pthread_cleanup_pop(1);
+                close(client.socket);
+                client.socket = -1;
             }
-
-            pthread_cleanup_pop(0);
         }
         catch(const std::exception &e) {
-            syslog(LOG_ERR, LOG_EXCEPT("NetService", e));
+            RLOG_EXCEPT("NetService", e);
             kill(getpid(), SIGTERM);
         }
         catch(abi::__forced_unwind&) {
             throw;
         }
         catch(...) {
-            syslog(LOG_ERR, LOG_MSG("NetService", "unknown exception"));
+            RLOG_ERR("NetService", "unknown exception");
             kill(getpid(), SIGTERM);
         }
+
+        return nullptr;
     }
 
 /*
@@ -246,92 +574,68 @@ namespace RoverNet
     void* NetService::ThreadNetworkOutgoingProcedure(void *arg)
     {
         NetService *netServ = static_cast<NetService*>(arg);
+        Tracing::RegisterThread("net outgoing");
         try {
-            bool clientConnectedSocketLocal;
-            while(true) {
+            int clientConnectedSocketLocal;
+            bool timestamps;
+            Message msg;
 /*
  * NOTE: Dequeue will put thread to sleep waiting for new messages to arrive
  */
-                Message msg = netServ->outQueue->Dequeue();
+            while(netServ->outQueue->Dequeue(msg, netServ->stop)) {
+                uint64_t dequeuedNs = Tracing::Now();
+
+/*
+ * NOTE: A response batch or history is enqueued in one run, its members follow the header
+ */
+                Message batch[GROUP_MAX_MEMBERS + 1];
+                unsigned count = 1;
+                batch[0] = msg;
+                unsigned members = GroupMembers(msg);
+                for(unsigned i = 0; i < members; ++i) batch[count++] = netServ->outQueue->Dequeue();
+
+                for(unsigned i = 0; i < count; ++i) {
+                    Tracing::Span(Tracing::SPAN_OUT_QUEUE, batch[i].meta.traceId, batch[i].msgType, batch[i].meta.queuedNs, dequeuedNs);
+                    FlightRecorder::RecordMessage(FlightRecorder::REC_MSG_OUT, batch[i]);
+                }
 
                 PTHREAD_GUARD( pthread_mutex_lock(&(netServ->clientConnectedMutex)) );
                 clientConnectedSocketLocal = netServ->clientConnectedSocket;
+                timestamps = netServ->clientTimestamps;
                 PTHREAD_GUARD( pthread_mutex_unlock(&(netServ->clientConnectedMutex)) );
 
                 if(-1 == clientConnectedSocketLocal) {
-                    syslog(LOG_NOTICE, LOG_MSG("NetService","Client not connected, discard outgoing message"));
+                    RLOG_DEBUG("NetService", "Client not connected, discard outgoing message");
                 }
                 else {
-                    msg = HostToNet(msg);
-                    ssize_t ret;
-                    ret = send(clientConnectedSocketLocal, &msg, MESSAGE_STRUCT_SIZE, 0);
-
-                    if( -1 == ret){
-                        syslog(LOG_ERR, LOG_MSG_ERR("NetService"));
+                    /* Prefixes and the messages go out in one segment */
+                    uint8_t frame[(GROUP_MAX_MEMBERS + 1) * 3 * MESSAGE_STRUCT_SIZE];
+                    size_t frameSize = 0;
+                    for(unsigned i = 0; i < count; ++i) frameSize += AppendMessage(frame + frameSize, batch[i], timestamps);
+
+                    if(!SendFrame(clientConnectedSocketLocal, frame, frameSize, netServ->stop)) {
+                        if(errno == ECANCELED) break;
+                        RLOG_ERRNO("NetService");
                     }
+
+                    uint64_t sentNs = Tracing::Now();
+                    for(unsigned i = 0; i < count; ++i)
+                        Tracing::Span(Tracing::SPAN_REPLY_SEND, batch[i].meta.traceId, batch[i].msgType, dequeuedNs, sentNs);
                 }
             }
         }
         catch(const std::exception &e) {
-            syslog(LOG_ERR, LOG_EXCEPT("NetService", e));
+            RLOG_EXCEPT("NetService", e);
             kill(getpid(), SIGTERM);
         }
         catch(abi::__forced_unwind&) {
             throw;
         }
         catch(...) {
-            syslog(LOG_ERR, LOG_MSG("NetService", "unknown exception"));
+            RLOG_ERR("NetService", "unknown exception");
             kill(getpid(), SIGTERM);
         }
-    }
 
-    Message NetService::HostToNet(Message src)
-    {
-        switch(src.msgType) {
-            case CMD_SET_LEFT_WHEEL_SPEED:
-            case CMD_SET_RIGHT_WHEEL_SPEED:
-            case CMD_SET_WHEELS_SPEED:
-            case MSG_WHEELS_STATE:
-                src.data.wheelsState.leftWheelSpeed = htons(src.data.wheelsState.leftWheelSpeed);
-                src.data.wheelsState.rightWheelSpeed = htons(src.data.wheelsState.rightWheelSpeed);
-                src.data.wheelsState.wheelMaxSpeed = htons(src.data.wheelsState.wheelMaxSpeed);
-                src.data.wheelsState.wheelMinSpeed = htons(src.data.wheelsState.wheelMinSpeed);
-                break;
-            case MSG_DISTANCE:
-                src.data.distance.distanceCM = htonl(src.data.distance.distanceCM);
-                break;
-            case MSG_VID_STREAM_PORT:
-                src.data.videoStreamPort.port = htonl(src.data.videoStreamPort.port);
-                break;
-            default:
-                // no action needed
-                break;
-        }
-        return src;
-    }
-
-    Message NetService::NetToHost(Message src)
-    {
-        switch(src.msgType) {
-            case CMD_SET_LEFT_WHEEL_SPEED:
-            case CMD_SET_RIGHT_WHEEL_SPEED:
-            case CMD_SET_WHEELS_SPEED:
-            case MSG_WHEELS_STATE:
-                src.data.wheelsState.leftWheelSpeed = ntohs(src.data.wheelsState.leftWheelSpeed);
-                src.data.wheelsState.rightWheelSpeed = ntohs(src.data.wheelsState.rightWheelSpeed);
-                src.data.wheelsState.wheelMaxSpeed = ntohs(src.data.wheelsState.wheelMaxSpeed);
-                src.data.wheelsState.wheelMinSpeed = ntohs(src.data.wheelsState.wheelMinSpeed);
-                break;
-            case MSG_DISTANCE:
-                src.data.distance.distanceCM = ntohl(src.data.distance.distanceCM);
-                break;
-            case MSG_VID_STREAM_PORT:
-                src.data.videoStreamPort.port = ntohl(src.data.videoStreamPort.port);
-                break;
-            default:
-                // no action needed
-                break;
-        }
-        return src;
+        return nullptr;
     }
 };
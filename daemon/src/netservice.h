@@ -11,48 +11,133 @@
 #ifndef _NET_SERVICE_H_
 #define _NET_SERVICE_H_
 
+#include <string>
 #include <pthread.h>
+#include <netinet/in.h>
 
+#include "util.h"
 #include "nettypes.h"
 #include "videostreammanager.h"
+#include "threadconfig.h"
+#include "timerservice.h"
+#include "stoptoken.h"
 
 
 namespace RoverNet
 {
+    struct NetConfig
+    {
+        /* IPv4 address and port the control connection is accepted on */
+        std::string address = SERVER_IP4_ADDR;
+        uint16_t port = SERVER_TCP_PORT;
+        /* Control connection */
+        ThreadAttributes threads;
+    };
+
     class NetService
     {
         public:
             explicit NetService(NetMsgQueueShrPtr incomingQueue,
                     NetMsgQueueShrPtr outgoingQueue, 
-                    const VideoStreamManager* const vidStreamMgr);
+                    const VideoStreamManager* const vidStreamMgr,
+                    TimerService* timers,
+                    const NetConfig& config = NetConfig());
             NetService(const NetService&) = delete;
             NetService& operator=(const NetService&) = delete;
             ~NetService();
 
-            void Init();
+            /* Received bytes of the message or group in progress, the longest is a group of 255 */
+            static constexpr size_t UNIT_MAX_BYTES = (1 + UINT8_MAX) * MESSAGE_STRUCT_SIZE;
+
+            /* Connection handed to the next daemon by a hot upgrade, the sockets travel with it */
+            struct HandoffState
+            {
+                int serverSocket;
+                /* -1 when no client is connected */
+                int clientSocket;
+                bool timestamps;
+                uint64_t nextTimestampNs;
+                uint32_t nextCorrelationId;
+                uint32_t pendingBytes;
+                uint8_t pending[UNIT_MAX_BYTES];
+            };
+
+            /* Continues on the sockets of the previous daemon when state is given */
+            void Init(const HandoffState* state = nullptr);
             void Stop();
+            /* Stops reading the client, the first step of a hot upgrade */
+            void StopInput();
+            /* Sends the queued responses and stops, the sockets are moved to state */
+            void Freeze(HandoffState& state);
 
         private:
+            NetConfig config;
             NetMsgQueueShrPtr inQueue;
             NetMsgQueueShrPtr outQueue;
 
-            pthread_t threadDeviceStatus;
             pthread_t threadNetworkIncoming;
             pthread_t threadNetworkOutgoing;
 
-            static void* ThreadDeviceStatusProcedure(void *arg);
             static void* ThreadNetworkIncomingProcedure(void *arg);
             static void* ThreadNetworkOutgoingProcedure(void *arg);
 
+/*
+ * Ends the threads, the client is disconnected and the responses not sent yet are dropped.
+ * The listening socket is opened by Init so that a failing bind is reported to the caller.
+ * The incoming thread has its own token so that a hot upgrade can stop it first.
+ */
+            StopToken inputStop;
+            StopToken stop;
+            int servSocket;
+            /* Drops the queued responses and closes the broadcast, the threads must have ended */
+            void Release();
+
+/*
+ * Receive side of the connection, used by the incoming thread only. The bytes of the message
+ * or group in progress are kept in unit, the first replayBytes of it came from the previous
+ * daemon and are parsed before reading the socket.
+ */
+            struct ClientStream
+            {
+                int socket = -1;
+                bool timestamps = false;
+                uint64_t nextTimestampNs = 0;
+                uint32_t nextCorrelationId = 0;
+                uint8_t unit[UNIT_MAX_BYTES];
+                size_t unitBytes = 0;
+                size_t replayBytes = 0;
+            };
+            ClientStream client;
+
+/*
+ * Reads the next message of the unit. A short read is continued, -1 with ECANCELED is
+ * returned when the stop comes first.
+ */
+            static ssize_t RecvMessage(ClientStream& stream, Message& msg, StopToken& stop);
+/*
+ * Reads the members that follow the header in group[0] into group[1..count], member tells
+ * which messages may follow it. The members are read off the stream even when the group is
+ * invalid, so the stream stays in step with the client. Returns false when the connection
+ * is gone, valid is false when the group has to be discarded.
+ */
+            static bool RecvGroup(ClientStream& stream, StopToken& stop, Message* group, unsigned count,
+                    unsigned maxCount, bool (*member)(uint8_t), bool& valid);
+
             /* NetService does not hold ownership iver this pointer */
             const VideoStreamManager* const videoStreamManager;
 
+            /* Availability broadcast every NET_STATUS_BCAST_T_SEC, NetService does not own the timers */
+            static void BroadcastStatus(void* arg);
+            TimerService* const timers;
+            TimerService::Handle statusTimer;
+            int bcastSocket;
+            sockaddr_in bcastAddr;
+
             /* -1 if disconnected, connected otherwise */
             int clientConnectedSocket;
+            /* Client sent TIMESTAMP or REQ_TIME_SYNC, responses are preceded by TIMESTAMP */
+            bool clientTimestamps;
             pthread_mutex_t clientConnectedMutex;
-
-            static Message HostToNet(Message src);
-            static Message NetToHost(Message src);
     };
 };
 
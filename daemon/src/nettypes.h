@@ -12,6 +12,7 @@
 #define _NET_TYPES_H_
 
 #include <cstdint>
+#include <cstddef>
 #include <memory>
 #include "messagequeue.h"
 
@@ -25,15 +26,30 @@ namespace RoverNet
         CMD_SET_RIGHT_WHEEL_SPEED = 0x02,
         CMD_SET_WHEELS_SPEED = 0x03,
         CMD_STOP = 0x04,
+        CMD_TRAJECTORY = 0x05,
+        TRAJECTORY_POINT = 0x06,
+        CMD_RAMP_WHEELS_SPEED = 0x07,
+        CMD_HEARTBEAT = 0x08,
 
         REQ_WHEELS_STATE = 0x11,
         REQ_DISTANCE = 0x12,
         REQ_VID_STREAM_PORT = 0x13,
+        REQ_TIME_SYNC = 0x14,
+        REQ_HISTORY = 0x15,
 
         MSG_WHEELS_STATE = 0x21,
         MSG_DISTANCE = 0x22,
         MSG_VID_STREAM_PORT = 0x23,
-        MSG_DEV_AVAILABILITY = 0x24
+        MSG_DEV_AVAILABILITY = 0x24,
+        MSG_TIME_SYNC = 0x25,
+        MSG_REFLEX = 0x26,
+        MSG_HISTORY = 0x27,
+        HISTORY_POINT = 0x28,
+        MSG_DEADMAN = 0x29,
+
+        TIMESTAMP = 0x30,
+        CORRELATION_ID = 0x31,
+        BATCH = 0x32
     };
 
     enum DeviceAvailability : uint8_t
@@ -50,9 +66,32 @@ namespace RoverNet
         int16_t wheelMinSpeed;
     };
 
+/*
+ * REQ_DISTANCE may ask for a filtered reading, a request of zeroes gets the raw sample.
+ * MSG_DISTANCE tells which filter the reading went through, the median and the estimate
+ * fall back to the raw sample until the daemon has seen enough samples. The estimate
+ * carries the rate of change of the distance, 0 otherwise. The daemon filters the samples
+ * it reads, they are dense when the daemon samples continuously and as sparse as the
+ * requests otherwise.
+ */
+    enum DistanceFilterMode : uint8_t
+    {
+        DIST_RAW = 0x0,
+        DIST_MEDIAN = 0x1,
+        DIST_ESTIMATE = 0x2
+    };
+
+    struct DataDistanceRequest
+    {
+        uint8_t filter;
+    };
+
     struct DataDistance
     {
         int32_t distanceCM;
+        /* Negative when approaching */
+        int16_t velocityCmS;
+        uint8_t filter;
     };
 
     struct DataVideoStreamPort
@@ -66,6 +105,181 @@ namespace RoverNet
         uint8_t availability;
     };
 
+/*
+ * MSG_REFLEX is sent unsolicited when the obstacle reflex engages (active 1) and releases
+ * (active 0), with the filtered distance that caused it. While the reflex is engaged the
+ * daemon clamps both wheel speeds to zero or below, reversing away stays possible. The
+ * TIMESTAMP of the message is the time of the sample.
+ */
+    struct DataReflex
+    {
+        int32_t distanceCM;
+        uint8_t active;
+    };
+
+/*
+ * CMD_TRAJECTORY is followed by count TRAJECTORY_POINT messages, 1 to TRAJECTORY_MAX_POINTS,
+ * with non decreasing offsets. The daemon sets the wheel speeds of each point at its offset
+ * from the time the trajectory was dispatched, the last speeds stay set when it ends.
+ * Any wheel speed command, CMD_STOP or a new trajectory ends a running trajectory.
+ * A TIMESTAMP sent before CMD_TRAJECTORY makes a late trajectory stale as a whole.
+ */
+    struct DataTrajectory
+    {
+        uint8_t count;
+    };
+
+    struct DataTrajectoryPoint
+    {
+        uint32_t offsetUs;
+        int16_t leftWheelSpeed;
+        int16_t rightWheelSpeed;
+    };
+
+/*
+ * CMD_RAMP_WHEELS_SPEED moves the wheels from their current speeds to the target speeds with
+ * setpoints generated by the daemon at its control rate. Both wheels arrive together, so the
+ * wheel with the larger change accelerates at acceleration (speed units per second, 0 selects
+ * the daemon default) and the ratio of the wheel speeds changes smoothly. Only changed speeds
+ * are sent to the device. A ramp is a motion like a trajectory and is ended the same way.
+ */
+    struct DataWheelsRamp
+    {
+        int16_t leftWheelSpeed;
+        int16_t rightWheelSpeed;
+        uint16_t acceleration;
+    };
+
+/*
+ * Deadman: with a deadline set the wheels are stopped when no command or CMD_HEARTBEAT
+ * arrives within it. CMD_HEARTBEAT keeps the current setpoint and sets the deadline for
+ * the connection, 0 keeps the daemon default (which may be off). The stop is reported by an
+ * unsolicited MSG_DEADMAN with the time since the last command. The watchdog stays off after
+ * a stop until the next command or heartbeat.
+ */
+    struct DataHeartbeat
+    {
+        uint32_t deadlineMs;
+    };
+
+    struct DataDeadman
+    {
+        uint32_t silenceMs;
+        uint32_t deadlineMs;
+    };
+
+/*
+ * REQ_HISTORY asks for the last spanMs of a series in bins of resolutionMs, 0 lets the daemon
+ * choose. The daemon coarsens the resolution to fit the bins in one response, so a bin may be
+ * wider than asked. The answer is MSG_HISTORY followed by count HISTORY_POINT messages, sent
+ * as one frame. The points carry the bins oldest first, four values per point:
+ *  HIST_DISTANCE   the mean distance in cm of each bin, four bins per point
+ *  HIST_WHEELS     left and right wheel setpoint in effect at the end of each bin, two bins per point
+ * A bin without data holds HISTORY_NO_DATA. The last bin ends when the request was answered,
+ * the TIMESTAMP of MSG_HISTORY is that time. The daemon keeps the samples of the last minute
+ * or so, then one second buckets for an hour and one minute buckets for a day.
+ */
+    enum HistorySeries : uint8_t
+    {
+        HIST_DISTANCE = 0x0,
+        HIST_WHEELS = 0x1
+    };
+
+    constexpr int16_t HISTORY_NO_DATA = INT16_MIN;
+
+    struct DataHistoryRequest
+    {
+        uint32_t spanMs;
+        uint16_t resolutionMs;
+        uint8_t series;
+    };
+
+    struct DataHistory
+    {
+        uint32_t resolutionMs;
+        uint16_t bins;
+        uint8_t series;
+        uint8_t count;
+    };
+
+    struct DataHistoryPoint
+    {
+        int16_t values[4];
+    };
+
+/*
+ * TIMESTAMP and CORRELATION_ID are prefixes, a prefix applies to the next message in the same
+ * direction that is not a prefix. Both are optional and a client that never sends them gets
+ * the plain message stream.
+ *
+ * Timestamps: TIMESTAMP carries nanoseconds of the daemon CLOCK_MONOTONIC split into two words:
+ *  - client to daemon, the time the next command was sent, converted to the daemon clock
+ *    with the offset estimated by the REQ_TIME_SYNC exchange. Wheel speed commands older
+ *    than the configured age are dropped, CMD_STOP is always applied.
+ *  - daemon to client, the time MSG_WHEELS_STATE or MSG_DISTANCE was read from the device
+ *    and the time REQ_TIME_SYNC was received for MSG_TIME_SYNC. Sent only to a client that
+ *    sent TIMESTAMP or REQ_TIME_SYNC on the connection, older clients never see it.
+ *
+ * REQ_TIME_SYNC is answered by TIMESTAMP + MSG_TIME_SYNC with the same sequence, holdNs is
+ * the time between receiving the request and sending the response. For the client send
+ * time t1 and receive time t4, t2 = TIMESTAMP, t3 = t2 + holdNs:
+ *      offset = ((t2 - t1) + (t3 - t4)) / 2    rtt = (t4 - t1) - holdNs
+ */
+    struct DataTimestamp
+    {
+        uint32_t high;
+        uint32_t low;
+    };
+
+    struct DataTimeSync
+    {
+        /* Chosen by the client, echoed in the response */
+        uint32_t sequence;
+        uint32_t holdNs;
+    };
+
+/*
+ * Correlation ids: a request preceded by CORRELATION_ID is answered by CORRELATION_ID with the
+ * same id followed by the response. Such requests are answered individually and may be
+ * answered out of order, so a client can keep any number of requests outstanding and match
+ * the responses by id. Id 0 is reserved.
+ */
+    struct DataCorrelationId
+    {
+        uint32_t id;
+        uint32_t reserved;
+    };
+
+/*
+ * Batches: BATCH is followed by count messages that form one frame, 1 to BATCH_MAX_ITEMS.
+ * A request batch may hold wheel speed commands, REQ_WHEELS_STATE and REQ_DISTANCE, without
+ * prefixes of their own. Prefixes sent before BATCH apply to all of its messages. The commands
+ * are applied together, as one command reflecting all of them in order, and the requests are
+ * answered by a single response batch: BATCH followed by the responses in request order, each
+ * may be preceded by its TIMESTAMP. A response batch carries the CORRELATION_ID of the request
+ * batch, a batch without requests is not answered. An invalid batch is discarded as a whole.
+ */
+    struct DataBatch
+    {
+        uint8_t count;
+    };
+
+/*
+ * Bookkeeping that travels with a message between the daemon threads, it is not part of
+ * the wire format
+ */
+    struct MessageMeta
+    {
+        /* Tracing id of the request, a response carries the id of the request it answers, 0 when not traced */
+        uint32_t traceId = 0;
+        /* CLOCK_MONOTONIC time the message was queued, 0 when not traced */
+        uint64_t queuedNs = 0;
+        /* TIMESTAMP received before the message or to be sent before the response, 0 if none */
+        uint64_t timestampNs = 0;
+        /* CORRELATION_ID of the request, copied to its response, 0 if none */
+        uint32_t correlationId = 0;
+    };
+
     struct Message
     {
         MessageType msgType;
@@ -74,12 +288,102 @@ namespace RoverNet
         {
            DataWheelsState wheelsState;
            DataDistance distance;
+           DataDistanceRequest distanceRequest;
            DataVideoStreamPort videoStreamPort;
            DataDeviceAvailability deviceAvailability;
+           DataTrajectory trajectory;
+           DataTrajectoryPoint trajectoryPoint;
+           DataWheelsRamp wheelsRamp;
+           DataReflex reflex;
+           DataTimestamp timestamp;
+           DataTimeSync timeSync;
+           DataCorrelationId correlationId;
+           DataBatch batch;
+           DataHeartbeat heartbeat;
+           DataDeadman deadman;
+           DataHistoryRequest historyRequest;
+           DataHistory history;
+           DataHistoryPoint historyPoint;
         } data;
+
+        MessageMeta meta;
     };
 
-    constexpr size_t MESSAGE_STRUCT_SIZE = sizeof(Message);
+    /* Size of the message on the wire, the fields before meta */
+    constexpr size_t MESSAGE_STRUCT_SIZE = offsetof(Message, data) + sizeof(Message::data);
+    static_assert(MESSAGE_STRUCT_SIZE == 12, "wire format of Message changed");
+
+/*
+ * Video is streamed over UDP from the port reported by MSG_VID_STREAM_PORT.
+ * A client subscribes by sending VideoControl datagram to that port and has to repeat it
+ * at least every VIDEO_SUBSCRIBER_TIMEOUT_SEC. Subscribed clients should send VID_RECEIVER_REPORT
+ * every 100-500 ms, the stream is adapted to the link based on the reports. Every frame is
+ * split into datagrams each starting with VideoPacketHeader followed by the frame bytes
+ * [offset, offset + payload).
+ * All fields are in network byte order.
+ */
+    enum VideoControlType : uint8_t
+    {
+        VID_SUBSCRIBE = 0x01,
+        VID_UNSUBSCRIBE = 0x02,
+        VID_RECEIVER_REPORT = 0x03
+    };
+
+/*
+ * What happens to a new frame when the subscriber queue is full. DROP_OLDEST always sends
+ * the most recent frames (lowest latency), DROP_NEWEST sends the queued frames first.
+ */
+    enum VideoDropPolicy : uint8_t
+    {
+        VID_DROP_OLDEST = 0x00,
+        VID_DROP_NEWEST = 0x01
+    };
+
+/*
+ * Zero fields (or a datagram with the ctrlType only) select the defaults
+ */
+    struct DataVideoSubscribe
+    {
+        VideoDropPolicy dropPolicy;
+        /* Frames queued for the subscriber, 1 to VIDEO_SEND_QUEUE_MAX */
+        uint8_t queueLength;
+    };
+
+/*
+ * Counters are cumulative since the subscription and wrap around. packetsReceived counts the
+ * datagrams of frames up to lastFrameSequence (the newest complete frame), bytesReceived all
+ * received datagrams. lastFrameAgeUS is the time between receiving the last datagram of
+ * lastFrameSequence and sending the report.
+ */
+    struct DataVideoReceiverReport
+    {
+        uint32_t packetsReceived;
+        uint32_t bytesReceived;
+        uint32_t lastFrameSequence;
+        uint32_t lastFrameAgeUS;
+    };
+
+    struct VideoControl
+    {
+        VideoControlType ctrlType;
+
+        union
+        {
+            DataVideoSubscribe subscribe;
+            DataVideoReceiverReport receiverReport;
+        } data;
+    };
+
+    struct VideoPacketHeader
+    {
+        uint32_t frameSequence;
+        uint32_t frameSize;
+        uint32_t offset;
+        uint32_t fourcc;
+        uint16_t width;
+        uint16_t height;
+        uint32_t timestampUS;
+    };
 
     using NetMsgQueue = MessageQueue<Message>;
     using NetMsgQueueShrPtr = std::shared_ptr<NetMsgQueue>;
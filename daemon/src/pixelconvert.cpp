@@ -0,0 +1,108 @@
+/*
+ * pixelconvert.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include "pixelconvert.h"
+
+namespace PixelConvert
+{
+    void ScalarYUYVToI420(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dstY, unsigned strideY, uint8_t* dstU, unsigned strideU, uint8_t* dstV, unsigned strideV,
+            unsigned firstColumn)
+    {
+        width &= ~1u;
+        height &= ~1u;
+
+        for(unsigned y = 0; y < height; y += 2) {
+            const uint8_t* row0 = src + y * srcStride;
+            const uint8_t* row1 = row0 + srcStride;
+            uint8_t* y0 = dstY + y * strideY;
+            uint8_t* y1 = y0 + strideY;
+            uint8_t* u = dstU + (y / 2) * strideU;
+            uint8_t* v = dstV + (y / 2) * strideV;
+
+            for(unsigned x = firstColumn; x < width; x += 2) {
+                const uint8_t* p0 = row0 + x * 2;
+                const uint8_t* p1 = row1 + x * 2;
+                y0[x] = p0[0];
+                y0[x + 1] = p0[2];
+                y1[x] = p1[0];
+                y1[x + 1] = p1[2];
+                u[x / 2] = (p0[1] + p1[1] + 1) >> 1;
+                v[x / 2] = (p0[3] + p1[3] + 1) >> 1;
+            }
+        }
+    }
+
+    void ScalarDownscale2x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride, unsigned firstColumn)
+    {
+        for(unsigned y = 0; y < height / 2; ++y) {
+            const uint8_t* row0 = src + 2 * y * srcStride;
+            const uint8_t* row1 = row0 + srcStride;
+            uint8_t* out = dst + y * dstStride;
+
+            for(unsigned x = firstColumn; x < width / 2; ++x) {
+                out[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2;
+            }
+        }
+    }
+
+    void ScalarDownscale4x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride, unsigned firstColumn)
+    {
+        for(unsigned y = 0; y < height / 4; ++y) {
+            const uint8_t* row = src + 4 * y * srcStride;
+            uint8_t* out = dst + y * dstStride;
+
+            for(unsigned x = firstColumn; x < width / 4; ++x) {
+                unsigned sum = 0;
+                for(unsigned r = 0; r < 4; ++r) {
+                    const uint8_t* p = row + r * srcStride + 4 * x;
+                    sum += p[0] + p[1] + p[2] + p[3];
+                }
+                out[x] = (sum + 8) >> 4;
+            }
+        }
+    }
+
+    const PixelKernels SCALAR = {
+        "scalar",
+        [](const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+           uint8_t* dstY, unsigned strideY, uint8_t* dstU, unsigned strideU, uint8_t* dstV, unsigned strideV) {
+            ScalarYUYVToI420(src, srcStride, width, height, dstY, strideY, dstU, strideU, dstV, strideV, 0);
+        },
+        [](const uint8_t* src, unsigned srcStride, unsigned width, unsigned height, uint8_t* dst, unsigned dstStride) {
+            ScalarDownscale2x(src, srcStride, width, height, dst, dstStride, 0);
+        },
+        [](const uint8_t* src, unsigned srcStride, unsigned width, unsigned height, uint8_t* dst, unsigned dstStride) {
+            ScalarDownscale4x(src, srcStride, width, height, dst, dstStride, 0);
+        }
+    };
+
+    std::vector<const PixelKernels*> Available()
+    {
+        std::vector<const PixelKernels*> ret = { &SCALAR };
+
+        for(const PixelKernels* k : { SSE2Kernels(), AVX2Kernels(), NEONKernels() }) {
+            if(k != nullptr) ret.push_back(k);
+        }
+
+        return ret;
+    }
+
+    const PixelKernels& Kernels()
+    {
+/*
+ * NOTE: Available() lists the implementations from the least to the most capable one
+ */
+        static const PixelKernels* selected = Available().back();
+        return *selected;
+    }
+};
@@ -0,0 +1,66 @@
+/*
+ * pixelconvert.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _PIXEL_CONVERT_H_
+#define _PIXEL_CONVERT_H_
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Pixel format conversion and downscaling kernels. Every implementation produces output
+ * bit-exact with the scalar reference:
+ *
+ *  YUYV -> I420    Y copied, U/V of two rows averaged as (a + b + 1) >> 1
+ *  2x downscale    (sum of 2x2 block + 2) >> 2
+ *  4x downscale    (sum of 4x4 block + 8) >> 4
+ *
+ * Strides are in bytes. Trailing columns or rows that do not form a whole block are ignored.
+ */
+struct PixelKernels
+{
+    const char* name;
+
+    void (*yuyvToI420)(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dstY, unsigned strideY, uint8_t* dstU, unsigned strideU, uint8_t* dstV, unsigned strideV);
+
+    void (*downscale2x)(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride);
+
+    void (*downscale4x)(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride);
+};
+
+namespace PixelConvert
+{
+    /* Best implementation supported by the CPU, selected once at first use */
+    const PixelKernels& Kernels();
+
+    /* All implementations compiled in and supported by the CPU, scalar reference first */
+    std::vector<const PixelKernels*> Available();
+
+    /* Scalar reference, also used by the vector kernels for the row tails */
+    extern const PixelKernels SCALAR;
+
+    /* Implementations provided by the architecture specific units, nullptr when not built */
+    const PixelKernels* SSE2Kernels();
+    const PixelKernels* AVX2Kernels();
+    const PixelKernels* NEONKernels();
+
+    void ScalarYUYVToI420(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dstY, unsigned strideY, uint8_t* dstU, unsigned strideU, uint8_t* dstV, unsigned strideV,
+            unsigned firstColumn);
+    void ScalarDownscale2x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride, unsigned firstColumn);
+    void ScalarDownscale4x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride, unsigned firstColumn);
+};
+
+#endif /* _PIXEL_CONVERT_H_ */
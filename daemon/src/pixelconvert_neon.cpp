@@ -0,0 +1,126 @@
+/*
+ * pixelconvert_neon.cpp
+ *
+ * NEON implementation of the pixel kernels, built when the compiler targets NEON
+ * (always on aarch64, -mfpu=neon on 32 bit ARM).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include "pixelconvert.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+namespace {
+    void NEONYUYVToI420(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dstY, unsigned strideY, uint8_t* dstU, unsigned strideU, uint8_t* dstV, unsigned strideV)
+    {
+        const unsigned vecWidth = width & ~31u;
+
+        for(unsigned y = 0; y + 1 < height; y += 2) {
+            const uint8_t* row0 = src + y * srcStride;
+            const uint8_t* row1 = row0 + srcStride;
+            uint8_t* y0 = dstY + y * strideY;
+            uint8_t* y1 = y0 + strideY;
+            uint8_t* u = dstU + (y / 2) * strideU;
+            uint8_t* v = dstV + (y / 2) * strideV;
+
+            for(unsigned x = 0; x < vecWidth; x += 32) {
+                /* val[0] = Y even, val[1] = U, val[2] = Y odd, val[3] = V */
+                uint8x16x4_t a = vld4q_u8(row0 + x * 2);
+                uint8x16x4_t b = vld4q_u8(row1 + x * 2);
+
+                uint8x16x2_t ya = { { a.val[0], a.val[2] } };
+                uint8x16x2_t yb = { { b.val[0], b.val[2] } };
+                vst2q_u8(y0 + x, ya);
+                vst2q_u8(y1 + x, yb);
+
+                /* vrhaddq computes (a + b + 1) >> 1 */
+                vst1q_u8(u + x / 2, vrhaddq_u8(a.val[1], b.val[1]));
+                vst1q_u8(v + x / 2, vrhaddq_u8(a.val[3], b.val[3]));
+            }
+        }
+
+        PixelConvert::ScalarYUYVToI420(src, srcStride, width, height, dstY, strideY, dstU, strideU, dstV, strideV, vecWidth);
+    }
+
+    void NEONDownscale2x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride)
+    {
+        const unsigned vecOut = (width / 2) & ~15u;
+
+        for(unsigned y = 0; y < height / 2; ++y) {
+            const uint8_t* row0 = src + 2 * y * srcStride;
+            const uint8_t* row1 = row0 + srcStride;
+            uint8_t* out = dst + y * dstStride;
+
+            for(unsigned x = 0; x < vecOut; x += 16) {
+                uint16x8_t s0 = vaddq_u16(vpaddlq_u8(vld1q_u8(row0 + 2 * x)), vpaddlq_u8(vld1q_u8(row1 + 2 * x)));
+                uint16x8_t s1 = vaddq_u16(vpaddlq_u8(vld1q_u8(row0 + 2 * x + 16)), vpaddlq_u8(vld1q_u8(row1 + 2 * x + 16)));
+
+                /* vrshrn computes (sum + 2) >> 2 */
+                vst1q_u8(out + x, vcombine_u8(vrshrn_n_u16(s0, 2), vrshrn_n_u16(s1, 2)));
+            }
+        }
+
+        PixelConvert::ScalarDownscale2x(src, srcStride, width, height, dst, dstStride, vecOut);
+    }
+
+    void NEONDownscale4x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride)
+    {
+        const unsigned vecOut = (width / 4) & ~7u;
+
+        for(unsigned y = 0; y < height / 4; ++y) {
+            const uint8_t* row = src + 4 * y * srcStride;
+            uint8_t* out = dst + y * dstStride;
+
+            for(unsigned x = 0; x < vecOut; x += 8) {
+                uint16x8_t accA = vdupq_n_u16(0);
+                uint16x8_t accB = vdupq_n_u16(0);
+
+                for(unsigned r = 0; r < 4; ++r) {
+                    const uint8_t* p = row + r * srcStride + 4 * x;
+                    accA = vpadalq_u8(accA, vld1q_u8(p));
+                    accB = vpadalq_u8(accB, vld1q_u8(p + 16));
+                }
+
+                /* vrshrn computes (sum + 8) >> 4 */
+                uint16x4_t qA = vrshrn_n_u32(vpaddlq_u16(accA), 4);
+                uint16x4_t qB = vrshrn_n_u32(vpaddlq_u16(accB), 4);
+
+                vst1_u8(out + x, vmovn_u16(vcombine_u16(qA, qB)));
+            }
+        }
+
+        PixelConvert::ScalarDownscale4x(src, srcStride, width, height, dst, dstStride, vecOut);
+    }
+
+    const PixelKernels NEON = { "neon", NEONYUYVToI420, NEONDownscale2x, NEONDownscale4x };
+};
+
+namespace PixelConvert
+{
+    const PixelKernels* NEONKernels()
+    {
+        return &NEON;
+    }
+};
+
+#else
+
+namespace PixelConvert
+{
+    const PixelKernels* NEONKernels()
+    {
+        return nullptr;
+    }
+};
+
+#endif
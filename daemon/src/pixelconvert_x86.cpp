@@ -0,0 +1,288 @@
+/*
+ * pixelconvert_x86.cpp
+ *
+ * SSE2 and AVX2 implementations of the pixel kernels. The functions are compiled with
+ * target attributes so the unit itself does not need -mavx2, the CPU support is checked
+ * at runtime before the implementation is offered.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include "pixelconvert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+namespace {
+
+/*
+ * SSE2
+ */
+    __attribute__((target("sse2")))
+    void SSE2YUYVToI420(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dstY, unsigned strideY, uint8_t* dstU, unsigned strideU, uint8_t* dstV, unsigned strideV)
+    {
+        const __m128i lowMask = _mm_set1_epi16(0x00FF);
+        const __m128i zero = _mm_setzero_si128();
+        const unsigned vecWidth = width & ~15u;
+
+        for(unsigned y = 0; y + 1 < height; y += 2) {
+            const uint8_t* row0 = src + y * srcStride;
+            const uint8_t* row1 = row0 + srcStride;
+            uint8_t* y0 = dstY + y * strideY;
+            uint8_t* y1 = y0 + strideY;
+            uint8_t* u = dstU + (y / 2) * strideU;
+            uint8_t* v = dstV + (y / 2) * strideV;
+
+            for(unsigned x = 0; x < vecWidth; x += 16) {
+                __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + x * 2));
+                __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + x * 2 + 16));
+                __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + x * 2));
+                __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + x * 2 + 16));
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(y0 + x),
+                        _mm_packus_epi16(_mm_and_si128(a0, lowMask), _mm_and_si128(a1, lowMask)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(y1 + x),
+                        _mm_packus_epi16(_mm_and_si128(b0, lowMask), _mm_and_si128(b1, lowMask)));
+
+                __m128i uv0 = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+                __m128i uv1 = _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8));
+                __m128i uv = _mm_avg_epu8(uv0, uv1);
+
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(u + x / 2),
+                        _mm_packus_epi16(_mm_and_si128(uv, lowMask), zero));
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(v + x / 2),
+                        _mm_packus_epi16(_mm_srli_epi16(uv, 8), zero));
+            }
+        }
+
+        PixelConvert::ScalarYUYVToI420(src, srcStride, width, height, dstY, strideY, dstU, strideU, dstV, strideV, vecWidth);
+    }
+
+    __attribute__((target("sse2")))
+    inline __m128i SSE2PairSums(__m128i v, __m128i lowMask)
+    {
+        return _mm_add_epi16(_mm_and_si128(v, lowMask), _mm_srli_epi16(v, 8));
+    }
+
+    __attribute__((target("sse2")))
+    void SSE2Downscale2x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride)
+    {
+        const __m128i lowMask = _mm_set1_epi16(0x00FF);
+        const __m128i two = _mm_set1_epi16(2);
+        const unsigned vecOut = (width / 2) & ~15u;
+
+        for(unsigned y = 0; y < height / 2; ++y) {
+            const uint8_t* row0 = src + 2 * y * srcStride;
+            const uint8_t* row1 = row0 + srcStride;
+            uint8_t* out = dst + y * dstStride;
+
+            for(unsigned x = 0; x < vecOut; x += 16) {
+                __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 2 * x));
+                __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 2 * x + 16));
+                __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 2 * x));
+                __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 2 * x + 16));
+
+                __m128i s0 = _mm_add_epi16(_mm_add_epi16(SSE2PairSums(a0, lowMask), SSE2PairSums(b0, lowMask)), two);
+                __m128i s1 = _mm_add_epi16(_mm_add_epi16(SSE2PairSums(a1, lowMask), SSE2PairSums(b1, lowMask)), two);
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x),
+                        _mm_packus_epi16(_mm_srli_epi16(s0, 2), _mm_srli_epi16(s1, 2)));
+            }
+        }
+
+        PixelConvert::ScalarDownscale2x(src, srcStride, width, height, dst, dstStride, vecOut);
+    }
+
+    __attribute__((target("sse2")))
+    void SSE2Downscale4x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride)
+    {
+        const __m128i lowMask = _mm_set1_epi16(0x00FF);
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i eight = _mm_set1_epi32(8);
+        const __m128i zero = _mm_setzero_si128();
+        const unsigned vecOut = (width / 4) & ~7u;
+
+        for(unsigned y = 0; y < height / 4; ++y) {
+            const uint8_t* row = src + 4 * y * srcStride;
+            uint8_t* out = dst + y * dstStride;
+
+            for(unsigned x = 0; x < vecOut; x += 8) {
+                __m128i accA = zero;
+                __m128i accB = zero;
+
+                for(unsigned r = 0; r < 4; ++r) {
+                    const uint8_t* p = row + r * srcStride + 4 * x;
+                    accA = _mm_add_epi16(accA, SSE2PairSums(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), lowMask));
+                    accB = _mm_add_epi16(accB, SSE2PairSums(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)), lowMask));
+                }
+
+                __m128i qA = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(accA, ones), eight), 4);
+                __m128i qB = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(accB, ones), eight), 4);
+
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x),
+                        _mm_packus_epi16(_mm_packs_epi32(qA, qB), zero));
+            }
+        }
+
+        PixelConvert::ScalarDownscale4x(src, srcStride, width, height, dst, dstStride, vecOut);
+    }
+
+/*
+ * AVX2, pack instructions operate within 128 bit lanes so the results are reordered
+ * with cross lane permutes before storing
+ */
+    __attribute__((target("avx2")))
+    void AVX2YUYVToI420(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dstY, unsigned strideY, uint8_t* dstU, unsigned strideU, uint8_t* dstV, unsigned strideV)
+    {
+        const __m256i lowMask = _mm256_set1_epi16(0x00FF);
+        const __m256i zero = _mm256_setzero_si256();
+        const unsigned vecWidth = width & ~31u;
+
+        for(unsigned y = 0; y + 1 < height; y += 2) {
+            const uint8_t* row0 = src + y * srcStride;
+            const uint8_t* row1 = row0 + srcStride;
+            uint8_t* y0 = dstY + y * strideY;
+            uint8_t* y1 = y0 + strideY;
+            uint8_t* u = dstU + (y / 2) * strideU;
+            uint8_t* v = dstV + (y / 2) * strideV;
+
+            for(unsigned x = 0; x < vecWidth; x += 32) {
+                __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + x * 2));
+                __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + x * 2 + 32));
+                __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + x * 2));
+                __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + x * 2 + 32));
+
+                __m256i ya = _mm256_packus_epi16(_mm256_and_si256(a0, lowMask), _mm256_and_si256(a1, lowMask));
+                __m256i yb = _mm256_packus_epi16(_mm256_and_si256(b0, lowMask), _mm256_and_si256(b1, lowMask));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(y0 + x), _mm256_permute4x64_epi64(ya, 0xD8));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(y1 + x), _mm256_permute4x64_epi64(yb, 0xD8));
+
+                __m256i uv0 = _mm256_packus_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(a1, 8));
+                __m256i uv1 = _mm256_packus_epi16(_mm256_srli_epi16(b0, 8), _mm256_srli_epi16(b1, 8));
+                __m256i uv = _mm256_permute4x64_epi64(_mm256_avg_epu8(uv0, uv1), 0xD8);
+
+                __m256i uu = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(uv, lowMask), zero), 0xD8);
+                __m256i vv = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(uv, 8), zero), 0xD8);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(u + x / 2), _mm256_castsi256_si128(uu));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(v + x / 2), _mm256_castsi256_si128(vv));
+            }
+        }
+
+        PixelConvert::ScalarYUYVToI420(src, srcStride, width, height, dstY, strideY, dstU, strideU, dstV, strideV, vecWidth);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i AVX2PairSums(__m256i v, __m256i lowMask)
+    {
+        return _mm256_add_epi16(_mm256_and_si256(v, lowMask), _mm256_srli_epi16(v, 8));
+    }
+
+    __attribute__((target("avx2")))
+    void AVX2Downscale2x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride)
+    {
+        const __m256i lowMask = _mm256_set1_epi16(0x00FF);
+        const __m256i two = _mm256_set1_epi16(2);
+        const unsigned vecOut = (width / 2) & ~31u;
+
+        for(unsigned y = 0; y < height / 2; ++y) {
+            const uint8_t* row0 = src + 2 * y * srcStride;
+            const uint8_t* row1 = row0 + srcStride;
+            uint8_t* out = dst + y * dstStride;
+
+            for(unsigned x = 0; x < vecOut; x += 32) {
+                __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + 2 * x));
+                __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + 2 * x + 32));
+                __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + 2 * x));
+                __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + 2 * x + 32));
+
+                __m256i s0 = _mm256_add_epi16(_mm256_add_epi16(AVX2PairSums(a0, lowMask), AVX2PairSums(b0, lowMask)), two);
+                __m256i s1 = _mm256_add_epi16(_mm256_add_epi16(AVX2PairSums(a1, lowMask), AVX2PairSums(b1, lowMask)), two);
+
+                __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(s0, 2), _mm256_srli_epi16(s1, 2));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm256_permute4x64_epi64(packed, 0xD8));
+            }
+        }
+
+        PixelConvert::ScalarDownscale2x(src, srcStride, width, height, dst, dstStride, vecOut);
+    }
+
+    __attribute__((target("avx2")))
+    void AVX2Downscale4x(const uint8_t* src, unsigned srcStride, unsigned width, unsigned height,
+            uint8_t* dst, unsigned dstStride)
+    {
+        const __m256i lowMask = _mm256_set1_epi16(0x00FF);
+        const __m256i ones = _mm256_set1_epi16(1);
+        const __m256i eight = _mm256_set1_epi32(8);
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        const unsigned vecOut = (width / 4) & ~15u;
+
+        for(unsigned y = 0; y < height / 4; ++y) {
+            const uint8_t* row = src + 4 * y * srcStride;
+            uint8_t* out = dst + y * dstStride;
+
+            for(unsigned x = 0; x < vecOut; x += 16) {
+                __m256i accA = zero;
+                __m256i accB = zero;
+
+                for(unsigned r = 0; r < 4; ++r) {
+                    const uint8_t* p = row + r * srcStride + 4 * x;
+                    accA = _mm256_add_epi16(accA, AVX2PairSums(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), lowMask));
+                    accB = _mm256_add_epi16(accB, AVX2PairSums(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32)), lowMask));
+                }
+
+                __m256i qA = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(accA, ones), eight), 4);
+                __m256i qB = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(accB, ones), eight), 4);
+                __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(qA, qB), zero);
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x),
+                        _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(packed, order)));
+            }
+        }
+
+        PixelConvert::ScalarDownscale4x(src, srcStride, width, height, dst, dstStride, vecOut);
+    }
+
+    const PixelKernels SSE2 = { "sse2", SSE2YUYVToI420, SSE2Downscale2x, SSE2Downscale4x };
+    const PixelKernels AVX2 = { "avx2", AVX2YUYVToI420, AVX2Downscale2x, AVX2Downscale4x };
+};
+
+namespace PixelConvert
+{
+    const PixelKernels* SSE2Kernels()
+    {
+        return __builtin_cpu_supports("sse2") ? &SSE2 : nullptr;
+    }
+
+    const PixelKernels* AVX2Kernels()
+    {
+        return __builtin_cpu_supports("avx2") ? &AVX2 : nullptr;
+    }
+};
+
+#else
+
+namespace PixelConvert
+{
+    const PixelKernels* SSE2Kernels()
+    {
+        return nullptr;
+    }
+
+    const PixelKernels* AVX2Kernels()
+    {
+        return nullptr;
+    }
+};
+
+#endif
@@ -10,26 +10,292 @@
  * Copyright (C) 2016 Tomasz Chadzynski
  */
 
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <algorithm>
+
 #include "server.h"
+#include "flightrecorder.h"
+#include "tracing.h"
+#include "handoff.h"
+#include "threadconfig.h"
+#include "logging.h"
 
-Server::Server():
+Server::Server(const ServerConfig& config):
+    config(config),
     inQueue(std::make_shared<RoverNet::NetMsgQueue>()),
     outQueue(std::make_shared<RoverNet::NetMsgQueue>()),
-    uc0Service(std::make_unique<DeviceUC0Service>(inQueue, outQueue)),
-    netService(std::make_unique<RoverNet::NetService>(inQueue, outQueue, &videoStreamManager))
+    timers(config.device.controlThreads),
+    statsNs(MonotonicNs()),
+    statsWakeups(0),
+    videoStreamManager(config.video),
+    uc0Service(std::make_unique<DeviceUC0Service>(inQueue, outQueue, &timers, config.device)),
+    netService(std::make_unique<RoverNet::NetService>(inQueue, outQueue, &videoStreamManager, &timers, config.net))
 {
 }
 
 void Server::Start()
 {
+    OpenDiagnostics();
+
+/*
+ * NOTE: The services preallocate in their constructors, locking here faults in that memory
+ * and MCL_FUTURE covers the thread stacks created below
+ */
+    if(config.lockMemory) LockMemory();
+
+    timers.Start();
     videoStreamManager.Start();
     uc0Service->Init();
     netService->Init();
 }
 
+void Server::OpenDiagnostics()
+{
+/*
+ * NOTE: Recording is a diagnostic aid, the rover is still operated when the file can not be created
+ */
+    if(!config.recorderPath.empty()) {
+        try {
+            FlightRecorder::Open(config.recorderPath.c_str(), config.recorderRecords);
+        }
+        catch(const std::exception& e) {
+            RLOG_WARNING("Server", "flight recorder disabled: %s", e.what());
+        }
+    }
+
+    if(!config.tracePath.empty()) {
+        try {
+            Tracing::Enable(config.traceEvents);
+        }
+        catch(const std::exception& e) {
+            RLOG_WARNING("Server", "tracing disabled: %s", e.what());
+        }
+    }
+}
+
 void Server::Stop()
 {
     netService->Stop();
     uc0Service->Stop();
     videoStreamManager.Stop();
+    timers.Stop();
+    Tracing::Disable();
+    FlightRecorder::Close();
+}
+
+bool Server::Upgrade(const char* path, char* const argv[])
+{
+    pid_t pid;
+    int sock;
+    try {
+        sock = Handoff::Spawn(path, argv, pid);
+    }
+    catch(const std::exception& e) {
+        RLOG_ERR("Server", "upgrade aborted: %s", e.what());
+        return false;
+    }
+
+    Handoff::Ready ready;
+    if(!Handoff::ReceiveReady(sock, ready) || !Handoff::Compatible(ready)) {
+        RLOG_ERR("Server", "upgrade aborted, %s did not start as a compatible daemon", path);
+        close(sock);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+
+/*
+ * NOTE: Commands stop here. The requests read so far are answered and the remaining ones are
+ * saved, the wheels keep the speed they have until the new daemon continues.
+ */
+    std::unique_ptr<Handoff::State> state = std::make_unique<Handoff::State>();
+    state->magic = Handoff::MAGIC;
+    state->freezeNs = MonotonicNs();
+    netService->StopInput();
+    uc0Service->Freeze(state->device);
+    netService->Freeze(state->net);
+
+    Handoff::Confirm confirm;
+    bool confirmed = false;
+    try {
+        Handoff::SendState(sock, *state);
+        confirmed = Handoff::ReceiveConfirm(sock, confirm);
+    }
+    catch(const std::exception& e) {
+        RLOG_EXCEPT("Server", e);
+    }
+
+    if(!confirmed) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(sock);
+        if(!config.recorderPath.empty()) FlightRecorder::Restore(config.recorderPath.c_str());
+        uc0Service->Init(&state->device);
+        netService->Init(&state->net);
+        RLOG_ERR("Server", "upgrade aborted, daemon %d did not take over, continuing", pid);
+        return false;
+    }
+
+    RLOG_NOTICE("Server", "daemon %d took over, commands paused for %.3f ms", pid, confirm.gapNs / 1e6);
+
+    close(state->net.serverSocket);
+    if(state->net.clientSocket != -1) close(state->net.clientSocket);
+    videoStreamManager.Stop();
+    timers.Stop();
+
+/*
+ * NOTE: Tracing and the recorder stay open until no thread of this daemon records. The new
+ * daemon moved the recorder file to the previous name, the mapping follows it there.
+ */
+    Tracing::Disable();
+    FlightRecorder::Close();
+    close(sock);
+    return true;
+}
+
+void Server::TakeOver(int handoffSocket)
+{
+    if(config.lockMemory) LockMemory();
+    timers.Start();
+
+    std::unique_ptr<Handoff::State> state = std::make_unique<Handoff::State>();
+    Handoff::SendReady(handoffSocket);
+    if(!Handoff::ReceiveState(handoffSocket, *state)) THROW_RUNTIME_MSG("no state from the previous daemon");
+
+    OpenDiagnostics();
+    uc0Service->Init(&state->device);
+    netService->Init(&state->net);
+
+    uint64_t gapNs = MonotonicNs() - state->freezeNs;
+    Handoff::SendConfirm(handoffSocket, gapNs);
+    RLOG_NOTICE("Server", "took over from the previous daemon, commands paused for %.3f ms", gapNs / 1e6);
+    uint64_t tickNs = NSEC_PER_SEC / config.device.rampRateHz;
+    if(gapNs > tickNs) {
+        RLOG_WARNING("Server", "upgrade pause longer than the control tick of %.1f ms", tickNs / 1e6);
+    }
+
+/*
+ * NOTE: The video port is bound by the previous daemon until it exits, the stream starts once
+ * it closed its end of the handoff socket
+ */
+    if(!Handoff::WaitClosed(handoffSocket)) {
+        RLOG_WARNING("Server", "previous daemon did not exit within %d ms", HANDOFF_TIMEOUT_MS);
+    }
+    close(handoffSocket);
+    videoStreamManager.Start();
+}
+
+void Server::DumpTrace()
+{
+    if(config.tracePath.empty()) {
+        RLOG_NOTICE("Server", "trace dump requested, tracing is not enabled (--trace)");
+        return;
+    }
+
+    Tracing::Dump(config.tracePath.c_str());
+}
+
+void Server::LogStats()
+{
+    DeadmanStats stats = uc0Service->Deadman();
+    RLOG_NOTICE("Server", "commands %llu, deadman stops %llu, near misses %llu, longest gap %.1f ms",
+            static_cast<unsigned long long>(stats.commands), static_cast<unsigned long long>(stats.trips),
+            static_cast<unsigned long long>(stats.nearMisses), stats.maxGapNs / 1e6);
+
+    char histogram[DEV_GAP_BUCKETS * 24];
+    size_t n = 0;
+    for(unsigned i = 0; i < DEV_GAP_BUCKETS && n < sizeof(histogram); ++i) {
+        if(stats.gaps[i] == 0) continue;
+        n += snprintf(histogram + n, sizeof(histogram) - n, " %s%ums:%llu", i == 0 ? "<" : ">=",
+                i == 0 ? 1 : 1u << (i - 1), static_cast<unsigned long long>(stats.gaps[i]));
+    }
+    RLOG_NOTICE("Server", "command gaps%s", n != 0 ? histogram : " none");
+
+    uint64_t now = MonotonicNs();
+    uint64_t wakeups = timers.Wakeups();
+    RLOG_NOTICE("Server", "timer wakeups %llu, %.2f per second since the last report",
+            static_cast<unsigned long long>(wakeups),
+            static_cast<double>(wakeups - statsWakeups) * NSEC_PER_SEC / std::max<uint64_t>(now - statsNs, 1));
+    statsNs = now;
+    statsWakeups = wakeups;
+}
+
+namespace {
+    bool ParseCpus(const std::string& text, uint64_t& cpus)
+    {
+        cpus = 0;
+        size_t pos = 0;
+        while(pos < text.size()) {
+            size_t end = text.find('+', pos);
+            if(end == std::string::npos) end = text.size();
+            std::string item = text.substr(pos, end - pos);
+            pos = end + 1;
+
+            char* rest;
+            unsigned long first = strtoul(item.c_str(), &rest, 10);
+            unsigned long last = first;
+            if(rest == item.c_str()) return false;
+            if(*rest == '-') {
+                const char* from = rest + 1;
+                last = strtoul(from, &rest, 10);
+                if(rest == from) return false;
+            }
+            if(*rest != '\0' || first > last || last >= 64) return false;
+            for(unsigned long cpu = first; cpu <= last; ++cpu) cpus |= 1ULL << cpu;
+        }
+        return cpus != 0;
+    }
+};
+
+bool ParseThreadConfig(const char* text, ServerConfig& config)
+{
+    std::string s = text;
+    size_t pos = 0;
+
+    while(pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if(end == std::string::npos) end = s.size();
+        std::string item = s.substr(pos, end - pos);
+        pos = end + 1;
+
+        if(item == "lock") {
+            config.lockMemory = true;
+            continue;
+        }
+
+        size_t eq = item.find('=');
+        if(eq == std::string::npos) return false;
+        std::string key = item.substr(0, eq);
+        std::string value = item.substr(eq + 1);
+
+        if(key == "stack") {
+            long kb = atol(value.c_str());
+            if(kb <= 0) return false;
+            size_t size = static_cast<size_t>(kb) * 1024;
+            config.device.controlThreads.stackSize = size;
+            config.device.monitorThreads.stackSize = size;
+            config.net.threads.stackSize = size;
+            config.video.threads.stackSize = size;
+            continue;
+        }
+
+        ThreadAttributes* attributes;
+        if(key == "control") attributes = &config.device.controlThreads;
+        else if(key == "monitor") attributes = &config.device.monitorThreads;
+        else if(key == "network") attributes = &config.net.threads;
+        else if(key == "video") attributes = &config.video.threads;
+        else return false;
+
+        size_t at = value.find('@');
+        char* rest;
+        long priority = strtol(value.c_str(), &rest, 10);
+        if(rest == value.c_str() || (at == std::string::npos ? *rest != '\0' : rest != value.c_str() + at)) return false;
+        if(priority < 0 || priority > 99) return false;
+        attributes->priority = static_cast<int>(priority);
+        if(at != std::string::npos && !ParseCpus(value.substr(at + 1), attributes->cpus)) return false;
+    }
+    return true;
 }
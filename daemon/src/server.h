@@ -12,26 +12,76 @@
 #define _SERVER_H_
 
 #include <memory>
+#include <string>
 
+#include "util.h"
 #include "nettypes.h"
 #include "deviceuc0service.h"
 #include "videostreammanager.h"
 #include "netservice.h"
+#include "timerservice.h"
+
+struct ServerConfig
+{
+    VideoConfig video;
+    RoverNet::NetConfig net;
+    DeviceConfig device;
+    /* Flight recorder file, empty string disables recording */
+    std::string recorderPath = FLIGHT_RECORDER_DEFAULT_PATH;
+    size_t recorderRecords = FLIGHT_RECORDER_DEFAULT_RECORDS;
+    /* Message trace written by DumpTrace(), empty string disables tracing */
+    std::string tracePath;
+    size_t traceEvents = TRACE_DEFAULT_EVENTS;
+    /* mlockall before the services start, the thread attributes are in the service configs */
+    bool lockMemory = false;
+};
+
+/*
+ * Comma separated thread settings of the services, CLASS=PRIO[@CPUS] for the classes control,
+ * monitor, network and video, stack=KB for all of them and lock for mlockall. CPUS is a list
+ * of CPUs and ranges joined by '+', such as 2 or 0-1+3. Items not given keep their value.
+ */
+bool ParseThreadConfig(const char* text, ServerConfig& config);
 
 class Server
 {
     public:
-        explicit Server();
+        explicit Server(const ServerConfig& config = ServerConfig());
         Server(const Server&) = delete;
         Server& operator=(const Server&) = delete;
 
         void Start();
         void Stop();
 
+/*
+ * Hot upgrade, starts path with argv as the new daemon and hands it the sockets and the device
+ * state. True when the new daemon took over, the services are stopped then and the process
+ * should exit without Stop. False when it failed, this daemon continues.
+ */
+        bool Upgrade(const char* path, char* const argv[]);
+        /* Start of a daemon started by Upgrade, handoffSocket is given by --handoff */
+        void TakeOver(int handoffSocket);
+
+        /* Writes the spans traced so far to the trace file, safe to call while running */
+        void DumpTrace();
+        /* Logs the deadman watchdog counters, the inter-command gap histogram and the timer wakeups */
+        void LogStats();
+
     private:
+        /* Flight recorder and tracing, failures only disable them */
+        void OpenDiagnostics();
+
+        ServerConfig config;
+
         RoverNet::NetMsgQueueShrPtr inQueue;
         RoverNet::NetMsgQueueShrPtr outQueue;
 
+        /* Runs the delayed commands and the watchdog, with the attributes of the control threads */
+        TimerService timers;
+        /* Timer wakeups at the previous LogStats */
+        uint64_t statsNs;
+        uint64_t statsWakeups;
+
         VideoStreamManager videoStreamManager;
         std::unique_ptr<DeviceUC0Service> uc0Service;
         std::unique_ptr<RoverNet::NetService> netService;
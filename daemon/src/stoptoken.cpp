@@ -0,0 +1,104 @@
+/*
+ * stoptoken.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "stoptoken.h"
+#include "logging.h"
+
+StopToken::StopToken():
+    requested(false),
+    eventFd(-1),
+    wakerCount(0)
+{
+    if(-1 == (eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))) THROW_RUNTIME();
+
+    pthread_condattr_t condAttr;
+    PTHREAD_GUARD( pthread_mutex_init(&mutex, NULL) );
+    PTHREAD_GUARD( pthread_condattr_init(&condAttr) );
+    PTHREAD_GUARD( pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC) );
+    PTHREAD_GUARD( pthread_cond_init(&cond, &condAttr) );
+    pthread_condattr_destroy(&condAttr);
+}
+
+StopToken::~StopToken()
+{
+    close(eventFd);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+void StopToken::Register(Waker waker, void* arg)
+{
+    if(wakerCount == STOP_MAX_WAKERS) THROW_RUNTIME_MSG("all %u stop wakers in use", STOP_MAX_WAKERS);
+    wakers[wakerCount] = waker;
+    wakerArgs[wakerCount] = arg;
+    wakerCount++;
+}
+
+void StopToken::Request()
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&mutex) );
+    requested.store(true, std::memory_order_release);
+    PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+    PTHREAD_GUARD( pthread_cond_broadcast(&cond) );
+
+    uint64_t one = 1;
+    if(-1 == write(eventFd, &one, sizeof(one)) && errno != EAGAIN) THROW_RUNTIME();
+
+/*
+ * NOTE: The wakers take the mutex of their wait before broadcasting, a thread that checked
+ * the flag before it was set is then already waiting and receives the broadcast
+ */
+    for(unsigned i = 0; i < wakerCount; ++i) wakers[i](wakerArgs[i]);
+}
+
+void StopToken::Reset()
+{
+    uint64_t count;
+    if(-1 == read(eventFd, &count, sizeof(count)) && errno != EAGAIN) THROW_RUNTIME();
+    requested.store(false, std::memory_order_release);
+}
+
+bool StopToken::SleepUntil(uint64_t deadlineNs)
+{
+    timespec deadline = NsToTimespec(deadlineNs);
+    int r = 0;
+
+    PTHREAD_GUARD( pthread_mutex_lock(&mutex) );
+    while(!Requested() && ETIMEDOUT != r) {
+        r = pthread_cond_timedwait(&cond, &mutex, &deadline);
+        if(r != 0 && r != ETIMEDOUT) {
+            pthread_mutex_unlock(&mutex);
+            THROW_RUNTIME_EID(r);
+        }
+    }
+    bool stopped = Requested();
+    PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+
+    return !stopped;
+}
+
+bool StopToken::WaitFd(int fd, short events)
+{
+    pollfd fds[2] = { { fd, events, 0 }, { eventFd, POLLIN, 0 } };
+
+    while(!Requested()) {
+        if(-1 == poll(fds, 2, -1)) {
+            if(errno == EINTR) continue;
+            THROW_RUNTIME();
+        }
+        if(fds[0].revents != 0 && !Requested()) return true;
+    }
+    return false;
+}
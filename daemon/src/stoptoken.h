@@ -0,0 +1,63 @@
+/*
+ * stoptoken.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _STOP_TOKEN_H_
+#define _STOP_TOKEN_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <cstdint>
+
+#include "util.h"
+
+/*
+ * Asks the threads of a service to return instead of cancelling them. Request sets the flag,
+ * makes Fd() readable for the threads waiting in poll, wakes SleepUntil and calls the
+ * registered wakers, which broadcast the condition variables the threads wait on. Every
+ * blocking wait of the threads checks Requested() so none of them sleeps past the stop.
+ *
+ * Reset clears the token for the next start, it is called when no thread uses it.
+ */
+class StopToken
+{
+    public:
+        typedef void (*Waker)(void* arg);
+
+        StopToken();
+        StopToken(const StopToken&) = delete;
+        StopToken& operator=(const StopToken&) = delete;
+        ~StopToken();
+
+        /* Called before the threads start, at most STOP_MAX_WAKERS */
+        void Register(Waker waker, void* arg);
+        void Request();
+        void Reset();
+
+        bool Requested() const { return requested.load(std::memory_order_acquire); }
+        /* Readable from Request until Reset */
+        int Fd() const { return eventFd; }
+
+        /* Sleeps until the CLOCK_MONOTONIC deadline, false when woken by the stop */
+        bool SleepUntil(uint64_t deadlineNs);
+        /* Waits for events on fd, false when the stop came first */
+        bool WaitFd(int fd, short events);
+
+    private:
+        std::atomic<bool> requested;
+        int eventFd;
+        Waker wakers[STOP_MAX_WAKERS];
+        void* wakerArgs[STOP_MAX_WAKERS];
+        unsigned wakerCount;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+};
+
+#endif /* _STOP_TOKEN_H_ */
@@ -0,0 +1,84 @@
+/*
+ * threadconfig.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <sched.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#include "threadconfig.h"
+#include "logging.h"
+
+void CreateThread(pthread_t* thread, const ThreadAttributes& attributes, const char* name,
+        void* (*procedure)(void*), void* arg)
+{
+    ThreadAttributes effective = attributes;
+
+    for(;;) {
+        pthread_attr_t attr;
+        PTHREAD_GUARD( pthread_attr_init(&attr) );
+        int r = pthread_attr_setstacksize(&attr, std::max<size_t>(effective.stackSize, PTHREAD_STACK_MIN));
+
+        if(r == 0 && effective.priority != 0) {
+            sched_param param = {};
+            param.sched_priority = effective.priority;
+            r = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            if(r == 0) r = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+            if(r == 0) r = pthread_attr_setschedparam(&attr, &param);
+        }
+
+        if(r == 0 && effective.cpus != 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for(unsigned cpu = 0; cpu < 64; ++cpu) {
+                if(effective.cpus & (1ULL << cpu)) CPU_SET(cpu, &set);
+            }
+            r = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+
+        if(r == 0) r = pthread_create(thread, &attr, procedure, arg);
+        pthread_attr_destroy(&attr);
+
+        if(r == 0) break;
+
+/*
+ * NOTE: EPERM comes from the real-time policy without CAP_SYS_NICE or RLIMIT_RTPRIO, EINVAL
+ * from a CPU mask with no CPU the process may run on. Either is dropped and creation retried.
+ */
+        if(r == EPERM && effective.priority != 0) {
+            RLOG_WARNING("Thread", "%s: SCHED_FIFO priority %d not permitted, default policy used",
+                    name, effective.priority);
+            effective.priority = 0;
+        }
+        else if(r == EINVAL && effective.cpus != 0) {
+            RLOG_WARNING("Thread", "%s: CPU mask 0x%llx not usable, any CPU used", name,
+                    static_cast<unsigned long long>(effective.cpus));
+            effective.cpus = 0;
+        }
+        else {
+            THROW_RUNTIME_EID(r);
+        }
+    }
+
+    /* Names longer than 15 characters are rejected, the thread is only unnamed then */
+    pthread_setname_np(*thread, name);
+    RLOG_DEBUG("Thread", "%s: priority %d, CPU mask 0x%llx, stack %zu KiB", name, effective.priority,
+            static_cast<unsigned long long>(effective.cpus), effective.stackSize / 1024);
+}
+
+void LockMemory()
+{
+    if(0 != mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        RLOG_WARNING("Thread", "memory not locked: %m");
+        return;
+    }
+    RLOG_NOTICE("Thread", "memory locked");
+}
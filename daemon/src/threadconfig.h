@@ -0,0 +1,43 @@
+/*
+ * threadconfig.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _THREAD_CONFIG_H_
+#define _THREAD_CONFIG_H_
+
+#include <pthread.h>
+#include <cstddef>
+#include <cstdint>
+
+#include "util.h"
+
+/*
+ * Attributes of the threads of one class. Priority 0 runs under the default time sharing
+ * policy, 1 to 99 under SCHED_FIFO. The CPU mask has bit n set for CPU n, 0 lets the
+ * thread run on any CPU.
+ */
+struct ThreadAttributes
+{
+    int priority = 0;
+    uint64_t cpus = 0;
+    size_t stackSize = THREAD_STACK_SIZE;
+};
+
+/*
+ * Creates a thread with the given attributes and names it. Missing permission for the
+ * real-time policy and CPUs that are not present do not fail the call, the thread is
+ * created without them and a warning is logged. Other errors throw.
+ */
+void CreateThread(pthread_t* thread, const ThreadAttributes& attributes, const char* name,
+        void* (*procedure)(void*), void* arg);
+
+/* Locks the current and future pages of the process in memory, logs a warning when not permitted */
+void LockMemory();
+
+#endif /* _THREAD_CONFIG_H_ */
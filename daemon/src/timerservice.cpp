@@ -0,0 +1,365 @@
+/*
+ * timerservice.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/timerfd.h>
+#include <cxxabi.h>
+#include <algorithm>
+
+#include "timerservice.h"
+#include "tracing.h"
+#include "logging.h"
+
+namespace {
+    constexpr unsigned SLOT_BITS = 6;
+    static_assert(TIMER_WHEEL_SLOTS == 1u << SLOT_BITS, "TIMER_WHEEL_SLOTS must be 2^SLOT_BITS");
+
+    void CleanupMutexUnlock(void *mutex)
+    {
+        if(0 != pthread_mutex_unlock(static_cast<pthread_mutex_t*>(mutex)))
+            throw std::runtime_error("TimerService::CleanupMutexUnlock: Unable to unlock mutex");
+    }
+};
+
+TimerService::TimerService(const ThreadAttributes& attributes):
+    attributes(attributes),
+    expired(NONE),
+    currentTick(MonotonicNs() / TIMER_TICK_NS),
+    programmedTick(UINT64_MAX),
+    running(NONE),
+    timerFd(-1),
+    started(false),
+    wakeups(0)
+{
+    for(Timer& t : timers) {
+        t.used = false;
+        t.level = NONE;
+    }
+    for(auto& level : wheel) std::fill(level, level + TIMER_WHEEL_SLOTS, NONE);
+
+    pthread_condattr_t condAttr;
+    PTHREAD_GUARD( pthread_condattr_init(&condAttr) );
+    PTHREAD_GUARD( pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC) );
+    PTHREAD_GUARD( pthread_cond_init(&idleCond, &condAttr) );
+    pthread_condattr_destroy(&condAttr);
+    PTHREAD_GUARD( pthread_mutex_init(&mutex, NULL) );
+}
+
+TimerService::~TimerService()
+{
+    if(timerFd != -1) close(timerFd);
+    pthread_cond_destroy(&idleCond);
+    pthread_mutex_destroy(&mutex);
+}
+
+void TimerService::Start()
+{
+    if(-1 == (timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK))) THROW_RUNTIME();
+    CreateThread(&threadTimer, attributes, "rover-timer", ThreadTimerProcedure, this);
+    started = true;
+}
+
+void TimerService::Stop()
+{
+    if(!started) return;
+    started = false;
+
+/*
+ * NOTE: A callback in progress completes before the thread sees the stop, the owners destroy
+ * their timers before the service is stopped anyway
+ */
+    stop.Request();
+    PTHREAD_GUARD( pthread_join(threadTimer, NULL) );
+    stop.Reset();
+    close(timerFd);
+    timerFd = -1;
+    programmedTick = UINT64_MAX;
+}
+
+TimerService::Handle TimerService::Create(Callback callback, void* arg)
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&mutex) );
+    for(uint32_t i = 0; i < TIMER_MAX_TIMERS; ++i) {
+        Timer& t = timers[i];
+        if(t.used) continue;
+        t.used = true;
+        t.callback = callback;
+        t.arg = arg;
+        t.level = NONE;
+        PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+        return i + 1;
+    }
+    PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+    THROW_RUNTIME_MSG("all %u timers in use", TIMER_MAX_TIMERS);
+}
+
+void TimerService::Destroy(Handle handle)
+{
+    Disarm(handle);
+    PTHREAD_GUARD( pthread_mutex_lock(&mutex) );
+    timers[handle - 1].used = false;
+    PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+}
+
+void TimerService::Arm(Handle handle, uint64_t deadlineNs, uint64_t periodNs)
+{
+    int32_t i = handle - 1;
+    Timer& t = timers[i];
+
+    PTHREAD_GUARD( pthread_mutex_lock(&mutex) );
+    if(t.level != NONE) Unlink(i);
+    t.deadlineNs = deadlineNs;
+    t.periodNs = periodNs;
+    t.expiry = (deadlineNs + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+
+/*
+ * NOTE: The wheel is only advanced by the timer thread. Nothing happens before the programmed
+ * tick, so the current tick of an idle wheel is moved up to now to place the timer relative
+ * to the present rather than to the last wakeup.
+ */
+    currentTick = std::max(currentTick, std::min(MonotonicNs() / TIMER_TICK_NS, NextTick() - 1));
+    Link(i, currentTick);
+
+/*
+ * NOTE: A deadline moved later leaves the timerfd at the earlier tick, the thread wakes once
+ * and sets it again. Commands that keep pushing a deadline cost no system call this way.
+ */
+    if(t.expiry < programmedTick) Program();
+    PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+}
+
+void TimerService::Disarm(Handle handle)
+{
+    int32_t i = handle - 1;
+
+    PTHREAD_GUARD( pthread_mutex_lock(&mutex) );
+    pthread_cleanup_push(CleanupMutexUnlock, &mutex);
+    if(timers[i].level != NONE) Unlink(i);
+    if(!started || !pthread_equal(pthread_self(), threadTimer)) {
+        while(running == i) PTHREAD_GUARD( pthread_cond_wait(&idleCond, &mutex) );
+    }
+    pthread_cleanup_pop(0);
+    PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+}
+
+int32_t& TimerService::Head(int32_t level, uint32_t slot)
+{
+    return level == static_cast<int32_t>(EXPIRED) ? expired : wheel[level][slot];
+}
+
+void TimerService::Link(int32_t i, uint64_t base)
+{
+    Timer& t = timers[i];
+    uint64_t expiry = std::max(t.expiry, base + 1);
+    uint64_t ahead = expiry - (base + 1);
+
+/*
+ * NOTE: The ticks after base are not processed yet. A level covers TIMER_WHEEL_SLOTS of its
+ * buckets from the first tick after base, timers beyond the top level are kept in its last
+ * bucket and placed again when it is reached.
+ */
+    unsigned level = 0;
+    while(level + 1 < TIMER_WHEEL_LEVELS && ahead >> (SLOT_BITS * (level + 1)) != 0) level++;
+    if(ahead >> (SLOT_BITS * TIMER_WHEEL_LEVELS) != 0) expiry = base + (1ULL << (SLOT_BITS * TIMER_WHEEL_LEVELS));
+
+    t.level = level;
+    t.slot = (expiry >> (SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    int32_t& head = Head(t.level, t.slot);
+    t.prev = NONE;
+    t.next = head;
+    if(head != NONE) timers[head].prev = i;
+    head = i;
+}
+
+void TimerService::Unlink(int32_t i)
+{
+    Timer& t = timers[i];
+    if(t.prev != NONE) timers[t.prev].next = t.next;
+    else Head(t.level, t.slot) = t.next;
+    if(t.next != NONE) timers[t.next].prev = t.prev;
+    t.level = NONE;
+}
+
+uint64_t TimerService::NextTick() const
+{
+    uint64_t next = UINT64_MAX;
+    for(unsigned level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        unsigned shift = SLOT_BITS * level;
+        uint64_t base = currentTick >> shift;
+        for(uint64_t k = 1; k <= TIMER_WHEEL_SLOTS; ++k) {
+            if(wheel[level][(base + k) & (TIMER_WHEEL_SLOTS - 1)] != NONE) {
+                next = std::min(next, (base + k) << shift);
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+uint64_t TimerService::NextExpiry() const
+{
+/*
+ * NOTE: The first bucket in use of a level holds the earliest timers of that level, their
+ * expiry is looked up since a coarse bucket starts before the timers in it
+ */
+    uint64_t next = UINT64_MAX;
+    for(unsigned level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        uint64_t base = currentTick >> (SLOT_BITS * level);
+        for(uint64_t k = 1; k <= TIMER_WHEEL_SLOTS; ++k) {
+            int32_t i = wheel[level][(base + k) & (TIMER_WHEEL_SLOTS - 1)];
+            if(i == NONE) continue;
+            for(; i != NONE; i = timers[i].next) next = std::min(next, timers[i].expiry);
+            break;
+        }
+    }
+    return next;
+}
+
+void TimerService::ProcessTick(uint64_t tick)
+{
+/*
+ * NOTE: Coarser levels are moved down first, a timer they place in a finer bucket that is
+ * due at this tick is then handled by the finer level
+ */
+    for(unsigned level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+        unsigned shift = SLOT_BITS * level;
+        if((tick & ((1ULL << shift) - 1)) != 0) continue;
+
+        int32_t i = wheel[level][(tick >> shift) & (TIMER_WHEEL_SLOTS - 1)];
+        wheel[level][(tick >> shift) & (TIMER_WHEEL_SLOTS - 1)] = NONE;
+        while(i != NONE) {
+            int32_t next = timers[i].next;
+            Link(i, tick - 1);
+            i = next;
+        }
+    }
+
+    int32_t i = wheel[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+    wheel[0][tick & (TIMER_WHEEL_SLOTS - 1)] = NONE;
+    while(i != NONE) {
+        int32_t next = timers[i].next;
+        Timer& t = timers[i];
+        t.level = EXPIRED;
+        t.prev = NONE;
+        t.next = expired;
+        if(expired != NONE) timers[expired].prev = i;
+        expired = i;
+        i = next;
+    }
+    currentTick = tick;
+}
+
+void TimerService::Advance(uint64_t nowTick)
+{
+    uint64_t next;
+    while((next = NextTick()) <= nowTick) ProcessTick(next);
+    currentTick = std::max(currentTick, nowTick);
+}
+
+void TimerService::Program()
+{
+    uint64_t next = NextExpiry();
+    if(next == programmedTick || timerFd == -1) return;
+
+    itimerspec spec = {};
+    if(next != UINT64_MAX) spec.it_value = NsToTimespec(next * TIMER_TICK_NS);
+    if(-1 == timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL)) THROW_RUNTIME();
+    programmedTick = next;
+}
+
+TimerService::Callback TimerService::Take(uint64_t now, bool advance, void*& arg)
+{
+    Callback callback = NULL;
+
+    PTHREAD_GUARD( pthread_mutex_lock(&mutex) );
+    pthread_cleanup_push(CleanupMutexUnlock, &mutex);
+    if(advance) {
+        programmedTick = UINT64_MAX;
+        Advance(now / TIMER_TICK_NS);
+    }
+    if(running != NONE) {
+        running = NONE;
+        PTHREAD_GUARD( pthread_cond_broadcast(&idleCond) );
+    }
+
+    if(expired != NONE) {
+        int32_t i = expired;
+        Timer& t = timers[i];
+        Unlink(i);
+        if(t.periodNs != 0) {
+            do t.deadlineNs += t.periodNs; while(t.deadlineNs <= now);
+            t.expiry = (t.deadlineNs + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+            Link(i, currentTick);
+        }
+        running = i;
+        callback = t.callback;
+        arg = t.arg;
+    }
+    else {
+        Program();
+    }
+    pthread_cleanup_pop(0);
+    PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+
+    return callback;
+}
+
+void* TimerService::ThreadTimerProcedure(void* arg)
+{
+/*
+ * NOTE: Thread does not have the ownership over the pointer to TimerService
+ * and should not free it
+ */
+    TimerService* ts = static_cast<TimerService*>(arg);
+    Tracing::RegisterThread("timer");
+
+    try {
+        while(ts->stop.WaitFd(ts->timerFd, POLLIN)) {
+            uint64_t expirations;
+            if(-1 == read(ts->timerFd, &expirations, sizeof(expirations))) {
+                if(errno == EINTR || errno == EAGAIN) continue;
+                THROW_RUNTIME();
+            }
+            ts->wakeups.fetch_add(1, std::memory_order_relaxed);
+
+            uint64_t now = MonotonicNs();
+            void* callbackArg;
+            Callback callback = ts->Take(now, true, callbackArg);
+            while(callback != NULL) {
+                try {
+                    callback(callbackArg);
+                }
+                catch(...) {
+                    pthread_mutex_lock(&(ts->mutex));
+                    ts->running = NONE;
+                    pthread_cond_broadcast(&(ts->idleCond));
+                    pthread_mutex_unlock(&(ts->mutex));
+                    throw;
+                }
+                callback = ts->Take(now, false, callbackArg);
+            }
+        }
+    }
+    catch(const std::exception &e) {
+        RLOG_EXCEPT("TimerService", e);
+        kill(getpid(), SIGTERM);
+    }
+    catch(abi::__forced_unwind&) {
+        throw;
+    }
+    catch(...) {
+        RLOG_ERR("TimerService", "unknown exception");
+        kill(getpid(), SIGTERM);
+    }
+    return NULL;
+}
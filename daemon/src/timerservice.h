@@ -0,0 +1,124 @@
+/*
+ * timerservice.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _TIMER_SERVICE_H_
+#define _TIMER_SERVICE_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <cstdint>
+
+#include "util.h"
+#include "threadconfig.h"
+#include "stoptoken.h"
+
+/*
+ * Timers of the services, run by one thread sleeping on a timerfd. Deadlines are absolute
+ * CLOCK_MONOTONIC times kept in a hierarchical wheel of TIMER_WHEEL_LEVELS levels with
+ * TIMER_WHEEL_SLOTS slots, each level TIMER_WHEEL_SLOTS times coarser, with TIMER_TICK_NS
+ * resolution. The timerfd is set to the earliest expiry and the buckets of the coarser
+ * levels are moved down when the thread wakes, so it wakes once per callback and never
+ * when no timer is armed.
+ *
+ * Callbacks run on the timer thread without the internal lock held, they may arm and
+ * disarm timers. An exception from a callback ends the daemon like in the service threads.
+ * All timers are preallocated, Create fails when TIMER_MAX_TIMERS are in use.
+ */
+class TimerService
+{
+    public:
+        typedef void (*Callback)(void* arg);
+        /* 0 is never a valid handle */
+        typedef uint32_t Handle;
+
+        explicit TimerService(const ThreadAttributes& attributes = ThreadAttributes());
+        TimerService(const TimerService&) = delete;
+        TimerService& operator=(const TimerService&) = delete;
+        ~TimerService();
+
+        void Start();
+        void Stop();
+
+        Handle Create(Callback callback, void* arg);
+        void Destroy(Handle handle);
+
+        /* Arms or moves the timer, periodNs 0 fires once. A deadline in the past fires at once. */
+        void Arm(Handle handle, uint64_t deadlineNs, uint64_t periodNs = 0);
+/*
+ * After return the callback is not running and does not run until armed again. Called from
+ * the callback itself it only prevents the next run.
+ */
+        void Disarm(Handle handle);
+
+        /* Times the timer thread woke up since the start */
+        uint64_t Wakeups() const { return wakeups.load(std::memory_order_relaxed); }
+
+    private:
+        static constexpr int32_t NONE = -1;
+        /* Level of the timers that are due and wait for their callback */
+        static constexpr unsigned EXPIRED = TIMER_WHEEL_LEVELS;
+
+        struct Timer
+        {
+            Callback callback;
+            void* arg;
+            bool used;
+            uint64_t deadlineNs;
+            uint64_t periodNs;
+            /* Tick the timer fires at */
+            uint64_t expiry;
+            /* List the timer is in, NONE when not armed */
+            int32_t level;
+            uint32_t slot;
+            int32_t prev;
+            int32_t next;
+        };
+
+        int32_t& Head(int32_t level, uint32_t slot);
+        void Link(int32_t i, uint64_t base);
+        void Unlink(int32_t i);
+        /* First tick after the current one with a timer to fire or to move down, UINT64_MAX if none */
+        uint64_t NextTick() const;
+        /* Earliest tick a timer fires at, UINT64_MAX if none */
+        uint64_t NextExpiry() const;
+        void ProcessTick(uint64_t tick);
+        /* Moves the timers due until nowTick to the expired list */
+        void Advance(uint64_t nowTick);
+        /* Sets the timerfd to the next expiry */
+        void Program();
+/*
+ * Ends the callback that was running and takes the next expired timer, advancing the wheel
+ * to now first when asked. Returns NULL and sets the timerfd when none is left.
+ */
+        Callback Take(uint64_t now, bool advance, void*& arg);
+
+        static void* ThreadTimerProcedure(void* arg);
+
+        ThreadAttributes attributes;
+        Timer timers[TIMER_MAX_TIMERS];
+        int32_t wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+        int32_t expired;
+        /* Ticks up to this one are processed */
+        uint64_t currentTick;
+        /* Tick the timerfd is set to, UINT64_MAX when it is disarmed */
+        uint64_t programmedTick;
+        /* Timer whose callback is running, NONE otherwise */
+        int32_t running;
+
+        int timerFd;
+        bool started;
+        StopToken stop;
+        pthread_t threadTimer;
+        pthread_mutex_t mutex;
+        pthread_cond_t idleCond;
+        std::atomic<uint64_t> wakeups;
+};
+
+#endif /* _TIMER_SERVICE_H_ */
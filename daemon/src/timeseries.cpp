@@ -0,0 +1,167 @@
+/*
+ * timeseries.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "timeseries.h"
+#include "logging.h"
+
+TimeSeries::TimeSeries(unsigned channels, Aggregate aggregate):
+    channels(channels),
+    aggregate(aggregate)
+{
+    if(channels == 0 || channels > HISTORY_MAX_CHANNELS) THROW_RUNTIME_MSG("invalid channel count %u", channels);
+
+    for(unsigned l = 0; l <= HISTORY_TIERS; ++l) {
+        Level& level = levels[l];
+        level.bucketNs = l == 0 ? 0 : HISTORY_TIER_NS[l - 1];
+        level.capacity = l == 0 ? HISTORY_SAMPLES : HISTORY_TIER_BUCKETS[l - 1];
+        level.count = 0;
+        level.next = 0;
+        level.time.resize(level.capacity);
+        for(unsigned c = 0; c < channels; ++c) level.values[c].resize(level.capacity);
+        level.openStart = 0;
+        level.openCount = 0;
+    }
+
+    binSum.resize(HISTORY_MAX_BINS * channels);
+    binCount.resize(HISTORY_MAX_BINS);
+
+    PTHREAD_GUARD( pthread_mutex_init(&mutex, NULL) );
+}
+
+TimeSeries::~TimeSeries()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+void TimeSeries::Level::Push(uint64_t t, const int32_t* v, unsigned channels)
+{
+    time[next] = t;
+    for(unsigned c = 0; c < channels; ++c) values[c][next] = v[c];
+    next = (next + 1) % capacity;
+    if(count < capacity) count++;
+}
+
+void TimeSeries::Append(uint64_t timeNs, const int32_t* values)
+{
+    PTHREAD_GUARD( pthread_mutex_lock(&mutex) );
+    levels[0].Push(timeNs, values, channels);
+
+    for(unsigned l = 1; l <= HISTORY_TIERS; ++l) {
+        Level& level = levels[l];
+        uint64_t bucket = timeNs - timeNs % level.bucketNs;
+
+        if(level.openCount != 0 && bucket != level.openStart) {
+            int32_t closed[HISTORY_MAX_CHANNELS];
+            uint64_t t;
+            Entry(level, level.count, t, closed);
+            level.Push(level.openStart, closed, channels);
+            level.openCount = 0;
+        }
+
+        if(level.openCount == 0) {
+            level.openStart = bucket;
+            for(unsigned c = 0; c < channels; ++c) level.openSum[c] = 0;
+        }
+        for(unsigned c = 0; c < channels; ++c) {
+            level.openSum[c] += values[c];
+            level.openLast[c] = values[c];
+        }
+        level.openCount++;
+    }
+    PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+}
+
+bool TimeSeries::Entry(const Level& level, size_t i, uint64_t& t, int32_t* v) const
+{
+    if(i < level.count) {
+        size_t at = level.At(i);
+        t = level.time[at];
+        for(unsigned c = 0; c < channels; ++c) v[c] = level.values[c][at];
+        return true;
+    }
+    if(i > level.count || level.openCount == 0) return false;
+
+    t = level.openStart;
+    for(unsigned c = 0; c < channels; ++c) {
+        v[c] = aggregate == LAST ? level.openLast[c] :
+            static_cast<int32_t>(std::lround(static_cast<double>(level.openSum[c]) / level.openCount));
+    }
+    return true;
+}
+
+uint64_t TimeSeries::Query(uint64_t startNs, uint64_t resolutionNs, unsigned bins, int32_t* out, bool* present)
+{
+    bins = std::min(bins, HISTORY_MAX_BINS);
+    uint64_t endNs = startNs + bins * resolutionNs;
+    uint64_t t;
+    int32_t v[HISTORY_MAX_CHANNELS];
+
+    PTHREAD_GUARD( pthread_mutex_lock(&mutex) );
+
+/*
+ * NOTE: The finest level that reaches back to the start or never dropped an entry is used,
+ * the coarsest one when every level lost the start
+ */
+    const Level* level = &levels[HISTORY_TIERS];
+    for(const Level& candidate : levels) {
+        if(candidate.count < candidate.capacity || (Entry(candidate, 0, t, v) && t <= startNs)) {
+            level = &candidate;
+            break;
+        }
+    }
+
+    size_t n = Entries(*level);
+    size_t first = 0, last = n;
+    while(first < last) {
+        size_t mid = (first + last) / 2;
+        Entry(*level, mid, t, v);
+        if(t < startNs) first = mid + 1;
+        else last = mid;
+    }
+
+    if(aggregate == MEAN) {
+        std::fill(binSum.begin(), binSum.begin() + bins * channels, 0);
+        std::fill(binCount.begin(), binCount.begin() + bins, 0);
+        for(size_t i = first; i < n && Entry(*level, i, t, v) && t < endNs; ++i) {
+            size_t b = (t - startNs) / resolutionNs;
+            for(unsigned c = 0; c < channels; ++c) binSum[b * channels + c] += v[c];
+            binCount[b]++;
+        }
+        for(unsigned b = 0; b < bins; ++b) {
+            present[b] = binCount[b] != 0;
+            for(unsigned c = 0; c < channels; ++c) {
+                out[b * channels + c] = present[b] ?
+                    static_cast<int32_t>(std::lround(static_cast<double>(binSum[b * channels + c]) / binCount[b])) : 0;
+            }
+        }
+    }
+    else {
+        /* The value in effect at the start was set by the entry before it */
+        int32_t current[HISTORY_MAX_CHANNELS] = {};
+        bool have = first != 0 && Entry(*level, first - 1, t, current);
+        size_t i = first;
+        for(unsigned b = 0; b < bins; ++b) {
+            uint64_t binEnd = startNs + (b + 1) * resolutionNs;
+            while(i < n && Entry(*level, i, t, v) && t < binEnd) {
+                std::copy(v, v + channels, current);
+                have = true;
+                i++;
+            }
+            present[b] = have;
+            std::copy(current, current + channels, out + b * channels);
+        }
+    }
+
+    PTHREAD_GUARD( pthread_mutex_unlock(&mutex) );
+    return level->bucketNs;
+}
@@ -0,0 +1,93 @@
+/*
+ * timeseries.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _TIME_SERIES_H_
+#define _TIME_SERIES_H_
+
+#include <pthread.h>
+#include <cstdint>
+#include <vector>
+
+#include "util.h"
+
+/*
+ * Fixed memory history of a sampled value with up to HISTORY_MAX_CHANNELS channels. Samples
+ * are kept in a ring, and in coarser tiers of HISTORY_TIER_NS buckets that reach further
+ * back. Every level is stored by column, the times apart from each channel.
+ *
+ * A bucket holds the mean of its samples (MEAN) or the last sample (LAST, for setpoints that
+ * stay in effect until the next one). A query bins a time range from the finest level that
+ * still reaches its start. All memory is allocated by the constructor. Append and Query may
+ * be called from any thread.
+ */
+class TimeSeries
+{
+    public:
+        enum Aggregate
+        {
+            MEAN,
+            LAST
+        };
+
+        TimeSeries(unsigned channels, Aggregate aggregate);
+        TimeSeries(const TimeSeries&) = delete;
+        TimeSeries& operator=(const TimeSeries&) = delete;
+        ~TimeSeries();
+
+        void Append(uint64_t timeNs, const int32_t* values);
+
+/*
+ * Fills bins of resolutionNs from startNs, channel values of a bin are adjacent in out.
+ * With MEAN a bin is the mean of the samples in it, with LAST the value in effect at its
+ * end. present tells the bins that have a value. Returns the bucket width of the level
+ * used, 0 for the samples.
+ */
+        uint64_t Query(uint64_t startNs, uint64_t resolutionNs, unsigned bins, int32_t* out, bool* present);
+
+        unsigned Channels() const { return channels; }
+
+    private:
+        struct Level
+        {
+            /* 0 for the samples */
+            uint64_t bucketNs;
+            size_t capacity;
+            size_t count;
+            size_t next;
+            std::vector<uint64_t> time;
+            std::vector<int32_t> values[HISTORY_MAX_CHANNELS];
+
+            /* Bucket being filled, not in the ring yet */
+            uint64_t openStart;
+            uint32_t openCount;
+            int64_t openSum[HISTORY_MAX_CHANNELS];
+            int32_t openLast[HISTORY_MAX_CHANNELS];
+
+            /* Ring position of the i-th oldest entry */
+            size_t At(size_t i) const { return (next + capacity - count + i) % capacity; }
+            void Push(uint64_t t, const int32_t* v, unsigned channels);
+        };
+
+        /* Entry of a level as seen by a query, the open bucket included */
+        bool Entry(const Level& level, size_t i, uint64_t& t, int32_t* v) const;
+        size_t Entries(const Level& level) const { return level.count + (level.openCount != 0 ? 1 : 0); }
+
+        unsigned channels;
+        Aggregate aggregate;
+        Level levels[HISTORY_TIERS + 1];
+
+        /* Query accumulators, HISTORY_MAX_BINS per channel */
+        std::vector<int64_t> binSum;
+        std::vector<uint32_t> binCount;
+
+        pthread_mutex_t mutex;
+};
+
+#endif /* _TIME_SERIES_H_ */
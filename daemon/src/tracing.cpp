@@ -0,0 +1,347 @@
+/*
+ * tracing.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tracing.h"
+#include "netcodec.h"
+#include "logging.h"
+
+namespace {
+    struct SpanRecord
+    {
+        uint64_t startNs;
+        uint64_t endNs;
+        uint32_t id;
+        uint8_t kind;
+        uint8_t msgType;
+    };
+
+    struct ThreadRing
+    {
+        /* Index of the next span, published by the owning thread after the slot is filled */
+        std::atomic<uint64_t> writeIndex;
+        std::atomic<bool> ready;
+        std::atomic<const char*> name;
+        pid_t tid;
+        std::unique_ptr<SpanRecord[]> spans;
+    };
+
+    std::unique_ptr<ThreadRing[]> rings;
+    std::atomic<unsigned> ringsClaimed(0);
+    uint64_t ringCapacity = 0;
+    std::atomic<uint32_t> lastId(0);
+
+    thread_local ThreadRing* threadRing = nullptr;
+    thread_local bool threadRingClaimed = false;
+
+    /* Synthetic timelines of the queue waits start above the range of kernel thread ids */
+    constexpr int LANE_TID_BASE = 0x40000000;
+    constexpr unsigned MAX_LANES = 32;
+
+    ThreadRing* Claim(const char* name) noexcept
+    {
+        if(!threadRingClaimed) {
+            threadRingClaimed = true;
+            unsigned slot = ringsClaimed.fetch_add(1);
+            if(slot < TRACE_MAX_THREADS) {
+                ThreadRing& r = rings[slot];
+                r.tid = static_cast<pid_t>(syscall(SYS_gettid));
+                r.name.store(name ? name : "thread", std::memory_order_relaxed);
+                r.ready.store(true, std::memory_order_release);
+                threadRing = &r;
+            }
+        }
+        else if(threadRing != nullptr && name != nullptr) {
+            threadRing->name.store(name, std::memory_order_relaxed);
+        }
+        return threadRing;
+    }
+
+    bool IsAsync(uint8_t kind)
+    {
+        return kind == Tracing::SPAN_IN_QUEUE || kind == Tracing::SPAN_DELAYED_SLOT ||
+               kind == Tracing::SPAN_SUPERSEDED || kind == Tracing::SPAN_OUT_QUEUE;
+    }
+
+    const char* SpanName(uint8_t kind)
+    {
+        switch(kind) {
+            case Tracing::SPAN_RECV: return "recv";
+            case Tracing::SPAN_IN_QUEUE: return "inQueue wait";
+            case Tracing::SPAN_DISPATCH: return "dispatch";
+            case Tracing::SPAN_DELAYED_SLOT: return "delayed slot wait";
+            case Tracing::SPAN_SUPERSEDED: return "delayed slot superseded";
+            case Tracing::SPAN_DEVICE_IO: return "device io";
+            case Tracing::SPAN_OUT_QUEUE: return "outQueue wait";
+            case Tracing::SPAN_REPLY_SEND: return "reply send";
+            default: return "unknown";
+        }
+    }
+
+    struct Entry
+    {
+        SpanRecord span;
+        int tid;
+    };
+
+    struct Timeline
+    {
+        int tid;
+        std::string name;
+        int sortIndex;
+    };
+
+    /* Copies the spans of a ring, spans overwritten while copying are dropped */
+    void CopyRing(const ThreadRing& r, std::vector<Entry>& entries)
+    {
+        uint64_t end = r.writeIndex.load(std::memory_order_acquire);
+        uint64_t begin = end > ringCapacity ? end - ringCapacity : 0;
+        size_t first = entries.size();
+
+        for(uint64_t i = begin; i < end; ++i) {
+            entries.push_back({ r.spans[i & (ringCapacity - 1)], r.tid });
+        }
+
+/*
+ * NOTE: The owner may be filling the slot of index after while we copy, so spans below
+ * after + 1 - capacity could be torn
+ */
+        uint64_t after = r.writeIndex.load(std::memory_order_acquire);
+        uint64_t valid = after + 1 > ringCapacity ? after + 1 - ringCapacity : 0;
+        if(valid > begin) {
+            size_t torn = std::min(valid - begin, end - begin);
+            entries.erase(entries.begin() + first, entries.begin() + first + torn);
+        }
+    }
+
+/*
+ * Waits of different messages in the same queue overlap without nesting, which a single
+ * timeline can not show. They are spread over lanes, a span goes to the first lane that is
+ * free at its start.
+ */
+    size_t AssignLanes(std::vector<Entry>& waits, std::vector<Timeline>& timelines)
+    {
+        std::sort(waits.begin(), waits.end(), [](const Entry& a, const Entry& b) {
+            if(a.span.kind != b.span.kind) return a.span.kind < b.span.kind;
+            return a.span.startNs < b.span.startNs;
+        });
+
+        size_t dropped = 0;
+        std::vector<uint64_t> laneEnd;
+        uint8_t kind = 0xff;
+
+        for(Entry& e : waits) {
+            if(e.span.kind != kind) {
+                kind = e.span.kind;
+                laneEnd.clear();
+            }
+
+            size_t lane = 0;
+            while(lane < laneEnd.size() && laneEnd[lane] > e.span.startNs) ++lane;
+            if(lane == MAX_LANES) {
+                e.tid = -1;
+                ++dropped;
+                continue;
+            }
+
+            e.tid = LANE_TID_BASE + kind * MAX_LANES + lane;
+            if(lane == laneEnd.size()) {
+                laneEnd.push_back(e.span.endNs);
+                timelines.push_back({ e.tid, std::string(SpanName(kind)) + " " + std::to_string(lane),
+                                      static_cast<int>(TRACE_MAX_THREADS + kind * MAX_LANES + lane) });
+            }
+            else {
+                laneEnd[lane] = e.span.endNs;
+            }
+        }
+
+        waits.erase(std::remove_if(waits.begin(), waits.end(), [](const Entry& e) { return e.tid == -1; }), waits.end());
+        return dropped;
+    }
+
+    void PrintTimestamp(FILE* f, const char* key, uint64_t ns)
+    {
+        fprintf(f, ",\"%s\":%llu.%03u", key, static_cast<unsigned long long>(ns / 1000), static_cast<unsigned>(ns % 1000));
+    }
+
+    void PrintEntry(FILE* f, const Entry& e, pid_t pid)
+    {
+        const char* msgName = RoverNet::MessageTypeName(e.span.msgType);
+        uint64_t duration = e.span.endNs > e.span.startNs ? e.span.endNs - e.span.startNs : 0;
+
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d",
+                SpanName(e.span.kind), IsAsync(e.span.kind) ? "queue" : "message", pid, e.tid);
+        PrintTimestamp(f, "ts", e.span.startNs);
+        PrintTimestamp(f, "dur", duration);
+        fprintf(f, ",\"args\":{\"id\":%u,\"msg\":\"%s\"}}", e.span.id, msgName ? msgName : "unknown");
+    }
+
+    /* Flow event linking spans of one message, step is s for the first, f for the last */
+    void PrintFlow(FILE* f, const Entry& e, pid_t pid, char step)
+    {
+        fprintf(f, ",\n{\"name\":\"message\",\"cat\":\"flow\",\"ph\":\"%c\",\"id\":%u,\"pid\":%d,\"tid\":%d%s",
+                step, e.span.id, pid, e.tid, step == 'f' ? ",\"bp\":\"e\"" : "");
+        PrintTimestamp(f, "ts", e.span.startNs);
+        fprintf(f, "}");
+    }
+};
+
+namespace Tracing
+{
+    std::atomic<bool> enabled(false);
+
+    void Enable(size_t eventsPerThread)
+    {
+        if(rings) THROW_RUNTIME_MSG("tracing already enabled");
+
+        uint64_t capacity = 2;
+        while(capacity < eventsPerThread) capacity <<= 1;
+
+        std::unique_ptr<ThreadRing[]> r(new ThreadRing[TRACE_MAX_THREADS]);
+        for(unsigned i = 0; i < TRACE_MAX_THREADS; ++i) {
+            r[i].writeIndex.store(0, std::memory_order_relaxed);
+            r[i].ready.store(false, std::memory_order_relaxed);
+            r[i].name.store(nullptr, std::memory_order_relaxed);
+            r[i].tid = 0;
+            r[i].spans.reset(new SpanRecord[capacity]);
+        }
+
+        ringCapacity = capacity;
+        ringsClaimed.store(0);
+        rings = std::move(r);
+        enabled.store(true, std::memory_order_release);
+
+        RLOG_INFO("Tracing", "tracing enabled, %llu spans per thread", static_cast<unsigned long long>(capacity));
+    }
+
+    void Disable() noexcept
+    {
+        enabled.store(false);
+        rings.reset();
+        ringCapacity = 0;
+    }
+
+    uint32_t NewId() noexcept
+    {
+        if(!Enabled()) return 0;
+
+        uint32_t id = lastId.fetch_add(1, std::memory_order_relaxed) + 1;
+        /* 0 means not traced, skipped when the counter wraps */
+        if(id == 0) id = lastId.fetch_add(1, std::memory_order_relaxed) + 1;
+        return id;
+    }
+
+    void RegisterThread(const char* name) noexcept
+    {
+        if(Enabled()) Claim(name);
+    }
+
+    void Span(SpanKind kind, uint32_t id, uint8_t msgType, uint64_t startNs, uint64_t endNs) noexcept
+    {
+        if(id == 0 || !Enabled()) return;
+
+        ThreadRing* r = Claim(nullptr);
+        if(r == nullptr) return;
+
+        uint64_t index = r->writeIndex.load(std::memory_order_relaxed);
+        SpanRecord& s = r->spans[index & (ringCapacity - 1)];
+        s.startNs = startNs;
+        s.endNs = endNs;
+        s.id = id;
+        s.kind = kind;
+        s.msgType = msgType;
+        r->writeIndex.store(index + 1, std::memory_order_release);
+    }
+
+    bool Dump(const char* path) noexcept
+    {
+        if(!rings) {
+            RLOG_WARNING("Tracing", "trace dump requested but tracing is not enabled");
+            return false;
+        }
+
+        try {
+            std::vector<Entry> spans;
+            std::vector<Entry> waits;
+            std::vector<Timeline> timelines;
+
+            unsigned count = std::min(ringsClaimed.load(std::memory_order_acquire), TRACE_MAX_THREADS);
+            for(unsigned i = 0; i < count; ++i) {
+                const ThreadRing& r = rings[i];
+                if(!r.ready.load(std::memory_order_acquire)) continue;
+
+                timelines.push_back({ r.tid, r.name.load(std::memory_order_relaxed), static_cast<int>(i) });
+                CopyRing(r, spans);
+            }
+
+            auto async = std::stable_partition(spans.begin(), spans.end(), [](const Entry& e) { return !IsAsync(e.span.kind); });
+            waits.assign(async, spans.end());
+            spans.erase(async, spans.end());
+
+            size_t dropped = AssignLanes(waits, timelines);
+            spans.insert(spans.end(), waits.begin(), waits.end());
+
+            /* Spans of one message are adjacent and in time order for the flow events */
+            std::sort(spans.begin(), spans.end(), [](const Entry& a, const Entry& b) {
+                if(a.span.id != b.span.id) return a.span.id < b.span.id;
+                return a.span.startNs < b.span.startNs;
+            });
+
+            std::string tmpPath = std::string(path) + ".tmp";
+            FILE* f = fopen(tmpPath.c_str(), "w");
+            if(f == nullptr) THROW_RUNTIME();
+
+            pid_t pid = getpid();
+            fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                       "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"rover_daemon\"}}", pid);
+
+            for(const Timeline& t : timelines) {
+                fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                        pid, t.tid, t.name.c_str());
+                fprintf(f, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"sort_index\":%d}}",
+                        pid, t.tid, t.sortIndex);
+            }
+
+            for(size_t i = 0; i < spans.size(); ++i) {
+                const Entry& e = spans[i];
+                PrintEntry(f, e, pid);
+
+                bool first = (i == 0 || spans[i - 1].span.id != e.span.id);
+                bool last = (i + 1 == spans.size() || spans[i + 1].span.id != e.span.id);
+                if(!(first && last)) PrintFlow(f, e, pid, first ? 's' : (last ? 'f' : 't'));
+            }
+
+            fprintf(f, "\n]}\n");
+
+            bool failed = ferror(f);
+            if(0 != fclose(f) || failed) {
+                unlink(tmpPath.c_str());
+                THROW_RUNTIME_MSG("error writing %s", tmpPath.c_str());
+            }
+            if(0 != rename(tmpPath.c_str(), path)) THROW_RUNTIME();
+
+            RLOG_NOTICE("Tracing", "%zu spans written to %s", spans.size(), path);
+            if(dropped != 0) RLOG_WARNING("Tracing", "%zu queue waits over %u concurrent not shown", dropped, MAX_LANES);
+            return true;
+        }
+        catch(const std::exception& e) {
+            RLOG_WARNING("Tracing", "trace dump failed: %s", e.what());
+            return false;
+        }
+    }
+};
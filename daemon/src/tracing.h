@@ -0,0 +1,90 @@
+/*
+ * tracing.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _TRACING_H_
+#define _TRACING_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+#include "util.h"
+
+/*
+ * Opt-in tracing of the message lifecycle. Every received message gets a trace id that is
+ * carried in Message::meta through the queues and copied to its response, each stage the
+ * message passes records a span with the id. Spans are kept in a ring per thread, recording
+ * takes no lock, no system call and does not allocate. Dump() writes the rings as Chrome
+ * trace event JSON, which opens in Perfetto (ui.perfetto.dev) or chrome://tracing.
+ *
+ * Work done by a thread is shown on the thread's timeline, the time a message spends
+ * waiting in a queue or in the delayed command slot is shown as an async span.
+ */
+namespace Tracing
+{
+    enum SpanKind : uint8_t
+    {
+        /* Incoming thread: decoding and routing of a received message */
+        SPAN_RECV,
+        /* Async: wait in the queue to the device service */
+        SPAN_IN_QUEUE,
+        /* Device command thread: handling of a dequeued message */
+        SPAN_DISPATCH,
+        /* Async: wait of a wheel command in the delayed slot until it is sent to the device */
+        SPAN_DELAYED_SLOT,
+        /* Async: wait of a wheel command that was replaced in the slot by a newer one */
+        SPAN_SUPERSEDED,
+        /* Call into the device library */
+        SPAN_DEVICE_IO,
+        /* Async: wait of a response in the outgoing queue */
+        SPAN_OUT_QUEUE,
+        /* Outgoing thread: sending of a response */
+        SPAN_REPLY_SEND
+    };
+
+    extern std::atomic<bool> enabled;
+
+/*
+ * Allocates rings of the given number of spans for up to TRACE_MAX_THREADS threads and
+ * starts tracing. Must be called before the traced threads start, throws runtime_error on failure.
+ */
+    void Enable(size_t eventsPerThread);
+
+    /* Must be called after the traced threads stopped */
+    void Disable() noexcept;
+
+    inline bool Enabled() noexcept
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    /* Timestamp for a span, 0 when tracing is disabled */
+    inline uint64_t Now() noexcept
+    {
+        return Enabled() ? MonotonicNs() : 0;
+    }
+
+    /* Id for a new message, 0 when tracing is disabled */
+    uint32_t NewId() noexcept;
+
+    /* Names the timeline of the calling thread, name is not copied */
+    void RegisterThread(const char* name) noexcept;
+
+    /* Records a span of the given message on the calling thread, does nothing for id 0 */
+    void Span(SpanKind kind, uint32_t id, uint8_t msgType, uint64_t startNs, uint64_t endNs) noexcept;
+
+/*
+ * Writes spans of all threads to path as Chrome trace event JSON, may be called while the
+ * traced threads run. Returns false and logs the reason on failure.
+ */
+    bool Dump(const char* path) noexcept;
+};
+
+#endif /* _TRACING_H_ */
@@ -12,20 +12,133 @@
 #define _ROVER_UTIL_H_
 
 #include <time.h>
+#include <cstdint>
 #include <string>
 
 
 const char* const MAIN_NAME = "Rover Daemon ";
 
-constexpr time_t DEV_CMD_SEND_T_SEC = 0;
-constexpr long DEV_CMD_SEND_T_NSEC = 100000000L; //100 msec
+/* Shortest interval between two wheel commands written to the device, later ones are coalesced */
+constexpr uint64_t DEV_CMD_SEND_NS = 100000000ULL;
+/* Default age limit of timestamped wheel speed commands */
+constexpr uint32_t DEV_CMD_MAX_AGE_MS = 500;
+/* Requests preallocated for one coalesced device read, more grow the list only under backlog */
+constexpr size_t DEV_REQUEST_WAITERS = 64;
 
 constexpr unsigned int NET_STATUS_BCAST_T_SEC = 5;
 
+/* Items preallocated by MessageQueue, the queue grows beyond this only under backlog */
+constexpr size_t MESSAGE_QUEUE_CAPACITY = 256;
+
+/* Messages in one BATCH frame, not counting the prefixes */
+constexpr unsigned BATCH_MAX_ITEMS = 8;
+/* Distance filtering, the median window is odd and at most DISTANCE_MEDIAN_MAX samples */
+constexpr unsigned DISTANCE_MEDIAN_MAX = 9;
+constexpr unsigned DISTANCE_MEDIAN_DEFAULT = 3;
+constexpr int32_t DISTANCE_OUTLIER_CM = 30;
+constexpr float DISTANCE_ACCEL_NOISE = 100.0f;
+constexpr float DISTANCE_SAMPLE_NOISE = 2.0f;
+/* Filtered distance above the stop distance that releases the reflex */
+constexpr int32_t DEV_REFLEX_HYSTERESIS_CM = 10;
+/* Shortest distance sampling period while the reflex is on, the sensor may be slower */
+constexpr uint64_t DEV_DISTANCE_SAMPLE_NS = 20000000ULL;
+/* Gap since the last command above this share of the deadman deadline counts as a near miss */
+constexpr unsigned DEV_DEADMAN_NEAR_MISS_PERCENT = 75;
+/* Buckets of the inter-command gap histogram, the first is under 1 ms, then powers of two */
+constexpr unsigned DEV_GAP_BUCKETS = 16;
+/* Control rate and default acceleration (speed units per second) of CMD_RAMP_WHEELS_SPEED */
+constexpr uint32_t DEV_RAMP_RATE_HZ = 50;
+constexpr uint32_t DEV_RAMP_ACCEL = 510;
+/* Setpoints of one CMD_TRAJECTORY */
+constexpr unsigned TRAJECTORY_MAX_POINTS = 64;
+/* Batches with outstanding replies preallocated, more grow the table only under backlog */
+constexpr size_t DEV_PENDING_BATCHES = 16;
+
+/* History of distance samples and wheel setpoints: the samples and coarser tiers of buckets */
+constexpr unsigned HISTORY_MAX_CHANNELS = 2;
+constexpr size_t HISTORY_SAMPLES = 4096;
+constexpr unsigned HISTORY_TIERS = 2;
+constexpr uint64_t HISTORY_TIER_NS[HISTORY_TIERS] = { 1000000000ULL, 60000000000ULL };
+constexpr size_t HISTORY_TIER_BUCKETS[HISTORY_TIERS] = { 3600, 1440 };
+/* HISTORY_POINT messages of one MSG_HISTORY, each carries four values */
+constexpr unsigned HISTORY_MAX_POINTS = 64;
+constexpr unsigned HISTORY_MAX_BINS = HISTORY_MAX_POINTS * 4;
+
 constexpr uint16_t SERVER_TCP_PORT = 5551;
 constexpr const char* SERVER_IP4_ADDR = "192.168.1.4";
 
 constexpr uint16_t SERVER_UDP_AVAL_BCAST_PORT = 5552;
 constexpr const char* SERVER_UDP_AVAL_BCAST_ADDR = "192.168.1.255";
 
+constexpr uint16_t SERVER_UDP_VIDEO_PORT = 5553;
+constexpr const char* VIDEO_DEFAULT_SOURCE = "auto";
+constexpr const char* VIDEO_DEFAULT_V4L2_DEVICE = "/dev/video0";
+constexpr uint16_t VIDEO_DEFAULT_WIDTH = 320;
+constexpr uint16_t VIDEO_DEFAULT_HEIGHT = 240;
+constexpr uint16_t VIDEO_DEFAULT_FPS = 15;
+constexpr unsigned VIDEO_POOL_FRAMES = 6;
+constexpr unsigned VIDEO_SEND_QUEUE_LEN = 2;
+constexpr unsigned VIDEO_SEND_QUEUE_MAX = 3;
+constexpr size_t VIDEO_PACKET_PAYLOAD = 1400;
+constexpr unsigned VIDEO_MAX_SUBSCRIBERS = 4;
+/* Converted frames per scale: full queue and a frame in flight per subscriber, one in conversion */
+constexpr unsigned VIDEO_CONVERTED_FRAMES = VIDEO_MAX_SUBSCRIBERS * (VIDEO_SEND_QUEUE_MAX + 1) + 1;
+constexpr unsigned VIDEO_SUBSCRIBER_TIMEOUT_SEC = 10;
+constexpr int VIDEO_SOCKET_SNDBUF = 128 * 1024;
+constexpr uint32_t VIDEO_DEFAULT_MAX_KBPS = 8000;
+constexpr uint32_t VIDEO_MIN_KBPS = 64;
+constexpr uint32_t VIDEO_CONTROL_RESERVE_KBPS = 256;
+/* Subscriber that sent reports before and stopped is treated as fully congested */
+constexpr uint64_t VIDEO_REPORT_TIMEOUT_NS = 1000000000ULL;
+/* Frames remembered per subscriber to match receiver reports */
+constexpr unsigned VIDEO_SENT_HISTORY = 32;
+
+/* Flight recorder ring, 32 byte records */
+constexpr const char* FLIGHT_RECORDER_DEFAULT_PATH = "/var/tmp/rover_daemon.rec";
+constexpr size_t FLIGHT_RECORDER_DEFAULT_RECORDS = 65536;
+
+/* Message tracing, spans kept per traced thread */
+constexpr size_t TRACE_DEFAULT_EVENTS = 16384;
+constexpr unsigned TRACE_MAX_THREADS = 16;
+
+/* Timer service: 1 ms ticks, four levels of 64 buckets reach 4.6 hours, longer deadlines are placed again */
+constexpr uint64_t TIMER_TICK_NS = 1000000ULL;
+constexpr unsigned TIMER_WHEEL_LEVELS = 4;
+constexpr unsigned TIMER_WHEEL_SLOTS = 64;
+constexpr unsigned TIMER_MAX_TIMERS = 16;
+
+/* Blocking waits one stop token can wake besides its own fd and sleeps */
+constexpr unsigned STOP_MAX_WAKERS = 8;
+
+/* Hot upgrade: wait for each step of the other daemon, time in-flight requests get before the freeze */
+constexpr int HANDOFF_TIMEOUT_MS = 5000;
+constexpr uint64_t HANDOFF_DRAIN_NS = 50000000ULL;
+/* Queued commands handed to the new daemon, more are dropped */
+constexpr unsigned HANDOFF_MAX_MESSAGES = 128;
+
+/* Stack of the service threads, the default of the C library is several megabytes */
+constexpr size_t THREAD_STACK_SIZE = 256 * 1024;
+
+constexpr long NSEC_PER_SEC = 1000000000L;
+
+inline uint64_t MonotonicNs()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return static_cast<uint64_t>(t.tv_sec) * NSEC_PER_SEC + t.tv_nsec;
+}
+
+inline timespec NsToTimespec(uint64_t ns)
+{
+    timespec t;
+    t.tv_sec = ns / NSEC_PER_SEC;
+    t.tv_nsec = ns % NSEC_PER_SEC;
+    return t;
+}
+
+inline uint64_t TimespecToNs(const timespec& t)
+{
+    return static_cast<uint64_t>(t.tv_sec) * NSEC_PER_SEC + t.tv_nsec;
+}
+
 #endif /* _ROVER_UTIL_H_ */
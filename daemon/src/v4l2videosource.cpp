@@ -0,0 +1,192 @@
+/*
+ * v4l2videosource.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include "v4l2videosource.h"
+#include "util.h"
+#include "logging.h"
+
+namespace {
+    constexpr unsigned V4L2_BUFFER_COUNT = 4;
+    constexpr int V4L2_CAPTURE_TIMEOUT_MSEC = 1000;
+
+    int XIoctl(int fd, unsigned long request, void* arg)
+    {
+        int r;
+        do {
+            r = ioctl(fd, request, arg);
+        } while(r == -1 && errno == EINTR);
+        return r;
+    }
+};
+
+V4L2VideoSource::V4L2VideoSource(const std::string& device, const VideoFormat& format):
+    device(device),
+    format(format),
+    fd(-1),
+    sequence(0),
+    streaming(false)
+{
+}
+
+V4L2VideoSource::~V4L2VideoSource()
+{
+    try {
+        Close();
+    }
+    catch(const std::exception& e) {
+        RLOG_EXCEPT("V4L2VideoSource", e);
+    }
+}
+
+void V4L2VideoSource::Open()
+{
+    if(-1 == (fd = open(device.c_str(), O_RDWR | O_NONBLOCK))) THROW_RUNTIME();
+
+    v4l2_capability cap;
+    memset(&cap, 0, sizeof(cap));
+    if(-1 == XIoctl(fd, VIDIOC_QUERYCAP, &cap)) THROW_RUNTIME();
+    if(!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(cap.capabilities & V4L2_CAP_STREAMING))
+        THROW_RUNTIME_MSG("%s does not support streaming capture", device.c_str());
+
+    v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = format.width;
+    fmt.fmt.pix.height = format.height;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if(-1 == XIoctl(fd, VIDIOC_S_FMT, &fmt)) THROW_RUNTIME();
+    if(fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV) THROW_RUNTIME_MSG("%s does not support YUYV", device.c_str());
+
+    /* Driver may adjust the resolution */
+    format.width = fmt.fmt.pix.width;
+    format.height = fmt.fmt.pix.height;
+    format.fourcc = VIDEO_FMT_YUYV;
+    if(fmt.fmt.pix.bytesperline != static_cast<uint32_t>(format.width) * 2)
+        THROW_RUNTIME_MSG("%s uses padded lines which are not supported", device.c_str());
+
+    v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = format.fps;
+    if(-1 == XIoctl(fd, VIDIOC_S_PARM, &parm)) {
+        RLOG_WARNING("V4L2VideoSource", "unable to set frame rate: %m");
+    }
+
+    v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = V4L2_BUFFER_COUNT;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if(-1 == XIoctl(fd, VIDIOC_REQBUFS, &req)) THROW_RUNTIME();
+    if(req.count < 2) THROW_RUNTIME_MSG("%s: insufficient buffer memory", device.c_str());
+
+    buffers.clear();
+    for(unsigned i = 0; i < req.count; ++i) {
+        v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if(-1 == XIoctl(fd, VIDIOC_QUERYBUF, &buf)) THROW_RUNTIME();
+
+        void* mem = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+        if(mem == MAP_FAILED) THROW_RUNTIME();
+        buffers.emplace_back(mem, buf.length);
+
+        if(-1 == XIoctl(fd, VIDIOC_QBUF, &buf)) THROW_RUNTIME();
+    }
+
+    pool.reset(new FramePool(buffers, RequeueBuffer, this));
+
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if(-1 == XIoctl(fd, VIDIOC_STREAMON, &type)) THROW_RUNTIME();
+    streaming = true;
+    sequence = 0;
+
+    RLOG_NOTICE("V4L2VideoSource", "capturing %ux%u@%u from %s", format.width, format.height, format.fps, device.c_str());
+}
+
+void V4L2VideoSource::Close()
+{
+/*
+ * NOTE: All frames have to be released by the caller before Close, the pool
+ * would otherwise reference unmapped memory
+ */
+    if(streaming) {
+        v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if(-1 == XIoctl(fd, VIDIOC_STREAMOFF, &type)) RLOG_ERRNO("V4L2VideoSource");
+        streaming = false;
+    }
+
+    pool.reset();
+
+    for(auto& b : buffers) {
+        munmap(b.first, b.second);
+    }
+    buffers.clear();
+
+    if(fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+FrameRef V4L2VideoSource::Capture(StopToken& stop)
+{
+    pollfd fds[2] = { { fd, POLLIN, 0 }, { stop.Fd(), POLLIN, 0 } };
+    int r = poll(fds, 2, V4L2_CAPTURE_TIMEOUT_MSEC);
+
+    if(r == -1 && errno != EINTR) THROW_RUNTIME();
+    if(r <= 0 || fds[0].revents == 0 || stop.Requested()) return FrameRef();
+
+    v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+
+    if(-1 == XIoctl(fd, VIDIOC_DQBUF, &buf)) {
+        if(errno == EAGAIN) return FrameRef();
+        THROW_RUNTIME();
+    }
+
+    FrameRef frame = pool->Adopt(buf.index);
+    frame->format = format;
+    frame->size = buf.bytesused;
+    frame->sequence = sequence++;
+    frame->timestampNs = TimespecToNs({ buf.timestamp.tv_sec, buf.timestamp.tv_usec * 1000 });
+
+    return frame;
+}
+
+void V4L2VideoSource::RequeueBuffer(void* ctx, unsigned index)
+{
+    V4L2VideoSource* src = static_cast<V4L2VideoSource*>(ctx);
+
+    v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+
+    if(src->streaming && -1 == XIoctl(src->fd, VIDIOC_QBUF, &buf)) {
+        RLOG_ERRNO("V4L2VideoSource");
+    }
+}
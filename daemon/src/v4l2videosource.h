@@ -0,0 +1,47 @@
+/*
+ * v4l2videosource.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _V4L2_VIDEO_SOURCE_H_
+#define _V4L2_VIDEO_SOURCE_H_
+
+#include <vector>
+
+#include "videosource.h"
+
+/*
+ * V4L2 capture using driver mmap buffers. The buffers are handed out directly as pool
+ * frames, a buffer is queued back to the driver when its last reference is dropped.
+ */
+class V4L2VideoSource : public VideoSource
+{
+    public:
+        explicit V4L2VideoSource(const std::string& device, const VideoFormat& format);
+        ~V4L2VideoSource();
+
+        void Open() override;
+        void Close() override;
+        FrameRef Capture(StopToken& stop) override;
+        VideoFormat Format() const override { return format; }
+        const char* Name() const override { return "v4l2"; }
+
+    private:
+        static void RequeueBuffer(void* ctx, unsigned index);
+
+        std::string device;
+        VideoFormat format;
+        int fd;
+        uint32_t sequence;
+        bool streaming;
+
+        std::vector<std::pair<void*, size_t>> buffers;
+        std::unique_ptr<FramePool> pool;
+};
+
+#endif /* _V4L2_VIDEO_SOURCE_H_ */
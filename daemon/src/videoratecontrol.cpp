@@ -0,0 +1,208 @@
+/*
+ * videoratecontrol.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <algorithm>
+
+#include "videoratecontrol.h"
+#include "util.h"
+
+namespace {
+    constexpr double LOSS_HIGH = 0.05;
+    constexpr double LOSS_LOW = 0.01;
+    constexpr double QUEUE_HIGH = 0.5;
+    constexpr double QUEUE_LOW = 0.1;
+    /* Queuing delay in the network that is treated as congestion, and as free capacity */
+    constexpr uint64_t DELAY_HIGH_NS = 50000000ULL;
+    constexpr uint64_t DELAY_LOW_NS = 15000000ULL;
+
+    constexpr double DECREASE_FACTOR = 0.75;
+    /* New estimate after a loss event, fraction of the rate the client actually received */
+    constexpr double DELIVERED_FACTOR = 0.9;
+    /* Additive increase per second, fraction of the maximum rate */
+    constexpr double INCREASE_PER_SEC = 0.05;
+    /* Switching to a higher level requires this much spare budget */
+    constexpr double UPGRADE_MARGIN = 0.85;
+
+    /* Longest pause of the stream while the network queue drains */
+    constexpr uint64_t DRAIN_MAX_NS = 1000000000ULL;
+
+    /* Send queue must get a chance to drain before it cuts the rate again */
+    constexpr uint64_t DECREASE_HOLDOFF_NS = 500000000ULL;
+    constexpr uint64_t INCREASE_HOLDOFF_NS = 1000000000ULL;
+};
+
+VideoRateController::VideoRateController(const Config& config):
+    config(config),
+    ladderSize(0),
+    ladderIndex(0),
+    level({ 0, 1 }),
+    estimate(config.maxRate),
+    lastDecreaseNs(0),
+    lastIncreaseNs(0),
+    baseDelayNs(UINT64_MAX),
+    drainUntilNs(0),
+    tokens(0),
+    lastRefillNs(0)
+{
+}
+
+void VideoRateController::Configure(const size_t* frameBytes, unsigned scaleLevels, unsigned fps, uint64_t nowNs)
+{
+    static const unsigned dividers[] = { 1, 2 };
+    static const unsigned lastLevelDividers[] = { 4, 8 };
+
+/*
+ * Ladder goes from the best to the worst quality: each resolution at full and half frame
+ * rate, the smallest resolution additionally at quarter and eighth of the frame rate
+ */
+    ladderSize = 0;
+    for(unsigned s = 0; s < scaleLevels; ++s) {
+        for(unsigned d : dividers) {
+            ladder[ladderSize] = { s, d };
+            ladderRate[ladderSize] = static_cast<double>(frameBytes[s]) * fps / d;
+            ladderSize++;
+        }
+    }
+    for(unsigned d : lastLevelDividers) {
+        ladder[ladderSize] = { scaleLevels - 1, d };
+        ladderRate[ladderSize] = static_cast<double>(frameBytes[scaleLevels - 1]) * fps / d;
+        ladderSize++;
+    }
+
+    estimate = config.maxRate;
+    ladderIndex = 0;
+    baseDelayNs = UINT64_MAX;
+    drainUntilNs = 0;
+    lastDecreaseNs = 0;
+    lastIncreaseNs = nowNs;
+    lastRefillNs = nowNs;
+    tokens = 0;
+
+    SelectLevel();
+}
+
+double VideoRateController::Budget() const noexcept
+{
+    return std::max(0.0, estimate - config.controlReserve);
+}
+
+void VideoRateController::OnReceiverReport(uint64_t nowNs, uint64_t frameSentNs, double lossFraction,
+        double deliveredRate, uint64_t frameDelayNs, uint64_t backlogNs)
+{
+    uint64_t queuingDelay = 0;
+
+    if(frameDelayNs != 0) {
+        baseDelayNs = std::min(baseDelayNs, frameDelayNs);
+        queuingDelay = frameDelayNs - baseDelayNs;
+    }
+
+/*
+ * NOTE: The backlog is current, the frame delay and loss of frames sent before the last
+ * decrease still describe the old queue
+ */
+    bool lateSignal = frameSentNs >= lastDecreaseNs && (lossFraction > LOSS_HIGH || queuingDelay > DELAY_HIGH_NS);
+
+    if(backlogNs > DELAY_HIGH_NS || lateSignal) {
+        Drain(nowNs, backlogNs);
+        Decrease(nowNs, deliveredRate);
+    }
+    else if(lossFraction < LOSS_LOW && queuingDelay < DELAY_LOW_NS && backlogNs < DELAY_HIGH_NS) {
+        Increase(nowNs);
+    }
+}
+
+void VideoRateController::OnSendQueue(uint64_t nowNs, double occupancy)
+{
+    if(occupancy > QUEUE_HIGH) {
+        Decrease(nowNs, 0);
+    }
+    else if(occupancy < QUEUE_LOW) {
+        Increase(nowNs);
+    }
+}
+
+bool VideoRateController::AdmitFrame(uint64_t nowNs, size_t bytes)
+{
+    if(nowNs < drainUntilNs) {
+        tokens = 0;
+        lastRefillNs = nowNs;
+        return false;
+    }
+
+    double rate = Budget();
+    double depth = std::max(static_cast<double>(bytes), rate * 0.2);
+
+    tokens = std::min(depth, tokens + rate * (nowNs - lastRefillNs) / NSEC_PER_SEC);
+    lastRefillNs = nowNs;
+
+    if(tokens < bytes) return false;
+
+    tokens -= bytes;
+    return true;
+}
+
+void VideoRateController::Drain(uint64_t nowNs, uint64_t backlogNs)
+{
+    drainUntilNs = std::max(drainUntilNs, nowNs + std::min(backlogNs, DRAIN_MAX_NS));
+}
+
+void VideoRateController::Decrease(uint64_t nowNs, double deliveredRate)
+{
+    if(nowNs - lastDecreaseNs < DECREASE_HOLDOFF_NS) return;
+
+    double next = estimate * DECREASE_FACTOR;
+    if(deliveredRate > 0) next = std::min(next, deliveredRate * DELIVERED_FACTOR);
+
+    estimate = std::max<double>(config.minRate + config.controlReserve, next);
+    lastDecreaseNs = nowNs;
+    lastIncreaseNs = nowNs;
+
+    SelectLevel();
+}
+
+void VideoRateController::Increase(uint64_t nowNs)
+{
+    if(nowNs - lastDecreaseNs < INCREASE_HOLDOFF_NS) {
+        lastIncreaseNs = nowNs;
+        return;
+    }
+
+    double step = static_cast<double>(config.maxRate) * INCREASE_PER_SEC * (nowNs - lastIncreaseNs) / NSEC_PER_SEC;
+    estimate = std::min<double>(config.maxRate, estimate + step);
+    lastIncreaseNs = nowNs;
+
+    SelectLevel();
+}
+
+void VideoRateController::SelectLevel()
+{
+    if(ladderSize == 0) return;
+
+    double budget = Budget();
+    unsigned index = ladderSize - 1;
+
+    for(unsigned i = 0; i < ladderSize; ++i) {
+        double limit = (i < ladderIndex) ? budget * UPGRADE_MARGIN : budget;
+        if(ladderRate[i] <= limit) {
+            index = i;
+            break;
+        }
+    }
+
+/*
+ * NOTE: Frame size changes with the level and so does the delay of an uncongested frame.
+ * Smaller frames only lower it, which the minimum follows, the baseline is kept then so
+ * that a queue standing after a decrease is not learned as the new baseline.
+ */
+    if(index < ladderIndex) baseDelayNs = UINT64_MAX;
+
+    ladderIndex = index;
+    level = ladder[index];
+}
@@ -0,0 +1,100 @@
+/*
+ * videoratecontrol.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _VIDEO_RATE_CONTROL_H_
+#define _VIDEO_RATE_CONTROL_H_
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Congestion control for the video stream. The available bandwidth is estimated AIMD style
+ * from client receiver reports (loss, delivered rate and queuing delay) and from the occupancy
+ * of the local socket send queue. Video gets the estimate minus the headroom reserved for control traffic,
+ * the budget is met by first lowering the frame rate, then the resolution and finally by
+ * dropping frames that do not fit the token bucket. When congestion shows, no frame is sent
+ * until the data already in the network has been delivered.
+ *
+ * The class is not synchronized, the owner serializes the calls.
+ */
+class VideoRateController
+{
+    public:
+        struct Config
+        {
+            /* Upper bound and starting point of the estimate, bytes per second */
+            uint32_t maxRate;
+            /* Lower bound of the video budget, bytes per second */
+            uint32_t minRate;
+            /* Bandwidth never given to video, bytes per second */
+            uint32_t controlReserve;
+        };
+
+        struct Level
+        {
+            unsigned scaleShift;
+            unsigned frameDivider;
+        };
+
+        explicit VideoRateController(const Config& config);
+
+/*
+ * Frame sizes in bytes (including packet headers) for each supported scale shift
+ * and the source frame rate, resets the state
+ */
+        void Configure(const size_t* frameBytes, unsigned scaleLevels, unsigned fps, uint64_t nowNs);
+
+/*
+ * Receiver report interval summary, frameDelayNs is the one way delay of the frame sent
+ * at frameSentNs (0 when unknown). Queuing delay is measured against the smallest delay
+ * seen since the last level change. backlogNs is the time the data in flight takes to be
+ * delivered at deliveredRate.
+ */
+        void OnReceiverReport(uint64_t nowNs, uint64_t frameSentNs, double lossFraction,
+                double deliveredRate, uint64_t frameDelayNs, uint64_t backlogNs);
+
+        /* Local send queue occupancy, fraction of the socket send buffer in use */
+        void OnSendQueue(uint64_t nowNs, double occupancy);
+
+        /* Token bucket check, consumes tokens when the frame is admitted */
+        bool AdmitFrame(uint64_t nowNs, size_t bytes);
+
+        Level CurrentLevel() const noexcept { return level; }
+        double Estimate() const noexcept { return estimate; }
+        double Budget() const noexcept;
+
+    private:
+        static constexpr unsigned MAX_LADDER = 16;
+
+        /* Stops admitting frames until the network queue built up so far has drained */
+        void Drain(uint64_t nowNs, uint64_t backlogNs);
+        void Decrease(uint64_t nowNs, double deliveredRate);
+        void Increase(uint64_t nowNs);
+        void SelectLevel();
+
+        Config config;
+
+        Level ladder[MAX_LADDER];
+        double ladderRate[MAX_LADDER];
+        unsigned ladderSize;
+        unsigned ladderIndex;
+        Level level;
+
+        double estimate;
+        uint64_t lastDecreaseNs;
+        uint64_t lastIncreaseNs;
+        uint64_t baseDelayNs;
+        uint64_t drainUntilNs;
+
+        double tokens;
+        uint64_t lastRefillNs;
+};
+
+#endif /* _VIDEO_RATE_CONTROL_H_ */
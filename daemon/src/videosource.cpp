@@ -0,0 +1,230 @@
+/*
+ * videosource.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "videosource.h"
+#include "v4l2videosource.h"
+#include "util.h"
+#include "logging.h"
+
+namespace {
+/*
+ * Parse optional "WxH[@FPS]" suffix, fields that are not present keep their defaults
+ */
+    VideoFormat ParseFormat(const std::string& str)
+    {
+        VideoFormat format = { VIDEO_FMT_YUYV, VIDEO_DEFAULT_WIDTH, VIDEO_DEFAULT_HEIGHT, VIDEO_DEFAULT_FPS };
+
+        if(str.empty()) return format;
+
+        unsigned w = 0, h = 0, fps = 0;
+        int n = sscanf(str.c_str(), "%ux%u@%u", &w, &h, &fps);
+        if(n < 2 || w == 0 || h == 0 || w > 4096 || h > 4096 || (w % 2) != 0 || (h % 2) != 0)
+            THROW_RUNTIME_MSG("Invalid video format: %s", str.c_str());
+
+        format.width = w;
+        format.height = h;
+        if(n == 3) {
+            if(fps == 0 || fps > 120) THROW_RUNTIME_MSG("Invalid video frame rate: %u", fps);
+            format.fps = fps;
+        }
+
+        return format;
+    }
+
+/*
+ * Advance absolute frame deadline, skipping missed periods instead of bursting to catch up
+ */
+    uint64_t NextDeadline(uint64_t deadlineNs, uint16_t fps)
+    {
+        uint64_t period = NSEC_PER_SEC / fps;
+        uint64_t now = MonotonicNs();
+
+        deadlineNs += period;
+        if(deadlineNs < now) deadlineNs = now + period;
+
+        return deadlineNs;
+    }
+};
+
+std::unique_ptr<VideoSource> VideoSource::Create(const std::string& spec)
+{
+    std::string kind = spec.substr(0, spec.find(':'));
+    std::string args = (kind.size() < spec.size()) ? spec.substr(kind.size() + 1) : std::string();
+
+    if(kind == "none") {
+        return nullptr;
+    }
+    else if(kind == "pattern") {
+        return std::unique_ptr<VideoSource>(new PatternVideoSource(ParseFormat(args)));
+    }
+    else if(kind == "file") {
+        std::string path = args.substr(0, args.find(':'));
+        std::string format = (path.size() < args.size()) ? args.substr(path.size() + 1) : std::string();
+        if(path.empty()) THROW_RUNTIME_MSG("Missing file path in video source: %s", spec.c_str());
+        return std::unique_ptr<VideoSource>(new FileVideoSource(path, ParseFormat(format)));
+    }
+    else if(kind == "v4l2") {
+        std::string device = args.substr(0, args.find(':'));
+        std::string format = (device.size() < args.size()) ? args.substr(device.size() + 1) : std::string();
+        if(device.empty()) device = VIDEO_DEFAULT_V4L2_DEVICE;
+        return std::unique_ptr<VideoSource>(new V4L2VideoSource(device, ParseFormat(format)));
+    }
+    else if(kind == "auto") {
+        if(0 == access(VIDEO_DEFAULT_V4L2_DEVICE, R_OK | W_OK)) {
+            return std::unique_ptr<VideoSource>(new V4L2VideoSource(VIDEO_DEFAULT_V4L2_DEVICE, ParseFormat(args)));
+        }
+        return std::unique_ptr<VideoSource>(new PatternVideoSource(ParseFormat(args)));
+    }
+
+    THROW_RUNTIME_MSG("Unknown video source: %s", spec.c_str());
+}
+
+PatternVideoSource::PatternVideoSource(const VideoFormat& format):
+    format(format),
+    sequence(0),
+    nextDeadlineNs(0)
+{
+}
+
+void PatternVideoSource::Open()
+{
+    pool.reset(new FramePool(VIDEO_POOL_FRAMES, VideoFrameSize(format)));
+    sequence = 0;
+    nextDeadlineNs = MonotonicNs();
+}
+
+void PatternVideoSource::Close()
+{
+    pool.reset();
+}
+
+FrameRef PatternVideoSource::Capture(StopToken& stop)
+{
+    static const uint8_t bars[8][3] = {
+        /* Y, U, V */
+        { 235, 128, 128 }, { 210, 16, 146 }, { 170, 166, 16 }, { 145, 54, 34 },
+        { 106, 202, 222 }, { 81, 90, 240 }, { 41, 240, 110 }, { 16, 128, 128 }
+    };
+
+    if(!stop.SleepUntil(nextDeadlineNs)) return FrameRef();
+    nextDeadlineNs = NextDeadline(nextDeadlineNs, format.fps);
+
+    FrameRef frame = pool->Acquire();
+    if(!frame) return frame;
+
+    const size_t rowBytes = static_cast<size_t>(format.width) * 2;
+    const unsigned barWidth = (format.width / 8) & ~1u;
+    const unsigned shift = (sequence * 2) % format.width;
+    uint8_t* data = frame->Data();
+
+    /* Bars scroll horizontally, the first row is built and replicated */
+    for(unsigned x = 0; x < format.width; x += 2) {
+        unsigned bar = (((x + shift) % format.width) / (barWidth ? barWidth : 1)) & 7;
+        uint8_t* px = data + x * 2;
+        px[0] = bars[bar][0];
+        px[1] = bars[bar][1];
+        px[2] = bars[bar][0];
+        px[3] = bars[bar][2];
+    }
+    for(unsigned y = 1; y < format.height; ++y) {
+        memcpy(data + y * rowBytes, data, rowBytes);
+    }
+
+    /* Horizontal line moving down so that vertical motion is visible too */
+    uint8_t* line = data + ((sequence * 2) % format.height) * rowBytes;
+    for(size_t i = 0; i < rowBytes; i += 2) {
+        line[i] = 235;
+        line[i + 1] = 128;
+    }
+
+    frame->format = format;
+    frame->size = VideoFrameSize(format);
+    frame->sequence = sequence++;
+    frame->timestampNs = MonotonicNs();
+
+    return frame;
+}
+
+FileVideoSource::FileVideoSource(const std::string& path, const VideoFormat& format):
+    path(path),
+    format(format),
+    fd(-1),
+    sequence(0),
+    nextDeadlineNs(0)
+{
+}
+
+FileVideoSource::~FileVideoSource()
+{
+    if(fd != -1) close(fd);
+}
+
+void FileVideoSource::Open()
+{
+    if(-1 == (fd = open(path.c_str(), O_RDONLY))) THROW_RUNTIME();
+
+    pool.reset(new FramePool(VIDEO_POOL_FRAMES, VideoFrameSize(format)));
+    sequence = 0;
+    nextDeadlineNs = MonotonicNs();
+}
+
+void FileVideoSource::Close()
+{
+    pool.reset();
+    if(fd != -1) {
+        if(0 != close(fd)) RLOG_ERRNO("FileVideoSource");
+        fd = -1;
+    }
+}
+
+FrameRef FileVideoSource::Capture(StopToken& stop)
+{
+    if(!stop.SleepUntil(nextDeadlineNs)) return FrameRef();
+    nextDeadlineNs = NextDeadline(nextDeadlineNs, format.fps);
+
+    FrameRef frame = pool->Acquire();
+    if(!frame) return frame;
+
+    const size_t frameSize = VideoFrameSize(format);
+    size_t filled = 0;
+    bool rewound = false;
+
+    while(filled < frameSize) {
+        ssize_t r = read(fd, frame->Data() + filled, frameSize - filled);
+        if(r > 0) {
+            filled += r;
+        }
+        else if(r == 0) {
+/*
+ * NOTE: Partial frame at the end of file is discarded, reading restarts from the beginning
+ */
+            if(rewound) THROW_RUNTIME_MSG("Video file %s is shorter than one frame", path.c_str());
+            if(-1 == lseek(fd, 0, SEEK_SET)) THROW_RUNTIME();
+            filled = 0;
+            rewound = true;
+        }
+        else if(errno != EINTR) {
+            THROW_RUNTIME();
+        }
+    }
+
+    frame->format = format;
+    frame->size = frameSize;
+    frame->sequence = sequence++;
+    frame->timestampNs = MonotonicNs();
+
+    return frame;
+}
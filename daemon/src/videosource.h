@@ -0,0 +1,92 @@
+/*
+ * videosource.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _VIDEO_SOURCE_H_
+#define _VIDEO_SOURCE_H_
+
+#include <memory>
+#include <string>
+
+#include "framepool.h"
+#include "stoptoken.h"
+
+/*
+ * Source of video frames. Capture() blocks until the next frame is available and returns
+ * a frame taken from the source's own pool, or an empty reference when no frame could be
+ * produced (pool exhausted or timeout), in which case the caller simply retries. The wait
+ * ends early with an empty reference when the stop is requested.
+ */
+class VideoSource
+{
+    public:
+        VideoSource() = default;
+        VideoSource(const VideoSource&) = delete;
+        VideoSource& operator=(const VideoSource&) = delete;
+        virtual ~VideoSource() = default;
+
+        virtual void Open() = 0;
+        virtual void Close() = 0;
+        virtual FrameRef Capture(StopToken& stop) = 0;
+        virtual VideoFormat Format() const = 0;
+        virtual const char* Name() const = 0;
+
+/*
+ * Create source from specification string:
+ *  pattern[:WxH[@FPS]]         synthetic moving test pattern
+ *  file:PATH[:WxH[@FPS]]       raw YUYV frames read from file in a loop
+ *  v4l2[:DEVICE[:WxH[@FPS]]]   V4L2 capture device using mmap buffers
+ *  auto                        v4l2 on the default device when present, pattern otherwise
+ *  none                        video disabled, returns nullptr
+ */
+        static std::unique_ptr<VideoSource> Create(const std::string& spec);
+};
+
+/* Synthetic moving color bars, used for testing without a camera */
+class PatternVideoSource : public VideoSource
+{
+    public:
+        explicit PatternVideoSource(const VideoFormat& format);
+
+        void Open() override;
+        void Close() override;
+        FrameRef Capture(StopToken& stop) override;
+        VideoFormat Format() const override { return format; }
+        const char* Name() const override { return "pattern"; }
+
+    private:
+        VideoFormat format;
+        std::unique_ptr<FramePool> pool;
+        uint32_t sequence;
+        uint64_t nextDeadlineNs;
+};
+
+/* Raw YUYV frames read from file, rewinds at the end of file */
+class FileVideoSource : public VideoSource
+{
+    public:
+        explicit FileVideoSource(const std::string& path, const VideoFormat& format);
+        ~FileVideoSource();
+
+        void Open() override;
+        void Close() override;
+        FrameRef Capture(StopToken& stop) override;
+        VideoFormat Format() const override { return format; }
+        const char* Name() const override { return "file"; }
+
+    private:
+        std::string path;
+        VideoFormat format;
+        std::unique_ptr<FramePool> pool;
+        int fd;
+        uint32_t sequence;
+        uint64_t nextDeadlineNs;
+};
+
+#endif /* _VIDEO_SOURCE_H_ */
@@ -1,7 +1,5 @@
 /*
  * videostreammanager.cpp
- * 
- * Interface library to the rover kernel driver
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License version 3 as
@@ -10,25 +8,225 @@
  * Copyright (C) 2016 Tomasz Chadzynski
  */
 
-/*
- * NOTE: dummy implementation
- */
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <climits>
+#include <algorithm>
 
 #include "videostreammanager.h"
+#include "nettypes.h"
+#include "logging.h"
 
 namespace {
-    bool running = false;
+    constexpr unsigned VIDEO_SEND_BATCH = 32;
+    /* Paced frames leave in bursts of about this duration */
+    constexpr uint64_t VIDEO_PACING_QUANTUM_NS = 2000000ULL;
+
+    bool SameAddress(const sockaddr_in& a, const sockaddr_in& b)
+    {
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+    }
+
+    VideoRateController::Config RateConfig(const VideoConfig& config)
+    {
+        VideoRateController::Config rc;
+        rc.maxRate = config.maxKbps * 1000 / 8;
+        rc.minRate = VIDEO_MIN_KBPS * 1000 / 8;
+        rc.controlReserve = config.reserveKbps * 1000 / 8;
+        return rc;
+    }
+
+    /* Bytes on the wire for a frame, including the per datagram header */
+    size_t FrameWireBytes(size_t frameSize)
+    {
+        size_t packets = (frameSize + VIDEO_PACKET_PAYLOAD - 1) / VIDEO_PACKET_PAYLOAD;
+        return frameSize + packets * sizeof(RoverNet::VideoPacketHeader);
+    }
+};
+
+VideoStreamManager::Subscriber::Subscriber(const VideoRateController::Config& rateConfig):
+    owner(nullptr),
+    active(false),
+    dropPolicy(RoverNet::VideoDropPolicy::VID_DROP_OLDEST),
+    queueLength(VIDEO_SEND_QUEUE_LEN),
+    queueHead(0),
+    queueCount(0),
+    rateControl(rateConfig),
+    loggedLevel({ 0, 1 }),
+    framesSent(0),
+    framesDropped(0)
+{
+    PTHREAD_GUARD( pthread_cond_init(&queueCond, NULL) );
+}
+
+VideoStreamManager::Subscriber::~Subscriber()
+{
+    pthread_cond_destroy(&queueCond);
 }
 
+VideoStreamManager::VideoStreamManager(const VideoConfig& config):
+    config(config),
+    scaleShift(0),
+    videoSocket(-1),
+    running(false),
+    boundPort(0),
+    started(false),
+    subscriberCount(0),
+    levelCount(0),
+    captureCounter(0),
+    sendBufferSize(VIDEO_SOCKET_SNDBUF),
+    framesCaptured(0),
+    framesConverted(0),
+    framesSent(0),
+    framesDropped(0)
+{
+    if(config.scale != 1 && config.scale != 2 && config.scale != 4)
+        THROW_RUNTIME_MSG("Unsupported video scale %u", config.scale);
+
+    for(auto& s : subscribers) {
+        s.reset(new Subscriber(RateConfig(config)));
+        s->owner = this;
+    }
+
+    PTHREAD_GUARD( pthread_mutex_init(&subscribersMutex, NULL) );
+    PTHREAD_GUARD( pthread_cond_init(&subscribersCond, NULL) );
+    stop.Register(Wake, this);
+}
+
+VideoStreamManager::~VideoStreamManager()
+{
+    if(videoSocket != -1) close(videoSocket);
+
+    pthread_cond_destroy(&subscribersCond);
+    pthread_mutex_destroy(&subscribersMutex);
+}
 
 void VideoStreamManager::Start()
 {
+    try {
+        source = VideoSource::Create(config.source);
+        if(!source) {
+            RLOG_NOTICE("VideoStreamManager", "video disabled");
+            return;
+        }
+
+        source->Open();
+        converter.reset(new FrameConverter(source->Format(), VIDEO_CONVERTED_FRAMES));
+
+        scaleShift = (config.scale == 4) ? 2 : (config.scale == 2) ? 1 : 0;
+        if(scaleShift > converter->MaxScaleShift()) {
+            RLOG_WARNING("VideoStreamManager", "%ux%u cannot be downscaled by %u",
+                    source->Format().width, source->Format().height, config.scale);
+            scaleShift = converter->MaxScaleShift();
+        }
+
+        sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(config.port);
+
+/*
+ * NOTE: Small send buffer keeps the local queue short so that its occupancy is an early
+ * congestion signal. Throughput TOS maps video to a lower priority class than the
+ * control connection (low delay) on the qdisc and on WMM capable Wi-Fi.
+ */
+        int tos = IPTOS_THROUGHPUT;
+        socklen_t optLen = sizeof(sendBufferSize);
+        sendBufferSize = VIDEO_SOCKET_SNDBUF;
+
+        if( -1 == (videoSocket = socket(AF_INET, SOCK_DGRAM, 0))) THROW_RUNTIME();
+        if( 0 != setsockopt(videoSocket, SOL_SOCKET, SO_SNDBUF, &sendBufferSize, sizeof(sendBufferSize))) THROW_RUNTIME();
+        if( 0 != getsockopt(videoSocket, SOL_SOCKET, SO_SNDBUF, &sendBufferSize, &optLen)) THROW_RUNTIME();
+        if( 0 != setsockopt(videoSocket, IPPROTO_IP, IP_TOS, &tos, sizeof(tos))) RLOG_WARNING("VideoStreamManager", "IP_TOS: %m");
+        if( 0 != bind(videoSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) THROW_RUNTIME();
+        if( 0 != getsockname(videoSocket, reinterpret_cast<sockaddr*>(&addr), &addrLen)) THROW_RUNTIME();
+        boundPort = ntohs(addr.sin_port);
+    }
+    catch(const std::exception &e) {
+        RLOG_EXCEPT("VideoStreamManager", e);
+        RLOG_ERR("VideoStreamManager", "video source %s unavailable, streaming disabled", config.source.c_str());
+        if(videoSocket != -1) {
+            close(videoSocket);
+            videoSocket = -1;
+        }
+        converter.reset();
+        source.reset();
+        return;
+    }
+
+/*
+ * Rate control levels start at the configured scale, lower levels add further downscaling
+ */
+    levelCount = 0;
+    for(unsigned s = scaleShift; s <= converter->MaxScaleShift(); ++s) {
+        levelFrameBytes[levelCount++] = FrameWireBytes(VideoFrameSize(converter->OutputFormat(s)));
+    }
+
+    subscriberCount = 0;
+    captureCounter = 0;
+    for(auto& s : subscribers) s->active = false;
+
     running = true;
+    CreateThread(&threadControl, config.threads, "rover-video-ctl", ThreadControlProcedure, this);
+    for(auto& s : subscribers) {
+        CreateThread(&(s->thread), config.threads, "rover-video-out", ThreadSubscriberProcedure, s.get());
+    }
+    CreateThread(&threadCapture, config.threads, "rover-capture", ThreadCaptureProcedure, this);
+    started = true;
+
+    VideoFormat out = converter->OutputFormat(scaleShift);
+    RLOG_NOTICE("VideoStreamManager", "streaming %s source as %ux%u I420 on UDP port %u",
+            source->Name(), out.width, out.height, Port());
 }
 
 void VideoStreamManager::Stop()
 {
+    if(started) {
+        stop.Request();
+
+        PTHREAD_GUARD( pthread_join(threadCapture, NULL) );
+        PTHREAD_GUARD( pthread_join(threadControl, NULL) );
+        for(auto& s : subscribers) PTHREAD_GUARD( pthread_join(s->thread, NULL) );
+        started = false;
+
+        RLOG_INFO("VideoStreamManager", "frames captured: %llu converted: %llu sent: %llu dropped: %llu",
+                static_cast<unsigned long long>(framesCaptured), static_cast<unsigned long long>(framesConverted),
+                static_cast<unsigned long long>(framesSent), static_cast<unsigned long long>(framesDropped));
+    }
+
+    /* Frames have to go back to the pool before the source releases its buffers */
+    for(auto& s : subscribers) {
+        for(auto& f : s->queue) f.Reset();
+        s->queueHead = 0;
+        s->queueCount = 0;
+        s->active = false;
+    }
+    subscriberCount = 0;
+
+    converter.reset();
+
+    if(source) {
+        source->Close();
+        source.reset();
+    }
+
+    if(videoSocket != -1) {
+        if(0 != close(videoSocket)) RLOG_ERRNO("VideoStreamManager");
+        videoSocket = -1;
+    }
+
     running = false;
+    boundPort = 0;
+    stop.Reset();
 }
 
 bool VideoStreamManager::Running() const noexcept
@@ -36,9 +234,515 @@ bool VideoStreamManager::Running() const noexcept
     return running;
 }
 
-uint16_t VideoStreamManager::Port() const 
+uint16_t VideoStreamManager::Port() const
+{
+    return boundPort;
+}
+
+VideoStreamStats VideoStreamManager::Stats()
+{
+    VideoStreamStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    stats.framesCaptured = framesCaptured;
+    stats.framesConverted = framesConverted;
+    stats.framesSent = framesSent;
+    stats.framesDropped = framesDropped;
+
+    PTHREAD_GUARD( pthread_mutex_lock(&subscribersMutex) );
+    for(auto& s : subscribers) {
+        if(!s->active) continue;
+
+        VideoRateController::Level level = RateLevel(*s);
+        VideoSubscriberStats& out = stats.subscribers[stats.subscriberCount++];
+        out.addr = s->addr;
+        out.framesSent = s->framesSent;
+        out.framesDropped = s->framesDropped;
+        out.budgetBytesPerSec = config.adaptive ? s->rateControl.Budget() : 0;
+        out.scale = 1u << (scaleShift + level.scaleShift);
+        out.frameDivider = level.frameDivider;
+    }
+    PTHREAD_GUARD( pthread_mutex_unlock(&subscribersMutex) );
+
+    return stats;
+}
+
+VideoRateController::Level VideoStreamManager::RateLevel(const Subscriber& sub) const
+{
+    if(!config.adaptive) return { 0, 1 };
+    return sub.rateControl.CurrentLevel();
+}
+
+void VideoStreamManager::Subscribe(Subscriber& sub, const sockaddr_in& addr, const RoverNet::DataVideoSubscribe& params)
+{
+    uint64_t now = MonotonicNs();
+
+    if(!sub.active) {
+        sub.addr = addr;
+        sub.active = true;
+        sub.queueHead = 0;
+        sub.queueCount = 0;
+        sub.rateControl.Configure(levelFrameBytes, levelCount, source->Format().fps, now);
+        sub.loggedLevel = sub.rateControl.CurrentLevel();
+        sub.framesSent = 0;
+        sub.framesDropped = 0;
+        sub.packetsSent = 0;
+        sub.bytesSent = 0;
+        sub.bytesLost = 0;
+        sub.historyNext = 0;
+        sub.reporting = false;
+        sub.matched = false;
+        subscriberCount++;
+    }
+
+    sub.lastSeenNs = now;
+    sub.dropPolicy = (params.dropPolicy == RoverNet::VideoDropPolicy::VID_DROP_NEWEST) ?
+            RoverNet::VideoDropPolicy::VID_DROP_NEWEST : RoverNet::VideoDropPolicy::VID_DROP_OLDEST;
+    sub.queueLength = (params.queueLength == 0) ? VIDEO_SEND_QUEUE_LEN : std::min<unsigned>(params.queueLength, VIDEO_SEND_QUEUE_MAX);
+}
+
+void VideoStreamManager::Unsubscribe(Subscriber& sub)
+{
+    for(auto& f : sub.queue) f.Reset();
+    sub.queueHead = 0;
+    sub.queueCount = 0;
+    sub.active = false;
+    subscriberCount--;
+}
+
+void VideoStreamManager::Enqueue(Subscriber& sub, const FrameRef& frame)
+{
+    if(sub.queueCount >= sub.queueLength) {
+        if(sub.dropPolicy == RoverNet::VideoDropPolicy::VID_DROP_NEWEST) {
+            sub.framesDropped++;
+            framesDropped++;
+            return;
+        }
+        while(sub.queueCount >= sub.queueLength) {
+            sub.queue[sub.queueHead].Reset();
+            sub.queueHead = (sub.queueHead + 1) % VIDEO_SEND_QUEUE_MAX;
+            sub.queueCount--;
+            sub.framesDropped++;
+            framesDropped++;
+        }
+    }
+
+    sub.queue[(sub.queueHead + sub.queueCount) % VIDEO_SEND_QUEUE_MAX] = frame;
+    sub.queueCount++;
+    PTHREAD_GUARD( pthread_cond_signal(&sub.queueCond) );
+}
+
+void VideoStreamManager::Wake(void* arg)
+{
+    VideoStreamManager* vsm = static_cast<VideoStreamManager*>(arg);
+    PTHREAD_GUARD( pthread_mutex_lock(&(vsm->subscribersMutex)) );
+    PTHREAD_GUARD( pthread_mutex_unlock(&(vsm->subscribersMutex)) );
+    PTHREAD_GUARD( pthread_cond_broadcast(&(vsm->subscribersCond)) );
+    for(auto& s : vsm->subscribers) PTHREAD_GUARD( pthread_cond_broadcast(&(s->queueCond)) );
+}
+
+void* VideoStreamManager::ThreadCaptureProcedure(void *arg)
+{
+    VideoStreamManager* vsm = static_cast<VideoStreamManager*>(arg);
+    try {
+        while(true) {
+/*
+ * NOTE: Capture is suspended while nobody watches to not waste CPU on the pattern
+ * generation or on copying frames out of the driver
+ */
+            PTHREAD_GUARD( pthread_mutex_lock(&(vsm->subscribersMutex)) );
+            while(vsm->subscriberCount == 0 && !vsm->stop.Requested()) {
+                PTHREAD_GUARD( pthread_cond_wait(&(vsm->subscribersCond), &(vsm->subscribersMutex)) );
+            }
+            PTHREAD_GUARD( pthread_mutex_unlock(&(vsm->subscribersMutex)) );
+            if(vsm->stop.Requested()) break;
+
+            FrameRef captured = vsm->source->Capture(vsm->stop);
+            if(!captured) continue;
+            vsm->framesCaptured++;
+
+            unsigned counter = vsm->captureCounter++;
+            unsigned shifts[VIDEO_MAX_SUBSCRIBERS];
+            unsigned scaleMask = 0;
+            uint64_t now = MonotonicNs();
+
+/*
+ * Collect the scales needed for this frame. Frame rate reduction drops frames before spending
+ * time on conversion, a frame nobody wants at this rate is not converted at all.
+ */
+            PTHREAD_GUARD( pthread_mutex_lock(&(vsm->subscribersMutex)) );
+            for(unsigned i = 0; i < VIDEO_MAX_SUBSCRIBERS; ++i) {
+                Subscriber& s = *(vsm->subscribers[i]);
+                shifts[i] = UINT_MAX;
+                if(!s.active) continue;
+
+                if(now - s.lastSeenNs > VIDEO_SUBSCRIBER_TIMEOUT_SEC * NSEC_PER_SEC) {
+                    RLOG_INFO("VideoStreamManager", "subscriber %s:%u timed out",
+                            inet_ntoa(s.addr.sin_addr), ntohs(s.addr.sin_port));
+                    vsm->Unsubscribe(s);
+                    continue;
+                }
+
+                VideoRateController::Level level = vsm->RateLevel(s);
+                if(level.scaleShift != s.loggedLevel.scaleShift || level.frameDivider != s.loggedLevel.frameDivider) {
+                    RLOG_INFO("VideoStreamManager", "subscriber %s:%u rate level: scale 1/%u, frame rate 1/%u",
+                            inet_ntoa(s.addr.sin_addr), ntohs(s.addr.sin_port),
+                            1u << (vsm->scaleShift + level.scaleShift), level.frameDivider);
+                    s.loggedLevel = level;
+                }
+
+                if((counter % level.frameDivider) != 0) continue;
+
+                shifts[i] = vsm->scaleShift + level.scaleShift;
+                scaleMask |= 1u << shifts[i];
+            }
+            PTHREAD_GUARD( pthread_mutex_unlock(&(vsm->subscribersMutex)) );
+
+            if(scaleMask == 0) continue;
+
+/*
+ * NOTE: The captured frame is released right after conversion, with V4L2 this
+ * returns the buffer to the driver before the frame is sent
+ */
+            FrameRef frames[FrameConverter::MAX_SCALE_SHIFT + 1];
+            vsm->converter->Convert(*captured, scaleMask, frames);
+            captured.Reset();
+            vsm->framesConverted++;
+
+            PTHREAD_GUARD( pthread_mutex_lock(&(vsm->subscribersMutex)) );
+            for(unsigned i = 0; i < VIDEO_MAX_SUBSCRIBERS; ++i) {
+                Subscriber& s = *(vsm->subscribers[i]);
+                if(shifts[i] == UINT_MAX || !s.active) continue;
+
+                if(frames[shifts[i]]) {
+                    vsm->Enqueue(s, frames[shifts[i]]);
+                }
+                else {
+                    s.framesDropped++;
+                    vsm->framesDropped++;
+                }
+            }
+            PTHREAD_GUARD( pthread_mutex_unlock(&(vsm->subscribersMutex)) );
+        }
+    }
+    catch(const std::exception &e) {
+        RLOG_EXCEPT("VideoStreamManager", e);
+        vsm->running = false;
+    }
+    catch(...) {
+        RLOG_ERR("VideoStreamManager", "unknown exception");
+        vsm->running = false;
+    }
+
+    return nullptr;
+}
+
+/*
+ * One thread per subscriber slot, sends the frames queued for the subscriber
+ */
+void* VideoStreamManager::ThreadSubscriberProcedure(void *arg)
+{
+    Subscriber* sub = static_cast<Subscriber*>(arg);
+    VideoStreamManager* vsm = sub->owner;
+    try {
+        while(true) {
+            FrameRef frame;
+            sockaddr_in addr;
+            bool admit = true;
+            double pacingRate = 0;
+            int queued = 0;
+
+            PTHREAD_GUARD( pthread_mutex_lock(&(vsm->subscribersMutex)) );
+            while(sub->queueCount == 0 && !vsm->stop.Requested()) {
+                PTHREAD_GUARD( pthread_cond_wait(&(sub->queueCond), &(vsm->subscribersMutex)) );
+            }
+            if(vsm->stop.Requested()) {
+                PTHREAD_GUARD( pthread_mutex_unlock(&(vsm->subscribersMutex)) );
+                break;
+            }
+            frame = std::move(sub->queue[sub->queueHead]);
+            sub->queueHead = (sub->queueHead + 1) % VIDEO_SEND_QUEUE_MAX;
+            sub->queueCount--;
+            addr = sub->addr;
+
+            if(vsm->config.adaptive) {
+                uint64_t now = MonotonicNs();
+                if(-1 == ioctl(vsm->videoSocket, SIOCOUTQ, &queued)) queued = 0;
+
+/*
+ * NOTE: The send queue is shared by all subscribers, its occupancy reflects the common
+ * uplink. Reports stop arriving when the uplink is as congested as the downlink.
+ */
+                sub->rateControl.OnSendQueue(now, static_cast<double>(queued) / vsm->sendBufferSize);
+                if(sub->reporting && now - sub->lastReportNs > VIDEO_REPORT_TIMEOUT_NS) {
+                    sub->rateControl.OnReceiverReport(now, now, 1.0, 0, 0, 0);
+                }
+                admit = sub->rateControl.AdmitFrame(now, FrameWireBytes(frame->size));
+                pacingRate = sub->rateControl.Budget();
+                if(!admit) {
+                    sub->framesDropped++;
+                    vsm->framesDropped++;
+                }
+            }
+            PTHREAD_GUARD( pthread_mutex_unlock(&(vsm->subscribersMutex)) );
+
+            if(!admit) continue;
+
+            uint64_t sendNs = MonotonicNs();
+            unsigned packets = vsm->SendFrame(*frame, addr, pacingRate);
+
+            PTHREAD_GUARD( pthread_mutex_lock(&(vsm->subscribersMutex)) );
+            if(sub->active && SameAddress(sub->addr, addr)) {
+                sub->packetsSent += packets;
+                sub->bytesSent += FrameWireBytes(frame->size);
+                SentFrame& h = sub->history[sub->historyNext++ % VIDEO_SENT_HISTORY];
+                h.sequence = frame->sequence;
+                h.packets = sub->packetsSent;
+                h.sendNs = sendNs;
+                sub->framesSent++;
+            }
+            PTHREAD_GUARD( pthread_mutex_unlock(&(vsm->subscribersMutex)) );
+            vsm->framesSent++;
+        }
+    }
+    catch(const std::exception &e) {
+        RLOG_EXCEPT("VideoStreamManager", e);
+        vsm->running = false;
+    }
+    catch(...) {
+        RLOG_ERR("VideoStreamManager", "unknown exception");
+        vsm->running = false;
+    }
+
+    return nullptr;
+}
+
+void* VideoStreamManager::ThreadControlProcedure(void *arg)
+{
+    VideoStreamManager* vsm = static_cast<VideoStreamManager*>(arg);
+    try {
+/*
+ * NOTE: The socket stays blocking for the senders, the control datagrams are read
+ * without waiting once poll reported them
+ */
+        while(vsm->stop.WaitFd(vsm->videoSocket, POLLIN)) {
+/*
+ * NOTE: Datagram may be longer than VideoControl for newer clients, trailing bytes are ignored
+ */
+            uint8_t buffer[64];
+            sockaddr_in from;
+            socklen_t fromLen = sizeof(from);
+
+            ssize_t r = recvfrom(vsm->videoSocket, buffer, sizeof(buffer), MSG_DONTWAIT,
+                    reinterpret_cast<sockaddr*>(&from), &fromLen);
+
+            if(r == -1) {
+                if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) RLOG_ERRNO("VideoStreamManager");
+                continue;
+            }
+            if(r < 1 || from.sin_family != AF_INET) continue;
+
+            RoverNet::VideoControl ctrl;
+            memset(&ctrl, 0, sizeof(ctrl));
+            memcpy(&ctrl, buffer, std::min(static_cast<size_t>(r), sizeof(ctrl)));
+
+            PTHREAD_GUARD( pthread_mutex_lock(&(vsm->subscribersMutex)) );
+            Subscriber* existing = nullptr;
+            Subscriber* freeSlot = nullptr;
+            for(auto& s : vsm->subscribers) {
+                if(s->active && SameAddress(s->addr, from)) existing = s.get();
+                if(!s->active && freeSlot == nullptr) freeSlot = s.get();
+            }
+
+            switch(ctrl.ctrlType) {
+                case RoverNet::VideoControlType::VID_SUBSCRIBE:
+                    if(existing != nullptr) {
+                        vsm->Subscribe(*existing, from, ctrl.data.subscribe);
+                    }
+                    else if(freeSlot != nullptr) {
+                        vsm->Subscribe(*freeSlot, from, ctrl.data.subscribe);
+                        RLOG_INFO("VideoStreamManager", "subscriber %s:%u added, %u subscribers",
+                                inet_ntoa(from.sin_addr), ntohs(from.sin_port), vsm->subscriberCount);
+                    }
+                    else {
+                        RLOG_WARNING("VideoStreamManager", "subscriber limit reached, %s:%u rejected",
+                                inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+                    }
+                    break;
+                case RoverNet::VideoControlType::VID_RECEIVER_REPORT:
+                    if(existing != nullptr && static_cast<size_t>(r) >= sizeof(ctrl)) {
+                        existing->lastSeenNs = MonotonicNs();
+                        vsm->HandleReceiverReport(*existing, ctrl.data.receiverReport);
+                    }
+                    break;
+                case RoverNet::VideoControlType::VID_UNSUBSCRIBE:
+                    if(existing != nullptr) vsm->Unsubscribe(*existing);
+                    break;
+                default:
+                    RLOG_WARNING("VideoStreamManager", "Unsupported control message 0x%02x", ctrl.ctrlType);
+            }
+            PTHREAD_GUARD( pthread_mutex_unlock(&(vsm->subscribersMutex)) );
+            PTHREAD_GUARD( pthread_cond_signal(&(vsm->subscribersCond)) );
+        }
+    }
+    catch(const std::exception &e) {
+        RLOG_EXCEPT("VideoStreamManager", e);
+        vsm->running = false;
+    }
+    catch(...) {
+        RLOG_ERR("VideoStreamManager", "unknown exception");
+        vsm->running = false;
+    }
+
+    return nullptr;
+}
+
+/*
+ * NOTE: Called with subscribersMutex held
+ */
+void VideoStreamManager::HandleReceiverReport(Subscriber& sub, const RoverNet::DataVideoReceiverReport& report)
 {
-    return 1234;
+    uint64_t now = MonotonicNs();
+    uint32_t packetsReceived = ntohl(report.packetsReceived);
+    uint32_t bytesReceived = ntohl(report.bytesReceived);
+    uint32_t sequence = ntohl(report.lastFrameSequence);
+    uint64_t ageNs = static_cast<uint64_t>(ntohl(report.lastFrameAgeUS)) * 1000;
+
+    sub.reporting = true;
+    sub.lastReportNs = now;
+
+/*
+ * NOTE: Packets still in flight must not count as lost, the report is compared with the
+ * packets sent up to the last frame the client completed
+ */
+    unsigned count = std::min(sub.historyNext, VIDEO_SENT_HISTORY);
+    unsigned newest = (sub.historyNext - 1) % VIDEO_SENT_HISTORY;
+    const SentFrame* sent = nullptr;
+    const SentFrame* pending = nullptr;
+    for(unsigned i = 0; i < count; ++i) {
+        if(sub.history[i].sequence != sequence) continue;
+        sent = &sub.history[i];
+        if(i != newest) pending = &sub.history[(i + 1) % VIDEO_SENT_HISTORY];
+    }
+    if(sent == nullptr) return;
+
+    if(sub.matched && now > sub.reportNs) {
+        /* Unsigned differences handle the counter wrap around */
+        uint32_t expected = sent->packets - sub.reportPacketsExpected;
+        uint32_t received = packetsReceived - sub.reportPacketsReceived;
+        uint32_t bytes = bytesReceived - sub.reportBytesReceived;
+
+        double loss = (expected > 0 && received < expected) ? 1.0 - static_cast<double>(received) / expected : 0.0;
+        double delivered = static_cast<double>(bytes) * NSEC_PER_SEC / (now - sub.reportNs);
+        if(received < expected) sub.bytesLost += (expected - received) * (VIDEO_PACKET_PAYLOAD + sizeof(RoverNet::VideoPacketHeader));
+
+/*
+ * NOTE: Bytes sent but neither received nor lost wait in the network. At the delivered rate
+ * they take backlog to arrive, the queuing delay of the newest byte. Unlike the frame delay
+ * it is known as soon as the link slows down, before any frame is late.
+ */
+        int32_t inFlight = static_cast<int32_t>(sub.bytesSent - bytesReceived - sub.bytesLost);
+        uint64_t backlog = (inFlight > 0 && delivered > 0) ?
+                static_cast<uint64_t>(inFlight * NSEC_PER_SEC / delivered) : 0;
+        uint64_t frameSent = sent->sendNs;
+        uint64_t frameDelay = (now > sent->sendNs + ageNs) ? now - sent->sendNs - ageNs : 0;
+        /* The frame after the last complete one is late at least since it was sent */
+        if(pending != nullptr && now - pending->sendNs > frameDelay) {
+            frameSent = pending->sendNs;
+            frameDelay = now - pending->sendNs;
+        }
+
+        if(config.adaptive) sub.rateControl.OnReceiverReport(now, frameSent, loss, delivered, frameDelay, backlog);
+
+        RLOG_DEBUG("VideoStreamManager", "report expected %u received %u loss %.3f delivered %.0f B/s delay %llu us backlog %llu us",
+                expected, received, loss, delivered, static_cast<unsigned long long>(frameDelay / 1000),
+                static_cast<unsigned long long>(backlog / 1000));
+    }
+
+    sub.matched = true;
+    sub.reportNs = now;
+    sub.reportPacketsExpected = sent->packets;
+    sub.reportPacketsReceived = packetsReceived;
+    sub.reportBytesReceived = bytesReceived;
 }
 
+/*
+ * Send the frame to a subscriber. Each datagram is gathered from a header on the stack
+ * and a slice of the pooled frame buffer, datagrams are passed to the kernel in batches.
+ * With a pacing rate the batches are spread in time so that the frame does not reach the
+ * link as a single burst that control packets would queue behind.
+ */
+unsigned VideoStreamManager::SendFrame(const VideoFrame& frame, const sockaddr_in& addr, double pacingRate)
+{
+    RoverNet::VideoPacketHeader headers[VIDEO_SEND_BATCH];
+    iovec iov[VIDEO_SEND_BATCH][2];
+    mmsghdr msgs[VIDEO_SEND_BATCH];
+
+    RoverNet::VideoPacketHeader tmpl;
+    tmpl.frameSequence = htonl(frame.sequence);
+    tmpl.frameSize = htonl(frame.size);
+    tmpl.offset = 0;
+    tmpl.fourcc = htonl(frame.format.fourcc);
+    tmpl.width = htons(frame.format.width);
+    tmpl.height = htons(frame.format.height);
+    tmpl.timestampUS = htonl(static_cast<uint32_t>(frame.timestampNs / 1000));
+
+    unsigned packets = 0;
+    size_t offset = 0;
+    unsigned batch = VIDEO_SEND_BATCH;
+    uint64_t start = MonotonicNs();
+
+    if(pacingRate > 0) {
+        double quantum = pacingRate * VIDEO_PACING_QUANTUM_NS / NSEC_PER_SEC;
+        batch = std::max(1u, std::min(VIDEO_SEND_BATCH,
+                static_cast<unsigned>(quantum / (VIDEO_PACKET_PAYLOAD + sizeof(tmpl)))));
+    }
+
+    while(offset < frame.size) {
+        unsigned n = 0;
 
+        /* The rest of the frame is dropped when the stop is requested while pacing */
+        if(pacingRate > 0 && offset > 0 &&
+                !stop.SleepUntil(start + static_cast<uint64_t>(FrameWireBytes(offset) * NSEC_PER_SEC / pacingRate))) {
+            break;
+        }
+
+        for(; n < batch && offset < frame.size; ++n) {
+            size_t len = std::min(VIDEO_PACKET_PAYLOAD, frame.size - offset);
+
+            headers[n] = tmpl;
+            headers[n].offset = htonl(offset);
+            iov[n][0].iov_base = &headers[n];
+            iov[n][0].iov_len = sizeof(headers[n]);
+            iov[n][1].iov_base = frame.Data() + offset;
+            iov[n][1].iov_len = len;
+
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_name = const_cast<sockaddr_in*>(&addr);
+            msgs[n].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[n].msg_hdr.msg_iov = iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 2;
+
+            offset += len;
+        }
+
+        unsigned sent = 0;
+        while(sent < n) {
+            int r = sendmmsg(videoSocket, msgs + sent, n - sent, 0);
+            if(r == -1) {
+                if(errno == EINTR) continue;
+/*
+ * NOTE: Errors are per subscriber (e.g. ECONNREFUSED reported for an earlier datagram),
+ * the rest of the frame for this subscriber is skipped
+ */
+                RLOG_DEBUG("VideoStreamManager", "sendmmsg: %m");
+                offset = frame.size;
+                break;
+            }
+            sent += r;
+        }
+        packets += sent;
+    }
+
+    return packets;
+}
@@ -1,6 +1,6 @@
 /*
  * videostreammanager.h
- * 
+ *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License version 3 as
  * published by the Free Software Foundation.
@@ -12,19 +12,186 @@
 #define _VIDEO_STREAM_MANAGER_H_
 
 #include <cstdint>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "util.h"
+#include "nettypes.h"
+#include "videosource.h"
+#include "frameconverter.h"
+#include "videoratecontrol.h"
+#include "threadconfig.h"
+#include "stoptoken.h"
+
+struct VideoConfig
+{
+    std::string source = VIDEO_DEFAULT_SOURCE;
+    uint16_t port = SERVER_UDP_VIDEO_PORT;
+    /* Output downscale factor, 1, 2 or 4 */
+    unsigned scale = 1;
+    /* Adapt frame rate and resolution to the link, upper bound of the bitrate per subscriber */
+    bool adaptive = true;
+    uint32_t maxKbps = VIDEO_DEFAULT_MAX_KBPS;
+    /* Bandwidth kept free for the control connection */
+    uint32_t reserveKbps = VIDEO_CONTROL_RESERVE_KBPS;
+    /* Capture, rate control and the subscriber senders */
+    ThreadAttributes threads;
+};
+
+struct VideoSubscriberStats
+{
+    sockaddr_in addr;
+    uint64_t framesSent;
+    uint64_t framesDropped;
+    uint32_t budgetBytesPerSec;
+    unsigned scale;
+    unsigned frameDivider;
+};
+
+struct VideoStreamStats
+{
+    uint64_t framesCaptured;
+    /* Conversion passes, one per captured frame that any subscriber wanted */
+    uint64_t framesConverted;
+    /* Sums over all subscribers */
+    uint64_t framesSent;
+    uint64_t framesDropped;
+    unsigned subscriberCount;
+    VideoSubscriberStats subscribers[VIDEO_MAX_SUBSCRIBERS];
+};
 
+/*
+ * Streams one video source to up to VIDEO_MAX_SUBSCRIBERS clients. Every captured frame is
+ * converted once per scale level in use and the immutable result is shared by reference
+ * between the subscribers. Each subscriber has its own send queue, drop policy, rate control
+ * and sending thread, so a slow client does not hold back the others.
+ */
 class VideoStreamManager
 {
     public:
-        explicit VideoStreamManager() = default;
+        explicit VideoStreamManager(const VideoConfig& config = VideoConfig());
         VideoStreamManager(const VideoStreamManager&) = delete;
         VideoStreamManager& operator=(const VideoStreamManager&) = delete;
+        ~VideoStreamManager();
 
+/*
+ * NOTE: Failure to open the video source is not fatal for the daemon,
+ * Start logs the error and the manager reports itself as not running
+ */
         void Start();
         void Stop();
         bool Running() const noexcept;
 
         uint16_t Port() const;
+
+        VideoStreamStats Stats();
+
+    private:
+        struct SentFrame
+        {
+            uint32_t sequence;
+            /* Value of packetsSent after the frame */
+            uint32_t packets;
+            uint64_t sendNs;
+        };
+
+/*
+ * NOTE: Slots live from Start to Stop, subscriptions only toggle active. All fields
+ * except the thread are guarded by subscribersMutex.
+ */
+        struct Subscriber
+        {
+            explicit Subscriber(const VideoRateController::Config& rateConfig);
+            Subscriber(const Subscriber&) = delete;
+            Subscriber& operator=(const Subscriber&) = delete;
+            ~Subscriber();
+
+            VideoStreamManager* owner;
+            pthread_t thread;
+            pthread_cond_t queueCond;
+
+            sockaddr_in addr;
+            uint64_t lastSeenNs;
+            bool active;
+
+            RoverNet::VideoDropPolicy dropPolicy;
+            unsigned queueLength;
+            FrameRef queue[VIDEO_SEND_QUEUE_MAX];
+            unsigned queueHead;
+            unsigned queueCount;
+
+            VideoRateController rateControl;
+            VideoRateController::Level loggedLevel;
+            uint64_t framesSent;
+            uint64_t framesDropped;
+
+            uint32_t packetsSent;
+            /* Datagram bytes sent and the estimate of those lost, counted like bytesReceived of the reports */
+            uint32_t bytesSent;
+            uint32_t bytesLost;
+            SentFrame history[VIDEO_SENT_HISTORY];
+            unsigned historyNext;
+
+            bool reporting;
+            uint64_t lastReportNs;
+            /* State at the last matched receiver report */
+            bool matched;
+            uint64_t reportNs;
+            uint32_t reportPacketsExpected;
+            uint32_t reportPacketsReceived;
+            uint32_t reportBytesReceived;
+        };
+
+        VideoConfig config;
+        unsigned scaleShift;
+
+        std::unique_ptr<VideoSource> source;
+        std::unique_ptr<FrameConverter> converter;
+        int videoSocket;
+
+        std::atomic<bool> running;
+        std::atomic<uint16_t> boundPort;
+        bool started;
+
+        pthread_t threadCapture;
+        pthread_t threadControl;
+        StopToken stop;
+
+        /* Stop waker, broadcasts the conditions the capture and subscriber threads wait on */
+        static void Wake(void* arg);
+        static void* ThreadCaptureProcedure(void *arg);
+        static void* ThreadSubscriberProcedure(void *arg);
+        static void* ThreadControlProcedure(void *arg);
+
+        /* Returns number of datagrams sent, pacing rate in bytes per second, 0 sends at once */
+        unsigned SendFrame(const VideoFrame& frame, const sockaddr_in& addr, double pacingRate);
+
+        /* Helpers below are called with subscribersMutex held */
+        void Subscribe(Subscriber& sub, const sockaddr_in& addr, const RoverNet::DataVideoSubscribe& params);
+        void Unsubscribe(Subscriber& sub);
+        void Enqueue(Subscriber& sub, const FrameRef& frame);
+        void HandleReceiverReport(Subscriber& sub, const RoverNet::DataVideoReceiverReport& report);
+        VideoRateController::Level RateLevel(const Subscriber& sub) const;
+
+        std::array<std::unique_ptr<Subscriber>, VIDEO_MAX_SUBSCRIBERS> subscribers;
+        unsigned subscriberCount;
+        pthread_mutex_t subscribersMutex;
+        pthread_cond_t subscribersCond;
+
+        /* Rate control ladder, wire size of a frame at each scale from scaleShift up */
+        size_t levelFrameBytes[FrameConverter::MAX_SCALE_SHIFT + 1];
+        unsigned levelCount;
+        unsigned captureCounter;
+        int sendBufferSize;
+
+        std::atomic<uint64_t> framesCaptured;
+        std::atomic<uint64_t> framesConverted;
+        std::atomic<uint64_t> framesSent;
+        std::atomic<uint64_t> framesDropped;
 };
 
 
@@ -0,0 +1,66 @@
+/*
+ * clocksync.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include "clocksync.h"
+
+ClockSync::ClockSync():
+    nextSequence(1),
+    sampleCount(0),
+    sampleNext(0),
+    offsetNs(0),
+    rttNs(0)
+{
+    for(unsigned i = 0; i < PENDING; ++i) {
+        pendingSentNs[i] = 0;
+        pendingSequence[i] = 0;
+    }
+}
+
+uint32_t ClockSync::Request(uint64_t sentNs)
+{
+    uint32_t sequence = nextSequence++;
+    if(nextSequence == 0) nextSequence = 1;
+
+    pendingSentNs[sequence % PENDING] = sentNs;
+    pendingSequence[sequence % PENDING] = sequence;
+    return sequence;
+}
+
+bool ClockSync::Response(uint32_t sequence, uint32_t holdNs, uint64_t daemonNs, uint64_t receivedNs)
+{
+    unsigned slot = sequence % PENDING;
+    if(sequence == 0 || pendingSequence[slot] != sequence) return false;
+    pendingSequence[slot] = 0;
+
+    uint64_t sentNs = pendingSentNs[slot];
+    uint64_t elapsed = receivedNs - sentNs;
+    if(receivedNs < sentNs || elapsed < holdNs) return false;
+
+/*
+ * NOTE: offset = ((t2 - t1) + (t3 - t4)) / 2 with t3 = t2 + hold, written so the
+ * unsigned clocks are subtracted before mixing signs
+ */
+    Sample s;
+    s.rttNs = elapsed - holdNs;
+    s.offsetNs = static_cast<int64_t>(daemonNs - sentNs) - static_cast<int64_t>(s.rttNs / 2);
+
+    samples[sampleNext] = s;
+    sampleNext = (sampleNext + 1) % WINDOW;
+    if(sampleCount < WINDOW) sampleCount++;
+
+    const Sample* best = &samples[0];
+    for(unsigned i = 1; i < sampleCount; ++i) {
+        if(samples[i].rttNs < best->rttNs) best = &samples[i];
+    }
+
+    offsetNs = best->offsetNs;
+    rttNs = best->rttNs;
+    return true;
+}
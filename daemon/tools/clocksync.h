@@ -0,0 +1,71 @@
+/*
+ * clocksync.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _CLOCK_SYNC_H_
+#define _CLOCK_SYNC_H_
+
+#include <cstdint>
+
+/*
+ * Client side estimate of the daemon clock from the REQ_TIME_SYNC exchange. Every answered
+ * request gives an offset and a round trip time, the offset of the sample with the lowest
+ * round trip among the recent ones is used, as it was least disturbed by queueing. Requests
+ * should be sent continuously, a few per second, to follow the drift of the clocks.
+ * Not thread safe.
+ */
+class ClockSync
+{
+    public:
+        ClockSync();
+
+        /* Registers a request sent at local time sentNs, returns the sequence to send */
+        uint32_t Request(uint64_t sentNs);
+
+/*
+ * Feeds MSG_TIME_SYNC received at local time receivedNs, daemonNs is the TIMESTAMP
+ * that preceded it. Returns false for a sequence that was not requested or expired.
+ */
+        bool Response(uint32_t sequence, uint32_t holdNs, uint64_t daemonNs, uint64_t receivedNs);
+
+        bool Synchronized() const { return sampleCount != 0; }
+
+        /* Daemon clock minus local clock */
+        int64_t OffsetNs() const { return offsetNs; }
+
+        /* Round trip of the sample the offset comes from */
+        uint64_t RttNs() const { return rttNs; }
+
+        uint64_t ToDaemon(uint64_t localNs) const { return localNs + offsetNs; }
+        uint64_t ToLocal(uint64_t daemonNs) const { return daemonNs - offsetNs; }
+
+    private:
+        static constexpr unsigned PENDING = 16;
+        static constexpr unsigned WINDOW = 8;
+
+        struct Sample
+        {
+            int64_t offsetNs;
+            uint64_t rttNs;
+        };
+
+        uint32_t nextSequence;
+        /* Send times of the outstanding requests, indexed by sequence % PENDING */
+        uint64_t pendingSentNs[PENDING];
+        uint32_t pendingSequence[PENDING];
+
+        Sample samples[WINDOW];
+        unsigned sampleCount;
+        unsigned sampleNext;
+
+        int64_t offsetNs;
+        uint64_t rttNs;
+};
+
+#endif /* _CLOCK_SYNC_H_ */
@@ -0,0 +1,247 @@
+/*
+ * flightdump.cpp
+ *
+ * Prints the content of a flight recorder file in time order. The file can be read while
+ * the daemon is running or after it crashed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <vector>
+
+#include "flightfile.h"
+#include "netcodec.h"
+#include "util.h"
+
+using namespace FlightRecorder;
+
+namespace {
+    const char* RecordTypeName(uint8_t type)
+    {
+        switch(type) {
+            case REC_MSG_IN: return "msg_in";
+            case REC_MSG_OUT: return "msg_out";
+            case REC_DEV_RESULT: return "dev_result";
+            case REC_DISTANCE: return "distance";
+            default: return "unknown";
+        }
+    }
+
+    /* Message fields as space separated key=value pairs */
+    void FormatMessage(const RoverNet::Message& msg, char* buffer, size_t size)
+    {
+        const char* name = RoverNet::MessageTypeName(msg.msgType);
+        int n = name ? snprintf(buffer, size, "%s", name) : snprintf(buffer, size, "type=0x%02x", msg.msgType);
+        if(n < 0 || static_cast<size_t>(n) >= size) return;
+
+        switch(msg.msgType) {
+            case RoverNet::CMD_SET_LEFT_WHEEL_SPEED:
+            case RoverNet::CMD_SET_RIGHT_WHEEL_SPEED:
+            case RoverNet::CMD_SET_WHEELS_SPEED:
+                snprintf(buffer + n, size - n, " left=%d right=%d",
+                        msg.data.wheelsState.leftWheelSpeed, msg.data.wheelsState.rightWheelSpeed);
+                break;
+            case RoverNet::MSG_WHEELS_STATE:
+                snprintf(buffer + n, size - n, " left=%d right=%d max=%d min=%d",
+                        msg.data.wheelsState.leftWheelSpeed, msg.data.wheelsState.rightWheelSpeed,
+                        msg.data.wheelsState.wheelMaxSpeed, msg.data.wheelsState.wheelMinSpeed);
+                break;
+            case RoverNet::MSG_DISTANCE:
+                snprintf(buffer + n, size - n, " cm=%d velocity=%d filter=%u", msg.data.distance.distanceCM,
+                        msg.data.distance.velocityCmS, msg.data.distance.filter);
+                break;
+            case RoverNet::REQ_DISTANCE:
+                snprintf(buffer + n, size - n, " filter=%u", msg.data.distanceRequest.filter);
+                break;
+            case RoverNet::MSG_REFLEX:
+                snprintf(buffer + n, size - n, " cm=%d active=%u", msg.data.reflex.distanceCM, msg.data.reflex.active);
+                break;
+            case RoverNet::MSG_VID_STREAM_PORT:
+                snprintf(buffer + n, size - n, " port=%u running=%u",
+                        msg.data.videoStreamPort.port, msg.data.videoStreamPort.running);
+                break;
+            case RoverNet::TIMESTAMP:
+                snprintf(buffer + n, size - n, " ns=%llu",
+                        static_cast<unsigned long long>(RoverNet::TimestampNs(msg.data.timestamp)));
+                break;
+            case RoverNet::REQ_TIME_SYNC:
+            case RoverNet::MSG_TIME_SYNC:
+                snprintf(buffer + n, size - n, " sequence=%u hold_ns=%u",
+                        msg.data.timeSync.sequence, msg.data.timeSync.holdNs);
+                break;
+            case RoverNet::CORRELATION_ID:
+                snprintf(buffer + n, size - n, " id=%u", msg.data.correlationId.id);
+                break;
+            case RoverNet::BATCH:
+                snprintf(buffer + n, size - n, " count=%u", msg.data.batch.count);
+                break;
+            case RoverNet::CMD_TRAJECTORY:
+                snprintf(buffer + n, size - n, " count=%u", msg.data.trajectory.count);
+                break;
+            case RoverNet::CMD_RAMP_WHEELS_SPEED:
+                snprintf(buffer + n, size - n, " left=%d right=%d acceleration=%u", msg.data.wheelsRamp.leftWheelSpeed,
+                        msg.data.wheelsRamp.rightWheelSpeed, msg.data.wheelsRamp.acceleration);
+                break;
+            case RoverNet::CMD_HEARTBEAT:
+                snprintf(buffer + n, size - n, " deadline_ms=%u", msg.data.heartbeat.deadlineMs);
+                break;
+            case RoverNet::MSG_DEADMAN:
+                snprintf(buffer + n, size - n, " silence_ms=%u deadline_ms=%u", msg.data.deadman.silenceMs,
+                        msg.data.deadman.deadlineMs);
+                break;
+            case RoverNet::REQ_HISTORY:
+                snprintf(buffer + n, size - n, " series=%u span_ms=%u resolution_ms=%u", msg.data.historyRequest.series,
+                        msg.data.historyRequest.spanMs, msg.data.historyRequest.resolutionMs);
+                break;
+            case RoverNet::MSG_HISTORY:
+                snprintf(buffer + n, size - n, " series=%u bins=%u resolution_ms=%u count=%u", msg.data.history.series,
+                        msg.data.history.bins, msg.data.history.resolutionMs, msg.data.history.count);
+                break;
+            case RoverNet::HISTORY_POINT:
+                snprintf(buffer + n, size - n, " %d %d %d %d", msg.data.historyPoint.values[0], msg.data.historyPoint.values[1],
+                        msg.data.historyPoint.values[2], msg.data.historyPoint.values[3]);
+                break;
+            case RoverNet::TRAJECTORY_POINT:
+                snprintf(buffer + n, size - n, " offset_us=%u left=%d right=%d", msg.data.trajectoryPoint.offsetUs,
+                        msg.data.trajectoryPoint.leftWheelSpeed, msg.data.trajectoryPoint.rightWheelSpeed);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void FormatRecord(const FlightRecord& rec, char* buffer, size_t size)
+    {
+        switch(rec.type) {
+            case REC_MSG_IN:
+            case REC_MSG_OUT:
+                {
+                    FormatMessage(RoverNet::FromWire(rec.payload), buffer, size);
+                }
+                break;
+            case REC_DEV_RESULT:
+                {
+                    RecordDeviceResult result;
+                    memcpy(&result, rec.payload, sizeof(result));
+                    FormatMessage(RoverNet::FromWire(result.command), buffer, size);
+                    size_t n = strlen(buffer);
+                    snprintf(buffer + n, size - n, " status=%d", result.status);
+                }
+                break;
+            case REC_DISTANCE:
+                {
+                    RecordDistance sample;
+                    memcpy(&sample, rec.payload, sizeof(sample));
+                    snprintf(buffer, size, "cm=%d status=%d", sample.distanceCM, sample.status);
+                }
+                break;
+            default:
+                snprintf(buffer, size, "size=%u", rec.size);
+                break;
+        }
+    }
+
+    void PrintUsage(FILE* s)
+    {
+        fprintf(s,
+                "Usage: rover_flightdump [options] [FILE]\n"
+                "   FILE                Flight recorder file (default %s).\n"
+                "   -n  --last N        Print only the last N records.\n"
+                "   -j  --json          Print records as JSON.\n"
+                "   -h  --help          Print this message.\n", FLIGHT_RECORDER_DEFAULT_PATH);
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char* const short_options = "n:jh";
+
+    const struct option long_options[] = {
+        { "last",   1,  NULL,  'n'},
+        { "json",   0,  NULL,  'j'},
+        { "help",   0,  NULL,  'h'},
+        { NULL,     0,  NULL,   0 }
+    };
+
+    size_t last = 0;
+    bool json = false;
+    int option;
+
+    while(-1 != (option = getopt_long(argc, argv, short_options, long_options, NULL))) {
+        switch(option) {
+            case 'n':
+                last = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 'h':
+                PrintUsage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                PrintUsage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    const char* path = (optind < argc) ? argv[optind] : FLIGHT_RECORDER_DEFAULT_PATH;
+
+    FlightRecorderHeader header;
+    std::vector<FlightFileEntry> entries;
+    if(!ReadFlightFile(path, header, entries)) return EXIT_FAILURE;
+
+    size_t first = (last != 0 && last < entries.size()) ? entries.size() - last : 0;
+    uint64_t lost = header.writeIndex - entries.size();
+
+    if(json) {
+        printf("{\"pid\":%u,\"capacity\":%llu,\"written\":%llu,\"records\":[", header.pid,
+                static_cast<unsigned long long>(header.capacity), static_cast<unsigned long long>(header.writeIndex));
+    }
+    else {
+        printf("# pid %u, %llu records written, %llu shown, %llu overwritten or incomplete\n", header.pid,
+                static_cast<unsigned long long>(header.writeIndex), static_cast<unsigned long long>(entries.size() - first),
+                static_cast<unsigned long long>(lost));
+    }
+
+    for(size_t i = first; i < entries.size(); ++i) {
+        const FlightRecord& rec = entries[i].record;
+        char details[128];
+        FormatRecord(rec, details, sizeof(details));
+
+        /* Monotonic time is converted to wall clock using the pair sampled at open */
+        uint64_t wallNs = header.realtimeBaseNs + (rec.timestampNs - header.monotonicBaseNs);
+        double sinceOpen = static_cast<double>(static_cast<int64_t>(rec.timestampNs - header.monotonicBaseNs)) / NSEC_PER_SEC;
+
+        if(json) {
+            printf("%s{\"index\":%llu,\"monotonic_ns\":%llu,\"thread\":%u,\"type\":\"%s\",\"size\":%u,\"payload\":\"",
+                    i == first ? "" : ",", static_cast<unsigned long long>(entries[i].index),
+                    static_cast<unsigned long long>(rec.timestampNs), rec.thread, RecordTypeName(rec.type), rec.size);
+            for(unsigned b = 0; b < rec.size && b < PAYLOAD_SIZE; ++b) printf("%02x", rec.payload[b]);
+            printf("\",\"details\":\"%s\"}", details);
+        }
+        else {
+            time_t seconds = wallNs / NSEC_PER_SEC;
+            tm local;
+            char stamp[32];
+            localtime_r(&seconds, &local);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+
+            printf("%s.%06llu %+12.6f %5u %-10s %s\n", stamp,
+                    static_cast<unsigned long long>(wallNs % NSEC_PER_SEC / 1000), sinceOpen,
+                    rec.thread, RecordTypeName(rec.type), details);
+        }
+    }
+
+    if(json) printf("]}\n");
+
+    return EXIT_SUCCESS;
+}
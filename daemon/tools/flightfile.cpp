@@ -0,0 +1,69 @@
+/*
+ * flightfile.cpp
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "flightfile.h"
+
+using namespace FlightRecorder;
+
+bool ReadFlightFile(const char* path, FlightRecorderHeader& header, std::vector<FlightFileEntry>& entries)
+{
+    FILE* f = fopen(path, "rb");
+    if(f == nullptr) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    bool ok = (1 == fread(&header, sizeof(header), 1, f));
+    if(!ok || 0 != memcmp(header.magic, MAGIC, sizeof(MAGIC))) {
+        fprintf(stderr, "%s: not a flight recorder file\n", path);
+        fclose(f);
+        return false;
+    }
+    if(header.version != VERSION || header.recordSize != sizeof(FlightRecord) ||
+            header.capacity == 0 || 0 != (header.capacity & (header.capacity - 1))) {
+        fprintf(stderr, "%s: unsupported version %u or record size %u\n", path, header.version, header.recordSize);
+        fclose(f);
+        return false;
+    }
+
+    std::vector<FlightRecord> slots(header.capacity);
+    size_t read = fread(slots.data(), sizeof(FlightRecord), slots.size(), f);
+    fclose(f);
+    if(read != slots.size()) {
+        fprintf(stderr, "%s: truncated file, %zu of %zu records\n", path, read, slots.size());
+        slots.resize(read);
+    }
+
+    uint64_t end = header.writeIndex;
+    uint64_t begin = end > header.capacity ? end - header.capacity : 0;
+    uint64_t mask = header.capacity - 1;
+
+    for(uint64_t i = begin; i < end; ++i) {
+        if((i & mask) >= slots.size()) continue;
+        const FlightRecord& rec = slots[i & mask];
+        if(rec.timestampNs == 0 || rec.sequence != static_cast<uint32_t>(i)) continue;
+        entries.push_back({ i, rec });
+    }
+
+/*
+ * NOTE: Slots are claimed before the timestamp is taken, so claim order may differ from
+ * time order by the time between the two, records are ordered by time
+ */
+    std::stable_sort(entries.begin(), entries.end(), [](const FlightFileEntry& a, const FlightFileEntry& b) {
+        return a.record.timestampNs < b.record.timestampNs;
+    });
+
+    return true;
+}
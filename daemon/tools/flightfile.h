@@ -0,0 +1,32 @@
+/*
+ * flightfile.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#ifndef _FLIGHT_FILE_H_
+#define _FLIGHT_FILE_H_
+
+#include <vector>
+
+#include "flightrecorder.h"
+
+struct FlightFileEntry
+{
+    uint64_t index;
+    FlightRecorder::FlightRecord record;
+};
+
+/*
+ * Reads a flight recorder file and returns the complete records of the current ring window
+ * ordered by time. Slots that were being written (or were being written at a crash) are
+ * skipped. Prints the reason to stderr and returns false when the file can not be used.
+ */
+bool ReadFlightFile(const char* path, FlightRecorder::FlightRecorderHeader& header,
+        std::vector<FlightFileEntry>& entries);
+
+#endif /* _FLIGHT_FILE_H_ */
@@ -0,0 +1,889 @@
+/*
+ * replay.cpp
+ *
+ * Load generator for rover_daemon. Replays the client messages of a flight recorder file,
+ * or a synthetic workload, over the control connection at the recorded pace scaled by
+ * a speed factor or as fast as possible. Responses are checked and their latency is
+ * reported as percentiles. With timestamps the daemon clock is tracked by REQ_TIME_SYNC,
+ * wheel commands are stamped with their send time and the age of the sensor readings at
+ * arrival is reported. With correlation ids every request carries its own id and is
+ * matched to its response by it, requests may then be answered out of order. Grouping sends
+ * consecutive commands and device requests as one BATCH frame.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * Copyright (C) 2016 Tomasz Chadzynski
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "flightfile.h"
+#include "clocksync.h"
+#include "netcodec.h"
+#include "util.h"
+
+namespace {
+    struct WorkItem
+    {
+        /* Send time relative to the start at 1x speed */
+        uint64_t offsetNs;
+        /* Host byte order */
+        RoverNet::Message msg;
+    };
+
+    enum ResponseKind { RESP_WHEELS_STATE, RESP_DISTANCE, RESP_VID_PORT, RESP_KINDS };
+    const char* const RESPONSE_NAMES[] = { "wheels_state", "distance", "vid_stream_port" };
+
+    constexpr uint64_t TIME_SYNC_INTERVAL_NS = 100000000ULL;
+
+    struct Correlated
+    {
+        uint64_t sentNs;
+        ResponseKind kind;
+    };
+
+/*
+ * State shared between the sending and the receiving thread, guarded by mutex.
+ * Every request gets exactly one response. Uncorrelated requests of one kind are answered
+ * in order, correlated ones in any order.
+ */
+    struct Session
+    {
+        int sock;
+        pthread_mutex_t mutex;
+        pthread_cond_t drained;
+
+        std::deque<uint64_t> pendingState;
+        std::deque<uint64_t> pendingPort;
+        std::deque<uint64_t> pendingDistance;
+        std::map<uint32_t, Correlated> pendingCorrelated;
+        /* Requests of each batch in order, keyed by the batch correlation id */
+        std::map<uint32_t, std::vector<Correlated>> pendingBatches;
+        size_t pendingBatchItems;
+        uint32_t nextCorrelationId;
+
+        std::vector<uint64_t> latency[RESP_KINDS];
+        uint64_t responses;
+        uint64_t unexpected;
+        uint64_t invalid;
+        /* Unsolicited MSG_REFLEX and MSG_DEADMAN, not counted as responses */
+        uint64_t reflexEvents;
+        uint64_t deadmanStops;
+        bool receiving;
+
+        ClockSync sync;
+        /* Age of the device reading at arrival, in the local clock */
+        std::vector<uint64_t> sensorAge[RESP_KINDS];
+        bool pinging;
+        pthread_cond_t pingStop;
+    };
+
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        uint16_t port = SERVER_TCP_PORT;
+        /* Multiple of the recorded pace, 0 sends as fast as possible */
+        double speed = 1.0;
+        double drainSeconds = 2.0;
+        bool json = false;
+        bool timestamps = false;
+        bool correlate = false;
+        /* Messages per BATCH frame, 1 sends every message on its own */
+        unsigned group = 1;
+    };
+
+/*
+ * Synthetic workload, message types are drawn with the given weights at a fixed rate
+ */
+    struct WorkloadSpec
+    {
+        double rate = 100.0;
+        double seconds = 10.0;
+        unsigned seed = 1;
+        unsigned weights[7] = { 6, 0, 0, 1, 2, 1, 0 };
+    };
+
+    const char* const WEIGHT_KEYS[] = { "set", "left", "right", "stop", "state", "distance", "port" };
+    const RoverNet::MessageType WEIGHT_TYPES[] = {
+        RoverNet::CMD_SET_WHEELS_SPEED, RoverNet::CMD_SET_LEFT_WHEEL_SPEED, RoverNet::CMD_SET_RIGHT_WHEEL_SPEED,
+        RoverNet::CMD_STOP, RoverNet::REQ_WHEELS_STATE, RoverNet::REQ_DISTANCE, RoverNet::REQ_VID_STREAM_PORT
+    };
+
+    bool ParseWorkload(const char* text, WorkloadSpec& spec)
+    {
+        std::string s = text;
+        size_t pos = 0;
+
+        while(pos < s.size()) {
+            size_t end = s.find(',', pos);
+            if(end == std::string::npos) end = s.size();
+            std::string item = s.substr(pos, end - pos);
+            pos = end + 1;
+
+            size_t eq = item.find('=');
+            if(eq == std::string::npos) return false;
+            std::string key = item.substr(0, eq);
+            double value = atof(item.c_str() + eq + 1);
+            if(value < 0) return false;
+
+            if(key == "rate") spec.rate = value;
+            else if(key == "time") spec.seconds = value;
+            else if(key == "seed") spec.seed = static_cast<unsigned>(value);
+            else {
+                bool found = false;
+                for(unsigned i = 0; i < sizeof(WEIGHT_KEYS) / sizeof(WEIGHT_KEYS[0]); ++i) {
+                    if(key == WEIGHT_KEYS[i]) {
+                        spec.weights[i] = static_cast<unsigned>(value);
+                        found = true;
+                    }
+                }
+                if(!found) return false;
+            }
+        }
+
+        unsigned total = 0;
+        for(unsigned w : spec.weights) total += w;
+        return total > 0 && spec.rate > 0 && spec.seconds > 0;
+    }
+
+    void GenerateWorkload(const WorkloadSpec& spec, std::vector<WorkItem>& items)
+    {
+        unsigned total = 0;
+        for(unsigned w : spec.weights) total += w;
+
+        uint64_t count = static_cast<uint64_t>(spec.rate * spec.seconds);
+        uint64_t state = spec.seed ? spec.seed : 1;
+
+        for(uint64_t i = 0; i < count; ++i) {
+            /* xorshift, the workload must be the same on every run with the same seed */
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+
+            unsigned pick = state % total;
+            unsigned type = 0;
+            while(pick >= spec.weights[type]) pick -= spec.weights[type++];
+
+            WorkItem item;
+            item.msg = RoverNet::Message();
+            item.offsetNs = static_cast<uint64_t>(i * NSEC_PER_SEC / spec.rate);
+            item.msg.msgType = WEIGHT_TYPES[type];
+            item.msg.data.wheelsState.leftWheelSpeed = static_cast<int16_t>((state >> 20) % 511) - 255;
+            item.msg.data.wheelsState.rightWheelSpeed = static_cast<int16_t>((state >> 40) % 511) - 255;
+            items.push_back(item);
+        }
+    }
+
+    bool LoadRecording(const char* path, std::vector<WorkItem>& items)
+    {
+        FlightRecorder::FlightRecorderHeader header;
+        std::vector<FlightFileEntry> entries;
+        if(!ReadFlightFile(path, header, entries)) return false;
+
+        uint64_t first = 0;
+        for(const FlightFileEntry& e : entries) {
+            if(e.record.type != FlightRecorder::REC_MSG_IN) continue;
+
+            WorkItem item;
+            item.msg = RoverNet::FromWire(e.record.payload);
+
+            /* Stamps of the recorded session are stale, they are regenerated with -t */
+            if(item.msg.msgType == RoverNet::TIMESTAMP || item.msg.msgType == RoverNet::REQ_TIME_SYNC) continue;
+            /* Ids are assigned again with -c */
+            if(item.msg.msgType == RoverNet::CORRELATION_ID) continue;
+
+            if(items.empty()) first = e.record.timestampNs;
+            item.offsetNs = e.record.timestampNs - first;
+            items.push_back(item);
+        }
+
+        if(items.empty()) {
+            fprintf(stderr, "%s: no client messages recorded\n", path);
+            return false;
+        }
+        return true;
+    }
+
+    size_t PendingCount(const Session& s)
+    {
+        return s.pendingState.size() + s.pendingPort.size() + s.pendingDistance.size() + s.pendingCorrelated.size() +
+            s.pendingBatchItems;
+    }
+
+    uint32_t NextCorrelationId(Session& s)
+    {
+        uint32_t id = s.nextCorrelationId++;
+        if(s.nextCorrelationId == 0) s.nextCorrelationId = 1;
+        return id;
+    }
+
+    bool Batchable(uint8_t type)
+    {
+        return type == RoverNet::CMD_SET_WHEELS_SPEED || type == RoverNet::CMD_SET_LEFT_WHEEL_SPEED ||
+               type == RoverNet::CMD_SET_RIGHT_WHEEL_SPEED || type == RoverNet::CMD_STOP ||
+               type == RoverNet::REQ_WHEELS_STATE || type == RoverNet::REQ_DISTANCE;
+    }
+
+    bool ResponseKindOf(uint8_t request, ResponseKind& kind)
+    {
+        switch(request) {
+            case RoverNet::REQ_WHEELS_STATE: kind = RESP_WHEELS_STATE; return true;
+            case RoverNet::REQ_DISTANCE: kind = RESP_DISTANCE; return true;
+            case RoverNet::REQ_VID_STREAM_PORT: kind = RESP_VID_PORT; return true;
+            default: return false;
+        }
+    }
+
+    bool ResponseKindMatches(uint8_t response, ResponseKind kind)
+    {
+        switch(kind) {
+            case RESP_WHEELS_STATE: return response == RoverNet::MSG_WHEELS_STATE;
+            case RESP_DISTANCE: return response == RoverNet::MSG_DISTANCE;
+            case RESP_VID_PORT: return response == RoverNet::MSG_VID_STREAM_PORT;
+            default: return false;
+        }
+    }
+
+    bool PopPending(std::deque<uint64_t>& pending, uint64_t& sentNs)
+    {
+        if(pending.empty()) return false;
+        sentNs = pending.front();
+        pending.pop_front();
+        return true;
+    }
+
+    bool CheckResponse(const RoverNet::Message& msg)
+    {
+        switch(msg.msgType) {
+            case RoverNet::MSG_WHEELS_STATE:
+                {
+                    const RoverNet::DataWheelsState& w = msg.data.wheelsState;
+                    return w.wheelMinSpeed <= w.wheelMaxSpeed &&
+                        w.leftWheelSpeed >= w.wheelMinSpeed && w.leftWheelSpeed <= w.wheelMaxSpeed &&
+                        w.rightWheelSpeed >= w.wheelMinSpeed && w.rightWheelSpeed <= w.wheelMaxSpeed;
+                }
+            case RoverNet::MSG_DISTANCE:
+                return msg.data.distance.distanceCM >= 0 && msg.data.distance.filter <= RoverNet::DIST_ESTIMATE;
+            case RoverNet::MSG_VID_STREAM_PORT:
+                return msg.data.videoStreamPort.running <= 1 &&
+                    (msg.data.videoStreamPort.running == 0 || msg.data.videoStreamPort.port != 0);
+            case RoverNet::MSG_TIME_SYNC:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void* ReceiveProcedure(void* arg)
+    {
+        Session* s = static_cast<Session*>(arg);
+        RoverNet::Message msg;
+        uint64_t stampNs = 0;
+        uint32_t correlationId = 0;
+        /* Response batch being received */
+        uint32_t batchId = 0;
+        unsigned batchRemaining = 0;
+        unsigned batchIndex = 0;
+
+        while(true) {
+            ssize_t r = recv(s->sock, &msg, RoverNet::MESSAGE_STRUCT_SIZE, MSG_WAITALL);
+            if(r != static_cast<ssize_t>(RoverNet::MESSAGE_STRUCT_SIZE)) break;
+
+            uint64_t now = MonotonicNs();
+            msg = RoverNet::NetToHost(msg);
+
+            /* Applies to the next message */
+            if(msg.msgType == RoverNet::TIMESTAMP) {
+                stampNs = RoverNet::TimestampNs(msg.data.timestamp);
+                continue;
+            }
+            if(msg.msgType == RoverNet::CORRELATION_ID) {
+                correlationId = msg.data.correlationId.id;
+                continue;
+            }
+            if(msg.msgType == RoverNet::BATCH) {
+                batchId = correlationId;
+                batchRemaining = msg.data.batch.count;
+                batchIndex = 0;
+                correlationId = 0;
+
+                pthread_mutex_lock(&s->mutex);
+                std::map<uint32_t, std::vector<Correlated>>::iterator it = s->pendingBatches.find(batchId);
+                if(it == s->pendingBatches.end() || it->second.size() != batchRemaining) s->unexpected++;
+                pthread_mutex_unlock(&s->mutex);
+                continue;
+            }
+
+            uint64_t capturedNs = stampNs;
+            uint32_t id = correlationId;
+            stampNs = 0;
+            correlationId = 0;
+            bool valid = CheckResponse(msg);
+
+            pthread_mutex_lock(&s->mutex);
+            if(msg.msgType == RoverNet::MSG_TIME_SYNC) {
+                if(!s->sync.Response(msg.data.timeSync.sequence, msg.data.timeSync.holdNs, capturedNs, now)) s->unexpected++;
+                pthread_mutex_unlock(&s->mutex);
+                continue;
+            }
+            if(msg.msgType == RoverNet::MSG_REFLEX || msg.msgType == RoverNet::MSG_DEADMAN) {
+                if(msg.msgType == RoverNet::MSG_REFLEX) s->reflexEvents++;
+                else s->deadmanStops++;
+                pthread_mutex_unlock(&s->mutex);
+                continue;
+            }
+
+            s->responses++;
+            if(!valid) s->invalid++;
+
+            if(capturedNs != 0 && s->sync.Synchronized()) {
+                /* An offset error larger than the age shows as zero */
+                uint64_t local = s->sync.ToLocal(capturedNs);
+                uint64_t age = now > local ? now - local : 0;
+                if(msg.msgType == RoverNet::MSG_WHEELS_STATE) s->sensorAge[RESP_WHEELS_STATE].push_back(age);
+                if(msg.msgType == RoverNet::MSG_DISTANCE) s->sensorAge[RESP_DISTANCE].push_back(age);
+            }
+
+            uint64_t sentNs;
+            if(batchRemaining != 0) {
+                batchRemaining--;
+                std::map<uint32_t, std::vector<Correlated>>::iterator it = s->pendingBatches.find(batchId);
+                bool known = it != s->pendingBatches.end() && batchIndex < it->second.size();
+                if(known && ResponseKindMatches(msg.msgType, it->second[batchIndex].kind))
+                    s->latency[it->second[batchIndex].kind].push_back(now - it->second[batchIndex].sentNs);
+                else
+                    s->unexpected++;
+                if(known) s->pendingBatchItems--;
+                batchIndex++;
+
+                /* Requests a short batch did not answer stay counted as missing */
+                if(batchRemaining == 0 && it != s->pendingBatches.end()) s->pendingBatches.erase(it);
+            }
+            else if(id != 0) {
+                std::map<uint32_t, Correlated>::iterator it = s->pendingCorrelated.find(id);
+                if(it != s->pendingCorrelated.end() && ResponseKindMatches(msg.msgType, it->second.kind)) {
+                    s->latency[it->second.kind].push_back(now - it->second.sentNs);
+                    s->pendingCorrelated.erase(it);
+                }
+                else {
+                    s->unexpected++;
+                }
+            }
+            else switch(msg.msgType) {
+                case RoverNet::MSG_WHEELS_STATE:
+                    if(PopPending(s->pendingState, sentNs)) s->latency[RESP_WHEELS_STATE].push_back(now - sentNs);
+                    else s->unexpected++;
+                    break;
+                case RoverNet::MSG_VID_STREAM_PORT:
+                    if(PopPending(s->pendingPort, sentNs)) s->latency[RESP_VID_PORT].push_back(now - sentNs);
+                    else s->unexpected++;
+                    break;
+                case RoverNet::MSG_DISTANCE:
+                    if(PopPending(s->pendingDistance, sentNs)) s->latency[RESP_DISTANCE].push_back(now - sentNs);
+                    else s->unexpected++;
+                    break;
+                default:
+                    break;
+            }
+
+            if(0 == PendingCount(*s)) pthread_cond_broadcast(&s->drained);
+            pthread_mutex_unlock(&s->mutex);
+        }
+
+        pthread_mutex_lock(&s->mutex);
+        s->receiving = false;
+        pthread_cond_broadcast(&s->drained);
+        pthread_mutex_unlock(&s->mutex);
+
+        return nullptr;
+    }
+
+    bool SendMessage(int sock, RoverNet::Message msg)
+    {
+        msg = RoverNet::HostToNet(msg);
+        if(RoverNet::MESSAGE_STRUCT_SIZE == send(sock, &msg, RoverNet::MESSAGE_STRUCT_SIZE, MSG_NOSIGNAL)) return true;
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* Keeps the clock estimate current while the workload runs */
+    void* PingProcedure(void* arg)
+    {
+        Session* s = static_cast<Session*>(arg);
+
+        pthread_mutex_lock(&s->mutex);
+        while(s->pinging) {
+            RoverNet::Message msg = {};
+            msg.msgType = RoverNet::REQ_TIME_SYNC;
+            msg.data.timeSync.sequence = s->sync.Request(MonotonicNs());
+            pthread_mutex_unlock(&s->mutex);
+
+            bool sent = SendMessage(s->sock, msg);
+
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline = NsToTimespec(TimespecToNs(deadline) + TIME_SYNC_INTERVAL_NS);
+
+            pthread_mutex_lock(&s->mutex);
+            if(!sent) break;
+            while(s->pinging && ETIMEDOUT != pthread_cond_timedwait(&s->pingStop, &s->mutex, &deadline));
+        }
+        pthread_mutex_unlock(&s->mutex);
+
+        return nullptr;
+    }
+
+/*
+ * Sends items as one BATCH frame. The batch carries a correlation id when it holds requests,
+ * a stamp when it holds wheel commands and timestamps are on.
+ */
+    bool SendBatch(Session& s, const Options& opt, const std::vector<WorkItem>& items, const std::vector<uint64_t>& scheduled)
+    {
+        uint8_t frame[(BATCH_MAX_ITEMS + 3) * RoverNet::MESSAGE_STRUCT_SIZE];
+        size_t frameSize = 0;
+        std::vector<Correlated> requests;
+        bool commands = false;
+
+        for(size_t i = 0; i < items.size(); ++i) {
+            ResponseKind kind;
+            if(ResponseKindOf(items[i].msg.msgType, kind)) requests.push_back({ scheduled[i], kind });
+            else commands = true;
+        }
+
+        RoverNet::Message prefix = {};
+
+        pthread_mutex_lock(&s.mutex);
+        if(!requests.empty()) {
+            prefix.msgType = RoverNet::CORRELATION_ID;
+            prefix.data.correlationId.id = NextCorrelationId(s);
+            s.pendingBatchItems += requests.size();
+            s.pendingBatches[prefix.data.correlationId.id].swap(requests);
+
+            prefix = RoverNet::HostToNet(prefix);
+            memcpy(frame + frameSize, &prefix, RoverNet::MESSAGE_STRUCT_SIZE);
+            frameSize += RoverNet::MESSAGE_STRUCT_SIZE;
+        }
+
+        if(opt.timestamps && commands && s.sync.Synchronized()) {
+            prefix = RoverNet::Message();
+            prefix.msgType = RoverNet::TIMESTAMP;
+            prefix.data.timestamp = RoverNet::MakeTimestamp(s.sync.ToDaemon(MonotonicNs()));
+            prefix = RoverNet::HostToNet(prefix);
+            memcpy(frame + frameSize, &prefix, RoverNet::MESSAGE_STRUCT_SIZE);
+            frameSize += RoverNet::MESSAGE_STRUCT_SIZE;
+        }
+        pthread_mutex_unlock(&s.mutex);
+
+        RoverNet::Message header = {};
+        header.msgType = RoverNet::BATCH;
+        header.data.batch.count = items.size();
+        header = RoverNet::HostToNet(header);
+        memcpy(frame + frameSize, &header, RoverNet::MESSAGE_STRUCT_SIZE);
+        frameSize += RoverNet::MESSAGE_STRUCT_SIZE;
+
+        for(const WorkItem& item : items) {
+            RoverNet::Message wire = RoverNet::HostToNet(item.msg);
+            memcpy(frame + frameSize, &wire, RoverNet::MESSAGE_STRUCT_SIZE);
+            frameSize += RoverNet::MESSAGE_STRUCT_SIZE;
+        }
+
+        if(static_cast<ssize_t>(frameSize) == send(s.sock, frame, frameSize, MSG_NOSIGNAL)) return true;
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return false;
+    }
+
+    bool IsWheelCommand(uint8_t type)
+    {
+        return type == RoverNet::CMD_SET_WHEELS_SPEED || type == RoverNet::CMD_SET_LEFT_WHEEL_SPEED ||
+               type == RoverNet::CMD_SET_RIGHT_WHEEL_SPEED || type == RoverNet::CMD_STOP;
+    }
+
+    int Connect(const Options& opt)
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(opt.port);
+        if(1 != inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr)) {
+            fprintf(stderr, "invalid address %s\n", opt.host.c_str());
+            return -1;
+        }
+
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if(sock == -1 || 0 != connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+            fprintf(stderr, "connect %s:%u: %s\n", opt.host.c_str(), opt.port, strerror(errno));
+            if(sock != -1) close(sock);
+            return -1;
+        }
+
+        int noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        return sock;
+    }
+
+    double Percentile(const std::vector<uint64_t>& sorted, double p)
+    {
+        if(sorted.empty()) return 0;
+        size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+        return sorted[i] / 1e6;
+    }
+
+    void PrintPercentiles(const char* title, std::vector<uint64_t>* sets, bool json)
+    {
+        if(!json) printf("%-16s %8s %9s %9s %9s %9s %9s\n", title, "count", "p50", "p90", "p99", "p99.9", "max");
+
+        for(unsigned k = 0; k < RESP_KINDS; ++k) {
+            std::vector<uint64_t>& l = sets[k];
+            std::sort(l.begin(), l.end());
+
+            if(json) {
+                printf("%s\"%s\":{\"count\":%zu,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+                        k == 0 ? "" : ",", RESPONSE_NAMES[k], l.size(), Percentile(l, 0.5), Percentile(l, 0.9),
+                        Percentile(l, 0.99), Percentile(l, 0.999), Percentile(l, 1.0));
+            }
+            else if(!l.empty()) {
+                printf("%-16s %8zu %9.3f %9.3f %9.3f %9.3f %9.3f\n", RESPONSE_NAMES[k], l.size(), Percentile(l, 0.5),
+                        Percentile(l, 0.9), Percentile(l, 0.99), Percentile(l, 0.999), Percentile(l, 1.0));
+            }
+        }
+    }
+
+    void PrintUsage(FILE* s)
+    {
+        fprintf(s,
+                "Usage: rover_replay [options] (-r FILE | -w SPEC)\n"
+                "   -r  --recording FILE   Replay client messages of a flight recorder file.\n"
+                "   -w  --workload SPEC    Synthetic workload, comma separated key=value pairs:\n"
+                "                          rate=HZ time=SEC seed=N and message weights\n"
+                "                          set left right stop state distance port\n"
+                "                          (default rate=100,time=10,set=6,stop=1,state=2,distance=1).\n"
+                "   -H  --host ADDR        Daemon address (default 127.0.0.1).\n"
+                "   -p  --port PORT        Daemon port (default %u).\n"
+                "   -x  --speed N          Multiple of the recorded pace, 0 for as fast as possible (default 1).\n"
+                "   -d  --drain SEC        Time to wait for outstanding responses (default 2).\n"
+                "   -t  --timestamps       Track the daemon clock, stamp wheel commands and report\n"
+                "                          the age of device readings at arrival.\n"
+                "   -c  --correlate        Send every request with its own correlation id and\n"
+                "                          match responses by id.\n"
+                "   -g  --group N          Send up to N consecutive commands and device requests\n"
+                "                          as one BATCH frame (default 1, at most %u).\n"
+                "   -j  --json             Print results as JSON.\n"
+                "   -h  --help             Print this message.\n"
+                "Latency is measured from the scheduled send time, so a sender falling behind\n"
+                "schedule is included in the result. Exit status is non zero when a response\n"
+                "is missing, unexpected or invalid.\n", SERVER_TCP_PORT, BATCH_MAX_ITEMS);
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char* const short_options = "r:w:H:p:x:d:tcg:jh";
+
+    const struct option long_options[] = {
+        { "recording",  1,  NULL,  'r'},
+        { "workload",   1,  NULL,  'w'},
+        { "host",       1,  NULL,  'H'},
+        { "port",       1,  NULL,  'p'},
+        { "speed",      1,  NULL,  'x'},
+        { "drain",      1,  NULL,  'd'},
+        { "timestamps", 0,  NULL,  't'},
+        { "correlate",  0,  NULL,  'c'},
+        { "group",      1,  NULL,  'g'},
+        { "json",       0,  NULL,  'j'},
+        { "help",       0,  NULL,  'h'},
+        { NULL,         0,  NULL,   0 }
+    };
+
+    Options opt;
+    const char* recording = nullptr;
+    const char* workload = nullptr;
+    int option;
+
+    while(-1 != (option = getopt_long(argc, argv, short_options, long_options, NULL))) {
+        switch(option) {
+            case 'r':
+                recording = optarg;
+                break;
+            case 'w':
+                workload = optarg;
+                break;
+            case 'H':
+                opt.host = optarg;
+                break;
+            case 'p':
+                opt.port = atoi(optarg);
+                break;
+            case 'x':
+                opt.speed = atof(optarg);
+                break;
+            case 'd':
+                opt.drainSeconds = atof(optarg);
+                break;
+            case 't':
+                opt.timestamps = true;
+                break;
+            case 'c':
+                opt.correlate = true;
+                break;
+            case 'g':
+                opt.group = atoi(optarg);
+                break;
+            case 'j':
+                opt.json = true;
+                break;
+            case 'h':
+                PrintUsage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                PrintUsage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if((recording != nullptr) == (workload != nullptr) || opt.speed < 0 || opt.group < 1 || opt.group > BATCH_MAX_ITEMS) {
+        PrintUsage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<WorkItem> items;
+    if(recording != nullptr) {
+        if(!LoadRecording(recording, items)) return EXIT_FAILURE;
+    }
+    else {
+        WorkloadSpec spec;
+        if(!ParseWorkload(workload, spec)) {
+            fprintf(stderr, "invalid workload: %s\n", workload);
+            PrintUsage(stderr);
+            return EXIT_FAILURE;
+        }
+        GenerateWorkload(spec, items);
+    }
+
+    Session session;
+    session.sock = Connect(opt);
+    if(session.sock == -1) return EXIT_FAILURE;
+
+    pthread_mutex_init(&session.mutex, NULL);
+    pthread_cond_init(&session.drained, NULL);
+    pthread_cond_init(&session.pingStop, NULL);
+    session.responses = 0;
+    session.unexpected = 0;
+    session.invalid = 0;
+    session.reflexEvents = 0;
+    session.deadmanStops = 0;
+    session.nextCorrelationId = 1;
+    session.pendingBatchItems = 0;
+    session.receiving = true;
+    session.pinging = opt.timestamps;
+
+    pthread_t receiver;
+    if(0 != pthread_create(&receiver, NULL, ReceiveProcedure, &session)) {
+        fprintf(stderr, "unable to start the receiving thread\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_t pinger;
+    if(opt.timestamps) {
+        if(0 != pthread_create(&pinger, NULL, PingProcedure, &session)) {
+            fprintf(stderr, "unable to start the time sync thread\n");
+            return EXIT_FAILURE;
+        }
+
+        /* Commands are stamped only once the offset is known */
+        for(int i = 0; i < 100; ++i) {
+            pthread_mutex_lock(&session.mutex);
+            bool synchronized = session.sync.Synchronized();
+            pthread_mutex_unlock(&session.mutex);
+            if(synchronized) break;
+            usleep(10000);
+        }
+    }
+
+    uint64_t sent = 0;
+    uint64_t maxLagNs = 0;
+    bool sendFailed = false;
+    std::vector<WorkItem> group;
+    std::vector<uint64_t> groupScheduled;
+    uint64_t start = MonotonicNs();
+
+    for(size_t n = 0; n < items.size(); ++n) {
+        const WorkItem& item = items[n];
+        uint64_t scheduled = start;
+        if(opt.speed > 0) {
+            scheduled += static_cast<uint64_t>(item.offsetNs / opt.speed);
+            timespec t = NsToTimespec(scheduled);
+            while(EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL));
+        }
+
+        uint64_t now = MonotonicNs();
+        if(opt.speed > 0) maxLagNs = std::max(maxLagNs, now - scheduled);
+        else scheduled = now;
+
+/*
+ * NOTE: A group is sent when it is full or the next message can not join it, so the messages
+ * wait for the rest of their group like the operations of a control tick
+ */
+        if(opt.group > 1 && Batchable(item.msg.msgType)) {
+            group.push_back(item);
+            groupScheduled.push_back(scheduled);
+
+            bool last = n + 1 == items.size() || !Batchable(items[n + 1].msg.msgType);
+            if(group.size() < opt.group && !last) continue;
+
+            bool ok = SendBatch(session, opt, group, groupScheduled);
+            if(ok) sent += group.size();
+            group.clear();
+            groupScheduled.clear();
+            if(!ok) {
+                sendFailed = true;
+                break;
+            }
+            continue;
+        }
+
+        uint32_t correlationId = 0;
+        ResponseKind kind;
+
+        pthread_mutex_lock(&session.mutex);
+        if(opt.correlate && ResponseKindOf(item.msg.msgType, kind)) {
+            correlationId = NextCorrelationId(session);
+            session.pendingCorrelated[correlationId] = { scheduled, kind };
+        }
+        else switch(item.msg.msgType) {
+            case RoverNet::REQ_WHEELS_STATE:
+                session.pendingState.push_back(scheduled);
+                break;
+            case RoverNet::REQ_DISTANCE:
+                session.pendingDistance.push_back(scheduled);
+                break;
+            case RoverNet::REQ_VID_STREAM_PORT:
+                session.pendingPort.push_back(scheduled);
+                break;
+            default:
+                break;
+        }
+        pthread_mutex_unlock(&session.mutex);
+
+        uint8_t frame[3 * RoverNet::MESSAGE_STRUCT_SIZE];
+        size_t frameSize = 0;
+
+        if(correlationId != 0) {
+            RoverNet::Message id = {};
+            id.msgType = RoverNet::CORRELATION_ID;
+            id.data.correlationId.id = correlationId;
+            id = RoverNet::HostToNet(id);
+            memcpy(frame, &id, RoverNet::MESSAGE_STRUCT_SIZE);
+            frameSize += RoverNet::MESSAGE_STRUCT_SIZE;
+        }
+
+        pthread_mutex_lock(&session.mutex);
+        bool stamp = opt.timestamps && session.sync.Synchronized() && IsWheelCommand(item.msg.msgType);
+        uint64_t daemonNow = session.sync.ToDaemon(MonotonicNs());
+        pthread_mutex_unlock(&session.mutex);
+
+        if(stamp) {
+            RoverNet::Message ts = {};
+            ts.msgType = RoverNet::TIMESTAMP;
+            ts.data.timestamp = RoverNet::MakeTimestamp(daemonNow);
+            ts = RoverNet::HostToNet(ts);
+            memcpy(frame + frameSize, &ts, RoverNet::MESSAGE_STRUCT_SIZE);
+            frameSize += RoverNet::MESSAGE_STRUCT_SIZE;
+        }
+
+        RoverNet::Message wire = RoverNet::HostToNet(item.msg);
+        memcpy(frame + frameSize, &wire, RoverNet::MESSAGE_STRUCT_SIZE);
+        frameSize += RoverNet::MESSAGE_STRUCT_SIZE;
+
+        if(static_cast<ssize_t>(frameSize) != send(session.sock, frame, frameSize, MSG_NOSIGNAL)) {
+            fprintf(stderr, "send: %s\n", strerror(errno));
+            sendFailed = true;
+            break;
+        }
+        sent++;
+    }
+
+    uint64_t sendEnd = MonotonicNs();
+
+    /* Outstanding responses are given drainSeconds to arrive */
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline = NsToTimespec(TimespecToNs(deadline) + static_cast<uint64_t>(opt.drainSeconds * NSEC_PER_SEC));
+
+    pthread_mutex_lock(&session.mutex);
+    while(session.receiving && 0 != PendingCount(session)) {
+        if(ETIMEDOUT == pthread_cond_timedwait(&session.drained, &session.mutex, &deadline)) break;
+    }
+    uint64_t missing = PendingCount(session);
+    session.pinging = false;
+    pthread_cond_broadcast(&session.pingStop);
+    pthread_mutex_unlock(&session.mutex);
+
+    if(opt.timestamps) pthread_join(pinger, NULL);
+
+    uint64_t end = MonotonicNs();
+
+    shutdown(session.sock, SHUT_RDWR);
+    pthread_join(receiver, NULL);
+    close(session.sock);
+
+    double sendSeconds = static_cast<double>(sendEnd - start) / NSEC_PER_SEC;
+    double totalSeconds = static_cast<double>(end - start) / NSEC_PER_SEC;
+    uint64_t errors = missing + session.unexpected + session.invalid + (sendFailed ? 1 : 0);
+
+    if(opt.json) {
+        printf("{\"sent\":%llu,\"send_seconds\":%.3f,\"sent_per_sec\":%.1f,\"responses\":%llu,\"responses_per_sec\":%.1f,"
+                "\"max_schedule_lag_ms\":%.3f,\"missing\":%llu,\"unexpected\":%llu,\"invalid\":%llu,\"latency_ms\":{",
+                static_cast<unsigned long long>(sent), sendSeconds, sendSeconds > 0 ? sent / sendSeconds : 0,
+                static_cast<unsigned long long>(session.responses), totalSeconds > 0 ? session.responses / totalSeconds : 0,
+                maxLagNs / 1e6, static_cast<unsigned long long>(missing),
+                static_cast<unsigned long long>(session.unexpected), static_cast<unsigned long long>(session.invalid));
+    }
+    else {
+        printf("sent %llu messages in %.3f s (%.1f/s), %llu responses (%.1f/s), max schedule lag %.3f ms\n",
+                static_cast<unsigned long long>(sent), sendSeconds, sendSeconds > 0 ? sent / sendSeconds : 0,
+                static_cast<unsigned long long>(session.responses), totalSeconds > 0 ? session.responses / totalSeconds : 0,
+                maxLagNs / 1e6);
+    }
+
+    PrintPercentiles("latency ms", session.latency, opt.json);
+
+    if(opt.timestamps) {
+        if(opt.json) {
+            printf("},\"clock\":{\"synchronized\":%s,\"offset_ms\":%.3f,\"rtt_ms\":%.3f},\"sensor_age_ms\":{",
+                    session.sync.Synchronized() ? "true" : "false", session.sync.OffsetNs() / 1e6, session.sync.RttNs() / 1e6);
+        }
+        else if(session.sync.Synchronized()) {
+            printf("daemon clock offset %.3f ms, best rtt %.3f ms\n", session.sync.OffsetNs() / 1e6, session.sync.RttNs() / 1e6);
+        }
+        else {
+            printf("daemon clock not synchronized\n");
+        }
+        PrintPercentiles("sensor age ms", session.sensorAge, opt.json);
+    }
+
+    if(opt.json) printf("},\"reflex_events\":%llu,\"deadman_stops\":%llu}\n", static_cast<unsigned long long>(session.reflexEvents),
+            static_cast<unsigned long long>(session.deadmanStops));
+    else printf("missing %llu, unexpected %llu, invalid %llu, reflex events %llu, deadman stops %llu\n",
+            static_cast<unsigned long long>(missing), static_cast<unsigned long long>(session.unexpected),
+            static_cast<unsigned long long>(session.invalid), static_cast<unsigned long long>(session.reflexEvents),
+            static_cast<unsigned long long>(session.deadmanStops));
+
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}